@@ -0,0 +1,80 @@
+#include "batch.h"
+#include "cpu.h"
+#include <algorithm>
+#include <cstring>
+
+namespace irmf
+{
+	BatchEvaluator::BatchEvaluator(const Program& program, BatchTarget target)
+		: m_program(program)
+		, m_target(BatchTarget::Generic)
+		, m_kernel(EvaluateBatchGeneric)
+		, m_regStorage(program.NumRegisters * BatchLanes + 16, 0.0f)
+		, m_frames(std::max(program.MaxDepth, 1))
+		, m_nextControl(program.Code.size())
+	{
+#if defined(IRMF_BATCH_X86)
+		const CpuFeatures& cpu = GetCpuFeatures();
+		bool best = target == BatchTarget::Auto;
+		if ((best || target == BatchTarget::AVX512) && cpu.AVX512F && cpu.FMA) {
+			m_target = BatchTarget::AVX512;
+			m_kernel = EvaluateBatchAVX512;
+		} else if ((best || target != BatchTarget::Generic) && cpu.AVX2 && cpu.FMA) {
+			m_target = BatchTarget::AVX2;
+			m_kernel = EvaluateBatchAVX2;
+		}
+#endif
+
+		// registers are 64-byte aligned rows of BatchLanes floats
+		float* regs = m_regStorage.data();
+		regs += (16 - ((uintptr_t)regs / sizeof(float)) % 16) % 16;
+		for (size_t i = 0; i < program.Constants.size(); i++)
+			std::fill_n(regs + (program.ConstantBase() + i) * BatchLanes, (size_t)BatchLanes, program.Constants[i]);
+
+		uint32_t next = (uint32_t)program.Code.size();
+		for (size_t i = program.Code.size(); i > 0; i--) {
+			m_nextControl[i - 1] = next;
+			if (IsControlFlow(program.Code[i - 1].Op))
+				next = (uint32_t)(i - 1);
+		}
+
+		m_context.Code = &m_program;
+		m_context.Regs = regs;
+		m_context.Frames = m_frames.data();
+		m_context.NextControl = m_nextControl.data();
+	}
+
+	const char* BatchEvaluator::GetTargetName() const
+	{
+		switch (m_target) {
+		case BatchTarget::AVX2: return "avx2";
+		case BatchTarget::AVX512: return "avx512";
+		default: return "generic";
+		}
+	}
+
+	bool BatchEvaluator::Evaluate(const float* x, const float* y, const float* z, size_t count, float* out)
+	{
+		float* regs = m_context.Regs;
+		const std::vector<uint16_t>& outputs = m_program.Outputs;
+
+		for (size_t base = 0; base < count; base += BatchLanes) {
+			int n = (int)std::min((size_t)BatchLanes, count - base);
+
+			memcpy(regs, x + base, n * sizeof(float));
+			memcpy(regs + BatchLanes, y + base, n * sizeof(float));
+			memcpy(regs + 2 * BatchLanes, z + base, n * sizeof(float));
+			for (int l = n; l < BatchLanes; l++)
+				for (int i = 0; i < 3; i++)
+					regs[i * BatchLanes + l] = regs[i * BatchLanes];
+
+			uint32_t lanes = (1u << n) - 1;
+			if (!m_kernel(m_context, lanes))
+				return false;
+
+			for (size_t o = 0; o < outputs.size(); o++)
+				memcpy(out + o * count + base, regs + outputs[o] * BatchLanes, n * sizeof(float));
+		}
+		return true;
+	}
+}
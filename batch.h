@@ -0,0 +1,47 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+#include "batch_kernel.h"
+#include "program.h"
+
+namespace irmf
+{
+	enum class BatchTarget
+	{
+		Auto,    // the best one the CPU supports
+		Generic, // baseline instruction set of the build (SSE2 on x86-64)
+		AVX2,
+		AVX512
+	};
+
+	// BatchEvaluator runs a compiled Program over structure-of-arrays batches
+	// of points, BatchLanes points at a time. Diverging branches and loops are
+	// handled with lane masks. Like Evaluator it shares the Program and owns
+	// its registers, so use one per thread.
+	class BatchEvaluator
+	{
+	public:
+		// The requested target falls back to the best one the CPU supports.
+		BatchEvaluator(const Program& program, BatchTarget target = BatchTarget::Auto);
+
+		// Evaluate computes the materials of count points. Material m of
+		// point i is written to out[m * count + i], out must hold
+		// GetOutputCount() * count floats. Returns false if a loop ran away.
+		bool Evaluate(const float* x, const float* y, const float* z, size_t count, float* out);
+
+		inline const Program& GetProgram() const { return m_program; }
+		inline int GetOutputCount() const { return (int)m_program.Outputs.size(); }
+		inline BatchTarget GetTarget() const { return m_target; }
+		const char* GetTargetName() const;
+
+	private:
+		const Program& m_program;
+		BatchTarget m_target;
+		BatchKernel m_kernel;
+		BatchContext m_context;
+
+		std::vector<float> m_regStorage;
+		std::vector<BatchFrame> m_frames;
+		std::vector<uint32_t> m_nextControl;
+	};
+}
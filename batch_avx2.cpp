@@ -0,0 +1,5 @@
+// Batch kernel built with AVX2 and FMA; only called when the CPU has both.
+#if defined(IRMF_BATCH_X86)
+#define IRMF_BATCH_KERNEL EvaluateBatchAVX2
+#include "batch_kernel.inl"
+#endif
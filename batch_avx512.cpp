@@ -0,0 +1,5 @@
+// Batch kernel built with AVX-512F; only called when the CPU has it.
+#if defined(IRMF_BATCH_X86)
+#define IRMF_BATCH_KERNEL EvaluateBatchAVX512
+#include "batch_kernel.inl"
+#endif
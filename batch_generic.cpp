@@ -0,0 +1,3 @@
+// Batch kernel for the baseline instruction set of the build.
+#define IRMF_BATCH_KERNEL EvaluateBatchGeneric
+#include "batch_kernel.inl"
@@ -0,0 +1,39 @@
+#pragma once
+#include <cstdint>
+#include "program.h"
+
+namespace irmf
+{
+	// Number of points evaluated together by the batch kernels: one AVX-512
+	// register, two AVX2 or four SSE registers per bytecode register.
+	enum { BatchLanes = 16 };
+
+	// BatchFrame is an entry of the control flow stack of the batch kernels.
+	// Masks hold one bit per lane.
+	struct BatchFrame
+	{
+		enum { If, Loop, Call };
+
+		int Kind;
+		uint32_t Pending;  // If: lanes waiting for the else branch, Loop: lanes that broke out, Call: lanes that returned
+		uint32_t Finished; // If: lanes that completed the then branch, Loop: lanes that continued
+		uint32_t End;      // Call: index of the EndCall instruction
+	};
+
+	// BatchContext is the per-evaluator state shared with the kernels.
+	struct BatchContext
+	{
+		const Program* Code;
+		float* Regs;                // NumRegisters * BatchLanes floats, 64-byte aligned
+		BatchFrame* Frames;         // Code->MaxDepth entries
+		const uint32_t* NextControl; // index of the next control flow instruction after each instruction
+	};
+
+	// A kernel runs the program on the lanes set in 'lanes'; the inputs are
+	// expected in registers 0-2 and the outputs are left in their registers.
+	typedef bool (*BatchKernel)(const BatchContext& ctx, uint32_t lanes);
+
+	bool EvaluateBatchGeneric(const BatchContext& ctx, uint32_t lanes);
+	bool EvaluateBatchAVX2(const BatchContext& ctx, uint32_t lanes);
+	bool EvaluateBatchAVX512(const BatchContext& ctx, uint32_t lanes);
+}
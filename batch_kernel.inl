@@ -0,0 +1,413 @@
+// Implementation of the batch kernels. This file is compiled several times,
+// once per instruction set (batch_generic.cpp, batch_avx2.cpp, ...), with
+// IRMF_BATCH_KERNEL naming the function to define. Everything else lives in
+// an anonymous namespace so that code built for different instruction sets
+// never gets merged by the linker.
+#include <cmath>
+#include <cstring>
+#include "batch_kernel.h"
+#include "interpreter.h"
+
+#ifndef IRMF_BATCH_KERNEL
+#error "IRMF_BATCH_KERNEL must be defined before including batch_kernel.inl"
+#endif
+
+namespace irmf
+{
+	namespace
+	{
+		const int W = BatchLanes;
+
+		inline float AsFloat(int32_t i) { float f; memcpy(&f, &i, sizeof(f)); return f; }
+		inline int32_t AsInt(float f) { int32_t i; memcpy(&i, &f, sizeof(i)); return i; }
+
+		// picks b where the mask is set, a elsewhere, without a branch
+		inline float Blend(float a, float b, int32_t mask) { return AsFloat((AsInt(a) & ~mask) | (AsInt(b) & mask)); }
+		// unlike fminf/fmaxf these map to single min/max instructions
+		inline float Min(float a, float b) { return b < a ? b : a; }
+		inline float Max(float a, float b) { return a < b ? b : a; }
+
+		// Branch-free single precision approximations (after Cephes) of the
+		// transcendental functions so that the lane loops vectorize. They are
+		// accurate to a few ulp; Sin/Cos hand arguments beyond 8192 to libm.
+		const float Pi = 3.14159265358979f;
+		const float HalfPi = 1.57079632679490f;
+		const float QuarterPi = 0.785398163397448f;
+		const float Ln2 = 0.693147180559945f;
+		const float Log2E = 1.44269504088896f;
+		const float TrigLimit = 8192.0f;
+
+		inline float SinPoly(float z, float zz) { return ((-1.9515295891e-4f * zz + 8.3321608736e-3f) * zz - 1.6666654611e-1f) * zz * z + z; }
+		inline float CosPoly(float zz) { return ((2.443315711809948e-5f * zz - 1.388731625493765e-3f) * zz + 4.166664568298827e-2f) * zz * zz - 0.5f * zz + 1.0f; }
+
+		// reduces |x| to [-pi/4, pi/4]; j is the (even) octant
+		inline float ReduceTrig(float x, int32_t& j)
+		{
+			float ax = Min(fabsf(x), TrigLimit);
+			j = (int32_t)(ax * 1.27323954473516f);
+			j = (j + 1) & ~1;
+			float y = (float)j;
+			return ((ax - y * 0.78515625f) - y * 2.4187564849853515625e-4f) - y * 3.77489497744594108e-8f;
+		}
+
+		inline float Sin(float x)
+		{
+			int32_t j;
+			float z = ReduceTrig(x, j), zz = z * z;
+			float r = Blend(SinPoly(z, zz), CosPoly(zz), -((j >> 1) & 1));
+			return AsFloat(AsInt(r) ^ ((j & 4) << 29) ^ (AsInt(x) & (int32_t)0x80000000));
+		}
+		inline float Cos(float x)
+		{
+			int32_t j;
+			float z = ReduceTrig(x, j), zz = z * z;
+			float r = Blend(CosPoly(zz), SinPoly(z, zz), -((j >> 1) & 1));
+			return AsFloat(AsInt(r) ^ (((j + 2) & 4) << 29));
+		}
+
+		// e^r for |r| <= ln(2) / 2, times 2^n
+		inline float ExpReduced(float r, float n)
+		{
+			float p = (((((1.9875691500e-4f * r + 1.3981999507e-3f) * r + 8.3334519073e-3f) * r + 4.1665795894e-2f) * r + 1.6666665459e-1f) * r + 5.0000001201e-1f) * r * r + r + 1.0f;
+			int32_t ni = (int32_t)n, h = ni >> 1; // two steps so that 2^n never overflows the exponent
+			return p * AsFloat((h + 127) << 23) * AsFloat((ni - h + 127) << 23);
+		}
+		inline float Exp(float x)
+		{
+			float xc = Min(Max(x, -103.97f), 88.7228391f);
+			float n = floorf(xc * Log2E + 0.5f);
+			float r = (xc - n * 0.693359375f) - n * -2.12194440e-4f;
+			float e = ExpReduced(r, n);
+			e = x > 88.7228391f ? INFINITY : e;
+			e = x < -103.97f ? 0.0f : e;
+			return x != x ? x : e;
+		}
+		inline float Exp2(float x)
+		{
+			float xc = Min(Max(x, -150.0f), 128.0f);
+			float n = floorf(xc + 0.5f);
+			float e = ExpReduced((xc - n) * Ln2, n);
+			e = x >= 128.0f ? INFINITY : e;
+			e = x < -150.0f ? 0.0f : e;
+			return x != x ? x : e;
+		}
+
+		// splits x > 0 into 2^e * (1 + m) and returns log(1 + m)
+		inline float LogReduced(float x, float& fe)
+		{
+			bool subnormal = x < 1.17549435e-38f;
+			int32_t bits = AsInt(subnormal ? x * 8388608.0f : x);
+			int32_t e = ((bits >> 23) & 0xff) - (subnormal ? 126 + 23 : 126);
+			float m = AsFloat((bits & 0x007fffff) | 0x3f000000); // [0.5, 1)
+			bool small = m < 0.707106781186547524f;
+			e = small ? e - 1 : e;
+			m = small ? m + m - 1.0f : m - 1.0f;
+			float z = m * m;
+			float y = ((((((((7.0376836292e-2f * m - 1.1514610310e-1f) * m + 1.1676998740e-1f) * m - 1.2420140846e-1f) * m + 1.4249322787e-1f) * m - 1.6668057665e-1f) * m + 2.0000714765e-1f) * m - 2.4999993993e-1f) * m + 3.3333331174e-1f) * m * z;
+			fe = (float)e;
+			return m + (y - 0.5f * z);
+		}
+		inline float LogSpecial(float x, float r)
+		{
+			r = x == 0.0f ? -INFINITY : r;
+			r = x == INFINITY ? INFINITY : r;
+			return (x < 0.0f || x != x) ? NAN : r;
+		}
+		inline float Log(float x)
+		{
+			float fe;
+			float y = LogReduced(x, fe);
+			return LogSpecial(x, (y + fe * -2.12194440e-4f) + fe * 0.693359375f);
+		}
+		inline float Log2(float x)
+		{
+			float fe;
+			float y = LogReduced(x, fe);
+			return LogSpecial(x, y * Log2E + fe);
+		}
+
+		inline float Pow(float a, float b)
+		{
+			float fe;
+			float aa = fabsf(a);
+			float l2 = LogSpecial(aa, LogReduced(aa, fe) * Log2E + fe);
+			float r = Exp2(b * l2);
+			bool integer = floorf(b) == b;
+			bool odd = integer && floorf(b * 0.5f) != b * 0.5f;
+			r = (a < 0.0f && odd) ? -r : r;
+			r = (a < 0.0f && !integer) ? NAN : r;
+			return (b == 0.0f || a == 1.0f) ? 1.0f : r;
+		}
+
+		inline float Atan(float x)
+		{
+			float ax = fabsf(x);
+			bool big = ax > 2.414213562373095f, mid = ax > 0.4142135623730950f;
+			float y0 = big ? HalfPi : (mid ? QuarterPi : 0.0f);
+			float t = big ? -1.0f / ax : (mid ? (ax - 1.0f) / (ax + 1.0f) : ax);
+			float z = t * t;
+			float r = (((8.05374449538e-2f * z - 1.38776856032e-1f) * z + 1.99777106478e-1f) * z - 3.33329491539e-1f) * z * t + t + y0;
+			return x < 0.0f ? -r : r;
+		}
+		inline float Atan2(float y, float x)
+		{
+			bool yneg = AsInt(y) < 0;
+			float offset = yneg ? -Pi : Pi;
+			float r = Atan(y / x);
+			r = x < 0.0f ? r + offset : r;
+			float zero = AsInt(x) < 0 ? offset : (yneg ? -0.0f : 0.0f);
+			return (x == 0.0f && y == 0.0f) ? zero : r;
+		}
+
+		inline float Round(float x)
+		{
+			float t = truncf(x);
+			return t + (fabsf(x - t) >= 0.5f ? (x < 0.0f ? -1.0f : 1.0f) : 0.0f);
+		}
+
+		// arguments the range reduction of Sin/Cos cannot handle go to libm
+		inline void LargeTrig(const float* a, float* t, float (*fn)(float))
+		{
+			int large = 0;
+			for (int l = 0; l < W; l++)
+				large |= !(fabsf(a[l]) < TrigLimit);
+			if (large)
+				for (int l = 0; l < W; l++)
+					if (!(fabsf(a[l]) < TrigLimit))
+						t[l] = fn(a[l]);
+		}
+
+#define LANES(expr) for (int l = 0; l < W; l++) t[l] = (expr); break
+#define LIBM(fn) for (int l = 0; l < W; l++) t[l] = fn(a[l]); break
+
+		inline void Compute(Opcode op, const float* a, const float* b, const float* c, float* t)
+		{
+			switch (op) {
+			case Opcode::Mov: LANES(a[l]);
+			case Opcode::Neg: LANES(-a[l]);
+			case Opcode::Not: LANES(a[l] == 0.0f ? 1.0f : 0.0f);
+			case Opcode::Abs: LANES(fabsf(a[l]));
+			case Opcode::Sign: LANES(a[l] > 0.0f ? 1.0f : (a[l] < 0.0f ? -1.0f : 0.0f));
+			case Opcode::Floor: LANES(floorf(a[l]));
+			case Opcode::Ceil: LANES(ceilf(a[l]));
+			case Opcode::Fract: LANES(a[l] - floorf(a[l]));
+			case Opcode::Trunc: LANES(truncf(a[l]));
+			case Opcode::Round: LANES(Round(a[l]));
+			case Opcode::RoundEven: LANES(nearbyintf(a[l]));
+			case Opcode::Sqrt: LANES(sqrtf(a[l]));
+			case Opcode::InvSqrt: LANES(1.0f / sqrtf(a[l]));
+			case Opcode::Exp: LANES(Exp(a[l]));
+			case Opcode::Exp2: LANES(Exp2(a[l]));
+			case Opcode::Log: LANES(Log(a[l]));
+			case Opcode::Log2: LANES(Log2(a[l]));
+			case Opcode::Sin:
+				for (int l = 0; l < W; l++)
+					t[l] = Sin(a[l]);
+				LargeTrig(a, t, sinf);
+				break;
+			case Opcode::Cos:
+				for (int l = 0; l < W; l++)
+					t[l] = Cos(a[l]);
+				LargeTrig(a, t, cosf);
+				break;
+			case Opcode::Tan:
+				for (int l = 0; l < W; l++)
+					t[l] = Sin(a[l]) / Cos(a[l]);
+				LargeTrig(a, t, tanf);
+				break;
+			case Opcode::Asin: LIBM(asinf);
+			case Opcode::Acos: LIBM(acosf);
+			case Opcode::Atan: LANES(Atan(a[l]));
+			case Opcode::Sinh: LIBM(sinhf);
+			case Opcode::Cosh: LIBM(coshf);
+			case Opcode::Tanh: LIBM(tanhf);
+
+			case Opcode::Add: LANES(a[l] + b[l]);
+			case Opcode::Sub: LANES(a[l] - b[l]);
+			case Opcode::Mul: LANES(a[l] * b[l]);
+			case Opcode::Div: LANES(a[l] / b[l]);
+			case Opcode::Mod: LANES(a[l] - b[l] * floorf(a[l] / b[l]));
+			case Opcode::Min: LANES(b[l] < a[l] ? b[l] : a[l]);
+			case Opcode::Max: LANES(a[l] < b[l] ? b[l] : a[l]);
+			case Opcode::Pow: LANES(Pow(a[l], b[l]));
+			case Opcode::Atan2: LANES(Atan2(a[l], b[l]));
+			case Opcode::Step: LANES(b[l] < a[l] ? 0.0f : 1.0f);
+			case Opcode::Lt: LANES(a[l] < b[l] ? 1.0f : 0.0f);
+			case Opcode::Le: LANES(a[l] <= b[l] ? 1.0f : 0.0f);
+			case Opcode::Gt: LANES(a[l] > b[l] ? 1.0f : 0.0f);
+			case Opcode::Ge: LANES(a[l] >= b[l] ? 1.0f : 0.0f);
+			case Opcode::Eq: LANES(a[l] == b[l] ? 1.0f : 0.0f);
+			case Opcode::Ne: LANES(a[l] != b[l] ? 1.0f : 0.0f);
+			case Opcode::And: LANES((a[l] != 0.0f && b[l] != 0.0f) ? 1.0f : 0.0f);
+			case Opcode::Or: LANES((a[l] != 0.0f || b[l] != 0.0f) ? 1.0f : 0.0f);
+			case Opcode::Xor: LANES(((a[l] != 0.0f) != (b[l] != 0.0f)) ? 1.0f : 0.0f);
+
+			case Opcode::Clamp:
+				for (int l = 0; l < W; l++) {
+					float v = a[l] < b[l] ? b[l] : a[l];
+					t[l] = c[l] < v ? c[l] : v;
+				}
+				break;
+			case Opcode::Mix: LANES(a[l] * (1.0f - c[l]) + b[l] * c[l]);
+			case Opcode::Smoothstep:
+				for (int l = 0; l < W; l++) {
+					float v = (c[l] - a[l]) / (b[l] - a[l]);
+					v = v < 0.0f ? 0.0f : (v > 1.0f ? 1.0f : v);
+					t[l] = v * v * (3.0f - 2.0f * v);
+				}
+				break;
+			case Opcode::Select: LANES(a[l] != 0.0f ? b[l] : c[l]);
+
+			default: LANES(0.0f);
+			}
+		}
+
+#undef LANES
+#undef LIBM
+
+		inline uint32_t Mask(const float* r)
+		{
+			uint32_t m = 0;
+			for (int l = 0; l < W; l++)
+				m |= (uint32_t)(r[l] != 0.0f) << l;
+			return m;
+		}
+
+		inline BatchFrame* InnermostLoop(BatchFrame* frames, int sp)
+		{
+			while (frames[sp - 1].Kind != BatchFrame::Loop)
+				sp--;
+			return &frames[sp - 1];
+		}
+	}
+
+	bool IRMF_BATCH_KERNEL(const BatchContext& ctx, uint32_t lanes)
+	{
+		const Program& program = *ctx.Code;
+		const Instruction* code = program.Code.data();
+		size_t size = program.Code.size();
+		float* regs = ctx.Regs;
+		BatchFrame* frames = ctx.Frames;
+		int sp = 0;
+		long long iterations = Evaluator::MaxLoopIterations;
+
+		uint32_t exec = lanes;
+		int32_t active[W]; // all bits set for the lanes in exec
+		for (int l = 0; l < W; l++)
+			active[l] = -(int32_t)((exec >> l) & 1);
+
+		for (size_t pc = 0; pc < size; pc++) {
+			const Instruction& in = code[pc];
+
+			if (in.Op < Opcode::If) {
+				alignas(64) float t[W];
+				Compute(in.Op, regs + in.A * W, regs + in.B * W, regs + in.C * W, t);
+				float* d = regs + in.Dst * W;
+				if (exec == lanes)
+					memcpy(d, t, sizeof(t));
+				else
+					for (int l = 0; l < W; l++)
+						d[l] = Blend(d[l], t[l], active[l]);
+				continue;
+			}
+
+			uint32_t before = exec;
+			switch (in.Op) {
+			case Opcode::If: {
+				if (exec == 0) {
+					// skip the whole statement
+					pc = in.Target;
+					if (code[pc].Op == Opcode::Else)
+						pc = code[pc].Target;
+					continue;
+				}
+				uint32_t cond = Mask(regs + in.A * W) & exec;
+				frames[sp++] = BatchFrame{ BatchFrame::If, exec & ~cond, 0, 0 };
+				exec = cond;
+				break;
+			}
+			case Opcode::Else: {
+				BatchFrame& f = frames[sp - 1];
+				f.Finished = exec;
+				exec = f.Pending;
+				f.Pending = 0;
+				break;
+			}
+			case Opcode::EndIf: {
+				BatchFrame& f = frames[--sp];
+				exec |= f.Finished | f.Pending;
+				break;
+			}
+
+			case Opcode::Loop:
+				if (exec == 0) {
+					pc = in.Target;
+					continue;
+				}
+				frames[sp++] = BatchFrame{ BatchFrame::Loop, 0, 0, 0 };
+				break;
+			case Opcode::BreakIfNot: {
+				uint32_t cond = Mask(regs + in.A * W) & exec;
+				InnermostLoop(frames, sp)->Pending |= exec & ~cond;
+				exec = cond;
+				break;
+			}
+			case Opcode::Break:
+				InnermostLoop(frames, sp)->Pending |= exec;
+				exec = 0;
+				break;
+			case Opcode::Continue:
+				InnermostLoop(frames, sp)->Finished |= exec;
+				exec = 0;
+				break;
+			case Opcode::ContinuePoint: {
+				BatchFrame& f = frames[sp - 1];
+				exec |= f.Finished;
+				f.Finished = 0;
+				break;
+			}
+			case Opcode::EndLoop:
+				if (exec != 0) {
+					if (--iterations < 0)
+						return false;
+					pc = in.Target; // next iteration
+					continue;
+				}
+				exec = frames[--sp].Pending;
+				break;
+
+			case Opcode::Call:
+				if (exec == 0) {
+					pc = in.Target;
+					continue;
+				}
+				frames[sp++] = BatchFrame{ BatchFrame::Call, 0, 0, in.Target };
+				break;
+			case Opcode::Return: {
+				int i = sp - 1;
+				while (frames[i].Kind != BatchFrame::Call || frames[i].End != in.Target)
+					i--;
+				frames[i].Pending |= exec;
+				exec = 0;
+				break;
+			}
+			case Opcode::EndCall:
+				exec |= frames[--sp].Pending;
+				break;
+
+			default:
+				break;
+			}
+
+			if (exec != before)
+				for (int l = 0; l < W; l++)
+					active[l] = -(int32_t)((exec >> l) & 1);
+
+			// no lane left: go straight to the next instruction that can
+			// bring lanes back
+			if (exec == 0)
+				pc = ctx.NextControl[pc] - 1;
+		}
+		return true;
+	}
+}
@@ -0,0 +1,111 @@
+#include "bench.h"
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include "batch.h"
+#include "interpreter.h"
+#include "native.h"
+#include "specialize.h"
+
+namespace irmf
+{
+	namespace
+	{
+		const size_t Points = 1 << 16;
+		// the slice rows sample Slices layers of Side x Side, as many points
+		// as a layer as out holds
+		const int Side = 256;
+		const int Slices = 4;
+		const double MinSeconds = 0.25;
+
+		// Rate runs pass, which evaluates count points, until MinSeconds
+		// have passed and returns the points per second; 0 if pass failed
+		double Rate(size_t count, const std::function<bool()>& pass)
+		{
+			auto start = std::chrono::steady_clock::now();
+			double seconds = 0.0;
+			size_t passes = 0;
+			while (seconds < MinSeconds) {
+				if (!pass())
+					return 0.0;
+				passes++;
+				seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			}
+			return passes * count / seconds;
+		}
+	}
+
+	bool BenchmarkEvaluators(const Model& model, std::vector<BenchResult>& results, std::string& err)
+	{
+		// the same points every run
+		std::vector<float> x(Points), y(Points), z(Points);
+		uint32_t seed = 1;
+		auto next = [&]() {
+			seed = seed * 1664525u + 1013904223u;
+			return (seed >> 8) / 16777216.0f;
+		};
+		for (size_t i = 0; i < Points; i++) {
+			x[i] = model.Min[0] + (model.Max[0] - model.Min[0]) * next();
+			y[i] = model.Min[1] + (model.Max[1] - model.Min[1]) * next();
+			z[i] = model.Min[2] + (model.Max[2] - model.Min[2]) * next();
+		}
+		std::vector<float> out(Points * model.Materials.size());
+
+		results.clear();
+		Evaluator scalar(model.Code);
+		double base = Rate(Points, [&] {
+			for (size_t i = 0; i < Points; i++)
+				if (!scalar.Evaluate(x[i], y[i], z[i], out.data()))
+					return false;
+			return true;
+		});
+		if (base == 0.0) {
+			err = "a loop in the model did not terminate";
+			return false;
+		}
+		results.push_back(BenchResult{ "interpreter", base, 1.0 });
+
+		const BatchTarget targets[] = { BatchTarget::Generic, BatchTarget::AVX2, BatchTarget::AVX512 };
+		for (BatchTarget target : targets) {
+			BatchEvaluator batch(model.Code, target);
+			// the CPU does not support it
+			if (batch.GetTarget() != target)
+				continue;
+			double rate = Rate(Points, [&] { return batch.Evaluate(x.data(), y.data(), z.data(), Points, out.data()); });
+			results.push_back(BenchResult{ std::string("batch ") + batch.GetTargetName(), rate, rate / base });
+		}
+
+		// a missing compiler only leaves the row out
+		NativeEvaluator native;
+		std::string nativeErr;
+		if (native.Load(model.Code, nativeErr)) {
+			double rate = Rate(Points, [&] { return native.Evaluate(x.data(), y.data(), z.data(), Points, out.data()); });
+			results.push_back(BenchResult{ "native", rate, rate / base });
+		}
+
+		// slices through the middle of the cells, against the interpreter
+		// on the same grid
+		float step[3];
+		for (int i = 0; i < 3; i++)
+			step[i] = (model.Max[i] - model.Min[i]) / (i == 2 ? Slices : Side);
+		auto center = [&](int axis, int i) { return model.Min[axis] + (i + 0.5f) * step[axis]; };
+		double slices = Rate((size_t)Side * Side * Slices, [&] {
+			for (int k = 0; k < Slices; k++)
+				for (int j = 0; j < Side; j++)
+					for (int i = 0; i < Side; i++)
+						if (!scalar.Evaluate(center(0, i), center(1, j), center(2, k), out.data()))
+							return false;
+			return true;
+		});
+		results.push_back(BenchResult{ "interpreter, slices", slices, 1.0 });
+		SliceEvaluator specialized(model.Code);
+		double rate = Rate((size_t)Side * Side * Slices, [&] {
+			for (int k = 0; k < Slices; k++)
+				if (!specialized.EvaluateSlice(center(2, k), center(0, 0), step[0], Side, center(1, 0), step[1], Side, out.data()))
+					return false;
+			return true;
+		});
+		results.push_back(BenchResult{ "specialized, slices", rate, rate / slices });
+		return true;
+	}
+}
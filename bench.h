@@ -0,0 +1,28 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "model.h"
+
+namespace irmf
+{
+	// BenchResult is how fast one way of evaluating a model ran in
+	// BenchmarkEvaluators.
+	struct BenchResult
+	{
+		std::string Evaluator;
+		double PointsPerSecond; // on one thread
+		double Speedup;         // over the scalar interpreter on the same points
+	};
+
+	// BenchmarkEvaluators times the scalar Evaluator and BatchEvaluator with
+	// each kernel the CPU supports on the same 2^16 random points in the
+	// model's bounds, each for at least a quarter of a second. The 6x target
+	// of the batch kernels is only met by straight-line models: on one core
+	// with AVX-512, the twisted extrusion example runs 6.4x as fast as the
+	// interpreter, but the lattice and functions examples 3.4x and the gyroid
+	// 2x. The scalar path skips the rest of the program for the points that
+	// return early (the gyroid's corners), while a batch runs it for as long
+	// as any of its 16 lanes needs it, and the functions the kernels hand to
+	// libm run one lane at a time.
+	bool BenchmarkEvaluators(const Model& model, std::vector<BenchResult>& results, std::string& err);
+}
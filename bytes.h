@@ -0,0 +1,45 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace irmf
+{
+	// Put16, Put32, Put64 and PutFloat append little-endian values to out,
+	// for the binary headers of the archive and printer formats; Get16,
+	// Get32 and Get64 read them back.
+	inline void Put16(std::vector<uint8_t>& out, uint32_t v)
+	{
+		out.push_back((uint8_t)v);
+		out.push_back((uint8_t)(v >> 8));
+	}
+	inline void Put32(std::vector<uint8_t>& out, uint32_t v)
+	{
+		Put16(out, v & 0xffff);
+		Put16(out, v >> 16);
+	}
+	inline void Put64(std::vector<uint8_t>& out, uint64_t v)
+	{
+		Put32(out, (uint32_t)v);
+		Put32(out, (uint32_t)(v >> 32));
+	}
+	inline void PutFloat(std::vector<uint8_t>& out, float v)
+	{
+		uint32_t bits;
+		memcpy(&bits, &v, 4);
+		Put32(out, bits);
+	}
+
+	inline uint32_t Get16(const uint8_t* p)
+	{
+		return p[0] | (p[1] << 8);
+	}
+	inline uint32_t Get32(const uint8_t* p)
+	{
+		return Get16(p) | (Get16(p + 2) << 16);
+	}
+	inline uint64_t Get64(const uint8_t* p)
+	{
+		return Get32(p) | ((uint64_t)Get32(p + 4) << 32);
+	}
+}
@@ -0,0 +1,91 @@
+#include "checkpoint.h"
+#include "hash.h"
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <ghc/filesystem.hpp>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace irmf
+{
+	std::string ExportHash(const Model& model, const std::string& settings)
+	{
+		return HashHex(model.Info.dump() + '\n' + model.Body + '\n' + settings, 32);
+	}
+
+	Checkpoint::Checkpoint(const std::string& output, const std::string& hash, double interval)
+		: m_filename(output + ".checkpoint")
+		, m_hash(hash)
+		, m_interval(interval)
+		, m_last(std::chrono::steady_clock::now())
+	{
+	}
+
+	bool Checkpoint::Load(int& done, uint64_t& size) const
+	{
+		std::ifstream file(m_filename, std::ios::binary);
+		if (!file)
+			return false;
+		std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		std::string err;
+		json11::Json record = json11::Json::parse(text, err);
+		if (!err.empty() || record["hash"].string_value() != m_hash || !record["done"].is_number() || !record["size"].is_string())
+			return false;
+		// sizes are kept as text, as JSON numbers are doubles
+		done = record["done"].int_value();
+		size = strtoull(record["size"].string_value().c_str(), nullptr, 10);
+		return done > 0;
+	}
+
+	bool Checkpoint::Due() const
+	{
+		return m_interval > 0 && std::chrono::duration<double>(std::chrono::steady_clock::now() - m_last).count() >= m_interval;
+	}
+
+	bool Checkpoint::Save(int done, uint64_t size, std::string& err)
+	{
+		json11::Json record = json11::Json::object {
+			{ "hash", m_hash },
+			{ "done", done },
+			{ "size", std::to_string(size) },
+		};
+		std::string text = record.dump();
+
+		// write a new file and move it over the old one, so a crash leaves
+		// one or the other
+		std::string tmp = m_filename + ".tmp";
+		FILE* file = fopen(tmp.c_str(), "wb");
+		if (!file) {
+			err = "failed to create " + tmp;
+			return false;
+		}
+		bool ok = fwrite(text.data(), 1, text.size(), file) == text.size() && fflush(file) == 0;
+#ifdef _WIN32
+		ok = ok && _commit(_fileno(file)) == 0;
+#else
+		ok = ok && fsync(fileno(file)) == 0;
+#endif
+		ok = fclose(file) == 0 && ok;
+		std::error_code ec;
+		if (ok)
+			ghc::filesystem::rename(tmp, m_filename, ec);
+		if (!ok || ec) {
+			remove(tmp.c_str());
+			err = "failed to write " + m_filename;
+			return false;
+		}
+		m_last = std::chrono::steady_clock::now();
+		return true;
+	}
+
+	void Checkpoint::Remove()
+	{
+		remove(m_filename.c_str());
+	}
+}
@@ -0,0 +1,40 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include "model.h"
+
+namespace irmf
+{
+	// ExportHash returns a hex SHA-256 of the model's source (preamble and
+	// body) and settings, a text holding everything else that shapes the
+	// output.
+	std::string ExportHash(const Model& model, const std::string& settings);
+
+	// Checkpoint lets an export that was killed resume where it left off. At
+	// most every interval seconds, Save records in <output>.checkpoint how
+	// many items (layers) are written and how long the output was then,
+	// with the export's hash; Load finds them again only for an export with
+	// the same hash. The output must be synced before each Save, so that
+	// what the checkpoint covers survives a crash.
+	class Checkpoint
+	{
+	public:
+		Checkpoint(const std::string& output, const std::string& hash, double interval);
+
+		// Load returns the items done and the output's size at the last
+		// checkpoint, or false if there is none for this export
+		bool Load(int& done, uint64_t& size) const;
+		// Due tells whether the interval has passed since the last Save
+		bool Due() const;
+		// Save replaces the checkpoint file in one step; false, with err
+		// set, if it could not be written
+		bool Save(int done, uint64_t size, std::string& err);
+		void Remove();
+
+	private:
+		std::string m_filename, m_hash;
+		double m_interval;
+		std::chrono::steady_clock::time_point m_last;
+	};
+}
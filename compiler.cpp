@@ -0,0 +1,1674 @@
+#include "compiler.h"
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <set>
+
+namespace irmf
+{
+	namespace
+	{
+		enum class BaseType
+		{
+			Void,
+			Float,
+			Int,
+			Bool
+		};
+
+		struct Type
+		{
+			BaseType Base;
+			int Rows, Cols; // vectors have Cols == 1, scalars Rows == Cols == 1
+			int Array;      // number of elements, 0 when not an array
+
+			Type(BaseType base = BaseType::Void, int rows = 1, int cols = 1, int array = 0)
+				: Base(base), Rows(rows), Cols(cols), Array(array) { }
+
+			int ElementSize() const { return Base == BaseType::Void ? 0 : Rows * Cols; }
+			int Size() const { return ElementSize() * (Array > 0 ? Array : 1); }
+			bool IsScalar() const { return Base != BaseType::Void && Array == 0 && Rows == 1 && Cols == 1; }
+			bool IsMatrix() const { return Array == 0 && Cols > 1; }
+			Type Element() const { return Type(Base, Rows, Cols); }
+			bool SameShape(const Type& o) const { return Rows == o.Rows && Cols == o.Cols && Array == o.Array; }
+			bool operator==(const Type& o) const { return Base == o.Base && SameShape(o); }
+			bool operator!=(const Type& o) const { return !(*this == o); }
+		};
+
+		bool ParseType(const std::string& name, Type& t)
+		{
+			if (name == "void")
+				t = Type();
+			else if (name == "float")
+				t = Type(BaseType::Float);
+			else if (name == "int" || name == "uint")
+				t = Type(BaseType::Int);
+			else if (name == "bool")
+				t = Type(BaseType::Bool);
+			else if (name.size() == 4 && name.compare(0, 3, "vec") == 0)
+				t = Type(BaseType::Float, name[3] - '0');
+			else if (name.size() == 5 && name.compare(1, 3, "vec") == 0)
+				t = Type(name[0] == 'b' ? BaseType::Bool : BaseType::Int, name[4] - '0');
+			else if (name.size() == 4 && name.compare(0, 3, "mat") == 0)
+				t = Type(BaseType::Float, name[3] - '0', name[3] - '0');
+			else if (name.size() == 6 && name.compare(0, 3, "mat") == 0)
+				t = Type(BaseType::Float, name[5] - '0', name[3] - '0'); // matCxR
+			else
+				return false;
+			return true;
+		}
+
+		std::string TypeName(const Type& t)
+		{
+			std::string s;
+			const char* prefix = t.Base == BaseType::Int ? "i" : (t.Base == BaseType::Bool ? "b" : "");
+			if (t.Base == BaseType::Void)
+				return "void";
+			if (t.Cols > 1)
+				s = "mat" + std::to_string(t.Cols) + (t.Rows == t.Cols ? "" : "x" + std::to_string(t.Rows));
+			else if (t.Rows > 1)
+				s = prefix + std::string("vec") + std::to_string(t.Rows);
+			else
+				s = t.Base == BaseType::Float ? "float" : (t.Base == BaseType::Int ? "int" : "bool");
+			if (t.Array)
+				s += "[" + std::to_string(t.Array) + "]";
+			return s;
+		}
+
+		// Registers are numbered [inputs][variables and temporaries] while
+		// compiling; constants live in their own index space, marked with
+		// ConstantFlag, and are moved in front of the variables at the end.
+		typedef uint32_t Reg;
+		const Reg ConstantFlag = 0x80000000u;
+
+		struct WideInstruction
+		{
+			Opcode Op;
+			Reg Dst, A, B, C;
+			uint32_t Target;
+		};
+
+		struct Value
+		{
+			Type T;
+			std::vector<Reg> Regs;
+			bool LValue;
+
+			// An lvalue indexed with a run-time index: stores select the
+			// element among all registers of the indexed object.
+			bool Dynamic;
+			Reg DynIndex;
+			std::vector<Reg> DynBase;
+			int DynStride;
+			std::vector<int> DynOffsets; // offset of each of Regs within an element
+
+			Value() : LValue(false), Dynamic(false), DynIndex(0), DynStride(0) { }
+		};
+
+		struct Variable
+		{
+			Type T;
+			std::vector<Reg> Regs;
+			bool Const;
+		};
+
+		struct FunctionFrame
+		{
+			const Node* Fn;
+			Type ReturnType;
+			std::vector<Reg> ReturnRegs;
+			bool HasFrame;               // emitted as Call ... EndCall
+			std::vector<size_t> Returns; // Return instructions to patch
+			size_t LoopBase;
+			size_t ScopeBase;
+		};
+
+		struct LoopFrame
+		{
+			std::vector<size_t> Breaks;
+			std::vector<size_t> Continues;
+		};
+
+		int CountKind(const Node& n, NodeKind kind)
+		{
+			int count = n.Kind == kind;
+			for (const NodePtr& c : n.Children)
+				count += CountKind(*c, kind);
+			for (const Declarator& d : n.Declarators)
+				if (d.Init)
+					count += CountKind(*d.Init, kind);
+			return count;
+		}
+
+		int SwizzleIndex(char c)
+		{
+			static const char* sets[] = { "xyzw", "rgba", "stpq" };
+			for (const char* set : sets) {
+				const char* p = strchr(set, c);
+				if (p && c)
+					return (int)(p - set);
+			}
+			return -1;
+		}
+
+		class Compiler
+		{
+		public:
+			Compiler() : m_next(Program::NumInputs), m_highWater(Program::NumInputs), m_hasDiscard(false) { }
+
+			bool Run(const Node& unit, Program& program, std::string& err)
+			{
+				if (!Translate(unit) || !Finish(program)) {
+					err = m_err;
+					return false;
+				}
+				return true;
+			}
+
+		private:
+			std::vector<WideInstruction> m_code;
+			std::vector<float> m_constants;
+			std::map<uint32_t, Reg> m_constantIndex;
+			Reg m_next;
+			Reg m_highWater;
+
+			std::vector<std::map<std::string, Variable>> m_scopes;
+			std::vector<Reg> m_scopeMarks;
+			std::map<std::string, std::vector<const Node*>> m_functions;
+			std::vector<FunctionFrame> m_frames;
+			std::vector<LoopFrame> m_loops;
+
+			std::string m_entry;
+			std::vector<Reg> m_outputs;
+			bool m_hasDiscard;
+			std::string m_err;
+
+			bool Fail(int line, const std::string& msg)
+			{
+				if (m_err.empty())
+					m_err = "line " + std::to_string(line) + ": " + msg;
+				return false;
+			}
+
+			/* registers */
+			Reg Alloc(int count)
+			{
+				Reg r = m_next;
+				m_next += count;
+				if (m_next > m_highWater)
+					m_highWater = m_next;
+				return r;
+			}
+			Value Temp(const Type& t)
+			{
+				Value v;
+				v.T = t;
+				Reg r = Alloc(t.Size());
+				for (int i = 0; i < t.Size(); i++)
+					v.Regs.push_back(r + i);
+				return v;
+			}
+			Reg Constant(float value)
+			{
+				uint32_t bits;
+				memcpy(&bits, &value, sizeof(bits));
+				auto it = m_constantIndex.find(bits);
+				if (it != m_constantIndex.end())
+					return it->second;
+				Reg r = ConstantFlag | (Reg)m_constants.size();
+				m_constants.push_back(value);
+				m_constantIndex[bits] = r;
+				return r;
+			}
+			bool IsConstant(Reg r) const { return (r & ConstantFlag) != 0; }
+			float ConstantValue(Reg r) const { return m_constants[r & ~ConstantFlag]; }
+			bool IsConstant(Reg r, float value) const { return IsConstant(r) && ConstantValue(r) == value; }
+			bool IsConstant(const Value& v) const
+			{
+				for (Reg r : v.Regs)
+					if (!IsConstant(r))
+						return false;
+				return true;
+			}
+
+			/* scopes */
+			void PushScope()
+			{
+				m_scopes.emplace_back();
+				m_scopeMarks.push_back(m_next);
+			}
+			void PopScope()
+			{
+				m_scopes.pop_back();
+				m_next = m_scopeMarks.back();
+				m_scopeMarks.pop_back();
+			}
+			Variable* Lookup(const std::string& name)
+			{
+				// inlined functions only see their own scopes and the globals
+				size_t base = m_frames.empty() ? 0 : m_frames.back().ScopeBase;
+				for (size_t i = m_scopes.size(); i > base; i--) {
+					auto it = m_scopes[i - 1].find(name);
+					if (it != m_scopes[i - 1].end())
+						return &it->second;
+				}
+				auto it = m_scopes[0].find(name);
+				return it != m_scopes[0].end() ? &it->second : nullptr;
+			}
+
+			/* code emission */
+			Reg Emit(Opcode op, Reg a, Reg b = 0, Reg c = 0)
+			{
+				int n = OperandCount(op);
+				if (IsConstant(a) && (n < 2 || IsConstant(b)) && (n < 3 || IsConstant(c)))
+					return Constant(ApplyOp(op, ConstantValue(a), n > 1 ? ConstantValue(b) : 0.0f, n > 2 ? ConstantValue(c) : 0.0f));
+
+				switch (op) {
+				case Opcode::Mov: return a;
+				case Opcode::Add:
+					if (IsConstant(a, 0.0f)) return b;
+					if (IsConstant(b, 0.0f)) return a;
+					break;
+				case Opcode::Sub:
+					if (IsConstant(b, 0.0f)) return a;
+					break;
+				case Opcode::Mul:
+					if (IsConstant(a, 1.0f)) return b;
+					if (IsConstant(b, 1.0f)) return a;
+					break;
+				case Opcode::Div:
+					if (IsConstant(b, 1.0f)) return a;
+					break;
+				case Opcode::And: // operands are booleans, i.e. 0 or 1
+					if (IsConstant(a)) return ConstantValue(a) != 0.0f ? b : Constant(0.0f);
+					if (IsConstant(b)) return ConstantValue(b) != 0.0f ? a : Constant(0.0f);
+					break;
+				case Opcode::Or:
+					if (IsConstant(a)) return ConstantValue(a) != 0.0f ? Constant(1.0f) : b;
+					if (IsConstant(b)) return ConstantValue(b) != 0.0f ? Constant(1.0f) : a;
+					break;
+				case Opcode::Select:
+					if (IsConstant(a)) return ConstantValue(a) != 0.0f ? b : c;
+					if (b == c) return b;
+					break;
+				default: break;
+				}
+
+				Reg d = Alloc(1);
+				m_code.push_back({ op, d, a, b, c, 0 });
+				return d;
+			}
+			void EmitTo(Opcode op, Reg dst, Reg a, Reg b = 0, Reg c = 0)
+			{
+				int n = OperandCount(op);
+				if (op != Opcode::Mov && IsConstant(a) && (n < 2 || IsConstant(b)) && (n < 3 || IsConstant(c))) {
+					a = Constant(ApplyOp(op, ConstantValue(a), n > 1 ? ConstantValue(b) : 0.0f, n > 2 ? ConstantValue(c) : 0.0f));
+					op = Opcode::Mov;
+				}
+				if (op == Opcode::Mov && dst == a)
+					return;
+				m_code.push_back({ op, dst, a, b, c, 0 });
+			}
+			size_t EmitControl(Opcode op, Reg a = 0)
+			{
+				m_code.push_back({ op, 0, a, 0, 0, 0 });
+				return m_code.size() - 1;
+			}
+			void Patch(size_t at, size_t target) { m_code[at].Target = (uint32_t)target; }
+
+			// Copy writes src into dst, going through temporaries when the
+			// two overlap (e.g. 'v = v.yxz').
+			void Copy(const std::vector<Reg>& dst, std::vector<Reg> src)
+			{
+				std::set<Reg> targets(dst.begin(), dst.end());
+				bool overlap = false;
+				for (Reg r : src)
+					overlap |= targets.count(r) > 0;
+				if (overlap)
+					for (Reg& r : src)
+						if (!IsConstant(r)) {
+							Reg t = Alloc(1);
+							EmitTo(Opcode::Mov, t, r);
+							r = t;
+						}
+				for (size_t i = 0; i < dst.size(); i++)
+					EmitTo(Opcode::Mov, dst[i], src[i]);
+			}
+
+			bool Store(const Value& dst, const Value& src, int line)
+			{
+				if (!dst.LValue)
+					return Fail(line, "assignment to a constant or temporary value");
+				if (!dst.T.SameShape(src.T))
+					return Fail(line, "cannot assign " + TypeName(src.T) + " to " + TypeName(dst.T));
+
+				if (!dst.Dynamic) {
+					Copy(dst.Regs, src.Regs);
+					return true;
+				}
+
+				int count = (int)dst.DynBase.size() / dst.DynStride;
+				for (int e = 0; e < count; e++) {
+					Reg cond = Emit(Opcode::Eq, dst.DynIndex, Constant((float)e));
+					for (size_t j = 0; j < dst.DynOffsets.size(); j++) {
+						Reg r = dst.DynBase[e * dst.DynStride + dst.DynOffsets[j]];
+						EmitTo(Opcode::Select, r, cond, src.Regs[j], r);
+					}
+				}
+				return true;
+			}
+
+			/* conversions */
+			Reg ConvertReg(Reg r, BaseType from, BaseType to)
+			{
+				if (from == to || to == BaseType::Float || from == BaseType::Bool)
+					return r;
+				if (to == BaseType::Int)
+					return Emit(Opcode::Trunc, r);
+				return Emit(Opcode::Ne, r, Constant(0.0f));
+			}
+
+			// Coerce applies the implicit int -> float conversion GLSL allows.
+			bool Coerce(Value& v, const Type& to, int line)
+			{
+				if (v.T == to)
+					return true;
+				if (v.T.SameShape(to) && v.T.Base == BaseType::Int && to.Base == BaseType::Float) {
+					v.T.Base = BaseType::Float;
+					v.LValue = false;
+					return true;
+				}
+				return Fail(line, "cannot convert " + TypeName(v.T) + " to " + TypeName(to));
+			}
+
+			Value Scalar(const Value& v, int i)
+			{
+				Value s;
+				s.T = Type(v.T.Base);
+				s.Regs.push_back(v.Regs[i]);
+				return s;
+			}
+
+			Value Constants(const Type& t, float value)
+			{
+				Value v;
+				v.T = t;
+				v.Regs.assign(t.Size(), Constant(value));
+				return v;
+			}
+
+			static bool IsNumeric(const Type& t) { return t.Array == 0 && (t.Base == BaseType::Float || t.Base == BaseType::Int); }
+			static bool IsBoolScalar(const Type& t) { return t.IsScalar() && t.Base == BaseType::Bool; }
+
+			bool HasSideEffects(const Node& n)
+			{
+				if (n.Kind == NodeKind::Assign || n.Kind == NodeKind::PreIncDec || n.Kind == NodeKind::PostIncDec)
+					return true;
+				if (n.Kind == NodeKind::Call && m_functions.count(n.Text))
+					return true;
+				for (const NodePtr& c : n.Children)
+					if (HasSideEffects(*c))
+						return true;
+				return false;
+			}
+
+			/* operators */
+			Reg Sum(const std::vector<std::pair<Reg, Reg>>& products)
+			{
+				Reg sum = Emit(Opcode::Mul, products[0].first, products[0].second);
+				for (size_t i = 1; i < products.size(); i++)
+					sum = Emit(Opcode::Add, sum, Emit(Opcode::Mul, products[i].first, products[i].second));
+				return sum;
+			}
+
+			// Componentwise applies op to every component; scalar arguments
+			// are broadcast to the shape of the others.
+			bool Componentwise(Opcode op, const std::vector<Value>& args, BaseType base, Value& out, int line)
+			{
+				Type shape = args[0].T;
+				for (const Value& a : args) {
+					if (a.T.Array || a.T.Base == BaseType::Void)
+						return Fail(line, "invalid operand of type " + TypeName(a.T));
+					if (a.T.Size() > shape.Size())
+						shape = a.T;
+				}
+				for (const Value& a : args)
+					if (!a.T.IsScalar() && !a.T.SameShape(shape))
+						return Fail(line, "mismatched operands " + TypeName(a.T) + " and " + TypeName(shape));
+
+				out = Value();
+				out.T = shape;
+				out.T.Base = base;
+				for (int i = 0; i < shape.Size(); i++) {
+					Reg r[3] = { 0, 0, 0 };
+					for (size_t k = 0; k < args.size(); k++)
+						r[k] = args[k].Regs[args[k].T.IsScalar() ? 0 : i];
+					out.Regs.push_back(Emit(op, r[0], r[1], r[2]));
+				}
+				return true;
+			}
+
+			static BaseType NumericBase(const std::vector<Value>& args)
+			{
+				for (const Value& a : args)
+					if (a.T.Base == BaseType::Float)
+						return BaseType::Float;
+				return BaseType::Int;
+			}
+
+			bool Arithmetic(const std::string& op, const Value& a, const Value& b, Value& out, int line)
+			{
+				if (!IsNumeric(a.T) || !IsNumeric(b.T))
+					return Fail(line, "invalid operands to '" + op + "': " + TypeName(a.T) + " and " + TypeName(b.T));
+
+				BaseType base = NumericBase({ a, b });
+				if (op == "*" && (a.T.IsMatrix() || b.T.IsMatrix()) && !a.T.IsScalar() && !b.T.IsScalar()) {
+					out = Value();
+					if (a.T.IsMatrix() && b.T.IsMatrix()) {
+						if (a.T.Cols != b.T.Rows)
+							return Fail(line, "cannot multiply " + TypeName(a.T) + " by " + TypeName(b.T));
+						out.T = Type(BaseType::Float, a.T.Rows, b.T.Cols);
+						for (int c = 0; c < b.T.Cols; c++)
+							for (int r = 0; r < a.T.Rows; r++) {
+								std::vector<std::pair<Reg, Reg>> p;
+								for (int k = 0; k < a.T.Cols; k++)
+									p.push_back({ a.Regs[k * a.T.Rows + r], b.Regs[c * b.T.Rows + k] });
+								out.Regs.push_back(Sum(p));
+							}
+					} else if (a.T.IsMatrix()) {
+						if (a.T.Cols != b.T.Rows)
+							return Fail(line, "cannot multiply " + TypeName(a.T) + " by " + TypeName(b.T));
+						out.T = Type(BaseType::Float, a.T.Rows);
+						for (int r = 0; r < a.T.Rows; r++) {
+							std::vector<std::pair<Reg, Reg>> p;
+							for (int k = 0; k < a.T.Cols; k++)
+								p.push_back({ a.Regs[k * a.T.Rows + r], b.Regs[k] });
+							out.Regs.push_back(Sum(p));
+						}
+					} else {
+						if (a.T.Rows != b.T.Rows)
+							return Fail(line, "cannot multiply " + TypeName(a.T) + " by " + TypeName(b.T));
+						out.T = Type(BaseType::Float, b.T.Cols);
+						for (int c = 0; c < b.T.Cols; c++) {
+							std::vector<std::pair<Reg, Reg>> p;
+							for (int k = 0; k < b.T.Rows; k++)
+								p.push_back({ a.Regs[k], b.Regs[c * b.T.Rows + k] });
+							out.Regs.push_back(Sum(p));
+						}
+					}
+					return true;
+				}
+
+				Opcode code = op == "+" ? Opcode::Add : op == "-" ? Opcode::Sub : op == "*" ? Opcode::Mul : op == "/" ? Opcode::Div : Opcode::Mod;
+				if (!Componentwise(code, { a, b }, base, out, line))
+					return false;
+				if (base == BaseType::Int && code == Opcode::Div)
+					for (Reg& r : out.Regs)
+						r = Emit(Opcode::Trunc, r);
+				return true;
+			}
+
+			bool BinaryOp(const std::string& op, const Value& a, const Value& b, Value& out, int line)
+			{
+				if (op == "+" || op == "-" || op == "*" || op == "/" || op == "%")
+					return Arithmetic(op, a, b, out, line);
+
+				out = Value();
+				out.T = Type(BaseType::Bool);
+
+				if (op == "<" || op == ">" || op == "<=" || op == ">=") {
+					if (!a.T.IsScalar() || !b.T.IsScalar() || !IsNumeric(a.T) || !IsNumeric(b.T))
+						return Fail(line, "'" + op + "' needs scalar operands, use lessThan() & co. for vectors");
+					Opcode code = op == "<" ? Opcode::Lt : op == ">" ? Opcode::Gt : op == "<=" ? Opcode::Le : Opcode::Ge;
+					out.Regs.push_back(Emit(code, a.Regs[0], b.Regs[0]));
+					return true;
+				}
+
+				if (op == "==" || op == "!=") {
+					if (!a.T.SameShape(b.T) || (a.T.Base == BaseType::Bool) != (b.T.Base == BaseType::Bool))
+						return Fail(line, "cannot compare " + TypeName(a.T) + " with " + TypeName(b.T));
+					bool eq = op == "==";
+					Reg r = Emit(eq ? Opcode::Eq : Opcode::Ne, a.Regs[0], b.Regs[0]);
+					for (size_t i = 1; i < a.Regs.size(); i++)
+						r = Emit(eq ? Opcode::And : Opcode::Or, r, Emit(eq ? Opcode::Eq : Opcode::Ne, a.Regs[i], b.Regs[i]));
+					out.Regs.push_back(r);
+					return true;
+				}
+
+				if (!IsBoolScalar(a.T) || !IsBoolScalar(b.T))
+					return Fail(line, "'" + op + "' needs boolean operands");
+				Opcode code = op == "&&" ? Opcode::And : op == "||" ? Opcode::Or : Opcode::Xor;
+				out.Regs.push_back(Emit(code, a.Regs[0], b.Regs[0]));
+				return true;
+			}
+
+			/* constructors */
+			bool Construct(const Type& t, const std::vector<Value>& args, Value& out, int line)
+			{
+				out = Value();
+				out.T = t;
+				if (args.empty())
+					return Fail(line, "constructor " + TypeName(t) + " needs arguments");
+
+				std::vector<Reg> comps;
+				std::vector<BaseType> bases;
+				for (const Value& a : args) {
+					if (a.T.Array || a.T.Base == BaseType::Void)
+						return Fail(line, "invalid argument of type " + TypeName(a.T) + " to " + TypeName(t));
+					for (Reg r : a.Regs) {
+						comps.push_back(r);
+						bases.push_back(a.T.Base);
+					}
+				}
+
+				int size = t.Size();
+				if (args.size() == 1 && args[0].T.IsScalar() && size > 1) {
+					Reg r = ConvertReg(comps[0], bases[0], t.Base);
+					if (t.Cols > 1) {
+						// diagonal matrix
+						for (int c = 0; c < t.Cols; c++)
+							for (int k = 0; k < t.Rows; k++)
+								out.Regs.push_back(c == k ? r : Constant(0.0f));
+					} else
+						out.Regs.assign(size, r);
+					return true;
+				}
+
+				if (args.size() == 1 && args[0].T.IsMatrix() && t.Cols > 1) {
+					const Value& m = args[0];
+					for (int c = 0; c < t.Cols; c++)
+						for (int k = 0; k < t.Rows; k++) {
+							if (c < m.T.Cols && k < m.T.Rows)
+								out.Regs.push_back(m.Regs[c * m.T.Rows + k]);
+							else
+								out.Regs.push_back(Constant(c == k ? 1.0f : 0.0f));
+						}
+					return true;
+				}
+
+				if ((int)comps.size() < size)
+					return Fail(line, "not enough components to construct " + TypeName(t));
+				if ((int)(comps.size() - args.back().Regs.size()) >= size)
+					return Fail(line, "too many arguments to construct " + TypeName(t));
+				for (int i = 0; i < size; i++)
+					out.Regs.push_back(ConvertReg(comps[i], bases[i], t.Base));
+				return true;
+			}
+
+			bool ConstructArray(const Node& n, Value& out)
+			{
+				Type elem;
+				if (!ParseType(n.Text, elem) || elem.Base == BaseType::Void)
+					return Fail(n.Line, "invalid array type " + n.Text);
+				int count = n.ArraySize > 0 ? n.ArraySize : (int)n.Children.size();
+				if (count != (int)n.Children.size())
+					return Fail(n.Line, "array constructor needs " + std::to_string(count) + " elements");
+
+				out = Value();
+				out.T = elem;
+				out.T.Array = count;
+				for (const NodePtr& c : n.Children) {
+					Value v;
+					if (!Expr(*c, v) || !Coerce(v, elem, c->Line))
+						return false;
+					out.Regs.insert(out.Regs.end(), v.Regs.begin(), v.Regs.end());
+				}
+				return true;
+			}
+
+			/* built-in functions */
+			Reg Dot(const Value& a, const Value& b)
+			{
+				std::vector<std::pair<Reg, Reg>> p;
+				for (size_t i = 0; i < a.Regs.size(); i++)
+					p.push_back({ a.Regs[i], b.Regs[i] });
+				return Sum(p);
+			}
+
+			Reg Determinant(const std::vector<Reg>& m, int n)
+			{
+				if (n == 1)
+					return m[0];
+				if (n == 2)
+					return Emit(Opcode::Sub, Emit(Opcode::Mul, m[0], m[3]), Emit(Opcode::Mul, m[2], m[1]));
+
+				// cofactor expansion along the first column
+				Reg det = 0;
+				for (int r = 0; r < n; r++) {
+					Reg minor = Determinant(Minor(m, n, 0, r), n - 1);
+					Reg term = Emit(Opcode::Mul, m[r], minor);
+					if (r == 0)
+						det = term;
+					else
+						det = Emit((r & 1) ? Opcode::Sub : Opcode::Add, det, term);
+				}
+				return det;
+			}
+
+			static std::vector<Reg> Minor(const std::vector<Reg>& m, int n, int col, int row)
+			{
+				std::vector<Reg> out;
+				for (int c = 0; c < n; c++)
+					for (int r = 0; r < n; r++)
+						if (c != col && r != row)
+							out.push_back(m[c * n + r]);
+				return out;
+			}
+
+			bool Builtin(const Node& call, std::vector<Value>& args, Value& out)
+			{
+				static const std::map<std::string, Opcode> unary = {
+					{ "abs", Opcode::Abs }, { "sign", Opcode::Sign }, { "floor", Opcode::Floor }, { "ceil", Opcode::Ceil },
+					{ "fract", Opcode::Fract }, { "trunc", Opcode::Trunc }, { "round", Opcode::Round }, { "roundEven", Opcode::RoundEven },
+					{ "sqrt", Opcode::Sqrt }, { "inversesqrt", Opcode::InvSqrt }, { "exp", Opcode::Exp }, { "exp2", Opcode::Exp2 },
+					{ "log", Opcode::Log }, { "log2", Opcode::Log2 }, { "sin", Opcode::Sin }, { "cos", Opcode::Cos }, { "tan", Opcode::Tan },
+					{ "asin", Opcode::Asin }, { "acos", Opcode::Acos }, { "sinh", Opcode::Sinh }, { "cosh", Opcode::Cosh }, { "tanh", Opcode::Tanh },
+				};
+				static const std::map<std::string, Opcode> binary = {
+					{ "pow", Opcode::Pow }, { "mod", Opcode::Mod }, { "min", Opcode::Min }, { "max", Opcode::Max }, { "step", Opcode::Step },
+				};
+				static const std::map<std::string, Opcode> relational = {
+					{ "lessThan", Opcode::Lt }, { "lessThanEqual", Opcode::Le }, { "greaterThan", Opcode::Gt },
+					{ "greaterThanEqual", Opcode::Ge }, { "equal", Opcode::Eq }, { "notEqual", Opcode::Ne },
+				};
+
+				const std::string& name = call.Text;
+				int line = call.Line;
+				size_t argc = args.size();
+				auto arity = [&](size_t n) {
+					if (argc == n)
+						return true;
+					return Fail(line, name + "() takes " + std::to_string(n) + " argument(s)");
+				};
+				auto vector = [&](const Value& v) {
+					if (v.T.Array || v.T.Cols > 1 || (v.T.Base != BaseType::Float && v.T.Base != BaseType::Int))
+						return Fail(line, name + "() needs vector arguments");
+					return true;
+				};
+
+				if (unary.count(name) || (name == "atan" && argc == 1)) {
+					if (!arity(1))
+						return false;
+					Opcode op = name == "atan" ? Opcode::Atan : unary.at(name);
+					bool keepsInt = op == Opcode::Abs || op == Opcode::Sign;
+					return Componentwise(op, args, keepsInt ? NumericBase(args) : BaseType::Float, out, line);
+				}
+				if (binary.count(name) || name == "atan") {
+					if (!arity(2))
+						return false;
+					Opcode op = name == "atan" ? Opcode::Atan2 : binary.at(name);
+					bool keepsInt = op == Opcode::Min || op == Opcode::Max;
+					return Componentwise(op, args, keepsInt ? NumericBase(args) : BaseType::Float, out, line);
+				}
+				if (name == "radians" || name == "degrees") {
+					if (!arity(1))
+						return false;
+					float k = name == "radians" ? 3.14159265358979f / 180.0f : 180.0f / 3.14159265358979f;
+					return Componentwise(Opcode::Mul, { args[0], Constants(Type(BaseType::Float), k) }, BaseType::Float, out, line);
+				}
+				if (name == "clamp") {
+					if (!arity(3))
+						return false;
+					return Componentwise(Opcode::Clamp, args, NumericBase(args), out, line);
+				}
+				if (name == "smoothstep") {
+					if (!arity(3))
+						return false;
+					return Componentwise(Opcode::Smoothstep, args, BaseType::Float, out, line);
+				}
+				if (name == "mix") {
+					if (!arity(3))
+						return false;
+					if (args[2].T.Base == BaseType::Bool)
+						return Componentwise(Opcode::Select, { args[2], args[1], args[0] }, NumericBase({ args[0], args[1] }), out, line);
+					return Componentwise(Opcode::Mix, args, BaseType::Float, out, line);
+				}
+
+				if (name == "dot" || name == "distance" || name == "length") {
+					if (!arity(name == "length" ? 1 : 2) || !vector(args[0]) || (argc > 1 && !vector(args[1])))
+						return false;
+					if (argc > 1 && args[0].Regs.size() != args[1].Regs.size())
+						return Fail(line, name + "() needs vectors of the same size");
+					Value v = args[0];
+					if (name == "distance" && !Arithmetic("-", args[0], args[1], v, line))
+						return false;
+					out = Value();
+					out.T = Type(BaseType::Float);
+					if (name == "dot")
+						out.Regs.push_back(Dot(args[0], args[1]));
+					else if (v.Regs.size() == 1)
+						out.Regs.push_back(Emit(Opcode::Abs, v.Regs[0]));
+					else
+						out.Regs.push_back(Emit(Opcode::Sqrt, Dot(v, v)));
+					return true;
+				}
+				if (name == "normalize") {
+					if (!arity(1) || !vector(args[0]))
+						return false;
+					Value k;
+					k.T = Type(BaseType::Float);
+					k.Regs.push_back(Emit(Opcode::InvSqrt, Dot(args[0], args[0])));
+					return Componentwise(Opcode::Mul, { args[0], k }, BaseType::Float, out, line);
+				}
+				if (name == "cross") {
+					if (!arity(2) || args[0].T.Size() != 3 || args[1].T.Size() != 3 || args[0].T.Cols > 1 || args[1].T.Cols > 1)
+						return Fail(line, "cross() needs two vec3 arguments");
+					const std::vector<Reg>& a = args[0].Regs;
+					const std::vector<Reg>& b = args[1].Regs;
+					out = Value();
+					out.T = Type(BaseType::Float, 3);
+					for (int i = 0; i < 3; i++) {
+						int j = (i + 1) % 3, k = (i + 2) % 3;
+						out.Regs.push_back(Emit(Opcode::Sub, Emit(Opcode::Mul, a[j], b[k]), Emit(Opcode::Mul, a[k], b[j])));
+					}
+					return true;
+				}
+				if (name == "reflect") {
+					// I - 2 * dot(N, I) * N
+					if (!arity(2) || !vector(args[0]) || !vector(args[1]))
+						return false;
+					Value k;
+					k.T = Type(BaseType::Float);
+					k.Regs.push_back(Emit(Opcode::Mul, Constant(2.0f), Dot(args[1], args[0])));
+					Value scaled;
+					return Arithmetic("*", k, args[1], scaled, line) && Arithmetic("-", args[0], scaled, out, line);
+				}
+				if (name == "faceforward") {
+					// dot(Nref, I) < 0 ? N : -N
+					if (!arity(3) || !vector(args[0]) || !vector(args[1]) || !vector(args[2]))
+						return false;
+					Value cond;
+					cond.T = Type(BaseType::Bool);
+					cond.Regs.push_back(Emit(Opcode::Lt, Dot(args[2], args[1]), Constant(0.0f)));
+					Value neg;
+					if (!Componentwise(Opcode::Neg, { args[0] }, BaseType::Float, neg, line))
+						return false;
+					return Componentwise(Opcode::Select, { cond, args[0], neg }, BaseType::Float, out, line);
+				}
+				if (name == "refract") {
+					// k = 1 - eta^2 (1 - dot(N, I)^2); k < 0 ? 0 : eta * I - (eta * dot(N, I) + sqrt(k)) * N
+					if (!arity(3) || !vector(args[0]) || !vector(args[1]) || !args[2].T.IsScalar())
+						return false;
+					Reg eta = args[2].Regs[0];
+					Reg d = Dot(args[1], args[0]);
+					Reg k = Emit(Opcode::Sub, Constant(1.0f), Emit(Opcode::Mul, Emit(Opcode::Mul, eta, eta), Emit(Opcode::Sub, Constant(1.0f), Emit(Opcode::Mul, d, d))));
+					Reg f = Emit(Opcode::Add, Emit(Opcode::Mul, eta, d), Emit(Opcode::Sqrt, k));
+					Reg negative = Emit(Opcode::Lt, k, Constant(0.0f));
+					out = Value();
+					out.T = args[0].T;
+					for (size_t i = 0; i < args[0].Regs.size(); i++) {
+						Reg r = Emit(Opcode::Sub, Emit(Opcode::Mul, eta, args[0].Regs[i]), Emit(Opcode::Mul, f, args[1].Regs[i]));
+						out.Regs.push_back(Emit(Opcode::Select, negative, Constant(0.0f), r));
+					}
+					return true;
+				}
+
+				if (name == "matrixCompMult") {
+					if (!arity(2) || !args[0].T.IsMatrix() || args[0].T != args[1].T)
+						return Fail(line, "matrixCompMult() needs two matrices of the same type");
+					return Componentwise(Opcode::Mul, args, BaseType::Float, out, line);
+				}
+				if (name == "outerProduct") {
+					if (!arity(2) || !vector(args[0]) || !vector(args[1]))
+						return false;
+					out = Value();
+					out.T = Type(BaseType::Float, args[0].T.Rows, args[1].T.Rows);
+					for (Reg c : args[1].Regs)
+						for (Reg r : args[0].Regs)
+							out.Regs.push_back(Emit(Opcode::Mul, r, c));
+					return true;
+				}
+				if (name == "transpose") {
+					if (!arity(1) || !args[0].T.IsMatrix())
+						return Fail(line, "transpose() needs a matrix");
+					const Value& m = args[0];
+					out = Value();
+					out.T = Type(BaseType::Float, m.T.Cols, m.T.Rows);
+					for (int c = 0; c < m.T.Rows; c++)
+						for (int r = 0; r < m.T.Cols; r++)
+							out.Regs.push_back(m.Regs[r * m.T.Rows + c]);
+					return true;
+				}
+				if (name == "determinant" || name == "inverse") {
+					if (!arity(1) || !args[0].T.IsMatrix() || args[0].T.Rows != args[0].T.Cols)
+						return Fail(line, name + "() needs a square matrix");
+					int n = args[0].T.Rows;
+					const std::vector<Reg>& m = args[0].Regs;
+					Reg det = Determinant(m, n);
+					out = Value();
+					if (name == "determinant") {
+						out.T = Type(BaseType::Float);
+						out.Regs.push_back(det);
+						return true;
+					}
+					// adjugate divided by the determinant
+					out.T = args[0].T;
+					Reg inv = Emit(Opcode::Div, Constant(1.0f), det);
+					for (int c = 0; c < n; c++)
+						for (int r = 0; r < n; r++) {
+							Reg cofactor = Determinant(Minor(m, n, r, c), n - 1);
+							if ((r + c) & 1)
+								cofactor = Emit(Opcode::Neg, cofactor);
+							out.Regs.push_back(Emit(Opcode::Mul, cofactor, inv));
+						}
+					return true;
+				}
+
+				if (relational.count(name)) {
+					if (!arity(2) || args[0].T.Cols > 1 || args[0].T.Rows < 2 || !args[0].T.SameShape(args[1].T))
+						return Fail(line, name + "() needs two vectors of the same size");
+					return Componentwise(relational.at(name), args, BaseType::Bool, out, line);
+				}
+				if (name == "any" || name == "all" || name == "not") {
+					if (!arity(1) || args[0].T.Base != BaseType::Bool || args[0].T.Rows < 2 || args[0].T.Cols > 1)
+						return Fail(line, name + "() needs a boolean vector");
+					if (name == "not")
+						return Componentwise(Opcode::Not, args, BaseType::Bool, out, line);
+					Opcode op = name == "any" ? Opcode::Or : Opcode::And;
+					Reg r = args[0].Regs[0];
+					for (size_t i = 1; i < args[0].Regs.size(); i++)
+						r = Emit(op, r, args[0].Regs[i]);
+					out = Value();
+					out.T = Type(BaseType::Bool);
+					out.Regs.push_back(r);
+					return true;
+				}
+				if (name == "isnan") {
+					if (!arity(1))
+						return false;
+					return Componentwise(Opcode::Ne, { args[0], args[0] }, BaseType::Bool, out, line);
+				}
+
+				return Fail(line, "unknown or unsupported function '" + name + "'");
+			}
+
+			/* user functions */
+			bool CallFunction(const Node& call, const std::vector<const Node*>& candidates, Value& out)
+			{
+				std::vector<Value> args(call.Children.size());
+				for (size_t i = 0; i < args.size(); i++)
+					if (!Expr(*call.Children[i], args[i]))
+						return false;
+
+				const Node* best = nullptr;
+				int bestScore = INT_MAX;
+				for (const Node* fn : candidates) {
+					if (fn->Params.size() != args.size())
+						continue;
+					int score = 0;
+					for (size_t i = 0; i < args.size() && score != INT_MAX; i++) {
+						Type pt;
+						ParseType(fn->Params[i].TypeName, pt);
+						pt.Array = fn->Params[i].ArraySize;
+						if (args[i].T == pt)
+							continue;
+						if (fn->Params[i].Qualifier == "in" && args[i].T.SameShape(pt) && args[i].T.Base == BaseType::Int && pt.Base == BaseType::Float)
+							score++;
+						else
+							score = INT_MAX;
+					}
+					if (score < bestScore) {
+						best = fn;
+						bestScore = score;
+					}
+				}
+				if (!best) {
+					std::string sig;
+					for (const Value& a : args)
+						sig += (sig.empty() ? "" : ", ") + TypeName(a.T);
+					return Fail(call.Line, "no matching function for " + call.Text + "(" + sig + ")");
+				}
+				for (const FunctionFrame& f : m_frames)
+					if (f.Fn == best)
+						return Fail(call.Line, "recursive call to " + call.Text + "() is not supported");
+
+				Type ret;
+				ParseType(best->TypeName, ret);
+				std::vector<Reg> result = Temp(ret).Regs;
+
+				std::vector<std::pair<std::string, Variable>> params;
+				for (size_t i = 0; i < args.size(); i++) {
+					const Param& p = best->Params[i];
+					Variable var;
+					ParseType(p.TypeName, var.T);
+					var.T.Array = p.ArraySize;
+					var.Const = false;
+					var.Regs = Temp(var.T).Regs;
+					if (p.Qualifier != "in" && !args[i].LValue)
+						return Fail(call.Line, "argument " + std::to_string(i + 1) + " of " + call.Text + "() must be a variable");
+					if (p.Qualifier == "out") {
+						for (Reg r : var.Regs)
+							EmitTo(Opcode::Mov, r, Constant(0.0f));
+					} else {
+						Value a = args[i];
+						if (!Coerce(a, var.T, call.Line))
+							return false;
+						Copy(var.Regs, a.Regs);
+					}
+					params.push_back({ p.Name, var });
+				}
+
+				if (!Body(*best, params, ret, result, false))
+					return false;
+
+				for (size_t i = 0; i < args.size(); i++)
+					if (best->Params[i].Qualifier != "in") {
+						Value v;
+						v.T = params[i].second.T;
+						v.Regs = params[i].second.Regs;
+						if (!Store(args[i], v, call.Line))
+							return false;
+					}
+
+				out = Value();
+				out.T = ret;
+				out.Regs = result;
+				return true;
+			}
+
+			// Body inlines a function body whose parameters are already bound
+			// to registers. Call/EndCall are only emitted when the body returns
+			// from somewhere other than its last statement.
+			bool Body(const Node& fn, const std::vector<std::pair<std::string, Variable>>& params, const Type& ret, const std::vector<Reg>& result, bool entry)
+			{
+				const Node& body = *fn.Children[0];
+				int returns = CountKind(body, NodeKind::Return);
+				bool tail = !body.Children.empty() && body.Children.back()->Kind == NodeKind::Return;
+
+				FunctionFrame frame;
+				frame.Fn = &fn;
+				frame.ReturnType = ret;
+				frame.ReturnRegs = result;
+				frame.HasFrame = returns > (tail ? 1 : 0) || (entry && m_hasDiscard);
+				frame.LoopBase = m_loops.size();
+				frame.ScopeBase = m_scopes.size();
+
+				size_t call = frame.HasFrame ? EmitControl(Opcode::Call) : 0;
+				PushScope();
+				for (const auto& p : params)
+					if (!p.first.empty())
+						m_scopes.back()[p.first] = p.second;
+				m_frames.push_back(frame);
+
+				bool ok = true;
+				for (const NodePtr& s : body.Children)
+					if (!(ok = Stmt(*s)))
+						break;
+
+				frame = m_frames.back();
+				m_frames.pop_back();
+				PopScope();
+				if (!ok)
+					return false;
+
+				if (frame.HasFrame) {
+					size_t end = EmitControl(Opcode::EndCall);
+					Patch(call, end);
+					for (size_t r : frame.Returns)
+						Patch(r, end);
+				}
+				return true;
+			}
+
+			/* expressions */
+			bool Index(const Value& v, const Node& indexNode, Value& out, int line)
+			{
+				Value index;
+				if (!Expr(indexNode, index))
+					return false;
+				if (!index.T.IsScalar() || index.T.Base == BaseType::Bool)
+					return Fail(line, "index must be an integer scalar");
+
+				Type elem;
+				int count;
+				if (v.T.Array) {
+					elem = v.T.Element();
+					count = v.T.Array;
+				} else if (v.T.Cols > 1) {
+					elem = Type(v.T.Base, v.T.Rows);
+					count = v.T.Cols;
+				} else if (v.T.Rows > 1) {
+					elem = Type(v.T.Base);
+					count = v.T.Rows;
+				} else
+					return Fail(line, "cannot index a value of type " + TypeName(v.T));
+
+				int stride = elem.Size();
+				out = Value();
+				out.T = elem;
+
+				if (IsConstant(index.Regs[0])) {
+					int i = (int)ConstantValue(index.Regs[0]);
+					if (i < 0 || i >= count)
+						return Fail(line, "index " + std::to_string(i) + " is out of range");
+					out.Regs.assign(v.Regs.begin() + i * stride, v.Regs.begin() + (i + 1) * stride);
+					out.LValue = v.LValue;
+					if (v.Dynamic) {
+						out.Dynamic = true;
+						out.DynIndex = v.DynIndex;
+						out.DynBase = v.DynBase;
+						out.DynStride = v.DynStride;
+						out.DynOffsets.assign(v.DynOffsets.begin() + i * stride, v.DynOffsets.begin() + (i + 1) * stride);
+					}
+					return true;
+				}
+
+				// run-time index: select the element (out of range reads element 0)
+				Reg idx = index.Regs[0];
+				std::vector<Reg> cond(count);
+				for (int e = 1; e < count; e++)
+					cond[e] = Emit(Opcode::Eq, idx, Constant((float)e));
+				for (int j = 0; j < stride; j++) {
+					Reg r = v.Regs[j];
+					for (int e = 1; e < count; e++)
+						r = Emit(Opcode::Select, cond[e], v.Regs[e * stride + j], r);
+					out.Regs.push_back(r);
+				}
+
+				if (v.LValue && !v.Dynamic) {
+					out.LValue = true;
+					out.Dynamic = true;
+					out.DynIndex = idx;
+					out.DynBase = v.Regs;
+					out.DynStride = stride;
+					for (int j = 0; j < stride; j++)
+						out.DynOffsets.push_back(j);
+				}
+				return true;
+			}
+
+			bool Member(const Value& v, const std::string& field, Value& out, int line)
+			{
+				if (v.T.Array || v.T.Cols > 1 || v.T.Base == BaseType::Void)
+					return Fail(line, "'" + field + "' is not a field of " + TypeName(v.T));
+				if (field.size() > 4)
+					return Fail(line, "invalid swizzle '" + field + "'");
+
+				out = Value();
+				out.T = Type(v.T.Base, (int)field.size());
+				std::set<int> seen;
+				for (char c : field) {
+					int i = SwizzleIndex(c);
+					if (i < 0 || i >= v.T.Rows)
+						return Fail(line, "invalid swizzle '" + field + "' of " + TypeName(v.T));
+					seen.insert(i);
+					out.Regs.push_back(v.Regs[i]);
+					if (v.Dynamic)
+						out.DynOffsets.push_back(v.DynOffsets[i]);
+				}
+				out.LValue = v.LValue && seen.size() == field.size();
+				if (v.Dynamic) {
+					out.Dynamic = true;
+					out.DynIndex = v.DynIndex;
+					out.DynBase = v.DynBase;
+					out.DynStride = v.DynStride;
+				}
+				return true;
+			}
+
+			bool Conditional(const Node& n, Value& out)
+			{
+				Value cond;
+				if (!Expr(*n.Children[0], cond))
+					return false;
+				if (!IsBoolScalar(cond.T))
+					return Fail(n.Line, "condition must be a bool");
+				if (IsConstant(cond.Regs[0]))
+					return Expr(*n.Children[ConstantValue(cond.Regs[0]) != 0.0f ? 1 : 2], out);
+
+				if (!HasSideEffects(*n.Children[1]) && !HasSideEffects(*n.Children[2])) {
+					Value a, b;
+					if (!Expr(*n.Children[1], a) || !Expr(*n.Children[2], b))
+						return false;
+					if (a.T.Base == BaseType::Int && b.T.Base == BaseType::Float && !Coerce(a, b.T, n.Line))
+						return false;
+					if (!Coerce(b, a.T, n.Line))
+						return false;
+					out = Value();
+					out.T = a.T;
+					for (size_t i = 0; i < a.Regs.size(); i++)
+						out.Regs.push_back(Emit(Opcode::Select, cond.Regs[0], a.Regs[i], b.Regs[i]));
+					return true;
+				}
+
+				Value a, b;
+				size_t branch = EmitControl(Opcode::If, cond.Regs[0]);
+				if (!Expr(*n.Children[1], a))
+					return false;
+				out = Temp(a.T);
+				Copy(out.Regs, a.Regs);
+				size_t other = EmitControl(Opcode::Else);
+				Patch(branch, other);
+				if (!Expr(*n.Children[2], b) || !Coerce(b, a.T, n.Line))
+					return false;
+				Copy(out.Regs, b.Regs);
+				Patch(other, EmitControl(Opcode::EndIf));
+				return true;
+			}
+
+			bool Logical(const Node& n, Value& out)
+			{
+				bool isAnd = n.Text == "&&";
+				Value a, b;
+				if (!Expr(*n.Children[0], a))
+					return false;
+				if (!IsBoolScalar(a.T))
+					return Fail(n.Line, "'" + n.Text + "' needs boolean operands");
+				if (!HasSideEffects(*n.Children[1]) || IsConstant(a.Regs[0])) {
+					if (IsConstant(a.Regs[0]) && (ConstantValue(a.Regs[0]) != 0.0f) != isAnd) {
+						out = a; // short-circuited
+						return true;
+					}
+					return Expr(*n.Children[1], b) && BinaryOp(n.Text, a, b, out, n.Line);
+				}
+
+				// the right operand has side effects: only evaluate it when needed
+				out = Temp(Type(BaseType::Bool));
+				EmitTo(Opcode::Mov, out.Regs[0], a.Regs[0]);
+				size_t branch = EmitControl(Opcode::If, isAnd ? a.Regs[0] : Emit(Opcode::Not, a.Regs[0]));
+				if (!Expr(*n.Children[1], b))
+					return false;
+				if (!IsBoolScalar(b.T))
+					return Fail(n.Line, "'" + n.Text + "' needs boolean operands");
+				EmitTo(Opcode::Mov, out.Regs[0], b.Regs[0]);
+				Patch(branch, EmitControl(Opcode::EndIf));
+				return true;
+			}
+
+			bool Expr(const Node& n, Value& out)
+			{
+				switch (n.Kind) {
+				case NodeKind::Number:
+					out = Constants(Type(n.IsInt ? BaseType::Int : BaseType::Float), (float)n.Number);
+					return true;
+
+				case NodeKind::Bool:
+					out = Constants(Type(BaseType::Bool), (float)n.Number);
+					return true;
+
+				case NodeKind::Identifier: {
+					Variable* var = Lookup(n.Text);
+					if (!var)
+						return Fail(n.Line, "undeclared identifier '" + n.Text + "'");
+					out = Value();
+					out.T = var->T;
+					out.Regs = var->Regs;
+					out.LValue = !var->Const;
+					return true;
+				}
+
+				case NodeKind::Unary: {
+					Value v;
+					if (!Expr(*n.Children[0], v))
+						return false;
+					if (n.Text == "!") {
+						if (!IsBoolScalar(v.T))
+							return Fail(n.Line, "'!' needs a bool operand");
+						return Componentwise(Opcode::Not, { v }, BaseType::Bool, out, n.Line);
+					}
+					if (!IsNumeric(v.T))
+						return Fail(n.Line, "invalid operand to unary '" + n.Text + "'");
+					if (n.Text == "+") {
+						out = v;
+						out.LValue = false;
+						return true;
+					}
+					return Componentwise(Opcode::Neg, { v }, v.T.Base, out, n.Line);
+				}
+
+				case NodeKind::PreIncDec:
+				case NodeKind::PostIncDec: {
+					Value v;
+					if (!Expr(*n.Children[0], v))
+						return false;
+					if (!IsNumeric(v.T))
+						return Fail(n.Line, "invalid operand to '" + n.Text + "'");
+					Value old = v;
+					old.LValue = old.Dynamic = false;
+					if (n.Kind == NodeKind::PostIncDec) {
+						old = Temp(v.T);
+						Copy(old.Regs, v.Regs);
+					}
+					Value updated;
+					if (!Arithmetic(n.Text == "++" ? "+" : "-", v, Constants(Type(v.T.Base), 1.0f), updated, n.Line) || !Store(v, updated, n.Line))
+						return false;
+					out = n.Kind == NodeKind::PostIncDec ? old : updated;
+					return true;
+				}
+
+				case NodeKind::Binary: {
+					if (n.Text == "&&" || n.Text == "||")
+						return Logical(n, out);
+					Value a, b;
+					return Expr(*n.Children[0], a) && Expr(*n.Children[1], b) && BinaryOp(n.Text, a, b, out, n.Line);
+				}
+
+				case NodeKind::Assign: {
+					Value dst, src;
+					if (!Expr(*n.Children[0], dst) || !Expr(*n.Children[1], src))
+						return false;
+					if (n.Text != "=") {
+						Value combined;
+						if (!Arithmetic(n.Text.substr(0, 1), dst, src, combined, n.Line))
+							return false;
+						src = combined;
+					}
+					if (!Coerce(src, dst.T, n.Line) || !Store(dst, src, n.Line))
+						return false;
+					out = src;
+					out.LValue = false;
+					return true;
+				}
+
+				case NodeKind::Ternary:
+					return Conditional(n, out);
+
+				case NodeKind::Call: {
+					auto fn = m_functions.find(n.Text);
+					if (fn != m_functions.end())
+						return CallFunction(n, fn->second, out);
+
+					std::vector<Value> args(n.Children.size());
+					for (size_t i = 0; i < args.size(); i++)
+						if (!Expr(*n.Children[i], args[i]))
+							return false;
+
+					Type t;
+					if (ParseType(n.Text, t)) {
+						if (t.Base == BaseType::Void)
+							return Fail(n.Line, "cannot construct void");
+						return Construct(t, args, out, n.Line);
+					}
+					return Builtin(n, args, out);
+				}
+
+				case NodeKind::ArrayCtor:
+					return ConstructArray(n, out);
+
+				case NodeKind::Member: {
+					Value v;
+					return Expr(*n.Children[0], v) && Member(v, n.Text, out, n.Line);
+				}
+
+				case NodeKind::Index: {
+					Value v;
+					return Expr(*n.Children[0], v) && Index(v, *n.Children[1], out, n.Line);
+				}
+
+				case NodeKind::Comma:
+					for (const NodePtr& c : n.Children)
+						if (!Expr(*c, out))
+							return false;
+					return true;
+
+				default:
+					return Fail(n.Line, "expected an expression");
+				}
+			}
+
+			/* statements */
+			bool Declaration(const Node& n)
+			{
+				Type base;
+				if (!ParseType(n.TypeName, base) || base.Base == BaseType::Void)
+					return Fail(n.Line, "invalid variable type " + n.TypeName);
+
+				for (const Declarator& d : n.Declarators) {
+					if (m_scopes.back().count(d.Name))
+						return Fail(d.Line, "redefinition of '" + d.Name + "'");
+
+					Type t = base;
+					t.Array = d.ArraySize;
+					Reg mark = m_next;
+
+					Value init;
+					if (d.Init) {
+						if (!Expr(*d.Init, init))
+							return false;
+						if (t.Array == -1)
+							t.Array = init.T.Array;
+						if (!Coerce(init, t, d.Line))
+							return false;
+					} else if (t.Array == -1)
+						return Fail(d.Line, "'" + d.Name + "' needs an initializer to size the array");
+					else if (n.IsConst)
+						return Fail(d.Line, "const '" + d.Name + "' needs an initializer");
+
+					Variable var;
+					var.T = t;
+					var.Const = n.IsConst;
+					if (d.Init && (IsConstant(init) ? n.IsConst : Fresh(init, mark)))
+						var.Regs = init.Regs; // folded constant or a fresh temporary: no copy needed
+					else {
+						var.Regs = Temp(t).Regs;
+						if (d.Init)
+							Copy(var.Regs, init.Regs);
+						else
+							for (Reg r : var.Regs)
+								EmitTo(Opcode::Mov, r, Constant(0.0f));
+					}
+					m_scopes.back()[d.Name] = var;
+				}
+				return true;
+			}
+
+			// Fresh reports whether v lives in distinct temporaries allocated
+			// since mark, which a declaration can then take over.
+			bool Fresh(const Value& v, Reg mark) const
+			{
+				std::set<Reg> seen;
+				for (Reg r : v.Regs)
+					if (IsConstant(r) || r < mark || r >= m_next || !seen.insert(r).second)
+						return false;
+				return true;
+			}
+
+			bool Condition(const Node& n, Value& cond)
+			{
+				if (!Expr(n, cond))
+					return false;
+				if (!IsBoolScalar(cond.T))
+					return Fail(n.Line, "condition must be a bool");
+				return true;
+			}
+
+			bool Scoped(const Node& n)
+			{
+				PushScope();
+				bool ok = Stmt(n);
+				PopScope();
+				return ok;
+			}
+
+			// Loop compiles for, while and do-while loops; any of init, cond
+			// and incr may be null.
+			bool Loop(const Node* init, const Node* cond, const Node* incr, const Node& body, bool condFirst)
+			{
+				PushScope();
+				if (init && !Stmt(*init)) {
+					PopScope();
+					return false;
+				}
+
+				bool ok = true;
+				Reg mark = m_next;
+				size_t loop = EmitControl(Opcode::Loop);
+				m_loops.emplace_back();
+
+				if (condFirst && cond) {
+					Value c;
+					ok = Condition(*cond, c);
+					if (ok && IsConstant(c.Regs[0]) && ConstantValue(c.Regs[0]) == 0.0f) {
+						// never entered
+						m_code.resize(loop);
+						m_loops.pop_back();
+						PopScope();
+						return true;
+					}
+					if (ok && !IsConstant(c.Regs[0]))
+						m_loops.back().Breaks.push_back(EmitControl(Opcode::BreakIfNot, c.Regs[0]));
+					m_next = mark;
+				}
+
+				ok = ok && Scoped(body);
+
+				size_t next = EmitControl(Opcode::ContinuePoint);
+				if (ok && incr) {
+					Value ignored;
+					ok = Expr(*incr, ignored);
+					m_next = mark;
+				}
+				if (ok && !condFirst && cond) {
+					Value c;
+					ok = Condition(*cond, c);
+					if (ok && IsConstant(c.Regs[0]) && ConstantValue(c.Regs[0]) == 0.0f)
+						m_loops.back().Breaks.push_back(EmitControl(Opcode::Break));
+					else if (ok && !IsConstant(c.Regs[0]))
+						m_loops.back().Breaks.push_back(EmitControl(Opcode::BreakIfNot, c.Regs[0]));
+					m_next = mark;
+				}
+
+				size_t end = EmitControl(Opcode::EndLoop);
+				Patch(end, loop);
+				Patch(loop, end);
+				for (size_t b : m_loops.back().Breaks)
+					Patch(b, end);
+				for (size_t c : m_loops.back().Continues)
+					Patch(c, next);
+				m_loops.pop_back();
+				PopScope();
+				return ok;
+			}
+
+			bool Stmt(const Node& n)
+			{
+				Reg mark = m_next;
+				bool ok = true;
+
+				switch (n.Kind) {
+				case NodeKind::Block:
+					PushScope();
+					for (const NodePtr& c : n.Children)
+						if (!(ok = Stmt(*c)))
+							break;
+					PopScope();
+					break;
+
+				case NodeKind::Declaration:
+					return Declaration(n); // keeps its registers
+
+				case NodeKind::ExprStmt: {
+					Value ignored;
+					ok = Expr(*n.Children[0], ignored);
+					break;
+				}
+
+				case NodeKind::If: {
+					Value cond;
+					if (!Condition(*n.Children[0], cond))
+						return false;
+					if (IsConstant(cond.Regs[0])) {
+						int taken = ConstantValue(cond.Regs[0]) != 0.0f ? 1 : 2;
+						if (taken < (int)n.Children.size())
+							ok = Scoped(*n.Children[taken]);
+						break;
+					}
+					size_t branch = EmitControl(Opcode::If, cond.Regs[0]);
+					m_next = mark;
+					ok = Scoped(*n.Children[1]);
+					if (ok && n.Children.size() > 2) {
+						size_t other = EmitControl(Opcode::Else);
+						Patch(branch, other);
+						branch = other;
+						ok = Scoped(*n.Children[2]);
+					}
+					Patch(branch, EmitControl(Opcode::EndIf));
+					break;
+				}
+
+				case NodeKind::For: {
+					const Node* init = n.Children[0]->Kind == NodeKind::Empty ? nullptr : n.Children[0].get();
+					const Node* cond = n.Children[1]->Kind == NodeKind::Empty ? nullptr : n.Children[1].get();
+					const Node* incr = n.Children[2]->Kind == NodeKind::Empty ? nullptr : n.Children[2].get();
+					ok = Loop(init, cond, incr, *n.Children[3], true);
+					break;
+				}
+				case NodeKind::While:
+					ok = Loop(nullptr, n.Children[0].get(), nullptr, *n.Children[1], true);
+					break;
+				case NodeKind::DoWhile:
+					ok = Loop(nullptr, n.Children[1].get(), nullptr, *n.Children[0], false);
+					break;
+
+				case NodeKind::Break:
+				case NodeKind::Continue:
+					if (m_loops.size() <= m_frames.back().LoopBase)
+						return Fail(n.Line, std::string(n.Kind == NodeKind::Break ? "break" : "continue") + " outside of a loop");
+					if (n.Kind == NodeKind::Break)
+						m_loops.back().Breaks.push_back(EmitControl(Opcode::Break));
+					else
+						m_loops.back().Continues.push_back(EmitControl(Opcode::Continue));
+					break;
+
+				case NodeKind::Return: {
+					Value v;
+					if (!n.Children.empty() && !Expr(*n.Children[0], v))
+						return false;
+					FunctionFrame& frame = m_frames.back(); // Expr may have grown m_frames
+					if (!n.Children.empty()) {
+						if (!Coerce(v, frame.ReturnType, n.Line))
+							return false;
+						Copy(frame.ReturnRegs, v.Regs);
+					} else if (frame.ReturnType.Base != BaseType::Void)
+						return Fail(n.Line, "missing return value");
+					if (frame.HasFrame)
+						frame.Returns.push_back(EmitControl(Opcode::Return));
+					break;
+				}
+
+				case NodeKind::Discard:
+					// no material anywhere at this point
+					for (Reg r : m_outputs)
+						EmitTo(Opcode::Mov, r, Constant(0.0f));
+					m_frames.front().Returns.push_back(EmitControl(Opcode::Return));
+					break;
+
+				case NodeKind::Empty:
+					break;
+
+				default:
+					return Fail(n.Line, "unexpected statement");
+				}
+
+				m_next = mark;
+				return ok;
+			}
+
+			/* program */
+			bool Translate(const Node& unit)
+			{
+				m_scopes.resize(1);
+				m_hasDiscard = CountKind(unit, NodeKind::Discard) > 0;
+
+				for (const NodePtr& c : unit.Children)
+					if (c->Kind == NodeKind::Function && !c->Children.empty()) {
+						if (IsTypeName(c->Text))
+							return Fail(c->Line, "cannot redefine " + c->Text);
+						m_functions[c->Text].push_back(c.get());
+					}
+				for (const NodePtr& c : unit.Children)
+					if (c->Kind == NodeKind::Function && c->Children.empty() && !m_functions.count(c->Text))
+						return Fail(c->Line, c->Text + "() is declared but never defined");
+
+				static const char* entries[] = { "mainModel4", "mainModel9", "mainModel16" };
+				static const int sizes[] = { 4, 9, 16 };
+				const Node* entry = nullptr;
+				int materials = 0;
+				for (int i = 0; i < 3 && !entry; i++) {
+					auto it = m_functions.find(entries[i]);
+					if (it != m_functions.end()) {
+						entry = it->second[0];
+						materials = sizes[i];
+						m_entry = entries[i];
+					}
+				}
+				if (!entry)
+					return Fail(1, "no mainModel4, mainModel9 or mainModel16 function");
+
+				// globals are initialized in order before the entry point runs
+				m_frames.push_back(FunctionFrame());
+				m_frames.back().LoopBase = 0;
+				m_frames.back().ScopeBase = 0;
+				for (const NodePtr& c : unit.Children)
+					if (c->Kind == NodeKind::Declaration && !Declaration(*c))
+						return false;
+				m_frames.pop_back();
+
+				std::vector<std::pair<std::string, Variable>> params;
+				bool hasPosition = false;
+				for (const Param& p : entry->Params) {
+					Variable var;
+					var.Const = false;
+					if (!ParseType(p.TypeName, var.T) || p.ArraySize)
+						return Fail(entry->Line, "invalid parameter type " + p.TypeName);
+					var.Regs = Temp(var.T).Regs;
+
+					if (p.Qualifier == "out") {
+						if (var.T.Size() != materials || var.T.Base != BaseType::Float || !m_outputs.empty())
+							return Fail(entry->Line, m_entry + "() must have a single 'out' parameter with " + std::to_string(materials) + " floats");
+						m_outputs = var.Regs;
+						for (Reg r : var.Regs)
+							EmitTo(Opcode::Mov, r, Constant(0.0f));
+					} else {
+						if (var.T != Type(BaseType::Float, 3) || hasPosition)
+							return Fail(entry->Line, m_entry + "() must have a single 'in vec3' parameter");
+						hasPosition = true;
+						for (int i = 0; i < 3; i++)
+							EmitTo(Opcode::Mov, var.Regs[i], (Reg)i);
+					}
+					params.push_back({ p.Name, var });
+				}
+				if (m_outputs.empty() || !hasPosition)
+					return Fail(entry->Line, m_entry + "() must take (out materials, in vec3 xyz)");
+
+				return Body(*entry, params, Type(), std::vector<Reg>(), true);
+			}
+
+			bool Finish(Program& program)
+			{
+				size_t registers = Program::NumInputs + m_constants.size() + (m_highWater - Program::NumInputs);
+				if (registers > 0xFFFF)
+					return Fail(1, "the model needs too many registers (" + std::to_string(registers) + ")");
+
+				uint32_t constantCount = (uint32_t)m_constants.size();
+				auto map = [&](Reg r) -> uint16_t {
+					if (IsConstant(r))
+						return (uint16_t)(Program::NumInputs + (r & ~ConstantFlag));
+					return (uint16_t)(r < Program::NumInputs ? r : r + constantCount);
+				};
+
+				program = Program();
+				program.Entry = m_entry;
+				program.Constants = m_constants;
+				program.NumRegisters = (uint16_t)registers;
+				program.Code.reserve(m_code.size());
+
+				int depth = 0;
+				for (const WideInstruction& w : m_code) {
+					Instruction in;
+					in.Op = w.Op;
+					in.Dst = map(w.Dst);
+					in.A = map(w.A);
+					in.B = map(w.B);
+					in.C = map(w.C);
+					in.Target = w.Target;
+					program.Code.push_back(in);
+
+					if (w.Op == Opcode::If || w.Op == Opcode::Loop || w.Op == Opcode::Call)
+						program.MaxDepth = std::max(program.MaxDepth, ++depth);
+					else if (w.Op == Opcode::EndIf || w.Op == Opcode::EndLoop || w.Op == Opcode::EndCall)
+						depth--;
+				}
+				for (Reg r : m_outputs)
+					program.Outputs.push_back(map(r));
+				return true;
+			}
+		};
+	}
+
+	bool Compile(const Node& unit, Program& program, std::string& err)
+	{
+		Compiler compiler;
+		return compiler.Run(unit, program, err);
+	}
+
+	bool CompileIRMF(const std::string& body, Program& program, std::string& err)
+	{
+		NodePtr unit;
+		if (!Parse(body, unit, err))
+			return false;
+		return Compile(*unit, program, err);
+	}
+}
@@ -0,0 +1,15 @@
+#pragma once
+#include <string>
+#include "parser.h"
+#include "program.h"
+
+namespace irmf
+{
+	// Compile translates the syntax tree of an IRMF body into a Program for
+	// its mainModel4, mainModel9 or mainModel16 entry point. User functions
+	// are inlined (recursion is rejected) and constant expressions are folded.
+	bool Compile(const Node& unit, Program& program, std::string& err);
+
+	// CompileIRMF parses and compiles the GLSL body of an IRMF shader.
+	bool CompileIRMF(const std::string& body, Program& program, std::string& err);
+}
@@ -0,0 +1,610 @@
+#include "contour.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include "sampler.h"
+#include "slicer.h"
+#include "threadpool.h"
+
+namespace irmf
+{
+	namespace
+	{
+		// Corners of a square are numbered counter-clockwise from (0, 0):
+		// (0, 0), (1, 0), (1, 1), (0, 1). Edge k runs from corner k to k + 1.
+		struct Square
+		{
+			uint8_t Count;
+			uint8_t From[2], To[2];
+		};
+
+		// BuildSquares derives the marching squares table the way the
+		// mesher's BuildCases does for a face of a cube: walking the corners
+		// counter-clockwise, each run of inside corners is cut off by a
+		// segment between the edge the walk enters it by and the edge it
+		// leaves by. The segment runs from the latter to the former, which
+		// puts the material on its left.
+		std::vector<Square> BuildSquares()
+		{
+			std::vector<Square> squares(16);
+			for (int config = 0; config < 16; config++) {
+				Square& square = squares[config];
+				square.Count = 0;
+				auto inside = [config](int k) { return (config >> (k & 3)) & 1; };
+				for (int k = 0; k < 4; k++) {
+					if (inside(k) || !inside(k + 1))
+						continue;
+					int m = k + 1;
+					while (!(inside(m) && !inside(m + 1)))
+						m++;
+					square.From[square.Count] = (uint8_t)(m & 3);
+					square.To[square.Count] = (uint8_t)k;
+					square.Count++;
+				}
+			}
+			return squares;
+		}
+
+		const Square* Squares()
+		{
+			static const std::vector<Square> squares = BuildSquares();
+			return squares.data();
+		}
+
+		// Segment is a piece of contour between two lattice edges, keyed
+		// (j * nx + i) * 2 + axis for the edge leaving sample (i, j) along
+		// axis. X and Y are where the contour crosses From.
+		struct Segment
+		{
+			uint64_t From, To;
+			double X, Y;
+
+			bool operator<(const Segment& other) const { return From < other.From; }
+		};
+
+		// Loop is a closed contour in micrometers, its first point not
+		// repeated at the end.
+		struct Loop
+		{
+			std::vector<int64_t> Points; // x, y pairs
+			double Area;                 // > 0: counter-clockwise
+			int64_t Min[2], Max[2];
+		};
+
+		// per thread state, created by the thread on its first layer
+		struct Worker
+		{
+			std::unique_ptr<RowSampler> Sampler;
+			std::vector<float> Rows[2]; // two rows of the lattice, per material
+			std::vector<uint8_t> Cases;
+			std::vector<std::vector<Segment>> Segments; // per material
+			std::vector<uint8_t> Visited, Keep;
+			std::vector<double> Line;
+			std::vector<Loop> Loops;
+			std::vector<int> Parents;
+		};
+
+		// Layer is the text of a layer and what it holds per material
+		struct Layer
+		{
+			std::string Text;
+			std::vector<uint64_t> Outlines, Holes, Points, Crossings;
+		};
+
+		// AppendMillimeters formats micrometers as millimeters, without the
+		// binary noise of printing a float
+		void AppendMillimeters(std::string& text, int64_t um)
+		{
+			char buffer[32];
+			uint64_t magnitude = um < 0 ? (uint64_t)-um : (uint64_t)um;
+			snprintf(buffer, sizeof(buffer), "%s%llu.%03llu", um < 0 ? "-" : "", (unsigned long long)(magnitude / 1000),
+				(unsigned long long)(magnitude % 1000));
+			text += buffer;
+		}
+
+		void AppendInteger(std::string& text, int64_t value)
+		{
+			char buffer[32];
+			snprintf(buffer, sizeof(buffer), "%lld", (long long)value);
+			text += buffer;
+		}
+
+		// Contains returns whether point (x, y) is inside loop, by the even-odd
+		// rule.
+		bool Contains(const Loop& loop, int64_t x, int64_t y)
+		{
+			if (x < loop.Min[0] || x > loop.Max[0] || y < loop.Min[1] || y > loop.Max[1])
+				return false;
+			bool inside = false;
+			size_t n = loop.Points.size() / 2;
+			for (size_t a = 0, b = n - 1; a < n; b = a++) {
+				int64_t ax = loop.Points[2 * a], ay = loop.Points[2 * a + 1];
+				int64_t bx = loop.Points[2 * b], by = loop.Points[2 * b + 1];
+				if ((ay > y) != (by > y) && x < ax + (double)(bx - ax) * (y - ay) / (double)(by - ay))
+					inside = !inside;
+			}
+			return inside;
+		}
+
+		// SegmentDistance returns the distance of p to segment (a, b)
+		double SegmentDistance(const double* p, const double* a, const double* b)
+		{
+			double dx = b[0] - a[0], dy = b[1] - a[1];
+			double length = dx * dx + dy * dy;
+			double t = length > 0.0 ? std::min(1.0, std::max(0.0, ((p[0] - a[0]) * dx + (p[1] - a[1]) * dy) / length)) : 0.0;
+			double x = a[0] + t * dx - p[0], y = a[1] + t * dy - p[1];
+			return std::sqrt(x * x + y * y);
+		}
+
+		class Contourer
+		{
+		public:
+			Contourer(const Model& model, const Grid& grid, const std::vector<std::string>& names, float iso, double tolerance, ContourFormat format)
+				: m_grid(grid)
+				, m_names(names)
+				, m_materials((int)names.size())
+				, m_iso(iso)
+				, m_tolerance(tolerance)
+				, m_format(format)
+				, m_scale(UnitLength(model) * 1e6)
+				, m_nx(grid.Size[0] + 2)
+				, m_ny(grid.Size[1] + 2)
+			{
+			}
+
+			// Contour samples layer k and puts its text in layer.
+			bool Contour(Worker& worker, int k, Layer& layer) const
+			{
+				worker.Segments.resize(m_materials);
+				for (int r = 0; r < 2; r++)
+					worker.Rows[r].resize((size_t)m_materials * m_nx);
+				worker.Cases.resize(m_nx);
+				for (std::vector<Segment>& segments : worker.Segments)
+					segments.clear();
+
+				// the lattice is the grid's cell centers with one more row
+				// and column of empty samples on every side
+				float* lower = worker.Rows[0].data();
+				float* upper = worker.Rows[1].data();
+				if (!Sample(worker, 0, k, lower))
+					return false;
+				for (int j = 0; j + 1 < m_ny; j++) {
+					if (!Sample(worker, j + 1, k, upper))
+						return false;
+					for (int m = 0; m < m_materials; m++)
+						Cross(lower + (size_t)m * m_nx, upper + (size_t)m * m_nx, j, worker.Cases.data(), worker.Segments[m]);
+					std::swap(lower, upper);
+				}
+
+				layer.Text.clear();
+				layer.Outlines.assign(m_materials, 0);
+				layer.Holes.assign(m_materials, 0);
+				layer.Points.assign(m_materials, 0);
+				layer.Crossings.assign(m_materials, 0);
+				int64_t z = std::llround((k + 1) * (double)m_grid.Pitch[2] * m_scale);
+				if (m_format == ContourFormat::CLI) {
+					layer.Text += "$$LAYER/";
+					AppendInteger(layer.Text, z);
+					layer.Text += "\n";
+				} else {
+					char group[64];
+					snprintf(group, sizeof(group), "  <g id=\"layer%05d\" data-z=\"", k);
+					layer.Text += group;
+					AppendMillimeters(layer.Text, z);
+					layer.Text += "\">\n";
+				}
+				for (int m = 0; m < m_materials; m++) {
+					layer.Crossings[m] = worker.Segments[m].size();
+					Link(worker, worker.Segments[m]);
+					Write(worker, m, layer);
+				}
+				if (m_format == ContourFormat::SVG)
+					layer.Text += "  </g>\n";
+				return true;
+			}
+
+		private:
+			double Position(int axis, int i) const
+			{
+				return m_grid.Min[axis] + (i - 0.5) * m_grid.Pitch[axis];
+			}
+
+			// Sample fills row j of layer k of the lattice, per material
+			bool Sample(Worker& worker, int j, int k, float* rows) const
+			{
+				if (j == 0 || j == m_ny - 1) {
+					std::fill(rows, rows + (size_t)m_materials * m_nx, 0.0f);
+					return true;
+				}
+				if (!worker.Sampler->Sample(j - 1, k))
+					return false;
+				for (int m = 0; m < m_materials; m++) {
+					float* row = rows + (size_t)m * m_nx;
+					const float* values = worker.Sampler->GetValues(m);
+					row[0] = row[m_nx - 1] = 0.0f;
+					std::copy(values, values + m_nx - 2, row + 1);
+				}
+				return true;
+			}
+
+			// Cross adds the segments of the squares between rows j (lower)
+			// and j + 1 (upper). The cases of a whole row are found first,
+			// without branches, then only the squares the contour crosses
+			// are visited, eight empty or full squares at a time.
+			void Cross(const float* lower, const float* upper, int j, uint8_t* cases, std::vector<Segment>& segments) const
+			{
+				const float iso = m_iso;
+				const int squares = m_nx - 1;
+				for (int i = 0; i < squares; i++)
+					cases[i] = (uint8_t)((lower[i] >= iso) | (lower[i + 1] >= iso) << 1 | (upper[i + 1] >= iso) << 2 | (upper[i] >= iso) << 3);
+
+				const Square* table = Squares();
+				for (int i = 0; i < squares;) {
+					if (i + 8 <= squares) {
+						uint64_t eight;
+						memcpy(&eight, cases + i, 8);
+						if (eight == 0 || eight == 0x0f0f0f0f0f0f0f0full) {
+							i += 8;
+							continue;
+						}
+					}
+					const Square& square = table[cases[i]];
+					for (int s = 0; s < square.Count; s++) {
+						Segment segment;
+						segment.From = Key(i, j, square.From[s]);
+						segment.To = Key(i, j, square.To[s]);
+						double t;
+						switch (square.From[s]) {
+						case 0:
+							t = (iso - lower[i]) / (lower[i + 1] - lower[i]);
+							segment.X = Position(0, i) + t * m_grid.Pitch[0];
+							segment.Y = Position(1, j);
+							break;
+						case 1:
+							t = (iso - lower[i + 1]) / (upper[i + 1] - lower[i + 1]);
+							segment.X = Position(0, i + 1);
+							segment.Y = Position(1, j) + t * m_grid.Pitch[1];
+							break;
+						case 2:
+							t = (iso - upper[i]) / (upper[i + 1] - upper[i]);
+							segment.X = Position(0, i) + t * m_grid.Pitch[0];
+							segment.Y = Position(1, j + 1);
+							break;
+						default:
+							t = (iso - lower[i]) / (upper[i] - lower[i]);
+							segment.X = Position(0, i);
+							segment.Y = Position(1, j) + t * m_grid.Pitch[1];
+							break;
+						}
+						segments.push_back(segment);
+					}
+					i++;
+				}
+			}
+
+			uint64_t Key(int i, int j, int edge) const
+			{
+				switch (edge) {
+				case 0:
+					return ((uint64_t)j * m_nx + i) * 2;
+				case 1:
+					return ((uint64_t)j * m_nx + i + 1) * 2 + 1;
+				case 2:
+					return ((uint64_t)(j + 1) * m_nx + i) * 2;
+				default:
+					return ((uint64_t)j * m_nx + i) * 2 + 1;
+				}
+			}
+
+			// Link follows the segments into loops, simplifies them and puts
+			// them in worker.Loops; every crossed edge starts one segment and
+			// ends another, so the loops close.
+			void Link(Worker& worker, std::vector<Segment>& segments) const
+			{
+				std::sort(segments.begin(), segments.end());
+				worker.Visited.assign(segments.size(), 0);
+				worker.Loops.clear();
+				for (size_t first = 0; first < segments.size(); first++) {
+					if (worker.Visited[first])
+						continue;
+					std::vector<double>& line = worker.Line;
+					line.clear();
+					size_t at = first;
+					while (!worker.Visited[at]) {
+						worker.Visited[at] = 1;
+						line.push_back(segments[at].X);
+						line.push_back(segments[at].Y);
+						Segment key;
+						key.From = segments[at].To;
+						auto next = std::lower_bound(segments.begin(), segments.end(), key);
+						if (next == segments.end() || next->From != key.From)
+							break;
+						at = next - segments.begin();
+					}
+					if (at == first)
+						Simplify(worker, line);
+				}
+			}
+
+			// Simplify adds line, a closed loop, to worker.Loops once
+			// Douglas-Peucker has dropped the points within the tolerance.
+			// If that would turn the loop around or flatten it, it keeps
+			// them all.
+			void Simplify(Worker& worker, const std::vector<double>& line) const
+			{
+				size_t n = line.size() / 2;
+				if (n < 3)
+					return;
+				std::vector<uint8_t>& keep = worker.Keep;
+				keep.assign(n, m_tolerance > 0.0 ? 0 : 1);
+				if (m_tolerance > 0.0) {
+					// split the loop at its first point and the point
+					// farthest from it
+					size_t far = 0;
+					double farthest = -1.0;
+					for (size_t i = 1; i < n; i++) {
+						double dx = line[2 * i] - line[0], dy = line[2 * i + 1] - line[1];
+						if (dx * dx + dy * dy > farthest) {
+							farthest = dx * dx + dy * dy;
+							far = i;
+						}
+					}
+					keep[0] = keep[far] = 1;
+					std::vector<std::pair<size_t, size_t>> stack = { { 0, far }, { far, n } };
+					while (!stack.empty()) {
+						size_t a = stack.back().first, b = stack.back().second;
+						stack.pop_back();
+						size_t worst = a;
+						double distance = m_tolerance;
+						for (size_t i = a + 1; i < b; i++) {
+							double d = SegmentDistance(&line[2 * i], &line[2 * a], &line[2 * (b % n)]);
+							if (d > distance) {
+								distance = d;
+								worst = i;
+							}
+						}
+						if (worst != a) {
+							keep[worst] = 1;
+							stack.emplace_back(a, worst);
+							stack.emplace_back(worst, b);
+						}
+					}
+				}
+
+				double area = 0.0;
+				for (size_t a = 0, b = n - 1; a < n; b = a++)
+					area += line[2 * b] * line[2 * a + 1] - line[2 * a] * line[2 * b + 1];
+				worker.Loops.emplace_back();
+				Loop& loop = worker.Loops.back();
+				for (int pass = 0; pass < 2; pass++) {
+					loop.Points.clear();
+					for (size_t i = 0; i < n; i++) {
+						if (!keep[i] && pass == 0)
+							continue;
+						int64_t x = std::llround(line[2 * i] * m_scale), y = std::llround(line[2 * i + 1] * m_scale);
+						size_t size = loop.Points.size();
+						if (size >= 2 && loop.Points[size - 2] == x && loop.Points[size - 1] == y)
+							continue;
+						loop.Points.push_back(x);
+						loop.Points.push_back(y);
+					}
+					while (loop.Points.size() >= 4 && loop.Points[0] == loop.Points[loop.Points.size() - 2]
+						&& loop.Points[1] == loop.Points.back())
+						loop.Points.resize(loop.Points.size() - 2);
+					size_t count = loop.Points.size() / 2;
+					loop.Area = 0.0;
+					for (size_t a = 0, b = count - 1; a < count; b = a++)
+						loop.Area += (double)loop.Points[2 * b] * loop.Points[2 * a + 1] - (double)loop.Points[2 * a] * loop.Points[2 * b + 1];
+					loop.Area *= 0.5;
+					if (count >= 3 && (loop.Area > 0.0) == (area > 0.0) && loop.Area != 0.0)
+						break;
+				}
+				size_t count = loop.Points.size() / 2;
+				if (count < 3 || loop.Area == 0.0) {
+					worker.Loops.pop_back();
+					return;
+				}
+				for (int a = 0; a < 2; a++) {
+					loop.Min[a] = loop.Max[a] = loop.Points[a];
+					for (size_t i = 1; i < count; i++) {
+						loop.Min[a] = std::min(loop.Min[a], loop.Points[2 * i + a]);
+						loop.Max[a] = std::max(loop.Max[a], loop.Points[2 * i + a]);
+					}
+				}
+			}
+
+			// Write appends material m's loops to the layer, each outline
+			// followed by the holes whose smallest enclosing outline it is.
+			void Write(Worker& worker, int m, Layer& layer) const
+			{
+				const std::vector<Loop>& loops = worker.Loops;
+				std::vector<int>& parents = worker.Parents;
+				parents.assign(loops.size(), -1);
+				for (size_t h = 0; h < loops.size(); h++) {
+					if (loops[h].Area > 0.0)
+						continue;
+					for (size_t o = 0; o < loops.size(); o++)
+						if (loops[o].Area > 0.0 && (parents[h] < 0 || loops[o].Area < loops[parents[h]].Area)
+							&& Contains(loops[o], loops[h].Points[0], loops[h].Points[1]))
+							parents[h] = (int)o;
+				}
+
+				if (loops.empty())
+					return;
+				if (m_format == ContourFormat::SVG) {
+					layer.Text += "    <path class=\"";
+					layer.Text += m_names[m];
+					layer.Text += "\" d=\"";
+				}
+				std::vector<bool> written(loops.size(), false);
+				for (size_t o = 0; o < loops.size(); o++) {
+					if (loops[o].Area < 0.0)
+						continue;
+					Append(loops[o], m, layer);
+					for (size_t h = 0; h < loops.size(); h++)
+						if (parents[h] == (int)o) {
+							Append(loops[h], m, layer);
+							written[h] = true;
+						}
+				}
+				for (size_t h = 0; h < loops.size(); h++)
+					if (loops[h].Area < 0.0 && !written[h])
+						Append(loops[h], m, layer);
+				if (m_format == ContourFormat::SVG)
+					layer.Text += "\"/>\n";
+			}
+
+			void Append(const Loop& loop, int m, Layer& layer) const
+			{
+				size_t count = loop.Points.size() / 2;
+				bool outline = loop.Area > 0.0;
+				(outline ? layer.Outlines : layer.Holes)[m]++;
+				layer.Points[m] += count;
+				std::string& text = layer.Text;
+				if (m_format == ContourFormat::CLI) {
+					// closed polylines repeat their first point
+					char head[64];
+					snprintf(head, sizeof(head), "$$POLYLINE/%d,%d,%llu", m + 1, outline ? 1 : 0, (unsigned long long)count + 1);
+					text += head;
+					for (size_t i = 0; i <= count; i++) {
+						text += ',';
+						AppendInteger(text, loop.Points[2 * (i % count)]);
+						text += ',';
+						AppendInteger(text, loop.Points[2 * (i % count) + 1]);
+					}
+					text += '\n';
+				} else {
+					// SVG's Y runs down
+					for (size_t i = 0; i < count; i++) {
+						text += i == 0 ? (text.back() == '"' ? "M" : " M") : i == 1 ? " L" : " ";
+						AppendMillimeters(text, loop.Points[2 * i]);
+						text += ' ';
+						AppendMillimeters(text, -loop.Points[2 * i + 1]);
+					}
+					text += " Z";
+				}
+			}
+
+			const Grid& m_grid;
+			const std::vector<std::string>& m_names;
+			int m_materials;
+			float m_iso;
+			double m_tolerance;
+			ContourFormat m_format;
+			double m_scale; // micrometers per model unit
+			int m_nx, m_ny;
+		};
+	}
+
+	bool WriteContours(const Model& model, const ContourSettings& settings, const std::string& filename, ContourStats& stats, std::string& err)
+	{
+		int materials = (int)model.Materials.size();
+		if (!(settings.IsoLevel > 0.0f && settings.IsoLevel <= 1.0f)) {
+			err = "the iso level must be in (0, 1]";
+			return false;
+		}
+		Grid grid;
+		if (settings.Source ? !GetSourceGrid(model, *settings.Source, grid, err)
+						   : !MakeGrid(model, settings.Pitch, settings.LayerHeight, grid, err))
+			return false;
+		double tolerance = settings.Tolerance > 0.0f ? settings.Tolerance : 0.1 * std::min(grid.Pitch[0], grid.Pitch[1]);
+
+		FILE* file = fopen(filename.c_str(), "wb");
+		if (!file) {
+			err = "failed to create " + filename;
+			return false;
+		}
+
+		// the header: CLI in micrometers, SVG in millimeters with Y down
+		std::vector<std::string> names = MaterialDirectories(model.Materials);
+		double scale = UnitLength(model) * 1e6;
+		int layers = grid.Size[2];
+		int64_t min[2], max[2];
+		for (int a = 0; a < 2; a++) {
+			min[a] = std::llround(grid.Min[a] * scale);
+			max[a] = std::llround((grid.Min[a] + (double)grid.Size[a] * grid.Pitch[a]) * scale);
+		}
+		int64_t height = std::llround(layers * (double)grid.Pitch[2] * scale);
+		std::string header;
+		if (settings.Format == ContourFormat::CLI) {
+			header = "$$HEADERSTART\n$$ASCII\n$$UNITS/0.001\n$$VERSION/200\n";
+			for (int m = 0; m < materials; m++)
+				header += "$$LABEL/" + std::to_string(m + 1) + "," + names[m] + "\n";
+			header += "$$DIMENSION/";
+			int64_t corners[6] = { min[0], min[1], 0, max[0], max[1], height };
+			for (int c = 0; c < 6; c++) {
+				AppendMillimeters(header, corners[c]);
+				header += c < 5 ? "," : "\n";
+			}
+			header += "$$LAYERS/" + std::to_string(layers) + "\n$$HEADEREND\n$$GEOMETRYSTART\n";
+		} else {
+			header = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"";
+			AppendMillimeters(header, max[0] - min[0]);
+			header += "mm\" height=\"";
+			AppendMillimeters(header, max[1] - min[1]);
+			header += "mm\" viewBox=\"";
+			int64_t box[4] = { min[0], -max[1], max[0] - min[0], max[1] - min[1] };
+			for (int c = 0; c < 4; c++) {
+				AppendMillimeters(header, box[c]);
+				header += c < 3 ? " " : "\">\n";
+			}
+		}
+		bool ok = fwrite(header.data(), 1, header.size(), file) == header.size();
+
+		ThreadPool pool(settings.Threads);
+		std::vector<Worker> workers(pool.GetThreadCount());
+		Contourer contourer(model, grid, names, settings.IsoLevel, tolerance, settings.Format);
+		stats.Outlines.assign(materials, 0);
+		stats.Holes.assign(materials, 0);
+		stats.Points.assign(materials, 0);
+		stats.Crossings.assign(materials, 0);
+
+		// layers finish out of order and wait in their slot until every
+		// layer before them has been written
+		int window = 2 * pool.GetThreadCount();
+		std::vector<Layer> slots(window);
+		std::atomic<bool> runaway(false);
+
+		auto contour = [&](int k, int slot, int w) {
+			Worker& worker = workers[w];
+			if (!worker.Sampler)
+				worker.Sampler.reset(new RowSampler(model, grid, 0, settings.Source));
+			if (!contourer.Contour(worker, k, slots[slot])) {
+				runaway = true;
+				return false;
+			}
+			return true;
+		};
+
+		auto write = [&](int k, int slot) {
+			const Layer& layer = slots[slot];
+			for (int m = 0; m < materials; m++) {
+				stats.Outlines[m] += layer.Outlines[m];
+				stats.Holes[m] += layer.Holes[m];
+				stats.Points[m] += layer.Points[m];
+				stats.Crossings[m] += layer.Crossings[m];
+			}
+			if (fwrite(layer.Text.data(), 1, layer.Text.size(), file) != layer.Text.size())
+				return false;
+			if (settings.Progress)
+				settings.Progress(k + 1, layers);
+			return true;
+		};
+
+		ok = ok && RunOrdered(pool, layers, window, contour, write);
+		if (ok) {
+			const char* footer = settings.Format == ContourFormat::CLI ? "$$GEOMETRYEND\n" : "</svg>\n";
+			ok = fwrite(footer, 1, strlen(footer), file) == strlen(footer);
+		}
+		if (fclose(file) != 0)
+			ok = false;
+		if (!ok) {
+			err = runaway ? "a loop in the model did not terminate" : "failed to write " + filename + " (disk full?)";
+			remove(filename.c_str());
+		}
+		return ok;
+	}
+}
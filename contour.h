@@ -0,0 +1,73 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include "model.h"
+
+namespace irmf
+{
+	class VoxelSource;
+
+	enum class ContourFormat
+	{
+		CLI, // Common Layer Interface, ASCII
+		SVG  // one group per layer
+	};
+
+	// ContourSettings controls the resolution, simplification and
+	// parallelism of a contour export.
+	struct ContourSettings
+	{
+		float Pitch;       // sample spacing in X and Y, in model units
+		float LayerHeight; // <= 0: same as Pitch
+		float IsoLevel;    // material value of the contours, in (0, 1]
+		float Tolerance;   // how far simplifying may move a contour, in
+		                   // model units (<= 0: Pitch / 10)
+		ContourFormat Format;
+		int Threads;       // <= 0: one per hardware thread
+		VoxelSource* Source; // if set, layers are read from it (and its grid)
+		                     // instead of evaluating the model
+
+		// Progress is called on the calling thread after each layer is
+		// written, with the number of layers done and the total
+		std::function<void(int, int)> Progress;
+
+		ContourSettings()
+			: Pitch(0.1f)
+			, LayerHeight(0.0f)
+			, IsoLevel(0.5f)
+			, Tolerance(0.0f)
+			, Format(ContourFormat::CLI)
+			, Threads(0)
+			, Source(nullptr)
+		{
+		}
+	};
+
+	// ContourStats is what a contour export wrote, per material.
+	struct ContourStats
+	{
+		std::vector<uint64_t> Outlines;  // counter-clockwise contours
+		std::vector<uint64_t> Holes;     // clockwise contours
+		std::vector<uint64_t> Points;    // after simplifying
+		std::vector<uint64_t> Crossings; // before
+	};
+
+	// WriteContours samples the model layer by layer along Z and writes the
+	// closed contours of every material, in mm with Z the top of each layer
+	// above the bottom of the model, as a CLI file (one part per material,
+	// in micrometers) or an SVG file (one group per layer holding an
+	// even-odd path per material, Y up).
+	//
+	// Each pair of sample rows is turned into marching squares cases a
+	// whole row at a time, and only the cells the contour crosses are
+	// visited. Corners diagonal to each other are kept apart, as marching
+	// cubes does, so the contours are the cross-sections of the mesh
+	// MarchingCubes makes. The segments are linked into loops with the
+	// material on their left, so outlines run counter-clockwise and holes
+	// clockwise; each outline is followed by the holes inside it, and loops
+	// are simplified with Douglas-Peucker within the tolerance. Layers are
+	// contoured in parallel and written in order as soon as they are ready.
+	bool WriteContours(const Model& model, const ContourSettings& settings, const std::string& filename, ContourStats& stats, std::string& err);
+}
@@ -0,0 +1,471 @@
+#include "cost.h"
+#include "lexer.h"
+#include <algorithm>
+#include <cmath>
+#include <map>
+#include <set>
+#include <sstream>
+
+namespace irmf
+{
+	// Loops whose trip count cannot be derived from the source are assumed to
+	// run this many times.
+	static const int DefaultLoopTrips = 16;
+
+	// Reference viewport and shader throughput used to turn operation counts
+	// into frame times; roughly a 720p preview on a mid-range GPU.
+	static const double ReferencePixels = 1280.0 * 720.0;
+	static const double GpuOpsPerMs = 2.5e8;
+
+	static const int RaymarchSteps[] = { 256, 192, 128, 96, 64 };
+	static const int MinRaymarchSteps = 32;
+	static const int MaxTiledFrames = 8;
+	static const int MaxProgressiveFrames = 64;
+
+	static const std::map<std::string, double>& BuiltinCosts()
+	{
+		static const std::map<std::string, double> costs = {
+			{ "abs", 1 }, { "sign", 1 }, { "floor", 1 }, { "ceil", 1 }, { "fract", 2 }, { "trunc", 1 }, { "round", 1 },
+			{ "min", 1 }, { "max", 1 }, { "clamp", 2 }, { "mix", 3 }, { "step", 1 }, { "smoothstep", 7 },
+			{ "mod", 3 }, { "sqrt", 4 }, { "inversesqrt", 4 }, { "pow", 12 }, { "exp", 8 }, { "exp2", 6 },
+			{ "log", 8 }, { "log2", 6 }, { "sin", 8 }, { "cos", 8 }, { "tan", 12 }, { "asin", 14 },
+			{ "acos", 14 }, { "atan", 14 }, { "sinh", 16 }, { "cosh", 16 }, { "tanh", 16 },
+			{ "radians", 1 }, { "degrees", 1 }, { "length", 6 }, { "distance", 9 }, { "dot", 5 },
+			{ "cross", 9 }, { "normalize", 10 }, { "reflect", 12 }, { "any", 2 }, { "all", 2 },
+			{ "lessThan", 3 }, { "lessThanEqual", 3 }, { "greaterThan", 3 }, { "greaterThanEqual", 3 },
+			{ "equal", 3 }, { "notEqual", 3 }, { "not", 3 }, { "transpose", 4 }, { "inverse", 40 },
+			{ "determinant", 15 }, { "matrixCompMult", 9 },
+		};
+		return costs;
+	}
+
+	static bool IsOperator(const Token& t)
+	{
+		static const std::set<std::string> ops = {
+			"+", "-", "*", "/", "%", "<", ">", "<=", ">=", "==", "!=", "&&", "||", "^^", "!", "?",
+			"+=", "-=", "*=", "/=", "%=", "++", "--",
+		};
+		return t.Type == TokenType::Punctuation && ops.count(t.Text) > 0;
+	}
+
+	class CostAnalyzer
+	{
+	public:
+		CostAnalyzer(const std::vector<Token>& tokens) : m_tokens(tokens), m_loops(0), m_unbounded(0) { }
+
+		bool Analyze(CostEstimate& out, std::string& err)
+		{
+			CollectConstants();
+			if (!CollectFunctions(err))
+				return false;
+
+			const char* entries[] = { "mainModel4", "mainModel9", "mainModel16" };
+			for (const char* entry : entries)
+				if (m_functions.count(entry))
+					out.Entry = entry;
+			if (out.Entry.empty()) {
+				err = "IRMF body does not define mainModel4, mainModel9 or mainModel16";
+				return false;
+			}
+
+			out.OpsPerSample = FunctionOps(out.Entry);
+			out.LoopCount = m_loops;
+			out.UnboundedLoops = m_unbounded;
+
+			// report the call graph reachable from the entry point
+			std::vector<std::string> queue(1, out.Entry);
+			std::set<std::string> seen(queue.begin(), queue.end());
+			for (size_t i = 0; i < queue.size(); i++) {
+				const Function& fn = m_functions[queue[i]];
+				FunctionCost fc;
+				fc.Name = queue[i];
+				fc.SelfOps = fn.SelfOps;
+				fc.TotalOps = fn.TotalOps;
+				fc.Calls = std::vector<std::string>(fn.Calls.begin(), fn.Calls.end());
+				out.Functions.push_back(fc);
+
+				for (const std::string& callee : fn.Calls)
+					if (seen.insert(callee).second)
+						queue.push_back(callee);
+			}
+			return true;
+		}
+
+	private:
+		struct Function
+		{
+			size_t Begin, End; // body tokens, braces excluded
+			bool Visiting, Done;
+			double SelfOps, TotalOps;
+			std::set<std::string> Calls;
+		};
+
+		const std::vector<Token>& m_tokens;
+		std::map<std::string, Function> m_functions;
+		std::map<std::string, double> m_constants;
+		int m_loops, m_unbounded;
+
+		const Token& At(size_t i) const
+		{
+			return m_tokens[std::min(i, m_tokens.size() - 1)];
+		}
+
+		size_t MatchClose(size_t open) const
+		{
+			const std::string& o = m_tokens[open].Text;
+			std::string c = (o == "(") ? ")" : (o == "[") ? "]" : "}";
+			int depth = 0;
+			for (size_t i = open; i < m_tokens.size(); i++) {
+				if (m_tokens[i].Is(o.c_str()))
+					depth++;
+				else if (m_tokens[i].Is(c.c_str()) && --depth == 0)
+					return i;
+			}
+			return m_tokens.size() - 1;
+		}
+
+		// 'const int N = 10;' and friends, so that loop bounds can use them
+		void CollectConstants()
+		{
+			for (size_t i = 0; i + 4 < m_tokens.size(); i++) {
+				if (!At(i).Is("const"))
+					continue;
+				size_t j = i + 1;
+				while (At(j).Type == TokenType::Identifier && At(j + 1).Type == TokenType::Identifier)
+					j++;
+				double value;
+				if (At(j).Type == TokenType::Identifier && At(j + 1).Is("=") && ParseNumber(j + 2, value) && At(j + 3).Is(";"))
+					m_constants[At(j).Text] = value;
+			}
+		}
+
+		bool ParseNumber(size_t& i, double& value) const
+		{
+			bool neg = false;
+			size_t k = i;
+			if (At(k).Is("-")) {
+				neg = true;
+				k++;
+			}
+			// int(10), float(2)
+			bool wrapped = At(k).Type == TokenType::Identifier && At(k + 1).Is("(") && At(k + 3).Is(")") &&
+				(At(k).Text == "int" || At(k).Text == "float");
+			const Token& t = wrapped ? At(k + 2) : At(k);
+			if (t.Type == TokenType::Number)
+				value = strtod(t.Text.c_str(), 0);
+			else if (t.Type == TokenType::Identifier && m_constants.count(t.Text))
+				value = m_constants.at(t.Text);
+			else
+				return false;
+			if (neg)
+				value = -value;
+			i = k + (wrapped ? 3 : 0);
+			return true;
+		}
+
+		bool ParseNumber(size_t&& i, double& value) const
+		{
+			size_t k = i;
+			return ParseNumber(k, value);
+		}
+
+		bool CollectFunctions(std::string& err)
+		{
+			int depth = 0;
+			for (size_t i = 0; i + 2 < m_tokens.size(); i++) {
+				const Token& t = m_tokens[i];
+				if (t.Is("{"))
+					depth++;
+				else if (t.Is("}"))
+					depth--;
+				if (depth != 0 || t.Type != TokenType::Identifier || m_tokens[i + 1].Type != TokenType::Identifier || !m_tokens[i + 2].Is("("))
+					continue;
+
+				size_t close = MatchClose(i + 2);
+				if (close + 1 >= m_tokens.size() || !m_tokens[close + 1].Is("{"))
+					continue; // prototype
+
+				Function fn = { close + 2, MatchClose(close + 1), false, false, 0, 0, {} };
+				m_functions[m_tokens[i + 1].Text] = fn;
+				i = fn.End;
+			}
+
+			if (depth != 0) {
+				err = "unbalanced braces in IRMF body";
+				return false;
+			}
+			return true;
+		}
+
+		double FunctionOps(const std::string& name)
+		{
+			Function& fn = m_functions[name];
+			if (fn.Done || fn.Visiting) // GLSL forbids recursion; don't loop on it
+				return fn.TotalOps;
+
+			fn.Visiting = true;
+			double self = 0, total = 0;
+			RangeOps(fn.Begin, fn.End, self, total, fn.Calls);
+			fn.SelfOps = self;
+			fn.TotalOps = total;
+			fn.Visiting = false;
+			fn.Done = true;
+			return total;
+		}
+
+		// end of the statement starting at i: a braced block or up to ';'
+		size_t StatementEnd(size_t i) const
+		{
+			if (m_tokens[i].Is("{"))
+				return MatchClose(i) + 1;
+			int depth = 0;
+			for (; i < m_tokens.size(); i++) {
+				if (m_tokens[i].Is("(") || m_tokens[i].Is("[") || m_tokens[i].Is("{"))
+					depth++;
+				else if (m_tokens[i].Is(")") || m_tokens[i].Is("]") || m_tokens[i].Is("}"))
+					depth--;
+				else if (depth == 0 && m_tokens[i].Is(";"))
+					return i + 1;
+			}
+			return m_tokens.size() - 1;
+		}
+
+		// for (int i = A; i < B; i++) style headers; returns -1 when unknown
+		double TripCount(size_t open, size_t close) const
+		{
+			std::vector<size_t> semis;
+			for (size_t i = open + 1; i < close; i++)
+				if (At(i).Is(";"))
+					semis.push_back(i);
+			if (semis.size() != 2)
+				return -1;
+
+			// init: [type] var = A
+			size_t i = open + 1;
+			if (At(i + 1).Type == TokenType::Identifier)
+				i++;
+			if (!At(i + 1).Is("="))
+				return -1;
+			std::string var = At(i).Text;
+			double start, bound, step;
+			if (!ParseNumber(i + 2, start))
+				return -1;
+
+			// condition: var op B
+			size_t c = semis[0] + 1;
+			if (At(c).Text != var)
+				return -1;
+			std::string cmp = At(c + 1).Text;
+			if (!ParseNumber(c + 2, bound))
+				return -1;
+
+			// increment: var++, ++var, var--, var += C, var -= C
+			size_t s = semis[1] + 1;
+			if ((At(s).Text == var && At(s + 1).Is("++")) || (At(s).Is("++") && At(s + 1).Text == var))
+				step = 1;
+			else if ((At(s).Text == var && At(s + 1).Is("--")) || (At(s).Is("--") && At(s + 1).Text == var))
+				step = -1;
+			else if (At(s).Text == var && (At(s + 1).Is("+=") || At(s + 1).Is("-=")) && ParseNumber(s + 2, step))
+				step = At(s + 1).Is("-=") ? -step : step;
+			else
+				return -1;
+
+			if (step == 0)
+				return -1;
+
+			double span = (bound - start) / step;
+			double trips;
+			if (cmp == "<" || cmp == ">" || cmp == "!=")
+				trips = std::ceil(span);
+			else if (cmp == "<=" || cmp == ">=")
+				trips = std::floor(span) + 1;
+			else
+				return -1;
+			return std::max(trips, 0.0);
+		}
+
+		void RangeOps(size_t begin, size_t end, double& self, double& total, std::set<std::string>& calls)
+		{
+			for (size_t i = begin; i < end; i++) {
+				const Token& t = m_tokens[i];
+
+				if (t.Is("for") || t.Is("while") || t.Is("do")) {
+					m_loops++;
+					size_t bodyStart, bodyEnd;
+					size_t headOpen = 0, headClose = 0;
+					double trips = -1;
+
+					if (t.Is("do")) {
+						bodyStart = i + 1;
+						bodyEnd = StatementEnd(bodyStart);
+						headOpen = bodyEnd + 1; // do { } while (cond);
+						headClose = MatchClose(headOpen);
+						i = headClose + 1;
+					} else {
+						headOpen = i + 1;
+						headClose = MatchClose(headOpen);
+						bodyStart = headClose + 1;
+						bodyEnd = StatementEnd(bodyStart);
+						if (t.Is("for"))
+							trips = TripCount(headOpen, headClose);
+						i = bodyEnd - 1;
+					}
+
+					if (trips < 0) {
+						trips = DefaultLoopTrips;
+						m_unbounded++;
+					}
+
+					double loopSelf = 0, loopTotal = 0;
+					RangeOps(headOpen + 1, headClose, loopSelf, loopTotal, calls);
+					RangeOps(bodyStart, bodyEnd, loopSelf, loopTotal, calls);
+					self += loopSelf * trips;
+					total += loopTotal * trips;
+					continue;
+				}
+
+				if (IsOperator(t)) {
+					self += 1;
+					total += 1;
+					continue;
+				}
+
+				if (t.Type != TokenType::Identifier || !m_tokens[i + 1].Is("("))
+					continue;
+
+				auto builtin = BuiltinCosts().find(t.Text);
+				if (builtin != BuiltinCosts().end()) {
+					self += builtin->second;
+					total += builtin->second;
+				} else if (m_functions.count(t.Text)) {
+					calls.insert(t.Text);
+					total += FunctionOps(t.Text) + 1;
+				}
+				// anything else is a type constructor or keyword: free
+			}
+		}
+	};
+
+	const char* PreviewModeName(PreviewMode mode)
+	{
+		switch (mode) {
+		case PreviewMode::FullRaymarch: return "raymarch";
+		case PreviewMode::Tiled: return "tiled";
+		case PreviewMode::Progressive: return "progressive";
+		case PreviewMode::Slice: return "slice";
+		default: return "unknown";
+		}
+	}
+
+	bool ParsePreviewMode(const std::string& name, PreviewMode& mode)
+	{
+		for (int i = 0; i < (int)PreviewMode::Count; i++) {
+			if (name == PreviewModeName((PreviewMode)i)) {
+				mode = (PreviewMode)i;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool EstimateCost(const std::string& body, CostEstimate& out, std::string& err)
+	{
+		std::vector<Token> tokens;
+		if (!Lex(body, tokens, err))
+			return false;
+
+		out = CostEstimate();
+		out.Mode = PreviewMode::Slice;
+		out.RaymarchSteps = 0;
+		out.FrameMs = 0;
+
+		CostAnalyzer analyzer(tokens);
+		return analyzer.Analyze(out, err);
+	}
+
+	void ChoosePreview(CostEstimate& est, float frameBudgetMs)
+	{
+		double msPerSample = std::max(est.OpsPerSample, 1.0) / GpuOpsPerMs;
+		double budget = std::max(frameBudgetMs, 1.0f);
+
+		for (int steps : RaymarchSteps) {
+			double ms = ReferencePixels * steps * msPerSample;
+			if (ms <= budget) {
+				est.Mode = PreviewMode::FullRaymarch;
+				est.RaymarchSteps = steps;
+				est.FrameMs = ms;
+				return;
+			}
+		}
+
+		// a full-quality frame no longer fits: spread it over several frames
+		int steps = RaymarchSteps[sizeof(RaymarchSteps) / sizeof(RaymarchSteps[0]) - 1];
+		double ms = ReferencePixels * steps * msPerSample;
+		if (ms <= budget * MaxTiledFrames) {
+			est.Mode = PreviewMode::Tiled;
+			est.RaymarchSteps = steps;
+			est.FrameMs = ms;
+			return;
+		}
+
+		ms = ReferencePixels * MinRaymarchSteps * msPerSample;
+		if (ms <= budget * MaxProgressiveFrames) {
+			est.Mode = PreviewMode::Progressive;
+			est.RaymarchSteps = MinRaymarchSteps;
+			est.FrameMs = ms;
+			return;
+		}
+
+		est.Mode = PreviewMode::Slice;
+		est.RaymarchSteps = 0;
+		est.FrameMs = ReferencePixels * msPerSample;
+	}
+
+	std::string FormatCostEstimate(const CostEstimate& est)
+	{
+		std::ostringstream ss;
+		ss << "Estimated cost: " << (long long)std::ceil(est.OpsPerSample) << " operations per sample (" << est.Entry << ")\n";
+		ss << "Loops: " << est.LoopCount;
+		if (est.UnboundedLoops > 0)
+			ss << " (" << est.UnboundedLoops << " with unknown trip count, assumed " << DefaultLoopTrips << ")";
+		ss << "\n";
+		ss << "Preview: " << PreviewModeName(est.Mode);
+		if (est.RaymarchSteps > 0)
+			ss << ", " << est.RaymarchSteps << " raymarch steps";
+		ss << ", ~" << (long long)std::ceil(est.FrameMs) << " ms per full frame at 1280x720\n";
+		ss << "Call graph:\n";
+		for (const FunctionCost& fn : est.Functions) {
+			ss << "  " << fn.Name << ": " << (long long)std::ceil(fn.TotalOps) << " ops";
+			if (!fn.Calls.empty()) {
+				ss << " -> ";
+				for (size_t i = 0; i < fn.Calls.size(); i++)
+					ss << (i ? ", " : "") << fn.Calls[i];
+			}
+			ss << "\n";
+		}
+		return ss.str();
+	}
+
+	json11::Json CostEstimateToJson(const CostEstimate& est)
+	{
+		json11::Json::array functions;
+		for (const FunctionCost& fn : est.Functions)
+			functions.push_back(json11::Json::object {
+				{ "name", fn.Name },
+				{ "selfOps", fn.SelfOps },
+				{ "totalOps", fn.TotalOps },
+				{ "calls", json11::Json(fn.Calls) },
+			});
+
+		return json11::Json::object {
+			{ "entry", est.Entry },
+			{ "opsPerSample", est.OpsPerSample },
+			{ "loops", est.LoopCount },
+			{ "unboundedLoops", est.UnboundedLoops },
+			{ "previewMode", PreviewModeName(est.Mode) },
+			{ "raymarchSteps", est.RaymarchSteps },
+			{ "frameMs", est.FrameMs },
+			{ "functions", functions },
+		};
+	}
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <json11/json11.hpp>
+
+namespace irmf
+{
+	// PreviewMode lists the ways a generated project can preview a model,
+	// from the most expensive per frame to the cheapest.
+	enum class PreviewMode
+	{
+		FullRaymarch, // march every pixel through the whole volume each frame
+		Tiled,        // full-resolution raymarch spread over several frames
+		Progressive,  // coarse raymarch first, refined tile by tile
+		Slice,        // a single Z slice, one sample per pixel
+		Count
+	};
+
+	const char* PreviewModeName(PreviewMode mode);
+	bool ParsePreviewMode(const std::string& name, PreviewMode& mode);
+
+	struct FunctionCost
+	{
+		std::string Name;
+		double SelfOps;  // operations in the function body, loops included
+		double TotalOps; // SelfOps plus the cost of every call
+		std::vector<std::string> Calls;
+	};
+
+	// CostEstimate is the result of the static analysis of an IRMF body. The
+	// unit is an "operation": one arithmetic operator or simple built-in call;
+	// transcendental built-ins count as several operations.
+	struct CostEstimate
+	{
+		std::string Entry;          // mainModel4, mainModel9 or mainModel16
+		double OpsPerSample;        // estimated cost of one entry point call
+		int LoopCount;
+		int UnboundedLoops;         // loops whose trip count had to be guessed
+		std::vector<FunctionCost> Functions;
+
+		// filled in by ChoosePreview
+		PreviewMode Mode;
+		int RaymarchSteps;
+		double FrameMs;             // estimated time of one full-quality frame
+	};
+
+	// EstimateCost analyzes the GLSL body of an IRMF shader: it counts the
+	// operations of every function, multiplies loop bodies by their trip count
+	// and folds the cost of callees into the call graph of the entry point.
+	bool EstimateCost(const std::string& body, CostEstimate& out, std::string& err);
+
+	// ChoosePreview picks the preview mode and raymarch step count that keep a
+	// reference viewport inside the given frame budget.
+	void ChoosePreview(CostEstimate& est, float frameBudgetMs);
+
+	std::string FormatCostEstimate(const CostEstimate& est);
+	json11::Json CostEstimateToJson(const CostEstimate& est);
+}
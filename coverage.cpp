@@ -0,0 +1,271 @@
+#include "coverage.h"
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <memory>
+
+namespace irmf
+{
+	namespace
+	{
+		// HalfPlane returns the share of a unit square where n . p <= t, p
+		// from its center and n a unit vector.
+		float HalfPlane(float t, float nx, float ny)
+		{
+			float a = std::fabs(nx), b = std::fabs(ny);
+			if (a < b)
+				std::swap(a, b);
+			// the line crosses two opposite sides while |t| <= (a - b) / 2,
+			// then cuts off a triangle at a corner
+			float reach = 0.5f * (a + b);
+			if (t >= reach)
+				return 1.0f;
+			if (t <= -reach)
+				return 0.0f;
+			if (std::fabs(t) <= 0.5f * (a - b))
+				return 0.5f + t / a;
+			float side = reach - std::fabs(t);
+			float corner = side * side / (2.0f * a * b);
+			return t > 0.0f ? 1.0f - corner : corner;
+		}
+	}
+
+	std::vector<float> SamplePattern(int n)
+	{
+		std::vector<float> pattern;
+		for (int s = 0; s < n; s++)
+			for (int t = 0; t < n; t++) {
+				pattern.push_back((s + (t + 0.5f) / n) / n);
+				pattern.push_back((t + (s + 0.5f) / n) / n);
+			}
+		return pattern;
+	}
+
+	CoverageSampler::CoverageSampler(const Model& model, const Grid& grid, AntiAlias mode, int samples, float iso)
+		: m_grid(grid)
+		, m_mode(mode)
+		, m_samples(std::max(samples, 1))
+		, m_materials(0)
+		, m_width(grid.Size[0])
+		, m_iso(iso)
+		, m_batch(model.Code)
+		, m_gradient(model)
+		, m_pattern(SamplePattern(m_samples))
+		, m_evaluations(0)
+	{
+		m_materials = m_batch.GetOutputCount();
+		m_coverage.resize((size_t)m_materials * m_width);
+		for (int i = 0; i < m_width; i++)
+			m_all.push_back(i);
+		for (CenterRow& row : m_rows)
+			row.J = row.K = INT_MIN;
+	}
+
+	bool CoverageSampler::Sample(int j, int k)
+	{
+		if (m_mode == AntiAlias::Supersample)
+			return Supersample(j, k, m_all);
+
+		const CenterRow *above, *row, *below;
+		if (m_mode == AntiAlias::None) {
+			if (!Centers(j, k, j, row))
+				return false;
+			for (size_t at = 0; at < m_coverage.size(); at++)
+				m_coverage[at] = Inside(row->Values[at]) ? 1.0f : 0.0f;
+			return true;
+		}
+		if (!Centers(j + 1, k, j, above) || !Centers(j, k, j, row) || !Centers(j - 1, k, j, below))
+			return false;
+
+		float px = m_grid.Pitch[0], py = m_grid.Pitch[1];
+		const CenterRow* rows[3] = { below, row, above };
+		m_edges.clear();
+		for (int i = 0; i < m_width; i++) {
+			bool edge = false;
+			for (int m = 0; m < m_materials; m++) {
+				size_t at = (size_t)m * m_width + i;
+				float v = row->Values[at];
+				const float* g = &row->Gradients[3 * at];
+				// in pixels, as is the coverage
+				float gx = g[0] * px, gy = g[1] * py;
+				// the plane through the center must side the neighbouring
+				// centers as the model does, or the material is not linear
+				// here (a step, a corner, a kink): those pixels are
+				// supersampled
+				for (int dy = -1; dy <= 1; dy++)
+					for (int dx = -1; dx <= 1; dx++) {
+						if (i + dx < 0 || i + dx >= m_width)
+							continue;
+						float n = rows[dy + 1]->Values[at + dx];
+						edge = edge || Inside(v + gx * dx + gy * dy) != Inside(n);
+					}
+				float length = std::sqrt(gx * gx + gy * gy);
+				if (length > 1e-6f && std::isfinite(length) && std::isfinite(v))
+					m_coverage[at] = HalfPlane((v - m_iso) / length, gx / length, gy / length);
+				else
+					m_coverage[at] = Inside(v) ? 1.0f : 0.0f;
+			}
+			if (edge)
+				m_edges.push_back(i);
+		}
+		return Supersample(j, k, m_edges);
+	}
+
+	// Centers evaluates row j of layer k at the pixel centers, with
+	// gradients unless the mode only thresholds them, or finds it among the
+	// rows kept. center is the row being sampled: the rows next to it are
+	// not replaced.
+	bool CoverageSampler::Centers(int j, int k, int center, const CenterRow*& found)
+	{
+		for (CenterRow& row : m_rows)
+			if (row.J == j && row.K == k) {
+				found = &row;
+				return true;
+			}
+		CenterRow* row = &m_rows[0];
+		for (CenterRow& r : m_rows)
+			if (r.K != k || r.J < center - 1 || r.J > center + 1) {
+				row = &r;
+				break;
+			}
+		row->J = INT_MIN; // until it is filled
+
+		m_x.resize(m_width);
+		m_y.assign(m_width, m_grid.Center(1, j));
+		m_z.assign(m_width, m_grid.Center(2, k));
+		for (int i = 0; i < m_width; i++)
+			m_x[i] = m_grid.Center(0, i);
+		row->Values.resize((size_t)m_materials * m_width);
+		m_evaluations += m_width;
+		if (m_mode == AntiAlias::None) {
+			if (!m_batch.Evaluate(m_x.data(), m_y.data(), m_z.data(), m_width, row->Values.data()))
+				return false;
+		} else {
+			row->Gradients.resize(3 * row->Values.size());
+			if (!m_gradient.Evaluate(m_x.data(), m_y.data(), m_z.data(), m_width, row->Values.data(), row->Gradients.data()))
+				return false;
+		}
+		row->J = j;
+		row->K = k;
+		found = row;
+		return true;
+	}
+
+	// Supersample sets the coverage of the given pixels of row j from the
+	// sample pattern
+	bool CoverageSampler::Supersample(int j, int k, const std::vector<int>& pixels)
+	{
+		size_t samples = (size_t)m_samples * m_samples, count = pixels.size();
+		size_t points = samples * count;
+		if (points == 0)
+			return true;
+
+		// sample by sample, so neighbouring points lie along the row
+		m_x.resize(points);
+		m_y.resize(points);
+		m_z.assign(points, m_grid.Center(2, k));
+		for (size_t s = 0; s < samples; s++) {
+			float dx = m_pattern[2 * s], y = m_grid.Min[1] + (j + m_pattern[2 * s + 1]) * m_grid.Pitch[1];
+			for (size_t p = 0; p < count; p++) {
+				m_x[s * count + p] = m_grid.Min[0] + (pixels[p] + dx) * m_grid.Pitch[0];
+				m_y[s * count + p] = y;
+			}
+		}
+		m_out.resize(m_materials * points);
+		if (!m_batch.Evaluate(m_x.data(), m_y.data(), m_z.data(), points, m_out.data()))
+			return false;
+		m_evaluations += points;
+
+		for (int m = 0; m < m_materials; m++) {
+			float* coverage = &m_coverage[(size_t)m * m_width];
+			for (size_t p = 0; p < count; p++)
+				coverage[pixels[p]] = 0.0f;
+			const float* out = &m_out[m * points];
+			for (size_t s = 0; s < samples; s++)
+				for (size_t p = 0; p < count; p++)
+					coverage[pixels[p]] += Inside(out[s * count + p]) ? 1.0f : 0.0f;
+			for (size_t p = 0; p < count; p++)
+				coverage[pixels[p]] /= samples;
+		}
+		return true;
+	}
+
+	bool CompareAntiAliasing(const Model& model, float pitch, float iso, std::vector<AntiAliasResult>& results, std::string& err)
+	{
+		Grid grid;
+		if (!MakeGrid(model, pitch, 0.0f, grid, err))
+			return false;
+		int width = grid.Size[0], height = grid.Size[1], materials = (int)model.Materials.size();
+
+		struct Mode
+		{
+			const char* Name;
+			AntiAlias AntiAliasing;
+			int Samples;
+		};
+		static const Mode modes[] = {
+			{ "threshold", AntiAlias::None, 1 },
+			{ "supersample 2x2", AntiAlias::Supersample, 2 },
+			{ "supersample 3x3", AntiAlias::Supersample, 3 },
+			{ "supersample 4x4", AntiAlias::Supersample, 4 },
+			{ "supersample 8x8", AntiAlias::Supersample, 8 },
+			{ "gradient", AntiAlias::Gradient, 4 },
+		};
+		const int count = sizeof(modes) / sizeof(modes[0]);
+
+		CoverageSampler reference(model, grid, AntiAlias::Supersample, 16, iso);
+		std::vector<std::unique_ptr<CoverageSampler>> samplers;
+		for (const Mode& mode : modes)
+			samplers.emplace_back(new CoverageSampler(model, grid, mode.AntiAliasing, mode.Samples, iso));
+		std::vector<double> seconds(count, 0.0), total(count, 0.0), most(count, 0.0);
+		double edges = 0.0;
+
+		// a few layers spread over the model, the same ones for every mode
+		int layers = std::min(8, grid.Size[2]);
+		for (int l = 0; l < layers; l++) {
+			int k = (2 * l + 1) * grid.Size[2] / (2 * layers);
+			for (int j = height - 1; j >= 0; j--) {
+				if (!reference.Sample(j, k)) {
+					err = "a loop in the model did not terminate";
+					return false;
+				}
+				for (int m = 0; m < materials; m++) {
+					const float* r = reference.GetValues(m);
+					for (int i = 0; i < width; i++)
+						edges += r[i] > 0.0f && r[i] < 1.0f;
+				}
+				for (int c = 0; c < count; c++) {
+					auto start = std::chrono::steady_clock::now();
+					if (!samplers[c]->Sample(j, k)) {
+						err = "a loop in the model did not terminate";
+						return false;
+					}
+					seconds[c] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+					for (int m = 0; m < materials; m++) {
+						const float* r = reference.GetValues(m);
+						const float* v = samplers[c]->GetValues(m);
+						for (int i = 0; i < width; i++) {
+							double e = std::fabs(v[i] - r[i]) * 255.0;
+							total[c] += e;
+							most[c] = std::max(most[c], e);
+						}
+					}
+				}
+			}
+		}
+
+		double pixels = (double)layers * width * height;
+		results.clear();
+		for (int c = 0; c < count; c++) {
+			AntiAliasResult result;
+			result.Mode = modes[c].Name;
+			result.Evaluations = samplers[c]->GetEvaluations() / pixels;
+			result.Seconds = seconds[c] / layers;
+			result.MeanError = edges > 0.0 ? total[c] / edges : 0.0;
+			result.MaxError = most[c];
+			results.push_back(result);
+		}
+		return true;
+	}
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "batch.h"
+#include "gradient.h"
+#include "sampler.h"
+
+namespace irmf
+{
+	enum class AntiAlias
+	{
+		None,        // a pixel is covered if its center is
+		Supersample, // the share of N x N samples that are covered
+		Gradient     // the area a line through the center's value and
+		             // gradient cuts off
+	};
+
+	// SamplePattern returns the n x n sample offsets every pixel uses, as x,
+	// y pairs in [0, 1): n-rooks, so each of the n^2 columns and rows of the
+	// pixel holds one sample and edges close to the axes still get n^2 steps.
+	std::vector<float> SamplePattern(int n);
+
+	// CoverageSampler samples rows of a Grid like RowSampler, but gives the
+	// share of each pixel where a material is at least the iso level, for
+	// anti-aliased layer images. Gradient evaluates the centers once, with
+	// their gradients; where the tangent plane puts one of the 8 neighbouring
+	// centers on the wrong side (a step, with no gradient, or a corner), the
+	// pixel is supersampled instead, so only those pixels cost more. Use one
+	// per thread.
+	class CoverageSampler
+	{
+	public:
+		CoverageSampler(const Model& model, const Grid& grid, AntiAlias mode, int samples, float iso);
+
+		// Sample computes row j of layer k: the coverage of material m in
+		// pixel i is then GetValues(m)[i]. Returns false if a loop ran away.
+		bool Sample(int j, int k);
+
+		inline const float* GetValues(int material) const { return m_coverage.data() + (size_t)material * m_width; }
+		// GetEvaluations returns the points evaluated so far, gradients
+		// included
+		inline uint64_t GetEvaluations() const { return m_evaluations; }
+
+	private:
+		// a row of centers with their gradients, kept for the rows next to it
+		struct CenterRow
+		{
+			int J, K;
+			std::vector<float> Values, Gradients;
+		};
+
+		bool Centers(int j, int k, int center, const CenterRow*& row);
+		bool Supersample(int j, int k, const std::vector<int>& pixels);
+		bool Inside(float v) const { return v >= m_iso; }
+
+		const Grid& m_grid;
+		AntiAlias m_mode;
+		int m_samples, m_materials, m_width;
+		float m_iso;
+		BatchEvaluator m_batch;
+		GradientEvaluator m_gradient;
+		std::vector<float> m_pattern;
+		std::vector<float> m_x, m_y, m_z, m_out, m_coverage;
+		std::vector<int> m_all, m_edges;
+		CenterRow m_rows[3];
+		uint64_t m_evaluations;
+	};
+
+	// AntiAliasResult is how one way of shading pixels did in
+	// CompareAntiAliasing.
+	struct AntiAliasResult
+	{
+		std::string Mode;
+		double Evaluations; // per pixel
+		double Seconds;     // per layer, on one thread
+		double MeanError;   // per edge pixel, in gray levels
+		double MaxError;
+	};
+
+	// CompareAntiAliasing samples a few layers spread over the model with
+	// each mode (thresholding, supersampling with 2 to 8 samples a side and
+	// gradient coverage) and compares them with 16 x 16 supersampling. Edge
+	// pixels are those the reference covers in part; the mean error is the
+	// total over all pixels divided by their number, so blurring covered or
+	// empty pixels counts against a mode too.
+	bool CompareAntiAliasing(const Model& model, float pitch, float iso, std::vector<AntiAliasResult>& results, std::string& err);
+}
@@ -0,0 +1,59 @@
+#include "cpu.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
+namespace irmf
+{
+	static CpuFeatures DetectCpuFeatures()
+	{
+		CpuFeatures f = { false, false, false, false };
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+		__builtin_cpu_init();
+		f.SSE41 = __builtin_cpu_supports("sse4.1");
+		f.AVX2 = __builtin_cpu_supports("avx2");
+		f.FMA = __builtin_cpu_supports("fma");
+		f.AVX512F = __builtin_cpu_supports("avx512f");
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+		int info[4];
+		__cpuid(info, 0);
+		int maxLeaf = info[0];
+
+		__cpuid(info, 1);
+		f.SSE41 = (info[2] & (1 << 19)) != 0;
+		f.FMA = (info[2] & (1 << 12)) != 0;
+		bool osxsave = (info[2] & (1 << 27)) != 0;
+
+		// the OS must save the YMM (and ZMM) registers on context switches
+		unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+		bool ymm = (xcr0 & 0x6) == 0x6;
+		bool zmm = (xcr0 & 0xE6) == 0xE6;
+		f.FMA = f.FMA && ymm;
+
+		if (maxLeaf >= 7) {
+			__cpuidex(info, 7, 0);
+			f.AVX2 = ymm && (info[1] & (1 << 5)) != 0;
+			f.AVX512F = zmm && (info[1] & (1 << 16)) != 0;
+		}
+#endif
+		return f;
+	}
+
+	const CpuFeatures& GetCpuFeatures()
+	{
+		static const CpuFeatures features = DetectCpuFeatures();
+		return features;
+	}
+
+	std::string CpuFeatureString()
+	{
+		const CpuFeatures& f = GetCpuFeatures();
+		std::string ret;
+		if (f.SSE41) ret += ",sse4.1";
+		if (f.AVX2) ret += ",avx2";
+		if (f.FMA) ret += ",fma";
+		if (f.AVX512F) ret += ",avx512f";
+		return ret.empty() ? "generic" : ret.substr(1);
+	}
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <string>
+
+namespace irmf
+{
+	// CpuFeatures lists the instruction set extensions the CPU evaluators can
+	// take advantage of. It is detected once, on first use.
+	struct CpuFeatures
+	{
+		bool SSE41;
+		bool AVX2;
+		bool FMA;
+		bool AVX512F;
+	};
+
+	const CpuFeatures& GetCpuFeatures();
+
+	// CpuFeatureString returns the detected features as "sse4.1,avx2,...".
+	std::string CpuFeatureString();
+}
@@ -0,0 +1,739 @@
+#include "decimate.h"
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <queue>
+#include <unordered_map>
+#include <utility>
+#include "batch.h"
+#include "sampler.h"
+#include "threadpool.h"
+
+namespace irmf
+{
+	namespace
+	{
+		const uint32_t None = 0xffffffffu;
+		const int ClusterCells = 32; // cluster edge, in cells
+
+		// Quadric sums area weighted squared distances to planes: the
+		// distance of x to plane (n, d) is n.x + d.
+		struct Quadric
+		{
+			double A[6]; // xx, xy, xz, yy, yz, zz
+			double B[3];
+			double C;
+			double W;    // total area
+
+			void Clear()
+			{
+				std::fill(A, A + 6, 0.0);
+				std::fill(B, B + 3, 0.0);
+				C = W = 0.0;
+			}
+
+			void AddPlane(const double n[3], double d, double w)
+			{
+				A[0] += w * n[0] * n[0];
+				A[1] += w * n[0] * n[1];
+				A[2] += w * n[0] * n[2];
+				A[3] += w * n[1] * n[1];
+				A[4] += w * n[1] * n[2];
+				A[5] += w * n[2] * n[2];
+				for (int k = 0; k < 3; k++)
+					B[k] += w * n[k] * d;
+				C += w * d * d;
+				W += w;
+			}
+
+			void Add(const Quadric& q)
+			{
+				for (int k = 0; k < 6; k++)
+					A[k] += q.A[k];
+				for (int k = 0; k < 3; k++)
+					B[k] += q.B[k];
+				C += q.C;
+				W += q.W;
+			}
+
+			// Error returns the mean squared distance of x to the planes.
+			double Error(const double x[3]) const
+			{
+				double e = A[0] * x[0] * x[0] + A[3] * x[1] * x[1] + A[5] * x[2] * x[2]
+					+ 2.0 * (A[1] * x[0] * x[1] + A[2] * x[0] * x[2] + A[4] * x[1] * x[2])
+					+ 2.0 * (B[0] * x[0] + B[1] * x[1] + B[2] * x[2]) + C;
+				return W > 0.0 ? std::max(0.0, e / W) : 0.0;
+			}
+
+			// Optimum finds the point of least error, if the planes pin one down.
+			bool Optimum(double x[3]) const
+			{
+				double c0 = A[3] * A[5] - A[4] * A[4];
+				double c1 = A[2] * A[4] - A[1] * A[5];
+				double c2 = A[1] * A[4] - A[2] * A[3];
+				double det = A[0] * c0 + A[1] * c1 + A[2] * c2;
+				double scale = (A[0] + A[3] + A[5]) / 3.0;
+				if (!(std::fabs(det) > 1e-3 * scale * scale * scale))
+					return false;
+				double inv[6] = { c0, c1, c2, A[0] * A[5] - A[2] * A[2], A[1] * A[2] - A[0] * A[4], A[0] * A[3] - A[1] * A[1] };
+				x[0] = -(inv[0] * B[0] + inv[1] * B[1] + inv[2] * B[2]) / det;
+				x[1] = -(inv[1] * B[0] + inv[3] * B[1] + inv[4] * B[2]) / det;
+				x[2] = -(inv[2] * B[0] + inv[4] * B[1] + inv[5] * B[2]) / det;
+				return true;
+			}
+		};
+
+		inline void Cross(const double u[3], const double v[3], double n[3])
+		{
+			n[0] = u[1] * v[2] - u[2] * v[1];
+			n[1] = u[2] * v[0] - u[0] * v[2];
+			n[2] = u[0] * v[1] - u[1] * v[0];
+		}
+
+		inline double Dot(const double u[3], const double v[3])
+		{
+			return u[0] * v[0] + u[1] * v[1] + u[2] * v[2];
+		}
+
+		// Normal returns twice the area of triangle (a, b, c) and its normal
+		// times that in n.
+		inline double Normal(const double* a, const double* b, const double* c, double n[3])
+		{
+			double u[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+			double v[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+			Cross(u, v, n);
+			return std::sqrt(Dot(n, n));
+		}
+
+		void AddTriangle(const double* a, const double* b, const double* c, Quadric* q[3])
+		{
+			double n[3];
+			double length = Normal(a, b, c, n);
+			if (!(length > 0.0))
+				return;
+			for (int k = 0; k < 3; k++)
+				n[k] /= length;
+			double d = -Dot(n, a);
+			for (int k = 0; k < 3; k++)
+				q[k]->AddPlane(n, d, 0.5 * length);
+		}
+
+		// Mesh is one material's mesh, welded together from the mesher's
+		// parts. Removed triangles start with None.
+		struct Mesh
+		{
+			std::vector<float> Positions;
+			std::vector<uint32_t> Triangles;
+			std::vector<Quadric> Quadrics; // per vertex, once simplifying starts
+			std::unordered_map<uint32_t, uint32_t> Boundary; // Top of the last part: key -> vertex
+
+			inline uint32_t GetVertexCount() const { return (uint32_t)(Positions.size() / 3); }
+		};
+
+		bool Weld(Mesh& mesh, const MeshPart& part)
+		{
+			std::vector<uint32_t> remap(part.GetVertexCount(), None);
+			for (const auto& shared : part.Bottom) {
+				auto it = mesh.Boundary.find(shared.first);
+				if (it != mesh.Boundary.end())
+					remap[shared.second] = it->second;
+			}
+			for (uint32_t i = 0; i < part.GetVertexCount(); i++) {
+				if (remap[i] != None)
+					continue;
+				if (mesh.Positions.size() / 3 >= None)
+					return false;
+				remap[i] = mesh.GetVertexCount();
+				mesh.Positions.insert(mesh.Positions.end(), &part.Positions[3 * i], &part.Positions[3 * i + 3]);
+			}
+			mesh.Boundary.clear();
+			for (const auto& shared : part.Top)
+				mesh.Boundary[shared.first] = remap[shared.second];
+			for (uint32_t t : part.Triangles)
+				mesh.Triangles.push_back(remap[t]);
+			return true;
+		}
+
+		// AddQuadrics sets each vertex's quadric from its triangles.
+		void AddQuadrics(Mesh& mesh)
+		{
+			mesh.Quadrics.resize(mesh.GetVertexCount());
+			for (Quadric& q : mesh.Quadrics)
+				q.Clear();
+			for (size_t t = 0; t < mesh.Triangles.size(); t += 3) {
+				double p[3][3];
+				Quadric* q[3];
+				for (int k = 0; k < 3; k++) {
+					uint32_t v = mesh.Triangles[t + k];
+					for (int a = 0; a < 3; a++)
+						p[k][a] = mesh.Positions[3 * (size_t)v + a];
+					q[k] = &mesh.Quadrics[v];
+				}
+				AddTriangle(p[0], p[1], p[2], q);
+			}
+		}
+
+		// Compact drops removed triangles and the vertices no triangle uses
+		// any more.
+		void Compact(Mesh& mesh)
+		{
+			std::vector<uint32_t> remap(mesh.GetVertexCount(), None);
+			size_t out = 0;
+			for (size_t t = 0; t < mesh.Triangles.size(); t += 3) {
+				if (mesh.Triangles[t] == None)
+					continue;
+				for (int k = 0; k < 3; k++)
+					remap[mesh.Triangles[t + k]] = 0;
+				for (int k = 0; k < 3; k++)
+					mesh.Triangles[out + k] = mesh.Triangles[t + k];
+				out += 3;
+			}
+			mesh.Triangles.resize(out);
+			mesh.Triangles.shrink_to_fit();
+			uint32_t count = 0;
+			for (uint32_t v = 0; v < remap.size(); v++)
+				if (remap[v] != None) {
+					remap[v] = count;
+					for (int k = 0; k < 3; k++)
+						mesh.Positions[3 * count + k] = mesh.Positions[3 * v + k];
+					mesh.Quadrics[count] = mesh.Quadrics[v];
+					count++;
+				}
+			mesh.Positions.resize(3 * (size_t)count);
+			mesh.Positions.shrink_to_fit();
+			mesh.Quadrics.resize(count);
+			mesh.Quadrics.shrink_to_fit();
+			for (uint32_t& v : mesh.Triangles)
+				v = remap[v];
+		}
+
+		// Collapser simplifies one cluster of a mesh at a time: the
+		// triangles whose vertices all fall in it. Locked vertices stay
+		// where they are, though others may collapse into them.
+		class Collapser
+		{
+		public:
+			// Run simplifies the triangles listed, keeping the mean squared
+			// distance to the planes of each vertex within limit, and writes
+			// the result back to the mesh, quadrics included.
+			void Run(Mesh& mesh, const uint32_t* triangles, size_t count, const std::vector<uint8_t>& locked, double limit, std::vector<uint32_t>& local)
+			{
+				m_limit = limit;
+				m_vertexCount = 0;
+				m_faces.clear();
+				for (size_t i = 0; i < count; i++) {
+					Face face;
+					face.Global = triangles[i];
+					face.Alive = true;
+					for (int k = 0; k < 3; k++) {
+						uint32_t g = mesh.Triangles[3 * (size_t)face.Global + k];
+						if (local[g] == None) {
+							local[g] = m_vertexCount;
+							if (m_vertices.size() <= m_vertexCount)
+								m_vertices.emplace_back();
+							Vertex& v = m_vertices[m_vertexCount++];
+							for (int a = 0; a < 3; a++)
+								v.P[a] = mesh.Positions[3 * (size_t)g + a];
+							v.Q = mesh.Quadrics[g];
+							v.Global = g;
+							v.Version = 0;
+							v.Locked = locked[g] != 0;
+							v.Alive = true;
+							v.Faces.clear();
+						}
+						face.V[k] = local[g];
+						m_vertices[local[g]].Faces.push_back((uint32_t)m_faces.size());
+					}
+					m_faces.push_back(face);
+				}
+
+				// each edge of a closed, consistently oriented mesh runs
+				// from the lower vertex in exactly one of its triangles
+				m_queue = std::priority_queue<Candidate>();
+				for (const Face& face : m_faces)
+					for (int k = 0; k < 3; k++)
+						if (face.V[k] < face.V[(k + 1) % 3])
+							Consider(face.V[k], face.V[(k + 1) % 3]);
+				while (!m_queue.empty()) {
+					Candidate c = m_queue.top();
+					m_queue.pop();
+					const Vertex& a = m_vertices[c.A];
+					const Vertex& b = m_vertices[c.B];
+					if (a.Alive && b.Alive && a.Version == c.VersionA && b.Version == c.VersionB)
+						Collapse(c);
+				}
+
+				for (uint32_t i = 0; i < m_vertexCount; i++) {
+					Vertex& v = m_vertices[i];
+					local[v.Global] = None;
+					if (!v.Alive)
+						continue;
+					if (!v.Locked)
+						for (int a = 0; a < 3; a++)
+							mesh.Positions[3 * (size_t)v.Global + a] = (float)v.P[a];
+					mesh.Quadrics[v.Global] = v.Q;
+				}
+				for (const Face& face : m_faces) {
+					uint32_t* t = &mesh.Triangles[3 * (size_t)face.Global];
+					if (!face.Alive)
+						t[0] = None;
+					else
+						for (int k = 0; k < 3; k++)
+							t[k] = m_vertices[face.V[k]].Global;
+				}
+			}
+
+		private:
+			struct Vertex
+			{
+				double P[3];
+				Quadric Q;
+				uint32_t Global, Version;
+				bool Locked, Alive;
+				std::vector<uint32_t> Faces;
+			};
+			struct Face
+			{
+				uint32_t V[3];
+				uint32_t Global;
+				bool Alive;
+			};
+			// Candidate is the collapse of edge (A, B) to P, valid while
+			// neither end changes
+			struct Candidate
+			{
+				double Error;
+				uint32_t A, B, VersionA, VersionB;
+				double P[3];
+
+				// the queue puts the least error on top
+				bool operator<(const Candidate& other) const { return Error > other.Error; }
+			};
+
+			void Consider(uint32_t a, uint32_t b)
+			{
+				const Vertex& va = m_vertices[a];
+				const Vertex& vb = m_vertices[b];
+				if (va.Locked && vb.Locked)
+					return;
+				Quadric q = va.Q;
+				q.Add(vb.Q);
+				Candidate c;
+				c.A = a;
+				c.B = b;
+				c.VersionA = va.Version;
+				c.VersionB = vb.Version;
+				if (va.Locked || vb.Locked) {
+					std::copy(va.Locked ? va.P : vb.P, (va.Locked ? va.P : vb.P) + 3, c.P);
+					c.Error = q.Error(c.P);
+				} else {
+					// the optimum, if it is near the edge, else the best of
+					// its ends and middle
+					double mid[3], x[3], length = 0.0;
+					for (int k = 0; k < 3; k++) {
+						mid[k] = 0.5 * (va.P[k] + vb.P[k]);
+						length += (va.P[k] - vb.P[k]) * (va.P[k] - vb.P[k]);
+					}
+					c.Error = HUGE_VAL;
+					if (q.Optimum(x)) {
+						double d = 0.0;
+						for (int k = 0; k < 3; k++)
+							d += (x[k] - mid[k]) * (x[k] - mid[k]);
+						if (d <= length) {
+							std::copy(x, x + 3, c.P);
+							c.Error = q.Error(x);
+						}
+					}
+					const double* choices[3] = { mid, va.P, vb.P };
+					for (const double* p : choices) {
+						double e = q.Error(p);
+						if (e < c.Error) {
+							std::copy(p, p + 3, c.P);
+							c.Error = e;
+						}
+					}
+				}
+				if (c.Error <= m_limit)
+					m_queue.push(c);
+			}
+
+			// Moves returns whether moving from to p keeps every triangle of
+			// from that does not use other facing the same way
+			bool Moves(const Vertex& from, uint32_t other, const double p[3]) const
+			{
+				for (uint32_t f : from.Faces) {
+					const Face& face = m_faces[f];
+					if (!face.Alive || face.V[0] == other || face.V[1] == other || face.V[2] == other)
+						continue;
+					const double* corners[3];
+					for (int k = 0; k < 3; k++)
+						corners[k] = &m_vertices[face.V[k]] == &from ? p : m_vertices[face.V[k]].P;
+					const double* old[3] = { m_vertices[face.V[0]].P, m_vertices[face.V[1]].P, m_vertices[face.V[2]].P };
+					double before[3], after[3];
+					double a = Normal(old[0], old[1], old[2], before);
+					double b = Normal(corners[0], corners[1], corners[2], after);
+					if (!(b > 1e-6 * a) || Dot(before, after) < 0.2 * a * b)
+						return false;
+				}
+				return true;
+			}
+
+			void Neighbours(const Vertex& v, std::vector<uint32_t>& out) const
+			{
+				out.clear();
+				for (uint32_t f : v.Faces) {
+					const Face& face = m_faces[f];
+					if (!face.Alive)
+						continue;
+					for (int k = 0; k < 3; k++)
+						if (&m_vertices[face.V[k]] != &v && std::find(out.begin(), out.end(), face.V[k]) == out.end())
+							out.push_back(face.V[k]);
+				}
+			}
+
+			void Collapse(const Candidate& c)
+			{
+				uint32_t keep = c.A, remove = c.B;
+				if (m_vertices[remove].Locked)
+					std::swap(keep, remove);
+				Vertex& k = m_vertices[keep];
+				Vertex& r = m_vertices[remove];
+
+				// the ends may only share the two vertices across the edge,
+				// and only two triangles may use it
+				Neighbours(k, m_around);
+				Neighbours(r, m_other);
+				int common = 0;
+				for (uint32_t n : m_other)
+					common += std::find(m_around.begin(), m_around.end(), n) != m_around.end();
+				int shared = 0;
+				for (uint32_t f : r.Faces) {
+					const Face& face = m_faces[f];
+					shared += face.Alive && (face.V[0] == keep || face.V[1] == keep || face.V[2] == keep);
+				}
+				if (common != 2 || shared != 2 || !Moves(r, keep, c.P) || !Moves(k, remove, c.P))
+					return;
+
+				for (uint32_t f : r.Faces) {
+					Face& face = m_faces[f];
+					if (!face.Alive)
+						continue;
+					if (face.V[0] == keep || face.V[1] == keep || face.V[2] == keep) {
+						face.Alive = false;
+						continue;
+					}
+					for (int i = 0; i < 3; i++)
+						if (face.V[i] == remove)
+							face.V[i] = keep;
+					k.Faces.push_back(f);
+				}
+				k.Faces.erase(std::remove_if(k.Faces.begin(), k.Faces.end(), [this](uint32_t f) { return !m_faces[f].Alive; }), k.Faces.end());
+				r.Alive = false;
+				r.Faces.clear();
+				std::copy(c.P, c.P + 3, k.P);
+				k.Q.Add(r.Q);
+				k.Version++;
+
+				Neighbours(k, m_around);
+				for (uint32_t n : m_around)
+					Consider(keep, n);
+			}
+
+			double m_limit;
+			std::vector<Vertex> m_vertices; // not shrunk, to reuse their face lists
+			uint32_t m_vertexCount;
+			std::vector<Face> m_faces;
+			std::priority_queue<Candidate> m_queue;
+			std::vector<uint32_t> m_around, m_other;
+		};
+
+		// Simplify runs one pass of Collapser over clusters of edge size,
+		// shifted by offset, and returns whether there was more than one.
+		bool Simplify(Mesh& mesh, ThreadPool& pool, double size, double offset, double limit)
+		{
+			uint32_t vertexCount = mesh.GetVertexCount();
+			float min[3] = { HUGE_VALF, HUGE_VALF, HUGE_VALF }, max[3] = { -HUGE_VALF, -HUGE_VALF, -HUGE_VALF };
+			for (uint32_t v = 0; v < vertexCount; v++)
+				for (int a = 0; a < 3; a++) {
+					min[a] = std::min(min[a], mesh.Positions[3 * (size_t)v + a]);
+					max[a] = std::max(max[a], mesh.Positions[3 * (size_t)v + a]);
+				}
+			size_t dims[3];
+			for (int a = 0; a < 3; a++)
+				dims[a] = (size_t)((max[a] - min[a] + offset) / size) + 1;
+			std::vector<uint32_t> cluster(vertexCount);
+			for (uint32_t v = 0; v < vertexCount; v++) {
+				size_t c[3];
+				for (int a = 0; a < 3; a++)
+					c[a] = std::min(dims[a] - 1, (size_t)((mesh.Positions[3 * (size_t)v + a] - min[a] + offset) / size));
+				cluster[v] = (uint32_t)((c[2] * dims[1] + c[1]) * dims[0] + c[0]);
+			}
+
+			// triangles by cluster; those between clusters lock their vertices
+			size_t clusters = dims[0] * dims[1] * dims[2];
+			std::vector<uint8_t> locked(vertexCount, 0);
+			std::vector<uint32_t> first(clusters + 1, 0);
+			size_t triangleCount = mesh.Triangles.size() / 3;
+			for (size_t t = 0; t < triangleCount; t++) {
+				const uint32_t* v = &mesh.Triangles[3 * t];
+				if (v[0] == None)
+					continue;
+				if (cluster[v[0]] == cluster[v[1]] && cluster[v[0]] == cluster[v[2]])
+					first[cluster[v[0]] + 1]++;
+				else
+					locked[v[0]] = locked[v[1]] = locked[v[2]] = 1;
+			}
+			for (size_t c = 0; c < clusters; c++)
+				first[c + 1] += first[c];
+			std::vector<uint32_t> order(first[clusters]), at(first.begin(), first.end() - 1);
+			for (size_t t = 0; t < triangleCount; t++) {
+				const uint32_t* v = &mesh.Triangles[3 * t];
+				if (v[0] != None && cluster[v[0]] == cluster[v[1]] && cluster[v[0]] == cluster[v[2]])
+					order[at[cluster[v[0]]]++] = (uint32_t)t;
+			}
+			at.clear();
+			at.shrink_to_fit();
+
+			std::vector<Collapser> collapsers(pool.GetThreadCount());
+			std::vector<uint32_t> local(vertexCount, None);
+			std::vector<size_t> used;
+			for (size_t c = 0; c < clusters; c++)
+				if (first[c + 1] > first[c])
+					used.push_back(c);
+			for (size_t c : used)
+				pool.Submit([&, c](int w) {
+					collapsers[w].Run(mesh, &order[first[c]], first[c + 1] - first[c], locked, limit, local);
+				});
+			pool.Wait();
+			return clusters > 1;
+		}
+
+		// Lines holds points and lines through each of them, and the
+		// buffers to evaluate the model along them.
+		struct Lines
+		{
+			std::vector<double> Points;     // 3 per point
+			std::vector<double> Directions; // 3 per line, the same number per point
+			std::vector<float> X, Y, Z, Values;
+
+			inline size_t GetPointCount() const { return Points.size() / 3; }
+		};
+
+		// Nearest finds, for each point, the distance along its lines to
+		// the nearest place where material m crosses iso, sampled every
+		// step up to steps away on either side; points with no crossing
+		// get HUGE_VAL. Outside the bounding box is empty, as for the
+		// mesher. Returns false if the model could not be evaluated.
+		bool Nearest(const Model& model, int m, float iso, BatchEvaluator& evaluator, double step, int steps, Lines& lines, std::vector<double>& nearest)
+		{
+			const int stencil = 2 * steps + 1;
+			size_t points = lines.GetPointCount(), count = lines.Directions.size() / 3;
+			size_t perPoint = points > 0 ? count / points : 0;
+			lines.X.resize(count * stencil);
+			lines.Y.resize(count * stencil);
+			lines.Z.resize(count * stencil);
+			for (size_t l = 0; l < count; l++) {
+				const double* p = &lines.Points[3 * (l / perPoint)];
+				const double* d = &lines.Directions[3 * l];
+				for (int i = 0; i < stencil; i++) {
+					lines.X[l * stencil + i] = (float)(p[0] + (i - steps) * step * d[0]);
+					lines.Y[l * stencil + i] = (float)(p[1] + (i - steps) * step * d[1]);
+					lines.Z[l * stencil + i] = (float)(p[2] + (i - steps) * step * d[2]);
+				}
+			}
+			size_t samples = count * stencil;
+			lines.Values.resize(samples * evaluator.GetOutputCount());
+			if (samples > 0 && !evaluator.Evaluate(lines.X.data(), lines.Y.data(), lines.Z.data(), samples, lines.Values.data()))
+				return false;
+
+			nearest.assign(points, HUGE_VAL);
+			std::vector<float> f(stencil);
+			for (size_t l = 0; l < count; l++) {
+				for (int i = 0; i < stencil; i++) {
+					size_t at = l * stencil + i;
+					bool inside = lines.X[at] >= model.Min[0] && lines.X[at] <= model.Max[0] && lines.Y[at] >= model.Min[1]
+						&& lines.Y[at] <= model.Max[1] && lines.Z[at] >= model.Min[2] && lines.Z[at] <= model.Max[2];
+					float v = lines.Values[m * samples + at];
+					f[i] = inside && v == v ? v : 0.0f;
+				}
+				double& best = nearest[l / perPoint];
+				for (int i = 0; i + 1 < stencil; i++)
+					if ((f[i] >= iso) != (f[i + 1] >= iso)) {
+						double x = (i - steps + (iso - f[i]) / (f[i + 1] - f[i])) * step;
+						best = std::min(best, std::fabs(x));
+					}
+			}
+			return true;
+		}
+
+		// Deviation finds the largest distance from points on the mesh to
+		// where material m crosses iso, or HUGE_VAL if a point has none
+		// within range or the model fails. Each point looks along
+		// its triangle's normal, the normal interpolated from its corners
+		// (nearer the surface's on coarse triangles) and the axes (which
+		// the normals of a staircase of marching cubes triangles can be far
+		// from); points that find nothing within a cell, as on thin rims,
+		// look again along the diagonals. The nearest crossing on these
+		// lines is never nearer than the surface is.
+		double Deviation(const Model& model, int m, float iso, const Mesh& mesh, double pitch, double range, ThreadPool& pool)
+		{
+			const int steps = (int)std::ceil(range / (0.25 * pitch));
+			const double step = range / steps;
+			size_t triangleCount = mesh.Triangles.size() / 3;
+			std::vector<uint32_t> firstUse(mesh.GetVertexCount(), None);
+			std::vector<double> normals(3 * (size_t)mesh.GetVertexCount(), 0.0);
+			for (size_t t = triangleCount; t-- > 0;) {
+				double p[3][3], n[3];
+				for (int k = 0; k < 3; k++)
+					for (int a = 0; a < 3; a++)
+						p[k][a] = mesh.Positions[3 * (size_t)mesh.Triangles[3 * t + k] + a];
+				Normal(p[0], p[1], p[2], n);
+				for (int k = 0; k < 3; k++) {
+					firstUse[mesh.Triangles[3 * t + k]] = (uint32_t)t;
+					for (int a = 0; a < 3; a++)
+						normals[3 * (size_t)mesh.Triangles[3 * t + k] + a] += n[a];
+				}
+			}
+			const double r2 = std::sqrt(0.5), r3 = std::sqrt(1.0 / 3.0);
+			const double diagonals[10][3] = { { r2, r2, 0 }, { r2, -r2, 0 }, { r2, 0, r2 }, { r2, 0, -r2 }, { 0, r2, r2 }, { 0, r2, -r2 },
+				{ r3, r3, r3 }, { r3, r3, -r3 }, { r3, -r3, r3 }, { -r3, r3, r3 } };
+
+			struct Worker
+			{
+				std::unique_ptr<BatchEvaluator> Evaluator;
+				Lines First, Again;
+				std::vector<double> Nearest, Found;
+				double Max;
+			};
+			std::vector<Worker> workers(pool.GetThreadCount());
+			const size_t chunk = 1024;
+			for (size_t t0 = 0; t0 < triangleCount; t0 += chunk)
+				pool.Submit([&, t0](int w) {
+					Worker& worker = workers[w];
+					if (!worker.Evaluator) {
+						worker.Evaluator.reset(new BatchEvaluator(model.Code));
+						worker.Max = 0.0;
+					}
+					Lines& lines = worker.First;
+					lines.Points.clear();
+					lines.Directions.clear();
+					for (size_t t = t0; t < std::min(t0 + chunk, triangleCount); t++) {
+						double p[3][3], n[3];
+						for (int k = 0; k < 3; k++)
+							for (int a = 0; a < 3; a++)
+								p[k][a] = mesh.Positions[3 * (size_t)mesh.Triangles[3 * t + k] + a];
+						double length = Normal(p[0], p[1], p[2], n);
+						if (!(length > 0.0))
+							continue;
+						for (int a = 0; a < 3; a++)
+							n[a] /= length;
+						// the centroid, the middle of each edge and the corners
+						// met first here
+						double weights[7][3] = { { 1 / 3.0, 1 / 3.0, 1 / 3.0 }, { 0.5, 0.5, 0 }, { 0, 0.5, 0.5 }, { 0.5, 0, 0.5 }, { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+						for (int s = 0; s < 7; s++) {
+							if (s >= 4 && firstUse[mesh.Triangles[3 * t + s - 4]] != t)
+								continue;
+							double smooth[3] = { 0, 0, 0 };
+							for (int a = 0; a < 3; a++) {
+								lines.Points.push_back(weights[s][0] * p[0][a] + weights[s][1] * p[1][a] + weights[s][2] * p[2][a]);
+								for (int k = 0; k < 3; k++)
+									smooth[a] += weights[s][k] * normals[3 * (size_t)mesh.Triangles[3 * t + k] + a];
+							}
+							double norm = std::sqrt(Dot(smooth, smooth));
+							for (int a = 0; a < 3; a++)
+								smooth[a] = norm > 0.0 ? smooth[a] / norm : n[a];
+							const double directions[5][3] = { { n[0], n[1], n[2] }, { smooth[0], smooth[1], smooth[2] }, { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+							for (const double* d : directions)
+								lines.Directions.insert(lines.Directions.end(), d, d + 3);
+						}
+					}
+					if (!Nearest(model, m, iso, *worker.Evaluator, step, steps, lines, worker.Nearest)) {
+						worker.Max = HUGE_VAL;
+						return;
+					}
+
+					Lines& again = worker.Again;
+					again.Points.clear();
+					again.Directions.clear();
+					std::vector<double>& found = worker.Found;
+					found.clear();
+					for (size_t i = 0; i < lines.GetPointCount(); i++)
+						if (worker.Nearest[i] > pitch) {
+							again.Points.insert(again.Points.end(), &lines.Points[3 * i], &lines.Points[3 * i + 3]);
+							for (const double* d : diagonals)
+								again.Directions.insert(again.Directions.end(), d, d + 3);
+							found.push_back(worker.Nearest[i]);
+						} else
+							worker.Max = std::max(worker.Max, worker.Nearest[i]);
+					if (again.GetPointCount() == 0)
+						return;
+					if (!Nearest(model, m, iso, *worker.Evaluator, step, steps, again, worker.Nearest)) {
+						worker.Max = HUGE_VAL;
+						return;
+					}
+					for (size_t i = 0; i < found.size(); i++)
+						worker.Max = std::max(worker.Max, std::min(found[i], worker.Nearest[i]));
+				});
+			pool.Wait();
+			double max = 0.0;
+			for (const Worker& worker : workers)
+				if (worker.Evaluator)
+					max = std::max(max, worker.Max);
+			return max;
+		}
+	}
+
+	bool Decimate(Mesher mesher, const Model& model, const MeshSettings& settings, const MeshConsumer& consume, MeshStats& stats, std::string& err)
+	{
+		int materials = (int)model.Materials.size();
+		Grid grid;
+		if (settings.Source ? !GetSourceGrid(model, *settings.Source, grid, err)
+						   : !MakeGrid(model, settings.Pitch, 0.0f, grid, err))
+			return false;
+		double pitch = std::min(grid.Pitch[0], std::min(grid.Pitch[1], grid.Pitch[2]));
+
+		std::vector<Mesh> meshes(materials);
+		bool tooLarge = false;
+		auto collect = [&](int m, const MeshPart& part) {
+			tooLarge = !Weld(meshes[m], part);
+			return !tooLarge;
+		};
+		if (!mesher(model, settings, collect, err)) {
+			if (tooLarge)
+				err = "too many vertices";
+			return false;
+		}
+
+		ThreadPool pool(settings.Threads);
+		double limit = (double)settings.MaxError * pitch;
+		stats.MaxDeviation.assign(materials, 0.0);
+		for (int m = 0; m < materials; m++) {
+			Mesh& mesh = meshes[m];
+			mesh.Boundary.clear();
+
+			// each level doubles the clusters and moves their edges off
+			// the last level's, until one cluster holds the whole mesh
+			AddQuadrics(mesh);
+			double offset = 0.0;
+			for (double size = ClusterCells * pitch; !mesh.Triangles.empty(); size *= 2.0) {
+				bool more = Simplify(mesh, pool, size, offset, limit * limit);
+				Compact(mesh);
+				if (!more)
+					break;
+				offset += 0.5 * size;
+			}
+			mesh.Quadrics.clear();
+			mesh.Quadrics.shrink_to_fit();
+
+			double range = 2.0 * limit + 2.0 * pitch;
+			stats.MaxDeviation[m] = Deviation(model, m, settings.IsoLevel, mesh, pitch, range, pool) / pitch;
+
+			MeshPart part;
+			part.Positions.swap(mesh.Positions);
+			part.Triangles.swap(mesh.Triangles);
+			if (!consume(m, part))
+				return false;
+		}
+		return true;
+	}
+}
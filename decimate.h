@@ -0,0 +1,26 @@
+#pragma once
+#include <string>
+#include "mesher.h"
+
+namespace irmf
+{
+	// Decimate runs mesher and simplifies each material's mesh before
+	// passing it to consume as a single part, with edge collapses ordered
+	// by quadric error: a collapse is made while the root of the area
+	// weighted mean squared distance of the new vertex to the planes of
+	// the triangles it replaces stays within settings.MaxError cells. The
+	// mesh is cut into clusters of 32^3 cells that are simplified in
+	// parallel, with the vertices of triangles crossing between clusters
+	// kept in place; each following level doubles the clusters and shifts
+	// their edges, until one cluster holds what is left. Collapses that
+	// would fold a triangle over or make the mesh non manifold are
+	// skipped, so closed meshes stay closed.
+	//
+	// As the limit is on an average, small features can move further. The
+	// result is checked against the model: from points on every triangle,
+	// lines are followed until the model's material crosses the iso level,
+	// and the largest distance to the nearest crossing is put in
+	// stats.MaxDeviation, in cells. It is infinite where a point found no
+	// crossing within 2 MaxError + 2 cells.
+	bool Decimate(Mesher mesher, const Model& model, const MeshSettings& settings, const MeshConsumer& consume, MeshStats& stats, std::string& err);
+}
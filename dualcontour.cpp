@@ -0,0 +1,1298 @@
+#include "dualcontour.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <memory>
+#include "batch.h"
+#include "gradient.h"
+#include "interval.h"
+#include "sampler.h"
+#include "threadpool.h"
+
+namespace irmf
+{
+	namespace
+	{
+		const int BrickLevel = 5;  // bricks of 32^3 cells: the largest cell a merge makes
+		const int SampleLevel = 3; // undecided boxes of 8^3 cells are sampled as a whole
+		const int BlockPoints = (1 << SampleLevel) + 1;
+		const int Bisections = 8;
+		const uint8_t HasNormal = 4;
+
+		// Node is a cell of the octree. Leaves know on which side of the
+		// surface their corners are, and those the surface passes through
+		// have a vertex.
+		struct Node
+		{
+			Node* Child;    // first of the 8 children (x + 2y + 4z), null for leaves
+			int32_t First;  // index of Child in the pool while building, -1 for leaves
+			int32_t Vertex; // the first of a vertex per patch, -1 if none
+			uint8_t Signs;  // bit c is set if corner c is in the material
+			uint8_t Level;  // the node spans 2^Level cells on each side
+		};
+
+		// EdgeOf numbers the edge between corners a and b (x + 2y + 4z) as
+		// MarchingCubes does: axis * 4 plus the corner's other two bits.
+		int EdgeOf(int a, int b)
+		{
+			int axis = a ^ b;
+			axis = axis == 1 ? 0 : axis == 2 ? 1 : 2;
+			int other0 = axis == 0 ? 1 : 0, other1 = axis == 2 ? 1 : 2;
+			return axis * 4 + ((a >> other0) & 1) + 2 * ((a >> other1) & 1);
+		}
+
+		// Patches splits the surface in a cell into the loops MarchingCubes
+		// would triangulate there: on every face, each run of inside corners
+		// is cut off by a segment joining the two edges it crosses, and the
+		// segments chain into loops. A cell gets a vertex per loop, so two
+		// sheets passing through it are not joined into one, and as both
+		// cells on a face see the same segments the mesh stays manifold.
+		// The exception is a loop through both segments of a face with two
+		// runs, a tunnel: if the cell on the other side also joins them, the
+		// two vertices share four triangles (see SplitPinches).
+		struct Patches
+		{
+			uint8_t Count[256];
+			int8_t Patch[256][12]; // the loop of each crossed edge, -1 if not crossed
+			bool Tunnel[256];
+		};
+
+		Patches BuildPatches()
+		{
+			Patches patches;
+			for (int config = 0; config < 256; config++) {
+				int next[12];
+				std::fill(next, next + 12, -1);
+				int runs[6][2], faces = 0; // an edge of each run on faces with two
+				for (int axis = 0; axis < 3; axis++)
+					for (int side = 0; side < 2; side++) {
+						int b = (axis + 1) % 3, c = (axis + 2) % 3;
+						// counter-clockwise as seen from outside
+						const int uv[4][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 } };
+						int corners[4];
+						for (int k = 0; k < 4; k++) {
+							const int* q = uv[side ? k : 3 - k];
+							corners[k] = (side << axis) | (q[0] << b) | (q[1] << c);
+						}
+						auto inside = [&](int k) { return (config >> corners[k & 3]) & 1; };
+						int count = 0;
+						for (int k = 0; k < 4; k++) {
+							if (inside(k) || !inside(k + 1))
+								continue;
+							int m = k + 1;
+							while (!(inside(m) && !inside(m + 1)))
+								m++;
+							int edge = EdgeOf(corners[k & 3], corners[(k + 1) & 3]);
+							next[edge] = EdgeOf(corners[m & 3], corners[(m + 1) & 3]);
+							if (count < 2)
+								runs[faces][count] = edge;
+							count++;
+						}
+						if (count == 2)
+							faces++;
+					}
+
+				patches.Count[config] = 0;
+				std::fill(patches.Patch[config], patches.Patch[config] + 12, -1);
+				for (int e = 0; e < 12; e++) {
+					if (next[e] < 0 || patches.Patch[config][e] >= 0)
+						continue;
+					for (int f = e; patches.Patch[config][f] < 0; f = next[f])
+						patches.Patch[config][f] = (int8_t)patches.Count[config];
+					patches.Count[config]++;
+				}
+				const int8_t* patch = patches.Patch[config];
+				patches.Tunnel[config] = false;
+				for (int f = 0; f < faces; f++)
+					patches.Tunnel[config] = patches.Tunnel[config] || patch[runs[f][0]] == patch[runs[f][1]];
+			}
+			return patches;
+		}
+
+		const Patches& CellPatches()
+		{
+			static const Patches patches = BuildPatches();
+			return patches;
+		}
+
+		Node Leaf(int level, uint8_t signs)
+		{
+			Node node;
+			node.Child = nullptr;
+			node.First = -1;
+			node.Vertex = -1;
+			node.Signs = signs;
+			node.Level = (uint8_t)level;
+			return node;
+		}
+
+		// Eigen diagonalizes the symmetric matrix a with Jacobi rotations;
+		// the eigenvectors end up in the columns of v
+		void Eigen(double a[3][3], double v[3][3])
+		{
+			for (int i = 0; i < 3; i++)
+				for (int j = 0; j < 3; j++)
+					v[i][j] = i == j ? 1.0 : 0.0;
+			double scale = std::fabs(a[0][0]) + std::fabs(a[1][1]) + std::fabs(a[2][2]);
+			for (int sweep = 0; sweep < 16; sweep++) {
+				double off = std::fabs(a[0][1]) + std::fabs(a[0][2]) + std::fabs(a[1][2]);
+				if (off <= 1e-9 * scale)
+					break;
+				for (int p = 0; p < 2; p++)
+					for (int q = p + 1; q < 3; q++) {
+						if (std::fabs(a[p][q]) <= 1e-12 * scale)
+							continue;
+						double theta = (a[q][q] - a[p][p]) / (2.0 * a[p][q]);
+						double t = (theta >= 0.0 ? 1.0 : -1.0) / (std::fabs(theta) + std::sqrt(theta * theta + 1.0));
+						double c = 1.0 / std::sqrt(t * t + 1.0), s = t * c;
+						for (int k = 0; k < 3; k++) {
+							double kp = a[k][p], kq = a[k][q];
+							a[k][p] = c * kp - s * kq;
+							a[k][q] = s * kp + c * kq;
+						}
+						for (int k = 0; k < 3; k++) {
+							double pk = a[p][k], qk = a[q][k];
+							a[p][k] = c * pk - s * qk;
+							a[q][k] = s * pk + c * qk;
+						}
+						for (int k = 0; k < 3; k++) {
+							double kp = v[k][p], kq = v[k][q];
+							v[k][p] = c * kp - s * kq;
+							v[k][q] = s * kp + c * kq;
+						}
+					}
+			}
+		}
+
+		// Qef sums the planes (point and normal of a surface crossing) a
+		// vertex should lie on, as normal equations.
+		struct Qef
+		{
+			double A[6]; // xx, xy, xz, yy, yz, zz
+			double B[3];
+			double C;
+			double Mass[3];
+			int Count;
+
+			Qef()
+			{
+				memset(this, 0, sizeof(*this));
+			}
+
+			void Add(const float* p, const float* n)
+			{
+				double d = (double)n[0] * p[0] + (double)n[1] * p[1] + (double)n[2] * p[2];
+				A[0] += (double)n[0] * n[0];
+				A[1] += (double)n[0] * n[1];
+				A[2] += (double)n[0] * n[2];
+				A[3] += (double)n[1] * n[1];
+				A[4] += (double)n[1] * n[2];
+				A[5] += (double)n[2] * n[2];
+				for (int k = 0; k < 3; k++) {
+					B[k] += n[k] * d;
+					Mass[k] += p[k];
+				}
+				C += d * d;
+				Count++;
+			}
+
+			void Add(const Qef& q)
+			{
+				for (int k = 0; k < 6; k++)
+					A[k] += q.A[k];
+				for (int k = 0; k < 3; k++) {
+					B[k] += q.B[k];
+					Mass[k] += q.Mass[k];
+				}
+				C += q.C;
+				Count += q.Count;
+			}
+
+			// Error is the sum of the squared distances of x to the planes.
+			double Error(const double* x) const
+			{
+				double ax[3] = {
+					A[0] * x[0] + A[1] * x[1] + A[2] * x[2],
+					A[1] * x[0] + A[3] * x[1] + A[4] * x[2],
+					A[2] * x[0] + A[4] * x[1] + A[5] * x[2],
+				};
+				double e = C;
+				for (int k = 0; k < 3; k++)
+					e += x[k] * ax[k] - 2.0 * x[k] * B[k];
+				return std::max(e, 0.0);
+			}
+
+			void MassPoint(double* x) const
+			{
+				for (int k = 0; k < 3; k++)
+					x[k] = Mass[k] / Count;
+			}
+
+			// Solve finds the point closest to the planes. Along directions
+			// the planes barely constrain (flat or gently curved surfaces)
+			// it stays at the mass point, so only real corners and edges
+			// pull it away.
+			void Solve(double* x) const
+			{
+				double c[3];
+				MassPoint(c);
+				double a[3][3] = {
+					{ A[0], A[1], A[2] },
+					{ A[1], A[3], A[4] },
+					{ A[2], A[4], A[5] },
+				};
+				double r[3];
+				for (int k = 0; k < 3; k++)
+					r[k] = B[k] - (a[k][0] * c[0] + a[k][1] * c[1] + a[k][2] * c[2]);
+
+				double v[3][3];
+				Eigen(a, v);
+				double top = std::max(a[0][0], std::max(a[1][1], a[2][2]));
+				for (int k = 0; k < 3; k++)
+					x[k] = c[k];
+				for (int i = 0; i < 3; i++) {
+					double lambda = a[i][i];
+					if (lambda <= 0.1 * top || lambda <= 1e-9)
+						continue;
+					double d = (v[0][i] * r[0] + v[1][i] * r[1] + v[2][i] * r[2]) / lambda;
+					for (int k = 0; k < 3; k++)
+						x[k] += d * v[k][i];
+				}
+			}
+		};
+
+		// Lattice is the lattice of MarchingCubes: the grid's cell centers
+		// with a layer of empty samples around them.
+		struct Lattice
+		{
+			float Min[3]; // lattice point 0
+			float Pitch;
+			int Size[3];  // the model is sampled at points 1..Size
+			float BoxMin[3], BoxMax[3];
+
+			inline float Position(int axis, int i) const { return Min[axis] + i * Pitch; }
+
+			inline bool InBox(float x, float y, float z) const
+			{
+				return x >= BoxMin[0] && x <= BoxMax[0] && y >= BoxMin[1] && y <= BoxMax[1] && z >= BoxMin[2] && z <= BoxMax[2];
+			}
+		};
+
+		// BrickMesh is one material's octree below a brick node and the
+		// vertices of its leaves.
+		struct BrickMesh
+		{
+			std::vector<Node> Pool; // Pool[0] is the brick node itself
+			std::vector<float> Positions;
+			std::vector<uint32_t> Triangles;
+			std::vector<uint32_t> Tunnels; // the vertices of cells with a tunnel
+			uint32_t Offset; // of the first vertex in the whole mesh
+		};
+
+		// BrickBuilder builds the octrees of bricks, one per material, from
+		// a single sampling pass. Use one per thread.
+		class BrickBuilder
+		{
+		public:
+			BrickBuilder(const Model& model, const Lattice& lattice, float iso, float tolerance)
+				: m_lattice(lattice)
+				, m_iso(iso)
+				, m_tolerance2((double)tolerance * tolerance)
+				, m_materials((int)model.Materials.size())
+				, m_batch(model.Code)
+				, m_interval(model.Code)
+				, m_gradient(model)
+				, m_samples((size_t)m_materials * BlockPoints * BlockPoints * BlockPoints)
+			{
+			}
+
+			// Build builds the brick at lattice point origin. The brick
+			// node of material m goes to roots[m] and the nodes below it to
+			// meshes[m], which stays empty if there are none. Returns false
+			// if a loop ran away.
+			bool Build(const int* origin, Node* roots, std::unique_ptr<BrickMesh>* meshes)
+			{
+				int32_t index[16];
+				for (int m = 0; m < m_materials; m++) {
+					m_meshes[m] = new BrickMesh();
+					m_meshes[m]->Pool.push_back(Leaf(BrickLevel, 0));
+					m_meshes[m]->Offset = 0;
+					m_qefs[m].clear();
+					meshes[m].reset(m_meshes[m]);
+					index[m] = 0;
+				}
+				if (!Split((1u << m_materials) - 1, index, BrickLevel, origin))
+					return false;
+
+				for (int m = 0; m < m_materials; m++) {
+					std::vector<Node>& pool = m_meshes[m]->Pool;
+					for (Node& node : pool)
+						node.Child = node.First >= 0 ? &pool[node.First] : nullptr;
+					roots[m] = pool[0];
+					if (pool.size() == 1 && m_meshes[m]->Positions.empty())
+						meshes[m].reset();
+				}
+				return true;
+			}
+
+		private:
+			struct Crossing
+			{
+				int Material, Axis;
+				int Point[3]; // lattice point at the lower end of the edge
+				bool LowInside;
+				float P[3], N[3];
+			};
+
+			// a search for the surface along a segment of the lattice axis
+			// next to a crossing, for its normal
+			struct Probe
+			{
+				int Crossing, Side;
+				float Start[3];
+				bool LowInside;
+				float Lo, Hi;
+			};
+
+			std::vector<Node>& Pool(int m) { return m_meshes[m]->Pool; }
+
+			bool IsReal(const int* origin, int size) const
+			{
+				for (int a = 0; a < 3; a++)
+					if (origin[a] < 1 || origin[a] + size > m_lattice.Size[a])
+						return false;
+				return true;
+			}
+
+			bool Split(uint32_t mask, int32_t* index, int level, const int* origin)
+			{
+				int size = 1 << level;
+				// boxes that reach into the empty layer are not bounded: the
+				// model does not have to be 0 there
+				if (level > 0 && IsReal(origin, size)) {
+					float lo[3], hi[3];
+					for (int a = 0; a < 3; a++) {
+						lo[a] = m_lattice.Position(a, origin[a]);
+						hi[a] = m_lattice.Position(a, origin[a] + size);
+					}
+					Interval bounds[16];
+					if (m_interval.Evaluate(lo, hi, bounds))
+						for (int m = 0; m < m_materials; m++) {
+							if (!(mask & (1u << m)))
+								continue;
+							if (bounds[m].Lo >= m_iso)
+								Pool(m)[index[m]] = Leaf(level, 0xff);
+							else if (bounds[m].Hi < m_iso)
+								Pool(m)[index[m]] = Leaf(level, 0);
+							else
+								continue;
+							mask &= ~(1u << m);
+						}
+				}
+				if (!mask)
+					return true;
+				if (level <= SampleLevel)
+					return SampleBlock(mask, index, level, origin);
+
+				int32_t first[16];
+				for (int m = 0; m < m_materials; m++)
+					if (mask & (1u << m)) {
+						first[m] = (int32_t)Pool(m).size();
+						Pool(m)[index[m]].First = first[m];
+						Pool(m).resize(first[m] + 8, Leaf(level - 1, 0));
+					}
+				int half = size / 2;
+				for (int c = 0; c < 8; c++) {
+					int32_t child[16];
+					for (int m = 0; m < m_materials; m++)
+						child[m] = (mask & (1u << m)) ? first[m] + c : -1;
+					int at[3] = { origin[0] + (c & 1) * half, origin[1] + ((c >> 1) & 1) * half, origin[2] + ((c >> 2) & 1) * half };
+					if (!Split(mask, child, level - 1, at))
+						return false;
+				}
+				for (int m = 0; m < m_materials; m++)
+					if (mask & (1u << m))
+						Merge(m, index[m], level, origin);
+				return true;
+			}
+
+			// Evaluate samples the points in m_x, m_y, m_z into m_values;
+			// outside the bounding box there is no material
+			bool Evaluate(size_t count)
+			{
+				m_values.resize(m_materials * count);
+				if (!m_batch.Evaluate(m_x.data(), m_y.data(), m_z.data(), count, m_values.data()))
+					return false;
+				for (size_t i = 0; i < count; i++)
+					if (!m_lattice.InBox(m_x[i], m_y[i], m_z[i]))
+						for (int m = 0; m < m_materials; m++)
+							m_values[m * count + i] = 0.0f;
+				return true;
+			}
+
+			void Resize(size_t count)
+			{
+				m_x.resize(count);
+				m_y.resize(count);
+				m_z.resize(count);
+			}
+
+			inline int PointIndex(int x, int y, int z, int n) const { return (z * n + y) * n + x; }
+
+			bool SampleBlock(uint32_t mask, int32_t* index, int level, const int* origin)
+			{
+				int n = (1 << level) + 1, points = n * n * n;
+				memcpy(m_block, origin, sizeof(m_block));
+				m_blockPoints = n;
+
+				// the points of the empty layer (and beyond) are not sampled
+				m_real.clear();
+				for (int z = 0; z < n; z++)
+					for (int y = 0; y < n; y++)
+						for (int x = 0; x < n; x++) {
+							int p[3] = { origin[0] + x, origin[1] + y, origin[2] + z };
+							bool real = true;
+							for (int a = 0; a < 3; a++)
+								real = real && p[a] >= 1 && p[a] <= m_lattice.Size[a];
+							if (real)
+								m_real.push_back(PointIndex(x, y, z, n));
+						}
+				Resize(m_real.size());
+				for (size_t i = 0; i < m_real.size(); i++) {
+					int p = m_real[i];
+					m_x[i] = m_lattice.Position(0, origin[0] + p % n);
+					m_y[i] = m_lattice.Position(1, origin[1] + (p / n) % n);
+					m_z[i] = m_lattice.Position(2, origin[2] + p / (n * n));
+				}
+				if (!Evaluate(m_real.size()))
+					return false;
+				std::fill(m_samples.begin(), m_samples.end(), 0.0f);
+				for (int m = 0; m < m_materials; m++)
+					for (size_t i = 0; i < m_real.size(); i++)
+						m_samples[m * points + m_real[i]] = m_values[m * m_real.size() + i];
+
+				// the edges the surfaces cross
+				m_crossings.clear();
+				m_edges.assign((size_t)m_materials * 3 * points, -1);
+				for (int m = 0; m < m_materials; m++) {
+					if (!(mask & (1u << m)))
+						continue;
+					const float* samples = m_samples.data() + m * points;
+					for (int z = 0; z < n; z++)
+						for (int y = 0; y < n; y++)
+							for (int x = 0; x < n; x++) {
+								int p = PointIndex(x, y, z, n);
+								bool inside = samples[p] >= m_iso;
+								int local[3] = { x, y, z };
+								for (int a = 0; a < 3; a++) {
+									if (local[a] + 1 >= n)
+										continue;
+									int q = p + (a == 0 ? 1 : a == 1 ? n : n * n);
+									if ((samples[q] >= m_iso) == inside)
+										continue;
+									m_edges[(size_t)m * 3 * points + p * 3 + a] = (int32_t)m_crossings.size();
+									Crossing c;
+									c.Material = m;
+									c.Axis = a;
+									c.Point[0] = origin[0] + x;
+									c.Point[1] = origin[1] + y;
+									c.Point[2] = origin[2] + z;
+									c.LowInside = inside;
+									m_crossings.push_back(c);
+								}
+							}
+				}
+				if (!Hermite())
+					return false;
+
+				for (int m = 0; m < m_materials; m++)
+					if (mask & (1u << m)) {
+						int local[3] = { 0, 0, 0 };
+						Cells(m, index[m], level, local);
+					}
+				return true;
+			}
+
+			// Bisect finds where the surface crosses count segments of one
+			// pitch along the lattice: segment i starts at start(i), runs
+			// along axis(i) and its low end is inside(i). lo and hi narrow
+			// down the crossing as fractions of the segment.
+			template <typename Start, typename Axis, typename Material, typename Inside>
+			bool Bisect(size_t count, Start start, Axis axis, Material material, Inside inside, std::vector<float>& lo, std::vector<float>& hi)
+			{
+				lo.assign(count, 0.0f);
+				hi.assign(count, 1.0f);
+				Resize(count);
+				for (int it = 0; it < Bisections; it++) {
+					for (size_t i = 0; i < count; i++) {
+						const float* s = start(i);
+						float p[3] = { s[0], s[1], s[2] };
+						p[axis(i)] += 0.5f * (lo[i] + hi[i]) * m_lattice.Pitch;
+						m_x[i] = p[0];
+						m_y[i] = p[1];
+						m_z[i] = p[2];
+					}
+					if (!Evaluate(count))
+						return false;
+					for (size_t i = 0; i < count; i++) {
+						float t = 0.5f * (lo[i] + hi[i]);
+						if ((m_values[material(i) * count + i] >= m_iso) == inside(i))
+							lo[i] = t;
+						else
+							hi[i] = t;
+					}
+				}
+				return true;
+			}
+
+			// Hermite locates the crossings and finds the surface normal at
+			// each: from the gradient, or where the material is a step, from
+			// the crossings of two neighbouring segments
+			bool Hermite()
+			{
+				size_t count = m_crossings.size();
+				if (count == 0)
+					return true;
+
+				m_starts.resize(3 * count);
+				for (size_t i = 0; i < count; i++)
+					for (int a = 0; a < 3; a++)
+						m_starts[3 * i + a] = m_lattice.Position(a, m_crossings[i].Point[a]);
+				bool ok = Bisect(count,
+					[this](size_t i) { return &m_starts[3 * i]; },
+					[this](size_t i) { return m_crossings[i].Axis; },
+					[this](size_t i) { return m_crossings[i].Material; },
+					[this](size_t i) { return m_crossings[i].LowInside; },
+					m_lo, m_hi);
+				if (!ok)
+					return false;
+				for (size_t i = 0; i < count; i++) {
+					Crossing& c = m_crossings[i];
+					for (int a = 0; a < 3; a++)
+						c.P[a] = m_starts[3 * i + a];
+					c.P[c.Axis] += 0.5f * (m_lo[i] + m_hi[i]) * m_lattice.Pitch;
+					m_x[i] = c.P[0];
+					m_y[i] = c.P[1];
+					m_z[i] = c.P[2];
+				}
+
+				m_values.resize(m_materials * count);
+				m_gradients.resize(3 * m_materials * count);
+				if (!m_gradient.Evaluate(m_x.data(), m_y.data(), m_z.data(), count, m_values.data(), m_gradients.data()))
+					return false;
+				// where the material steps, the crossings on the parallel edges
+				// on both sides give a tangent if they are in line; near edges
+				// and corners of the surface, segments a quarter pitch away are
+				// probed instead
+				m_tangents.resize(6 * count);
+				m_found.assign(count, 0);
+				m_probes.clear();
+				for (size_t i = 0; i < count; i++) {
+					Crossing& c = m_crossings[i];
+					const float* g = &m_gradients[3 * (c.Material * count + i)];
+					float length = std::sqrt(g[0] * g[0] + g[1] * g[1] + g[2] * g[2]);
+					if (length > 1e-6f / m_lattice.Pitch && std::isfinite(length)) {
+						for (int a = 0; a < 3; a++)
+							c.N[a] = -g[a] / length;
+						m_found[i] = HasNormal;
+						continue;
+					}
+					for (int side = 0; side < 2; side++) {
+						int axis = (c.Axis + 1 + side) % 3;
+						if (Tangent(c, axis, &m_tangents[6 * i + 3 * side])) {
+							m_found[i] |= 1 << side;
+							continue;
+						}
+						for (int sign = 1; sign >= -1; sign -= 2) {
+							Probe probe;
+							probe.Crossing = (int)i;
+							probe.Side = side;
+							for (int a = 0; a < 3; a++)
+								probe.Start[a] = m_lattice.Position(a, c.Point[a]);
+							probe.Start[axis] += sign * 0.25f * m_lattice.Pitch;
+							m_probes.push_back(probe);
+						}
+					}
+				}
+
+				if (!m_probes.empty()) {
+					// keep the first probe on each side whose segment the surface crosses
+					size_t probes = m_probes.size();
+					Resize(2 * probes);
+					for (size_t i = 0; i < probes; i++) {
+						const Probe& probe = m_probes[i];
+						int axis = m_crossings[probe.Crossing].Axis;
+						for (int end = 0; end < 2; end++) {
+							float p[3] = { probe.Start[0], probe.Start[1], probe.Start[2] };
+							p[axis] += end * m_lattice.Pitch;
+							m_x[2 * i + end] = p[0];
+							m_y[2 * i + end] = p[1];
+							m_z[2 * i + end] = p[2];
+						}
+					}
+					if (!Evaluate(2 * probes))
+						return false;
+					size_t kept = 0;
+					for (size_t i = 0; i < probes; i++) {
+						Probe probe = m_probes[i];
+						const float* values = &m_values[m_crossings[probe.Crossing].Material * 2 * probes];
+						bool low = values[2 * i] >= m_iso, high = values[2 * i + 1] >= m_iso;
+						if (low == high || (m_found[probe.Crossing] & (1 << probe.Side)))
+							continue;
+						m_found[probe.Crossing] |= 1 << probe.Side;
+						probe.LowInside = low;
+						m_probes[kept++] = probe;
+					}
+					m_probes.resize(kept);
+					ok = Bisect(kept,
+						[this](size_t i) { return m_probes[i].Start; },
+						[this](size_t i) { return m_crossings[m_probes[i].Crossing].Axis; },
+						[this](size_t i) { return m_crossings[m_probes[i].Crossing].Material; },
+						[this](size_t i) { return m_probes[i].LowInside; },
+						m_lo, m_hi);
+					if (!ok)
+						return false;
+					for (size_t i = 0; i < kept; i++) {
+						const Probe& probe = m_probes[i];
+						const Crossing& c = m_crossings[probe.Crossing];
+						float* t = &m_tangents[6 * probe.Crossing + 3 * probe.Side];
+						for (int a = 0; a < 3; a++)
+							t[a] = probe.Start[a] - c.P[a];
+						t[c.Axis] += 0.5f * (m_lo[i] + m_hi[i]) * m_lattice.Pitch;
+					}
+				}
+
+				for (size_t i = 0; i < count; i++)
+					if (!(m_found[i] & HasNormal))
+						Normal(m_crossings[i], &m_tangents[6 * i], m_found[i]);
+				return true;
+			}
+
+			// Tangent sets t to the direction from the crossing on the
+			// parallel edge one step down axis to the one a step up, if both
+			// are in the block and in line with c
+			bool Tangent(const Crossing& c, int axis, float* t) const
+			{
+				const Crossing* below = Neighbour(c, axis, -1);
+				const Crossing* above = Neighbour(c, axis, 1);
+				if (!below || !above)
+					return false;
+				float down[3], up[3];
+				for (int a = 0; a < 3; a++) {
+					down[a] = c.P[a] - below->P[a];
+					up[a] = above->P[a] - c.P[a];
+				}
+				float dot = down[0] * up[0] + down[1] * up[1] + down[2] * up[2];
+				float lengths = (down[0] * down[0] + down[1] * down[1] + down[2] * down[2]) * (up[0] * up[0] + up[1] * up[1] + up[2] * up[2]);
+				if (!(dot > 0.0f && dot * dot > 0.97f * lengths))
+					return false;
+				for (int a = 0; a < 3; a++)
+					t[a] = above->P[a] - below->P[a];
+				return true;
+			}
+
+			// Neighbour finds the crossing on the parallel edge a step along
+			// axis, or the edge before or after that one if the surface is
+			// tilted
+			const Crossing* Neighbour(const Crossing& c, int axis, int step) const
+			{
+				int n = m_blockPoints;
+				const int32_t* edges = m_edges.data() + (size_t)c.Material * 3 * n * n * n;
+				for (int shift : { 0, -1, 1 }) {
+					int local[3];
+					for (int a = 0; a < 3; a++)
+						local[a] = c.Point[a] - m_block[a];
+					local[axis] += step;
+					local[c.Axis] += shift;
+					if (local[axis] < 0 || local[axis] >= n || local[c.Axis] < 0 || local[c.Axis] + 1 >= n)
+						continue;
+					int32_t crossing = edges[PointIndex(local[0], local[1], local[2], n) * 3 + c.Axis];
+					if (crossing >= 0)
+						return &m_crossings[crossing];
+				}
+				return nullptr;
+			}
+
+			// Normal sets the normal of a crossing from the tangents found
+			// (bit side of found), pointing out of the material
+			void Normal(Crossing& c, const float* tangents, int found)
+			{
+				float axes[2][3] = {};
+				axes[0][(c.Axis + 1) % 3] = 1.0f;
+				axes[1][(c.Axis + 2) % 3] = 1.0f;
+				const float* u = (found & 1) ? tangents : axes[0];
+				const float* v = (found & 2) ? tangents + 3 : axes[1];
+				float n[3] = { u[1] * v[2] - u[2] * v[1], u[2] * v[0] - u[0] * v[2], u[0] * v[1] - u[1] * v[0] };
+				float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+				if (!(length > 0.0f) || n[c.Axis] == 0.0f) {
+					n[0] = n[1] = n[2] = 0.0f;
+					n[c.Axis] = 1.0f;
+					length = 1.0f;
+				}
+				float sign = ((n[c.Axis] > 0.0f) == c.LowInside) ? 1.0f : -1.0f;
+				for (int a = 0; a < 3; a++)
+					c.N[a] = sign * n[a] / length;
+			}
+
+			int32_t AddVertex(int m, const Qef& qef, const int* origin, int size)
+			{
+				double x[3];
+				qef.Solve(x);
+				if (!Contains(x, origin, size))
+					qef.MassPoint(x);
+				BrickMesh& mesh = *m_meshes[m];
+				int32_t vertex = (int32_t)(mesh.Positions.size() / 3);
+				for (int a = 0; a < 3; a++)
+					mesh.Positions.push_back((float)x[a]);
+				m_qefs[m].push_back(qef);
+				return vertex;
+			}
+
+			bool Contains(const double* x, const int* origin, int size) const
+			{
+				for (int a = 0; a < 3; a++)
+					if (x[a] < m_lattice.Position(a, origin[a]) || x[a] > m_lattice.Position(a, origin[a] + size))
+						return false;
+				return true;
+			}
+
+			// Cells builds the nodes of a sampled block from its samples
+			void Cells(int m, int32_t index, int level, const int* local)
+			{
+				int n = m_blockPoints, points = n * n * n;
+				int origin[3] = { m_block[0] + local[0], m_block[1] + local[1], m_block[2] + local[2] };
+				if (level == 0) {
+					const float* samples = m_samples.data() + m * points;
+					uint8_t signs = 0;
+					for (int c = 0; c < 8; c++) {
+						int p = PointIndex(local[0] + (c & 1), local[1] + ((c >> 1) & 1), local[2] + ((c >> 2) & 1), n);
+						signs |= (samples[p] >= m_iso) << c;
+					}
+					Node node = Leaf(0, signs);
+					if (signs != 0 && signs != 0xff) {
+						const Patches& patches = CellPatches();
+						Qef qefs[4];
+						const int32_t* edges = m_edges.data() + (size_t)m * 3 * points;
+						for (int a = 0; a < 3; a++)
+							for (int r = 0; r < 4; r++) {
+								int at[3] = { local[0], local[1], local[2] };
+								at[a == 0 ? 1 : 0] += r & 1;
+								at[a == 2 ? 1 : 2] += r >> 1;
+								int32_t crossing = edges[PointIndex(at[0], at[1], at[2], n) * 3 + a];
+								if (crossing >= 0)
+									qefs[patches.Patch[signs][a * 4 + r]].Add(m_crossings[crossing].P, m_crossings[crossing].N);
+							}
+						node.Vertex = AddVertex(m, qefs[0], origin, 1);
+						for (int p = 1; p < patches.Count[signs]; p++)
+							AddVertex(m, qefs[p], origin, 1);
+						if (patches.Tunnel[signs])
+							for (int p = 0; p < patches.Count[signs]; p++)
+								m_meshes[m]->Tunnels.push_back((uint32_t)node.Vertex + p);
+					}
+					Pool(m)[index] = node;
+					return;
+				}
+
+				int32_t first = (int32_t)Pool(m).size();
+				Pool(m)[index].First = first;
+				Pool(m).resize(first + 8, Leaf(level - 1, 0));
+				int half = 1 << (level - 1);
+				for (int c = 0; c < 8; c++) {
+					int at[3] = { local[0] + (c & 1) * half, local[1] + ((c >> 1) & 1) * half, local[2] + ((c >> 2) & 1) * half };
+					Cells(m, first + c, level - 1, at);
+				}
+				Merge(m, index, level, origin);
+			}
+
+			// Merge turns a node whose children are all leaves into a leaf if
+			// one vertex fits their planes within the tolerance and that
+			// does not change the topology of the surface
+			void Merge(int m, int32_t index, int level, const int* origin)
+			{
+				std::vector<Node>& pool = Pool(m);
+				int32_t first = pool[index].First;
+				uint8_t signs = 0;
+				int32_t lowest = -1;
+				bool same = true;
+				for (int c = 0; c < 8; c++) {
+					const Node& child = pool[first + c];
+					if (child.First >= 0)
+						return;
+					signs |= ((child.Signs >> c) & 1) << c;
+					same = same && child.Signs == pool[first].Signs;
+					if (child.Vertex >= 0 && (lowest < 0 || child.Vertex < lowest))
+						lowest = child.Vertex;
+				}
+
+				Node node = Leaf(level, signs);
+				if (lowest < 0) {
+					if (!same || (signs != 0 && signs != 0xff))
+						return;
+				} else {
+					// the children's vertices are the last ones added
+					Qef qef;
+					for (size_t v = lowest; v < m_qefs[m].size(); v++)
+						qef.Add(m_qefs[m][v]);
+					if (!Manifold(&pool[first], signs))
+						return;
+					double x[3];
+					qef.Solve(x);
+					if (!Contains(x, origin, 1 << level) || qef.Error(x) > m_tolerance2)
+						return;
+					m_meshes[m]->Positions.resize(3 * (size_t)lowest);
+					m_qefs[m].resize(lowest);
+					node.Vertex = AddVertex(m, qef, origin, 1 << level);
+				}
+				pool.resize(first);
+				pool[index] = node;
+			}
+
+			// Manifold is the topological safety test of Ju et al.: the
+			// children and the merged cell each hold a single patch without
+			// a tunnel, and the sign in the middle of every edge, face and
+			// of the cell itself is that of one of the corners around it, so
+			// no part of the surface is lost in the merge
+			static bool Manifold(const Node* children, uint8_t signs)
+			{
+				const Patches& patches = CellPatches();
+				if (patches.Count[signs] > 1 || patches.Tunnel[signs])
+					return false;
+				for (int c = 0; c < 8; c++)
+					if (patches.Count[children[c].Signs] > 1 || patches.Tunnel[children[c].Signs])
+						return false;
+				// the 27 corners of the children, 0..2 on each axis
+				auto sign = [&](int x, int y, int z) {
+					int c = std::min(x, 1) | (std::min(y, 1) << 1) | (std::min(z, 1) << 2);
+					int corner = (x - std::min(x, 1)) | ((y - std::min(y, 1)) << 1) | ((z - std::min(z, 1)) << 2);
+					return (children[c].Signs >> corner) & 1;
+				};
+				for (int p = 0; p < 27; p++) {
+					int at[3] = { p % 3, (p / 3) % 3, p / 9 };
+					if (at[0] != 1 && at[1] != 1 && at[2] != 1)
+						continue;
+					// the corners of the merged cell around the point
+					bool found = false;
+					for (int c = 0; c < 8 && !found; c++) {
+						int corner[3];
+						bool around = true;
+						for (int a = 0; a < 3; a++) {
+							int bit = (c >> a) & 1;
+							around = around && (at[a] == 1 || at[a] == 2 * bit);
+							corner[a] = at[a] == 1 ? 2 * bit : at[a];
+						}
+						found = around && sign(corner[0], corner[1], corner[2]) == sign(at[0], at[1], at[2]);
+					}
+					if (!found)
+						return false;
+				}
+				return true;
+			}
+
+			const Lattice& m_lattice;
+			float m_iso;
+			double m_tolerance2;
+			int m_materials;
+			BatchEvaluator m_batch;
+			IntervalEvaluator m_interval;
+			GradientEvaluator m_gradient;
+
+			BrickMesh* m_meshes[16];
+			std::vector<Qef> m_qefs[16]; // per vertex of the brick being built
+
+			// the sampled block
+			int m_block[3];
+			int m_blockPoints;
+			std::vector<float> m_samples;  // material * points + point
+			std::vector<int32_t> m_edges;  // (material * points + point) * 3 + axis: crossing or -1
+			std::vector<int> m_real;
+			std::vector<Crossing> m_crossings;
+			std::vector<Probe> m_probes;
+
+			std::vector<float> m_tangents; // two per crossing
+			std::vector<uint8_t> m_found;  // per crossing: the tangents found, or HasNormal
+
+			std::vector<float> m_x, m_y, m_z, m_values, m_gradients, m_starts, m_lo, m_hi;
+		};
+
+		// Contour implements the contouring procedures of Ju et al.: every
+		// minimal edge the surface crosses gets a quad joining the vertices
+		// of the four leaves around it.
+		class Contour
+		{
+		public:
+			// Cells of level skip are not entered (their insides are done
+			// separately); -1 enters all.
+			Contour(std::vector<uint32_t>& triangles, int skip)
+				: m_triangles(triangles)
+				, m_skip(skip)
+			{
+			}
+
+			void Cell(const Node* n)
+			{
+				if (!n->Child || n->Level == m_skip)
+					return;
+				for (int c = 0; c < 8; c++)
+					Cell(n->Child + c);
+				for (int a = 0; a < 3; a++) {
+					int b = (a + 1) % 3, c = (a + 2) % 3;
+					for (int k = 0; k < 4; k++) {
+						int low = ((k & 1) << b) | ((k >> 1) << c);
+						Face(n->Child + low, n->Child + (low | (1 << a)), a);
+					}
+				}
+				for (int d = 0; d < 3; d++) {
+					int e1 = (d + 1) % 3, e2 = (d + 2) % 3;
+					for (int s = 0; s < 2; s++) {
+						const Node* around[4];
+						for (int k = 0; k < 4; k++)
+							around[k] = n->Child + ((s << d) | ((k & 1) << e1) | ((k >> 1) << e2));
+						Edge(around, d);
+					}
+				}
+			}
+
+		private:
+			static const Node* Child(const Node* n, int c) { return n->Child ? n->Child + c : n; }
+
+			// Face handles the face between n0 and n1, n0 on the low side of axis a
+			void Face(const Node* n0, const Node* n1, int a)
+			{
+				if (!n0->Child && !n1->Child)
+					return;
+				int b = (a + 1) % 3, c = (a + 2) % 3;
+				for (int k = 0; k < 4; k++) {
+					int face = ((k & 1) << b) | ((k >> 1) << c);
+					Face(Child(n0, face | (1 << a)), Child(n1, face), a);
+				}
+				for (int d : { b, c }) {
+					int e = d == b ? c : b;
+					int e1 = (d + 1) % 3;
+					for (int s = 0; s < 2; s++) {
+						const Node* around[4];
+						for (int k = 0; k < 4; k++) {
+							int p = k & 1, q = k >> 1;
+							int pa = e1 == a ? p : q, pe = e1 == a ? q : p;
+							around[k] = Child(pa ? n1 : n0, ((1 - pa) << a) | (pe << e) | (s << d));
+						}
+						Edge(around, d);
+					}
+				}
+			}
+
+			// Edge handles the edge along axis d between four cells, n[p + 2q]
+			// being on the p side of axis d + 1 and the q side of d + 2
+			void Edge(const Node* const* n, int d)
+			{
+				int e1 = (d + 1) % 3, e2 = (d + 2) % 3;
+				if (!n[0]->Child && !n[1]->Child && !n[2]->Child && !n[3]->Child) {
+					Quad(n, d);
+					return;
+				}
+				for (int s = 0; s < 2; s++) {
+					const Node* around[4];
+					for (int k = 0; k < 4; k++)
+						around[k] = Child(n[k], (s << d) | ((1 - (k & 1)) << e1) | ((1 - (k >> 1)) << e2));
+					Edge(around, d);
+				}
+			}
+
+			void Quad(const Node* const* n, int d)
+			{
+				// the edge belongs to the smallest cell
+				int smallest = 0;
+				for (int k = 1; k < 4; k++)
+					if (n[k]->Level < n[smallest]->Level)
+						smallest = k;
+				int e1 = (d + 1) % 3, e2 = (d + 2) % 3;
+				int corner = ((1 - (smallest & 1)) << e1) | ((1 - (smallest >> 1)) << e2);
+				bool low = (n[smallest]->Signs >> corner) & 1;
+				bool high = (n[smallest]->Signs >> (corner | (1 << d))) & 1;
+				if (low == high)
+					return;
+				for (int k = 0; k < 4; k++)
+					if (n[k]->Vertex < 0)
+						return;
+
+				// counter-clockwise around d, facing out of the material; a
+				// cell with several patches gives the vertex of the edge's
+				const Patches& patches = CellPatches();
+				static const int up[4] = { 0, 1, 3, 2 }, down[4] = { 0, 2, 3, 1 };
+				const int* order = low ? up : down;
+				uint32_t v[4];
+				for (int k = 0; k < 4; k++) {
+					const Node* cell = n[order[k]];
+					v[k] = (uint32_t)cell->Vertex;
+					if (patches.Count[cell->Signs] > 1) {
+						int at = ((1 - (order[k] & 1)) << e1) | ((1 - (order[k] >> 1)) << e2);
+						v[k] += patches.Patch[cell->Signs][EdgeOf(at, at | (1 << d))];
+					}
+				}
+				Triangle(v[0], v[1], v[2]);
+				Triangle(v[0], v[2], v[3]);
+			}
+
+			void Triangle(uint32_t a, uint32_t b, uint32_t c)
+			{
+				if (a == b || b == c || a == c)
+					return;
+				m_triangles.push_back(a);
+				m_triangles.push_back(b);
+				m_triangles.push_back(c);
+			}
+
+			std::vector<uint32_t>& m_triangles;
+			int m_skip;
+		};
+
+		// SplitPinches gives every sheet of the surface that meets another
+		// at one of the tunnels' vertices a vertex of its own. Around such a
+		// vertex the triangles do not form one fan but several that touch
+		// at the neighbouring vertex on the other side of the tunnel; each
+		// fan after the first gets a copy of the vertex, and every copy is
+		// moved halfway to the middle of its fan's ring so that the sheets
+		// do not touch.
+		void SplitPinches(MeshPart& part, const std::vector<uint32_t>& tunnels)
+		{
+			if (tunnels.empty())
+				return;
+			std::vector<int32_t> slot(part.GetVertexCount(), -1);
+			for (size_t i = 0; i < tunnels.size(); i++)
+				slot[tunnels[i]] = (int32_t)i;
+			std::vector<std::vector<uint32_t>> fans(tunnels.size());
+			for (size_t t = 0; t < part.Triangles.size(); t++)
+				if (slot[part.Triangles[t]] >= 0)
+					fans[slot[part.Triangles[t]]].push_back((uint32_t)t);
+
+			// the triangles around a vertex as the edges of its ring, in order
+			struct Wedge
+			{
+				uint32_t Corner; // into Triangles
+				uint32_t A, B;
+			};
+			std::vector<Wedge> ring;
+			std::vector<int> cycle;
+			for (size_t i = 0; i < tunnels.size(); i++) {
+				uint32_t u = tunnels[i];
+				ring.clear();
+				for (uint32_t corner : fans[i]) {
+					uint32_t t = corner - corner % 3;
+					int k = corner % 3;
+					ring.push_back(Wedge{ corner, part.Triangles[t + (k + 1) % 3], part.Triangles[t + (k + 2) % 3] });
+				}
+				// a pinch is where the ring passes twice
+				uint32_t pinch = u;
+				for (size_t a = 0; a < ring.size() && pinch == u; a++)
+					for (size_t b = a + 1; b < ring.size(); b++)
+						if (ring[a].A == ring[b].A) {
+							pinch = ring[a].A;
+							break;
+						}
+				if (pinch == u)
+					continue;
+
+				// walk the fans from the pinch, closing each as soon as it can
+				cycle.assign(ring.size(), -1);
+				int fans = 0;
+				for (size_t start = 0; start < ring.size(); start++) {
+					if (cycle[start] >= 0 || ring[start].A != pinch)
+						continue;
+					size_t at = start;
+					while (true) {
+						cycle[at] = fans;
+						uint32_t b = ring[at].B;
+						if (b == ring[start].A)
+							break;
+						size_t next = ring.size();
+						for (size_t w = 0; w < ring.size() && next == ring.size(); w++)
+							if (cycle[w] < 0 && ring[w].A == b)
+								next = w;
+						if (next == ring.size())
+							break;
+						at = next;
+					}
+					fans++;
+				}
+				for (size_t w = 0; w < ring.size(); w++)
+					if (cycle[w] < 0)
+						cycle[w] = 0;
+				if (fans < 2)
+					continue;
+
+				float origin[3] = { part.Positions[3 * u], part.Positions[3 * u + 1], part.Positions[3 * u + 2] };
+				for (int f = 0; f < fans; f++) {
+					uint32_t vertex = f == 0 ? u : part.GetVertexCount();
+					double middle[3] = { 0.0, 0.0, 0.0 };
+					int count = 0;
+					for (size_t w = 0; w < ring.size(); w++)
+						if (cycle[w] == f) {
+							part.Triangles[ring[w].Corner] = vertex;
+							for (int a = 0; a < 3; a++)
+								middle[a] += part.Positions[3 * ring[w].A + a];
+							count++;
+						}
+					if (f > 0)
+						part.Positions.insert(part.Positions.end(), origin, origin + 3);
+					for (int a = 0; a < 3; a++)
+						part.Positions[3 * vertex + a] = 0.5f * (origin[a] + (float)(middle[a] / count));
+				}
+			}
+		}
+
+		// Morton interleaves the bits of brick coordinates, so that the
+		// eight children of a node are next to each other
+		size_t Morton(int x, int y, int z)
+		{
+			size_t code = 0;
+			for (int bit = 0; bit < 21; bit++)
+				code |= (size_t)((x >> bit) & 1) << (3 * bit) |
+					(size_t)((y >> bit) & 1) << (3 * bit + 1) |
+					(size_t)((z >> bit) & 1) << (3 * bit + 2);
+			return code;
+		}
+	}
+
+	bool DualContour(const Model& model, const MeshSettings& settings, const MeshConsumer& consume, std::string& err)
+	{
+		int materials = (int)model.Materials.size();
+		if (materials > 16) {
+			err = "too many materials";
+			return false;
+		}
+		if (!(settings.IsoLevel > 0.0f && settings.IsoLevel <= 1.0f)) {
+			err = "the iso level must be in (0, 1]";
+			return false;
+		}
+		if (settings.Source) {
+			err = "dual contouring evaluates the model; it cannot read voxels";
+			return false;
+		}
+		Grid grid;
+		if (!MakeGrid(model, settings.Pitch, 0.0f, grid, err))
+			return false;
+
+		Lattice lattice;
+		lattice.Pitch = grid.Pitch[0];
+		int bricks[3], levels = 0;
+		for (int a = 0; a < 3; a++) {
+			lattice.Min[a] = grid.Min[a] - 0.5f * lattice.Pitch;
+			lattice.Size[a] = grid.Size[a];
+			lattice.BoxMin[a] = model.Min[a];
+			lattice.BoxMax[a] = model.Max[a];
+			// the lattice has Size + 2 points, so Size + 1 cells
+			bricks[a] = (grid.Size[a] + 1 + (1 << BrickLevel) - 1) >> BrickLevel;
+			while ((1 << levels) < bricks[a])
+				levels++;
+		}
+		if (levels > 10) {
+			err = "the pitch is too small for the size of the model";
+			return false;
+		}
+		float tolerance = settings.Tolerance > 0.0f ? settings.Tolerance : 0.1f * lattice.Pitch;
+
+		// the nodes above the bricks, level by level, in Morton order;
+		// bricks outside the lattice stay empty leaves
+		size_t slots = (size_t)1 << (3 * levels);
+		std::vector<std::vector<std::vector<Node>>> tree(materials, std::vector<std::vector<Node>>(levels + 1));
+		for (int m = 0; m < materials; m++)
+			for (int t = 0; t <= levels; t++)
+				tree[m][t].assign(slots >> (3 * t), Leaf(BrickLevel + t, 0));
+		std::vector<std::unique_ptr<BrickMesh>> meshes(slots * materials);
+
+		std::vector<size_t> codes;
+		for (int z = 0; z < bricks[2]; z++)
+			for (int y = 0; y < bricks[1]; y++)
+				for (int x = 0; x < bricks[0]; x++)
+					codes.push_back(Morton(x, y, z));
+		std::sort(codes.begin(), codes.end());
+
+		ThreadPool pool(settings.Threads);
+		std::vector<std::unique_ptr<BrickBuilder>> builders(pool.GetThreadCount());
+		auto build = [&](int i, int, int w) {
+			if (!builders[w])
+				builders[w].reset(new BrickBuilder(model, lattice, settings.IsoLevel, tolerance));
+			size_t code = codes[i];
+			int origin[3] = { 0, 0, 0 };
+			for (int bit = 0; bit < levels; bit++)
+				for (int a = 0; a < 3; a++)
+					origin[a] |= (int)((code >> (3 * bit + a)) & 1) << bit;
+			for (int a = 0; a < 3; a++)
+				origin[a] <<= BrickLevel;
+			Node roots[16];
+			if (!builders[w]->Build(origin, roots, &meshes[code * materials]))
+				return false;
+			for (int m = 0; m < materials; m++)
+				tree[m][0][code] = roots[m];
+			return true;
+		};
+		auto progress = [&](int i, int) {
+			if (settings.Progress)
+				settings.Progress(i + 1, (int)codes.size());
+			return true;
+		};
+		bool ok = RunOrdered(pool, (int)codes.size(), 4 * pool.GetThreadCount(), build, progress);
+		if (!ok)
+			err = "a loop in the model did not terminate";
+		builders.clear();
+
+		for (int m = 0; m < materials && ok; m++) {
+			for (int t = 1; t <= levels; t++)
+				for (size_t i = 0; i < tree[m][t].size(); i++)
+					tree[m][t][i].Child = &tree[m][t - 1][8 * i];
+
+			// number the vertices brick by brick
+			uint64_t offset = 0;
+			for (size_t code : codes) {
+				BrickMesh* mesh = meshes[code * materials + m].get();
+				if (!mesh)
+					continue;
+				mesh->Offset = (uint32_t)offset;
+				for (Node& node : mesh->Pool)
+					if (node.Vertex >= 0)
+						node.Vertex += mesh->Offset;
+				for (uint32_t& vertex : mesh->Tunnels)
+					vertex += mesh->Offset;
+				Node& root = tree[m][0][code];
+				if (root.Vertex >= 0)
+					root.Vertex += mesh->Offset;
+				offset += mesh->Positions.size() / 3;
+				if (offset > 0xffffffffu) {
+					err = "too many vertices";
+					ok = false;
+					break;
+				}
+			}
+		}
+
+		// the insides of the bricks in parallel, then what joins them
+		if (ok) {
+			for (size_t code : codes)
+				pool.Submit([&, code](int) {
+					for (int m = 0; m < materials; m++) {
+						BrickMesh* mesh = meshes[code * materials + m].get();
+						if (mesh)
+							Contour(mesh->Triangles, -1).Cell(&tree[m][0][code]);
+					}
+				});
+			pool.Wait();
+		}
+
+		for (int m = 0; m < materials && ok; m++) {
+			MeshPart part;
+			std::vector<uint32_t> tunnels;
+			Contour(part.Triangles, BrickLevel).Cell(&tree[m][levels][0]);
+			for (size_t code : codes) {
+				std::unique_ptr<BrickMesh>& mesh = meshes[code * materials + m];
+				if (!mesh)
+					continue;
+				part.Positions.insert(part.Positions.end(), mesh->Positions.begin(), mesh->Positions.end());
+				part.Triangles.insert(part.Triangles.end(), mesh->Triangles.begin(), mesh->Triangles.end());
+				tunnels.insert(tunnels.end(), mesh->Tunnels.begin(), mesh->Tunnels.end());
+				mesh.reset();
+			}
+			SplitPinches(part, tunnels);
+			ok = consume(m, part);
+		}
+		return ok;
+	}
+}
@@ -0,0 +1,22 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "mesher.h"
+
+namespace irmf
+{
+	// DualContour meshes every material like MarchingCubes, on the same
+	// grid, but places a vertex per sheet of surface in a cell where the
+	// surface's tangent planes meet, so sharp edges and corners of CSG-like
+	// models are kept. The grid is an octree built in parallel, brick by
+	// brick: boxes the IntervalEvaluator proves to be on one side of the
+	// surface are not sampled, and cells whose planes are fitted within
+	// Tolerance by a single vertex are merged when that keeps the surface's
+	// topology, so flat regions take few triangles. The meshes are closed,
+	// manifold and consistently oriented.
+	// Surface normals come from the GradientEvaluator, or from probing the
+	// surface next to each crossing where the material is a step function.
+	// Each material's mesh is held in memory and passed to consume as a
+	// single part.
+	bool DualContour(const Model& model, const MeshSettings& settings, const MeshConsumer& consume, std::string& err);
+}
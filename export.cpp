@@ -0,0 +1,615 @@
+// irmf-export: samples an IRMF model on the CPU and writes it in a format
+// for printers and other tools, without SHADERed.
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include "bench.h"
+#include "contour.h"
+#include "dualcontour.h"
+#include "mesher.h"
+#include "model.h"
+#include "pipeline.h"
+#include "resin.h"
+#include "slicer.h"
+#include "threemf.h"
+#include "vdb.h"
+#include "voxelfile.h"
+#include "voxels.h"
+#include "voxelstore.h"
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+namespace
+{
+	void Usage()
+	{
+		fprintf(stderr,
+			"usage: irmf-export <format> <model.irmf> <output> [options]\n"
+			"\n"
+			"formats:\n"
+			"  slices            ZIP of 8-bit PNG slices, one directory per material\n"
+			"  dither            ZIP of 8-bit PNG slices assigning each pixel one material\n"
+			"  cli, svg          layer contours, CLI (micrometers) or SVG (a group per layer)\n"
+			"  stl, ply          mesh, one file per material\n"
+			"  3mf               3MF package with one object per material\n"
+			"  binvox            run-length encoded voxels, one file per material\n"
+			"  svx               ZIP of PNG density (and material) slices with a manifest\n"
+			"  cbddlp, photon    resin printer layers, 1-bit (needs --printer)\n"
+			"  ctb               resin printer layers, Chitubox v2 (needs --printer)\n"
+			"  voxelize          out-of-core voxel store for --store, then its volumes\n"
+			"  irmfvox           sparse voxel file for --store\n"
+			"  vdb               OpenVDB file with a float grid per material\n"
+			"  antialias         text report comparing the slices anti-aliasing modes\n"
+			"  benchmark         text report of the evaluators' speed on the model\n"
+			"  fanout            several of slices, stl, ply, binvox and volume statistics\n"
+			"                    from one sampling pass: <output>.zip, .stl, .binvox, .txt\n"
+			"\n"
+			"options:\n"
+			"  --pitch <size>    pixel or cell size, in model units (default 0.1)\n"
+			"  --layer <height>  slices, dither, contours: layer height (default: the pitch);\n"
+			"                    resin: in mm (default: the printer's)\n"
+			"  --iso <level>     meshes, contours, anti-aliasing: material value of the\n"
+			"                    surface (default 0.5)\n"
+			"  --method <mc|dc>  meshes: marching cubes, or dual contouring on an adaptive\n"
+			"                    octree, which keeps sharp edges (default mc)\n"
+			"  --decimate <e>    meshes: simplify while the surface moves about e cells on\n"
+			"                    average, and report how far it moved at most\n"
+			"  --threshold <v>   voxels: material value of a filled voxel (default 0.5)\n"
+			"  --tolerance <d>   dc, contours: how far merging cells or simplifying may move\n"
+			"                    the surface\n"
+			"                    (default: a tenth of the pitch)\n"
+			"  --antialias <m>   slices: none (material values), supersample (N x N samples\n"
+			"                    per pixel) or gradient (coverage from the gradient)\n"
+			"  --samples <n>     anti-aliasing: N (default 4)\n"
+			"  --refine <n>      slices: sample blocks of n x n pixels in full only near\n"
+			"                    edges, 0 for every pixel (default 32)\n"
+			"  --checkpoint <s>  slices: seconds between checkpoints that a killed export\n"
+			"                    resumes from when run again, 0 for none (default 60)\n"
+			"  --carry <f>       dither: share of the error passed on to the next layer,\n"
+			"                    in [0, 1); layers then dither a few rows apart, which\n"
+			"                    costs about 7%% (default 0)\n"
+			"  --outputs <list>  fanout: comma separated (default slices,stl,binvox,stats)\n"
+			"  --zip             vdb: zlib-compress the voxel values\n"
+			"  --printer <name>  resin: printer profile to use\n"
+			"  --printers <file> resin: JSON file of printer profiles (default printers.json)\n"
+			"  --store <file>    slices, dither, contours, mc meshes: read a voxelize store or an\n"
+			"                    .irmfvox\n"
+			"                    file instead of evaluating the model\n"
+			"  --memory <MB>     voxelize, --store: bricks kept mapped (default 256)\n"
+			"  --threads <n>     worker threads (default: one per hardware thread)\n"
+			"  --quiet           no progress output\n");
+	}
+
+	// PeakMemory returns the peak resident set size in MB, or 0 if unknown.
+	double PeakMemory()
+	{
+#ifdef _WIN32
+		return 0.0;
+#else
+		struct rusage usage;
+		if (getrusage(RUSAGE_SELF, &usage) != 0)
+			return 0.0;
+#ifdef __APPLE__
+		return usage.ru_maxrss / 1048576.0;
+#else
+		return usage.ru_maxrss / 1024.0;
+#endif
+#endif
+	}
+
+	// MaterialFilenames names one output per material: the output itself if
+	// there is only one, name_material.ext otherwise.
+	std::vector<std::string> MaterialFilenames(const std::string& output, const std::vector<std::string>& materials)
+	{
+		if (materials.size() == 1)
+			return { output };
+		size_t slash = output.find_last_of("/\\");
+		size_t dot = output.find_last_of('.');
+		if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+			dot = output.size();
+		std::vector<std::string> names;
+		for (const std::string& dir : irmf::MaterialDirectories(materials))
+			names.push_back(output.substr(0, dot) + "_" + dir + output.substr(dot));
+		return names;
+	}
+
+	// PrintVoxelStats writes what each material fills, with its bounds in
+	// model units.
+	void PrintVoxelStats(FILE* f, const irmf::Model& model, const irmf::Grid& grid, const std::vector<irmf::VoxelStats>& stats)
+	{
+		for (size_t m = 0; m < stats.size(); m++) {
+			fprintf(f, "%s: %llu voxels, volume %g", model.Materials[m].c_str(), (unsigned long long)stats[m].Voxels, stats[m].Volume);
+			if (stats[m].Voxels > 0)
+				fprintf(f, ", from (%g, %g, %g) to (%g, %g, %g)",
+					grid.Min[0] + stats[m].Min[0] * grid.Pitch[0], grid.Min[1] + stats[m].Min[1] * grid.Pitch[1], grid.Min[2] + stats[m].Min[2] * grid.Pitch[2],
+					grid.Min[0] + (stats[m].Max[0] + 1) * grid.Pitch[0], grid.Min[1] + (stats[m].Max[1] + 1) * grid.Pitch[1], grid.Min[2] + (stats[m].Max[2] + 1) * grid.Pitch[2]);
+			fprintf(f, "\n");
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 4) {
+		Usage();
+		return 2;
+	}
+	std::string format = argv[1], input = argv[2], output = argv[3];
+
+	float pitch = 0.1f, layer = 0.0f, iso = 0.5f, tolerance = 0.0f, threshold = 0.5f, decimate = 0.0f, carry = 0.0f;
+	std::string method = "mc", antialias = "none", outputs = "slices,stl,binvox,stats", printer, printers = "printers.json", storeFile;
+	size_t memory = 256;
+	double checkpoint = 60.0;
+	int threads = 0, samples = 4, refine = 32;
+	bool quiet = false, zip = false, checkpointSet = false;
+	for (int i = 4; i < argc; i++) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--pitch" && hasValue)
+			pitch = (float)atof(argv[++i]);
+		else if (arg == "--layer" && hasValue)
+			layer = (float)atof(argv[++i]);
+		else if (arg == "--iso" && hasValue)
+			iso = (float)atof(argv[++i]);
+		else if (arg == "--method" && hasValue)
+			method = argv[++i];
+		else if (arg == "--threshold" && hasValue)
+			threshold = (float)atof(argv[++i]);
+		else if (arg == "--decimate" && hasValue)
+			decimate = (float)atof(argv[++i]);
+		else if (arg == "--antialias" && hasValue)
+			antialias = argv[++i];
+		else if (arg == "--samples" && hasValue)
+			samples = atoi(argv[++i]);
+		else if (arg == "--outputs" && hasValue)
+			outputs = argv[++i];
+		else if (arg == "--refine" && hasValue)
+			refine = atoi(argv[++i]);
+		else if (arg == "--checkpoint" && hasValue) {
+			checkpoint = atof(argv[++i]);
+			checkpointSet = true;
+		}
+		else if (arg == "--carry" && hasValue)
+			carry = (float)atof(argv[++i]);
+		else if (arg == "--tolerance" && hasValue)
+			tolerance = (float)atof(argv[++i]);
+		else if (arg == "--printer" && hasValue)
+			printer = argv[++i];
+		else if (arg == "--printers" && hasValue)
+			printers = argv[++i];
+		else if (arg == "--store" && hasValue)
+			storeFile = argv[++i];
+		else if (arg == "--memory" && hasValue)
+			memory = (size_t)atoll(argv[++i]);
+		else if (arg == "--threads" && hasValue)
+			threads = atoi(argv[++i]);
+		else if (arg == "--zip")
+			zip = true;
+		else if (arg == "--quiet")
+			quiet = true;
+		else {
+			fprintf(stderr, "unknown option %s\n\n", arg.c_str());
+			Usage();
+			return 2;
+		}
+	}
+	if (format != "slices" && format != "dither" && format != "cli" && format != "svg" && format != "stl" && format != "ply" && format != "3mf"
+		&& format != "binvox" && format != "svx" && format != "cbddlp" && format != "photon" && format != "ctb"
+		&& format != "voxelize" && format != "irmfvox" && format != "vdb" && format != "antialias"
+		&& format != "benchmark" && format != "fanout") {
+		fprintf(stderr, "unknown format %s\n\n", format.c_str());
+		Usage();
+		return 2;
+	}
+	if (method != "mc" && method != "dc") {
+		fprintf(stderr, "unknown method %s\n\n", method.c_str());
+		Usage();
+		return 2;
+	}
+	if (antialias != "none" && antialias != "supersample" && antialias != "gradient") {
+		fprintf(stderr, "unknown anti-aliasing %s\n\n", antialias.c_str());
+		Usage();
+		return 2;
+	}
+	if (antialias != "none" && format != "slices") {
+		fprintf(stderr, "--antialias is for slices\n\n");
+		Usage();
+		return 2;
+	}
+	if (checkpointSet && format != "slices") {
+		fprintf(stderr, "--checkpoint is for slices; %s exports start over when run again\n\n", format.c_str());
+		Usage();
+		return 2;
+	}
+	if (samples < 1 || samples > 16) {
+		fprintf(stderr, "--samples must be from 1 to 16\n\n");
+		Usage();
+		return 2;
+	}
+
+	if (!storeFile.empty() && format != "slices" && format != "dither" && format != "cli" && format != "svg" && format != "stl" && format != "ply"
+		&& format != "3mf") {
+		fprintf(stderr, "--store is for slices, dither, contours and meshes\n\n");
+		Usage();
+		return 2;
+	}
+
+	std::string err;
+	irmf::Model model;
+	if (!irmf::LoadModelFile(input, model, err)) {
+		fprintf(stderr, "%s: %s\n", input.c_str(), err.c_str());
+		return 1;
+	}
+
+	irmf::VoxelStore store;
+	irmf::VoxelFile voxelFile;
+	irmf::VoxelSource* source = nullptr;
+	if (!storeFile.empty()) {
+		bool irmfvox = storeFile.size() > 8 && storeFile.compare(storeFile.size() - 8, 8, ".irmfvox") == 0;
+		if (irmfvox ? !voxelFile.Open(storeFile, err) : !store.Open(storeFile, memory << 20, err)) {
+			fprintf(stderr, "%s\n", err.c_str());
+			return 1;
+		}
+		source = irmfvox ? (irmf::VoxelSource*)&voxelFile : &store;
+	}
+
+	std::function<void(int, int)> progress;
+	if (!quiet)
+		progress = [](int done, int total) {
+			fprintf(stderr, "\r%d/%d", done, total);
+			if (done == total)
+				fprintf(stderr, "\n");
+		};
+
+	auto start = std::chrono::steady_clock::now();
+	auto elapsed = [&start]() {
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	};
+
+	if (format == "fanout") {
+		irmf::PipelineSettings settings;
+		settings.Pitch = pitch;
+		settings.LayerHeight = layer;
+		settings.Threads = threads;
+		settings.Progress = progress;
+		irmf::MeshSettings meshSettings;
+		meshSettings.IsoLevel = iso;
+		irmf::VoxelSettings voxelSettings;
+		voxelSettings.Threshold = threshold;
+		irmf::MeshStats meshStats;
+		std::vector<irmf::VoxelStats> voxelStats;
+		std::vector<std::unique_ptr<irmf::SlabSink>> sinks;
+		std::vector<std::string> written, names;
+		bool stats = false;
+		for (size_t at = 0; at <= outputs.size();) {
+			size_t comma = std::min(outputs.find(',', at), outputs.size());
+			std::string name = outputs.substr(at, comma - at);
+			at = comma + 1;
+			if (std::find(names.begin(), names.end(), name) != names.end())
+				name = "repeated";
+			names.push_back(name);
+			if (name == "slices") {
+				sinks.push_back(irmf::NewSliceSink(model, output + ".zip"));
+				written.push_back(output + ".zip");
+			} else if (name == "stl" || name == "ply") {
+				meshSettings.Format = name == "ply" ? irmf::MeshFormat::PLY : irmf::MeshFormat::STL;
+				std::vector<std::string> filenames = MaterialFilenames(output + "." + name, model.Materials);
+				sinks.push_back(irmf::NewMeshSink(meshSettings, filenames, meshStats));
+				written.insert(written.end(), filenames.begin(), filenames.end());
+			} else if (name == "binvox") {
+				std::vector<std::string> filenames = MaterialFilenames(output + ".binvox", model.Materials);
+				sinks.push_back(irmf::NewBinvoxSink(voxelSettings, filenames));
+				written.insert(written.end(), filenames.begin(), filenames.end());
+			} else if (name == "stats") {
+				sinks.push_back(irmf::NewStatsSink(voxelStats));
+				stats = true;
+			} else {
+				fprintf(stderr, "unknown or repeated output %s\n\n", name.c_str());
+				Usage();
+				return 2;
+			}
+		}
+		std::vector<irmf::SlabSink*> pointers;
+		for (const std::unique_ptr<irmf::SlabSink>& sink : sinks)
+			pointers.push_back(sink.get());
+		if (!irmf::RunPipeline(model, settings, pointers, err)) {
+			fprintf(stderr, "%s: %s\n", output.c_str(), err.c_str());
+			return 1;
+		}
+		if (stats) {
+			irmf::Grid grid;
+			irmf::MakeGrid(model, pitch, layer, grid, err);
+			std::string filename = output + ".txt";
+			FILE* f = fopen(filename.c_str(), "w");
+			if (f)
+				PrintVoxelStats(f, model, grid, voxelStats);
+			if (!f || fclose(f) != 0) {
+				fprintf(stderr, "%s: write failed\n", filename.c_str());
+				return 1;
+			}
+			written.push_back(filename);
+			if (!quiet)
+				PrintVoxelStats(stderr, model, grid, voxelStats);
+		}
+		if (!quiet) {
+			for (size_t m = 0; m < meshStats.Triangles.size(); m++)
+				fprintf(stderr, "%s: %llu triangles\n", model.Materials[m].c_str(), (unsigned long long)meshStats.Triangles[m]);
+			for (const std::string& filename : written)
+				fprintf(stderr, "wrote %s\n", filename.c_str());
+			fprintf(stderr, "in %.2f s, peak memory %.0f MB\n", elapsed(), PeakMemory());
+		}
+		return 0;
+	}
+
+	if (format == "voxelize") {
+		irmf::VoxelizeSettings settings;
+		settings.Pitch = pitch;
+		settings.LayerHeight = layer;
+		settings.Budget = memory << 20;
+		settings.Threads = threads;
+		settings.Progress = progress;
+		std::vector<irmf::VoxelStats> stats;
+		if (!irmf::Voxelize(model, settings, output, store, err) || !irmf::AnalyzeVoxels(store, threads, stats, err)
+			|| !store.Close(err)) {
+			fprintf(stderr, "%s: %s\n", output.c_str(), err.c_str());
+			return 1;
+		}
+		if (!quiet) {
+			const irmf::Grid& grid = store.GetGrid();
+			PrintVoxelStats(stderr, model, grid, stats);
+			fprintf(stderr, "wrote %s (%dx%dx%d) in %.2f s, peak memory %.0f MB (bricks %.0f MB)\n", output.c_str(),
+				grid.Size[0], grid.Size[1], grid.Size[2], elapsed(), PeakMemory(), store.GetPeakResident() / 1048576.0);
+		}
+		return 0;
+	}
+
+	if (format == "irmfvox") {
+		irmf::VoxelFileSettings settings;
+		settings.Pitch = pitch;
+		settings.LayerHeight = layer;
+		settings.Threads = threads;
+		settings.Progress = progress;
+		if (!irmf::WriteVoxelFile(model, settings, output, err)) {
+			fprintf(stderr, "%s: %s\n", output.c_str(), err.c_str());
+			return 1;
+		}
+		if (!quiet)
+			fprintf(stderr, "wrote %s in %.2f s, peak memory %.0f MB\n", output.c_str(), elapsed(), PeakMemory());
+		return 0;
+	}
+
+	if (format == "vdb") {
+		irmf::VdbSettings settings;
+		settings.Pitch = pitch;
+		settings.LayerHeight = layer;
+		settings.Zip = zip;
+		settings.Threads = threads;
+		settings.Progress = progress;
+		irmf::VdbStats stats;
+		if (!irmf::WriteVdb(model, settings, output, stats, err)) {
+			fprintf(stderr, "%s: %s\n", output.c_str(), err.c_str());
+			return 1;
+		}
+		if (!quiet) {
+			for (size_t m = 0; m < model.Materials.size(); m++)
+				fprintf(stderr, "%s: %llu active voxels, %llu leaves, %llu tiles\n", model.Materials[m].c_str(),
+					(unsigned long long)stats.Voxels[m], (unsigned long long)stats.Leaves[m], (unsigned long long)stats.Tiles[m]);
+			fprintf(stderr, "wrote %s in %.2f s, peak memory %.0f MB\n", output.c_str(), elapsed(), PeakMemory());
+		}
+		return 0;
+	}
+
+	if (format == "antialias") {
+		std::vector<irmf::AntiAliasResult> results;
+		if (!irmf::CompareAntiAliasing(model, pitch, iso, results, err)) {
+			fprintf(stderr, "%s\n", err.c_str());
+			return 1;
+		}
+		FILE* f = fopen(output.c_str(), "w");
+		if (!f) {
+			fprintf(stderr, "%s: cannot create\n", output.c_str());
+			return 1;
+		}
+		fprintf(f, "%-16s %12s %10s %10s %10s\n", "mode", "evals/pixel", "ms/layer", "mean err", "max err");
+		for (const irmf::AntiAliasResult& result : results)
+			fprintf(f, "%-16s %12.2f %10.2f %10.2f %10.0f\n", result.Mode.c_str(), result.Evaluations,
+				result.Seconds * 1000.0, result.MeanError, result.MaxError);
+		if (fclose(f) != 0) {
+			fprintf(stderr, "%s: write failed\n", output.c_str());
+			return 1;
+		}
+		if (!quiet)
+			fprintf(stderr, "wrote %s in %.2f s\n", output.c_str(), elapsed());
+		return 0;
+	}
+
+	if (format == "benchmark") {
+		std::vector<irmf::BenchResult> results;
+		if (!irmf::BenchmarkEvaluators(model, results, err)) {
+			fprintf(stderr, "%s\n", err.c_str());
+			return 1;
+		}
+		FILE* f = fopen(output.c_str(), "w");
+		if (!f) {
+			fprintf(stderr, "%s: cannot create\n", output.c_str());
+			return 1;
+		}
+		fprintf(f, "%-24s %12s %8s\n", "evaluator", "Mpoints/s", "speedup");
+		for (const irmf::BenchResult& result : results)
+			fprintf(f, "%-24s %12.2f %8.2f\n", result.Evaluator.c_str(), result.PointsPerSecond / 1e6, result.Speedup);
+		if (fclose(f) != 0) {
+			fprintf(stderr, "%s: write failed\n", output.c_str());
+			return 1;
+		}
+		if (!quiet)
+			fprintf(stderr, "wrote %s in %.2f s\n", output.c_str(), elapsed());
+		return 0;
+	}
+
+	if (format == "slices") {
+		irmf::SliceSettings settings;
+		settings.Pitch = pitch;
+		settings.LayerHeight = layer;
+		if (antialias == "supersample")
+			settings.AntiAliasing = irmf::AntiAlias::Supersample;
+		else if (antialias == "gradient")
+			settings.AntiAliasing = irmf::AntiAlias::Gradient;
+		settings.Samples = samples;
+		settings.IsoLevel = iso;
+		settings.Refine = refine;
+		settings.Threads = threads;
+		settings.CheckpointInterval = checkpoint;
+		settings.Source = source;
+		settings.Progress = progress;
+		irmf::SliceStats stats;
+		if (!irmf::SliceToZip(model, settings, output, stats, err)) {
+			fprintf(stderr, "%s: %s\n", output.c_str(), err.c_str());
+			return 1;
+		}
+		if (!quiet) {
+			if (stats.Resumed > 0)
+				fprintf(stderr, "resumed from a checkpoint: kept the %d layers before it\n", stats.Resumed);
+			if (!source && stats.Pixels > 0)
+				fprintf(stderr, "%llu points evaluated (%.3f per pixel, %.1f%% culled), %llu blocks bounded\n",
+					(unsigned long long)stats.Evaluations, (double)stats.Evaluations / stats.Pixels,
+					100.0 * (1.0 - (double)stats.Evaluations / stats.Pixels), (unsigned long long)stats.Boxes);
+			fprintf(stderr, "wrote %s in %.2f s, peak memory %.0f MB\n", output.c_str(), elapsed(), PeakMemory());
+		}
+		return 0;
+	}
+
+	if (format == "dither") {
+		irmf::SliceSettings settings;
+		settings.Pitch = pitch;
+		settings.LayerHeight = layer;
+		settings.Carry = carry;
+		settings.Threads = threads;
+		settings.Source = source;
+		settings.Progress = progress;
+		irmf::DitherStats stats;
+		if (!irmf::DitherToZip(model, settings, output, stats, err)) {
+			fprintf(stderr, "%s: %s\n", output.c_str(), err.c_str());
+			return 1;
+		}
+		if (!quiet) {
+			for (size_t m = 0; m < model.Materials.size(); m++)
+				fprintf(stderr, "%s: %llu voxels (%.0f by value)\n", model.Materials[m].c_str(),
+					(unsigned long long)stats.Voxels[m], stats.Expected[m]);
+			fprintf(stderr, "wrote %s in %.2f s, peak memory %.0f MB\n", output.c_str(), elapsed(), PeakMemory());
+		}
+		return 0;
+	}
+
+	if (format == "cli" || format == "svg") {
+		irmf::ContourSettings settings;
+		settings.Pitch = pitch;
+		settings.LayerHeight = layer;
+		settings.IsoLevel = iso;
+		settings.Tolerance = tolerance;
+		settings.Format = format == "cli" ? irmf::ContourFormat::CLI : irmf::ContourFormat::SVG;
+		settings.Threads = threads;
+		settings.Source = source;
+		settings.Progress = progress;
+		irmf::ContourStats stats;
+		if (!irmf::WriteContours(model, settings, output, stats, err)) {
+			fprintf(stderr, "%s: %s\n", output.c_str(), err.c_str());
+			return 1;
+		}
+		if (!quiet) {
+			for (size_t m = 0; m < model.Materials.size(); m++)
+				fprintf(stderr, "%s: %llu outlines, %llu holes, %llu points (from %llu)\n", model.Materials[m].c_str(),
+					(unsigned long long)stats.Outlines[m], (unsigned long long)stats.Holes[m], (unsigned long long)stats.Points[m],
+					(unsigned long long)stats.Crossings[m]);
+			fprintf(stderr, "wrote %s in %.2f s, peak memory %.0f MB\n", output.c_str(), elapsed(), PeakMemory());
+		}
+		return 0;
+	}
+
+	if (format == "cbddlp" || format == "photon" || format == "ctb") {
+		if (printer.empty()) {
+			fprintf(stderr, "%s needs --printer\n\n", format.c_str());
+			Usage();
+			return 2;
+		}
+		irmf::PrinterProfile profile;
+		if (!irmf::LoadPrinterProfile(printers, printer, profile, err)) {
+			fprintf(stderr, "%s\n", err.c_str());
+			return 1;
+		}
+		irmf::ResinSettings settings;
+		settings.Format = format == "ctb" ? irmf::ResinFormat::CTB : irmf::ResinFormat::CBDDLP;
+		settings.LayerHeight = layer;
+		settings.Threads = threads;
+		settings.Progress = progress;
+		if (!irmf::WriteResinFile(model, profile, settings, output, err)) {
+			fprintf(stderr, "%s: %s\n", output.c_str(), err.c_str());
+			return 1;
+		}
+		if (!quiet)
+			fprintf(stderr, "wrote %s in %.2f s, peak memory %.0f MB\n", output.c_str(), elapsed(), PeakMemory());
+		return 0;
+	}
+
+	if (format == "binvox" || format == "svx") {
+		irmf::VoxelSettings settings;
+		settings.Pitch = pitch;
+		settings.Threshold = threshold;
+		settings.Threads = threads;
+		settings.Progress = progress;
+		std::vector<std::string> filenames = MaterialFilenames(output, model.Materials);
+		bool ok = format == "binvox" ? irmf::WriteBinvox(model, settings, filenames, err) : irmf::WriteSvx(model, settings, output, err);
+		if (!ok) {
+			fprintf(stderr, "%s: %s\n", output.c_str(), err.c_str());
+			return 1;
+		}
+		if (!quiet)
+			fprintf(stderr, "wrote %s in %.2f s, peak memory %.0f MB\n", output.c_str(), elapsed(), PeakMemory());
+		return 0;
+	}
+
+	irmf::MeshSettings settings;
+	settings.Pitch = pitch;
+	settings.IsoLevel = iso;
+	settings.Tolerance = tolerance;
+	settings.MaxError = decimate;
+	settings.Format = format == "ply" ? irmf::MeshFormat::PLY : irmf::MeshFormat::STL;
+	settings.Threads = threads;
+	settings.Source = source;
+	settings.Progress = progress;
+	std::vector<std::string> filenames = MaterialFilenames(output, model.Materials);
+	irmf::MeshStats stats;
+	irmf::Mesher mesher = method == "dc" ? irmf::DualContour : irmf::MarchingCubes;
+	bool ok;
+	if (format == "3mf") {
+		filenames.assign(model.Materials.begin(), model.Materials.end());
+		ok = irmf::WriteThreeMf(mesher, model, settings, output, stats, err);
+	} else
+		ok = irmf::WriteMeshFiles(mesher, model, settings, filenames, stats, err);
+	if (!ok) {
+		fprintf(stderr, "%s: %s\n", output.c_str(), err.c_str());
+		return 1;
+	}
+	if (!quiet) {
+		double seconds = elapsed();
+		uint64_t total = 0;
+		for (size_t m = 0; m < filenames.size(); m++) {
+			fprintf(stderr, "wrote %s: %llu triangles, %llu vertices", filenames[m].c_str(),
+				(unsigned long long)stats.Triangles[m], (unsigned long long)stats.Vertices[m]);
+			if (m < stats.MaxDeviation.size() && std::isinf(stats.MaxDeviation[m]))
+				fprintf(stderr, ", more than %.2f cells from the surface", 2.0 * decimate + 2.0);
+			else if (m < stats.MaxDeviation.size())
+				fprintf(stderr, ", at most %.2f cells from the surface", stats.MaxDeviation[m]);
+			fprintf(stderr, "\n");
+			total += stats.Triangles[m];
+		}
+		fprintf(stderr, "%.2f s, %.2f M triangles/s, peak memory %.0f MB\n", seconds, total / seconds / 1e6, PeakMemory());
+	}
+	return 0;
+}
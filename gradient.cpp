@@ -0,0 +1,183 @@
+#include "gradient.h"
+#include "interpreter.h"
+
+namespace irmf
+{
+	namespace
+	{
+		const float Ln2 = 0.693147180559945f;
+
+		// the result of a function of a with derivative f'(a) = slope
+		inline Dual Chain(float v, const Dual& a, float slope)
+		{
+			Dual r(v);
+			for (int i = 0; i < 3; i++)
+				r.D[i] = slope * a.D[i];
+			return r;
+		}
+		// the result of a function of a and b with partial derivatives sa, sb
+		inline Dual Chain2(float v, const Dual& a, float sa, const Dual& b, float sb)
+		{
+			Dual r(v);
+			for (int i = 0; i < 3; i++)
+				r.D[i] = sa * a.D[i] + sb * b.D[i];
+			return r;
+		}
+	}
+
+	Dual ApplyDualOp(Opcode op, const Dual& a, const Dual& b, const Dual& c)
+	{
+		float v = ApplyOp(op, a.V, b.V, c.V);
+		switch (op) {
+		case Opcode::Mov:
+		case Opcode::Fract:
+			return Chain(v, a, 1.0f);
+		case Opcode::Neg: return Chain(v, a, -1.0f);
+		case Opcode::Abs: return Chain(v, a, a.V < 0.0f ? -1.0f : 1.0f);
+
+		case Opcode::Sqrt: return Chain(v, a, v > 0.0f ? 0.5f / v : 0.0f);
+		case Opcode::InvSqrt: return Chain(v, a, a.V > 0.0f ? -0.5f * v / a.V : 0.0f);
+		case Opcode::Exp: return Chain(v, a, v);
+		case Opcode::Exp2: return Chain(v, a, v * Ln2);
+		case Opcode::Log: return Chain(v, a, 1.0f / a.V);
+		case Opcode::Log2: return Chain(v, a, 1.0f / (a.V * Ln2));
+		case Opcode::Sin: return Chain(v, a, std::cos(a.V));
+		case Opcode::Cos: return Chain(v, a, -std::sin(a.V));
+		case Opcode::Tan: return Chain(v, a, 1.0f + v * v);
+		case Opcode::Asin: return Chain(v, a, 1.0f / std::sqrt(1.0f - a.V * a.V));
+		case Opcode::Acos: return Chain(v, a, -1.0f / std::sqrt(1.0f - a.V * a.V));
+		case Opcode::Atan: return Chain(v, a, 1.0f / (1.0f + a.V * a.V));
+		case Opcode::Sinh: return Chain(v, a, std::cosh(a.V));
+		case Opcode::Cosh: return Chain(v, a, std::sinh(a.V));
+		case Opcode::Tanh: return Chain(v, a, 1.0f - v * v);
+
+		case Opcode::Add: return Chain2(v, a, 1.0f, b, 1.0f);
+		case Opcode::Sub: return Chain2(v, a, 1.0f, b, -1.0f);
+		case Opcode::Mul: return Chain2(v, a, b.V, b, a.V);
+		case Opcode::Div: return Chain2(v, a, 1.0f / b.V, b, -v / b.V);
+		case Opcode::Mod: return Chain2(v, a, 1.0f, b, -std::floor(a.V / b.V));
+		case Opcode::Min: return b.V < a.V ? b : a;
+		case Opcode::Max: return a.V < b.V ? b : a;
+		case Opcode::Pow: {
+			// the b term only exists where a^b is defined for non-integer b
+			float sa = a.V != 0.0f ? b.V * v / a.V : (b.V == 1.0f ? 1.0f : 0.0f);
+			float sb = a.V > 0.0f ? v * std::log(a.V) : 0.0f;
+			return Chain2(v, a, sa, b, sb);
+		}
+		case Opcode::Atan2: {
+			float r2 = a.V * a.V + b.V * b.V;
+			if (r2 == 0.0f)
+				return Dual(v);
+			return Chain2(v, a, b.V / r2, b, -a.V / r2);
+		}
+
+		case Opcode::Clamp: {
+			const Dual& t = a.V < b.V ? b : a;
+			return c.V < t.V ? c : t;
+		}
+		case Opcode::Mix: {
+			Dual r = Chain2(v, a, 1.0f - c.V, b, c.V);
+			for (int i = 0; i < 3; i++)
+				r.D[i] += (b.V - a.V) * c.D[i];
+			return r;
+		}
+		case Opcode::Smoothstep: {
+			float w = b.V - a.V;
+			float t = (c.V - a.V) / w;
+			if (!(t > 0.0f && t < 1.0f))
+				return Dual(v);
+			// v = t^2 (3 - 2t), t = (c - a) / (b - a)
+			float s = 6.0f * t * (1.0f - t) / w;
+			Dual r(v);
+			for (int i = 0; i < 3; i++)
+				r.D[i] = s * (c.D[i] - a.D[i] - t * (b.D[i] - a.D[i]));
+			return r;
+		}
+		case Opcode::Select: return a.V != 0.0f ? b : c;
+
+		default:
+			// Not, Sign, Floor, Ceil, Trunc, Round, RoundEven, Step and the
+			// comparisons are piecewise constant
+			return Dual(v);
+		}
+	}
+
+	GradientEvaluator::GradientEvaluator(const Model& model)
+		: m_model(model)
+		, m_regs(model.Code.NumRegisters)
+	{
+		const Program& program = model.Code;
+		for (size_t i = 0; i < program.Constants.size(); i++)
+			m_regs[program.ConstantBase() + i] = Dual(program.Constants[i]);
+	}
+
+	bool GradientEvaluator::EvaluatePoint(float x, float y, float z)
+	{
+		Dual* r = m_regs.data();
+		r[0] = Dual(x);
+		r[1] = Dual(y);
+		r[2] = Dual(z);
+		r[0].D[0] = r[1].D[1] = r[2].D[2] = 1.0f;
+
+		const std::vector<Instruction>& code = m_model.Code.Code;
+		long long iterations = Evaluator::MaxLoopIterations;
+
+		// same control flow as Evaluator::Evaluate, decided by the values
+		for (size_t pc = 0; pc < code.size(); pc++) {
+			const Instruction& in = code[pc];
+			switch (in.Op) {
+			case Opcode::If:
+			case Opcode::BreakIfNot:
+				if (r[in.A].V == 0.0f)
+					pc = in.Target;
+				break;
+			case Opcode::Else:
+			case Opcode::Break:
+			case Opcode::Continue:
+			case Opcode::Return:
+				pc = in.Target;
+				break;
+			case Opcode::EndLoop:
+				if (--iterations < 0)
+					return false;
+				pc = in.Target;
+				break;
+			case Opcode::EndIf:
+			case Opcode::Loop:
+			case Opcode::ContinuePoint:
+			case Opcode::Call:
+			case Opcode::EndCall:
+				break;
+			default:
+				r[in.Dst] = ApplyDualOp(in.Op, r[in.A], r[in.B], r[in.C]);
+				break;
+			}
+		}
+		return true;
+	}
+
+	bool GradientEvaluator::Evaluate(const float* x, const float* y, const float* z, size_t count, float* values, float* gradients)
+	{
+		const std::vector<uint16_t>& outputs = m_model.Code.Outputs;
+		const float* min = m_model.Min;
+		const float* max = m_model.Max;
+
+		for (size_t i = 0; i < count; i++) {
+			bool inside = x[i] >= min[0] && x[i] <= max[0] &&
+				y[i] >= min[1] && y[i] <= max[1] &&
+				z[i] >= min[2] && z[i] <= max[2];
+			if (inside && !EvaluatePoint(x[i], y[i], z[i]))
+				return false;
+
+			for (size_t m = 0; m < outputs.size(); m++) {
+				size_t o = m * count + i;
+				Dual d = inside ? m_regs[outputs[m]] : Dual();
+				values[o] = d.V;
+				gradients[3 * o + 0] = d.D[0];
+				gradients[3 * o + 1] = d.D[1];
+				gradients[3 * o + 2] = d.D[2];
+			}
+		}
+		return true;
+	}
+}
@@ -0,0 +1,50 @@
+#pragma once
+#include <cstddef>
+#include <vector>
+#include "model.h"
+#include "program.h"
+
+namespace irmf
+{
+	// Dual is a value together with its partial derivatives with respect to
+	// x, y and z (forward-mode automatic differentiation).
+	struct Dual
+	{
+		float V;
+		float D[3];
+
+		Dual() : V(0.0f), D{ 0.0f, 0.0f, 0.0f } { }
+		Dual(float v) : V(v), D{ 0.0f, 0.0f, 0.0f } { }
+	};
+
+	// ApplyDualOp evaluates an arithmetic opcode like ApplyOp and carries
+	// the derivatives along. Functions that are piecewise constant (floor,
+	// step, comparisons) have a zero derivative, and at kinks (abs, min, ...)
+	// the derivative of the branch ApplyOp takes is used.
+	Dual ApplyDualOp(Opcode op, const Dual& a, const Dual& b, const Dual& c);
+
+	// GradientEvaluator runs a model's Program on dual numbers, which gives
+	// the materials and their gradients in a single pass. Points outside the
+	// bounding box from the preamble have no material: their values and
+	// gradients are 0. Like Evaluator, use one per thread.
+	class GradientEvaluator
+	{
+	public:
+		GradientEvaluator(const Model& model);
+
+		// Evaluate computes the materials of count points and their
+		// gradients. Material m of point i is written to values[m * count + i]
+		// and its gradient to gradients[3 * (m * count + i) + 0..2]. Returns
+		// false if a loop ran away.
+		bool Evaluate(const float* x, const float* y, const float* z, size_t count, float* values, float* gradients);
+
+		inline const Program& GetProgram() const { return m_model.Code; }
+		inline int GetOutputCount() const { return (int)m_model.Code.Outputs.size(); }
+
+	private:
+		bool EvaluatePoint(float x, float y, float z);
+
+		const Model& m_model;
+		std::vector<Dual> m_regs;
+	};
+}
@@ -0,0 +1,20 @@
+#include "hash.h"
+#include <algorithm>
+#include <openssl/sha.h>
+
+namespace irmf
+{
+	std::string HashHex(const std::string& data, int bytes)
+	{
+		unsigned char digest[SHA256_DIGEST_LENGTH];
+		SHA256((const unsigned char*)data.data(), data.size(), digest);
+
+		static const char* hex = "0123456789abcdef";
+		std::string ret;
+		for (int i = 0; i < std::min(bytes, (int)SHA256_DIGEST_LENGTH); i++) {
+			ret += hex[digest[i] >> 4];
+			ret += hex[digest[i] & 0xf];
+		}
+		return ret;
+	}
+}
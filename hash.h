@@ -0,0 +1,9 @@
+#pragma once
+#include <string>
+
+namespace irmf
+{
+	// HashHex returns the first bytes bytes (at most 32) of the SHA-256 of
+	// data as lowercase hex, for keys of caches and checkpoints.
+	std::string HashHex(const std::string& data, int bytes);
+}
@@ -0,0 +1,60 @@
+#include "interpreter.h"
+
+namespace irmf
+{
+	Evaluator::Evaluator(const Program& program)
+		: m_program(program)
+		, m_regs(program.NumRegisters, 0.0f)
+	{
+		// constants are never written, load them once
+		for (size_t i = 0; i < program.Constants.size(); i++)
+			m_regs[program.ConstantBase() + i] = program.Constants[i];
+	}
+
+	bool Evaluator::Evaluate(float x, float y, float z, float* out)
+	{
+		float* r = m_regs.data();
+		r[0] = x;
+		r[1] = y;
+		r[2] = z;
+
+		const Instruction* code = m_program.Code.data();
+		size_t size = m_program.Code.size();
+		long long iterations = MaxLoopIterations;
+
+		for (size_t pc = 0; pc < size; pc++) {
+			const Instruction& in = code[pc];
+			switch (in.Op) {
+			case Opcode::If:
+			case Opcode::BreakIfNot:
+				if (r[in.A] == 0.0f)
+					pc = in.Target;
+				break;
+			case Opcode::Else:
+			case Opcode::Break:
+			case Opcode::Continue:
+			case Opcode::Return:
+				pc = in.Target;
+				break;
+			case Opcode::EndLoop:
+				if (--iterations < 0)
+					return false;
+				pc = in.Target;
+				break;
+			case Opcode::EndIf:
+			case Opcode::Loop:
+			case Opcode::ContinuePoint:
+			case Opcode::Call:
+			case Opcode::EndCall:
+				break;
+			default:
+				r[in.Dst] = ApplyOp(in.Op, r[in.A], r[in.B], r[in.C]);
+				break;
+			}
+		}
+
+		for (size_t i = 0; i < m_program.Outputs.size(); i++)
+			out[i] = r[m_program.Outputs[i]];
+		return true;
+	}
+}
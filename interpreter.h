@@ -0,0 +1,31 @@
+#pragma once
+#include <vector>
+#include "program.h"
+
+namespace irmf
+{
+	// Evaluator runs a compiled Program one sample at a time. The Program is
+	// shared and never modified, so any number of evaluators (e.g. one per
+	// thread) can use it at once; each owns its register file, which is
+	// allocated once in the constructor.
+	class Evaluator
+	{
+	public:
+		// Evaluate gives up (returning false) after this many loop iterations
+		// in a single sample, which catches loops that never terminate.
+		enum { MaxLoopIterations = 1 << 24 };
+
+		Evaluator(const Program& program);
+
+		// Evaluate runs the entry point at (x, y, z) and writes
+		// GetOutputCount() material values to out.
+		bool Evaluate(float x, float y, float z, float* out);
+
+		inline const Program& GetProgram() const { return m_program; }
+		inline int GetOutputCount() const { return (int)m_program.Outputs.size(); }
+
+	private:
+		const Program& m_program;
+		std::vector<float> m_regs;
+	};
+}
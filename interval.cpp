@@ -0,0 +1,458 @@
+#include "interval.h"
+#include <algorithm>
+#include <cmath>
+
+namespace irmf
+{
+	namespace
+	{
+		const double Pi = 3.14159265358979323846;
+		const float Inf = INFINITY;
+
+		// outward rounding by one ulp; zero results of +-*/ are exact
+		inline float Down(float x) { return x == 0.0f ? x : std::nextafter(x, -Inf); }
+		inline float Up(float x) { return x == 0.0f ? x : std::nextafter(x, Inf); }
+		// libm results are within two ulps
+		inline Interval Widen(float lo, float hi) { return Interval(Down(Down(lo)), Up(Up(hi))); }
+		inline Interval Exact(float lo, float hi) { return Interval(lo, hi); }
+
+		inline Interval Whole() { return Interval(-Inf, Inf); }
+		inline Interval Bool(bool isTrue, bool isFalse) { return Interval(isTrue ? 1.0f : 0.0f, isFalse ? 0.0f : 1.0f); }
+		inline Interval Union(const Interval& a, const Interval& b) { return Interval(std::min(a.Lo, b.Lo), std::max(a.Hi, b.Hi)); }
+
+		// truth of a condition over an interval
+		inline bool IsTrue(const Interval& a) { return a.Lo > 0.0f || a.Hi < 0.0f; }
+		inline bool IsFalse(const Interval& a) { return a.Lo == 0.0f && a.Hi == 0.0f; }
+
+		template<typename F> inline Interval Increasing(F f, const Interval& a) { return Widen(f(a.Lo), f(a.Hi)); }
+		template<typename F> inline Interval Decreasing(F f, const Interval& a) { return Widen(f(a.Hi), f(a.Lo)); }
+		// for rounding functions, which are exact
+		template<typename F> inline Interval Steps(F f, const Interval& a) { return Exact(f(a.Lo), f(a.Hi)); }
+
+		Interval Add(const Interval& a, const Interval& b) { return Interval(Down(a.Lo + b.Lo), Up(a.Hi + b.Hi)); }
+		Interval Sub(const Interval& a, const Interval& b) { return Interval(Down(a.Lo - b.Hi), Up(a.Hi - b.Lo)); }
+		Interval Mul(const Interval& a, const Interval& b)
+		{
+			float p[4] = { a.Lo * b.Lo, a.Lo * b.Hi, a.Hi * b.Lo, a.Hi * b.Hi };
+			for (float v : p)
+				if (v != v) // 0 * inf
+					return Whole();
+			return Interval(Down(*std::min_element(p, p + 4)), Up(*std::max_element(p, p + 4)));
+		}
+		Interval Div(const Interval& a, const Interval& b)
+		{
+			if (b.Lo <= 0.0f && b.Hi >= 0.0f)
+				return Whole();
+			float p[4] = { a.Lo / b.Lo, a.Lo / b.Hi, a.Hi / b.Lo, a.Hi / b.Hi };
+			for (float v : p)
+				if (v != v) // inf / inf
+					return Whole();
+			return Interval(Down(*std::min_element(p, p + 4)), Up(*std::max_element(p, p + 4)));
+		}
+
+		// does [lo, hi] contain p + k * period for some integer k
+		inline bool ContainsPeriodic(double lo, double hi, double p, double period)
+		{
+			double k = std::ceil((lo - p) / period);
+			return p + k * period <= hi;
+		}
+		// sin(x + phase)
+		Interval SinRange(const Interval& a, double phase)
+		{
+			if (!(a.Hi - a.Lo < 2.0 * Pi))
+				return Interval(-1.0f, 1.0f);
+			double lo = (double)a.Lo + phase, hi = (double)a.Hi + phase;
+			float s0 = (float)std::sin(lo), s1 = (float)std::sin(hi);
+			Interval r = Widen(std::min(s0, s1), std::max(s0, s1));
+			if (ContainsPeriodic(lo, hi, Pi / 2, 2 * Pi)) r.Hi = 1.0f;
+			if (ContainsPeriodic(lo, hi, -Pi / 2, 2 * Pi)) r.Lo = -1.0f;
+			return Interval(std::max(r.Lo, -1.0f), std::min(r.Hi, 1.0f));
+		}
+		Interval TanRange(const Interval& a)
+		{
+			if (!(a.Hi - a.Lo < Pi) || ContainsPeriodic(a.Lo, a.Hi, Pi / 2, Pi))
+				return Whole();
+			return Increasing([](float x) { return std::tan(x); }, a);
+		}
+
+		Interval Pow(const Interval& a, const Interval& b)
+		{
+			if (b.IsPoint() && b.Lo == std::floor(b.Lo) && std::fabs(b.Lo) < 65536.0f) {
+				// integer exponent: monotonic in |a| for even powers, in a for odd ones
+				float n = b.Lo;
+				if (n == 0.0f)
+					return Interval(1.0f);
+				auto f = [n](float x) { return std::pow(x, n); };
+				bool even = std::fmod(n, 2.0f) == 0.0f;
+				if (n < 0.0f && a.Lo <= 0.0f && a.Hi >= 0.0f)
+					return Whole();
+				if (!even)
+					return n > 0.0f ? Increasing(f, a) : Decreasing(f, a);
+				float lo = a.Lo, hi = a.Hi;
+				float mn = (lo <= 0.0f && hi >= 0.0f) ? 0.0f : std::min(std::fabs(lo), std::fabs(hi));
+				float mx = std::max(std::fabs(lo), std::fabs(hi));
+				return n > 0.0f ? Widen(f(mn), f(mx)) : Widen(f(mx), f(mn));
+			}
+			if (a.Lo < 0.0f)
+				return Whole();
+			// for a >= 0, pow is monotonic in each argument: the extremes
+			// are at the corners
+			float p[4] = { std::pow(a.Lo, b.Lo), std::pow(a.Lo, b.Hi), std::pow(a.Hi, b.Lo), std::pow(a.Hi, b.Hi) };
+			for (float v : p)
+				if (v != v)
+					return Whole();
+			return Widen(*std::min_element(p, p + 4), *std::max_element(p, p + 4));
+		}
+
+		Interval Mod(const Interval& a, const Interval& b)
+		{
+			Interval q = ApplyIntervalOp(Opcode::Floor, Div(a, b), b, b);
+			if (q.IsPoint())
+				return Sub(a, Mul(b, q));
+			if (b.Lo > 0.0f)
+				return Interval(0.0f, b.Hi);
+			if (b.Hi < 0.0f)
+				return Interval(b.Lo, 0.0f);
+			return Whole();
+		}
+
+		Interval Atan2(const Interval& y, const Interval& x)
+		{
+			if (x.Lo > 0.0f)
+				return Increasing([](float v) { return std::atan(v); }, Div(y, x));
+			return Interval(-3.14159274f, 3.14159274f);
+		}
+
+		Interval Compare(Opcode op, const Interval& a, const Interval& b)
+		{
+			switch (op) {
+			case Opcode::Lt: return Bool(a.Hi < b.Lo, a.Lo >= b.Hi);
+			case Opcode::Le: return Bool(a.Hi <= b.Lo, a.Lo > b.Hi);
+			case Opcode::Gt: return Bool(a.Lo > b.Hi, a.Hi <= b.Lo);
+			case Opcode::Ge: return Bool(a.Lo >= b.Hi, a.Hi < b.Lo);
+			case Opcode::Eq: return Bool(a.IsPoint() && b.IsPoint() && a.Lo == b.Lo, a.Hi < b.Lo || b.Hi < a.Lo);
+			case Opcode::Ne: return Bool(a.Hi < b.Lo || b.Hi < a.Lo, a.IsPoint() && b.IsPoint() && a.Lo == b.Lo);
+			case Opcode::And: return Bool(IsTrue(a) && IsTrue(b), IsFalse(a) || IsFalse(b));
+			case Opcode::Or: return Bool(IsTrue(a) || IsTrue(b), IsFalse(a) && IsFalse(b));
+			case Opcode::Xor: {
+				bool known = (IsTrue(a) || IsFalse(a)) && (IsTrue(b) || IsFalse(b));
+				bool x = IsTrue(a) != IsTrue(b);
+				return Bool(known && x, known && !x);
+			}
+			default: return Interval(0.0f, 1.0f);
+			}
+		}
+	}
+
+	Interval ApplyIntervalOp(Opcode op, const Interval& a, const Interval& b, const Interval& c)
+	{
+		Interval r;
+		switch (op) {
+		case Opcode::Mov: r = a; break;
+		case Opcode::Neg: r = Interval(-a.Hi, -a.Lo); break;
+		case Opcode::Not: r = Bool(IsFalse(a), IsTrue(a)); break;
+		case Opcode::Abs:
+			if (a.Lo >= 0.0f) r = a;
+			else if (a.Hi <= 0.0f) r = Interval(-a.Hi, -a.Lo);
+			else r = Interval(0.0f, std::max(-a.Lo, a.Hi));
+			break;
+		case Opcode::Sign: r = Steps([](float x) { return ApplyOp(Opcode::Sign, x, 0.0f, 0.0f); }, a); break;
+		case Opcode::Floor: r = Steps([](float x) { return std::floor(x); }, a); break;
+		case Opcode::Ceil: r = Steps([](float x) { return std::ceil(x); }, a); break;
+		case Opcode::Fract:
+			if (std::floor(a.Lo) == std::floor(a.Hi))
+				r = Sub(a, Interval(std::floor(a.Lo)));
+			else
+				r = Interval(0.0f, 1.0f);
+			break;
+		case Opcode::Trunc: r = Steps([](float x) { return std::trunc(x); }, a); break;
+		case Opcode::Round: r = Steps([](float x) { return std::round(x); }, a); break;
+		case Opcode::RoundEven: r = Steps([](float x) { return std::nearbyint(x); }, a); break;
+		case Opcode::Sqrt: r = Increasing([](float x) { return std::sqrt(std::max(x, 0.0f)); }, a); r.Lo = std::max(r.Lo, 0.0f); break;
+		case Opcode::InvSqrt: r = a.Lo <= 0.0f ? Interval(0.0f, Inf) : Decreasing([](float x) { return 1.0f / std::sqrt(x); }, a); break;
+		case Opcode::Exp: r = Increasing([](float x) { return std::exp(x); }, a); r.Lo = std::max(r.Lo, 0.0f); break;
+		case Opcode::Exp2: r = Increasing([](float x) { return std::exp2(x); }, a); r.Lo = std::max(r.Lo, 0.0f); break;
+		case Opcode::Log: r = Increasing([](float x) { return std::log(std::max(x, 0.0f)); }, a); break;
+		case Opcode::Log2: r = Increasing([](float x) { return std::log2(std::max(x, 0.0f)); }, a); break;
+		case Opcode::Sin: r = SinRange(a, 0.0); break;
+		case Opcode::Cos: r = SinRange(a, Pi / 2); break;
+		case Opcode::Tan: r = TanRange(a); break;
+		case Opcode::Asin: r = Increasing([](float x) { return std::asin(std::min(std::max(x, -1.0f), 1.0f)); }, a); break;
+		case Opcode::Acos: r = Decreasing([](float x) { return std::acos(std::min(std::max(x, -1.0f), 1.0f)); }, a); break;
+		case Opcode::Atan: r = Increasing([](float x) { return std::atan(x); }, a); break;
+		case Opcode::Sinh: r = Increasing([](float x) { return std::sinh(x); }, a); break;
+		case Opcode::Cosh:
+			r = Increasing([](float x) { return std::cosh(x); }, ApplyIntervalOp(Opcode::Abs, a, b, c));
+			r.Lo = std::max(r.Lo, 1.0f);
+			break;
+		case Opcode::Tanh: r = Increasing([](float x) { return std::tanh(x); }, a); break;
+
+		case Opcode::Add: r = Add(a, b); break;
+		case Opcode::Sub: r = Sub(a, b); break;
+		case Opcode::Mul: r = Mul(a, b); break;
+		case Opcode::Div: r = Div(a, b); break;
+		case Opcode::Mod: r = Mod(a, b); break;
+		case Opcode::Min: r = Interval(std::min(a.Lo, b.Lo), std::min(a.Hi, b.Hi)); break;
+		case Opcode::Max: r = Interval(std::max(a.Lo, b.Lo), std::max(a.Hi, b.Hi)); break;
+		case Opcode::Pow: r = Pow(a, b); break;
+		case Opcode::Atan2: r = Atan2(a, b); break;
+		case Opcode::Step: r = Bool(a.Hi <= b.Lo, b.Hi < a.Lo); break;
+		case Opcode::Lt: case Opcode::Le: case Opcode::Gt: case Opcode::Ge:
+		case Opcode::Eq: case Opcode::Ne: case Opcode::And: case Opcode::Or: case Opcode::Xor:
+			r = Compare(op, a, b);
+			break;
+
+		case Opcode::Clamp:
+			r = Interval(std::min(std::max(a.Lo, b.Lo), c.Lo), std::min(std::max(a.Hi, b.Hi), c.Hi));
+			break;
+		case Opcode::Mix: r = Add(Mul(a, Sub(Interval(1.0f), c)), Mul(b, c)); break;
+		case Opcode::Smoothstep:
+			// monotonic in x for fixed edges, decreasing when a > b
+			if (a.IsPoint() && b.IsPoint() && a.Lo != b.Lo) {
+				auto f = [&](float x) { return ApplyOp(Opcode::Smoothstep, a.Lo, b.Lo, x); };
+				r = a.Lo < b.Lo ? Increasing(f, c) : Decreasing(f, c);
+			} else
+				r = Interval(0.0f, 1.0f);
+			r = Interval(std::max(r.Lo, 0.0f), std::min(r.Hi, 1.0f));
+			break;
+		case Opcode::Select:
+			r = IsTrue(a) ? b : (IsFalse(a) ? c : Union(b, c));
+			break;
+
+		default: r = Whole(); break;
+		}
+
+		if (r.Lo != r.Lo || r.Hi != r.Hi)
+			return Whole();
+		return r;
+	}
+
+	IntervalEvaluator::IntervalEvaluator(const Program& program)
+		: m_program(program)
+		, m_regs(program.NumRegisters)
+		, m_frames(program.MaxDepth + 1)
+		, m_depth(0)
+		, m_iterations(0)
+		, m_failed(false)
+	{
+		for (size_t i = 0; i < program.Constants.size(); i++)
+			m_regs[program.ConstantBase() + i] = Interval(program.Constants[i]);
+	}
+
+	void IntervalEvaluator::Merge(bool& has, Registers& into, const Registers& regs)
+	{
+		if (!has) {
+			into = regs;
+			has = true;
+			return;
+		}
+		for (size_t i = 0; i < regs.size(); i++)
+			into[i] = Union(into[i], regs[i]);
+	}
+
+	IntervalEvaluator::Frame& IntervalEvaluator::Innermost(bool loop)
+	{
+		size_t i = m_depth;
+		while (m_frames[i - 1].Loop != loop)
+			i--;
+		return m_frames[i - 1];
+	}
+
+	// The state in regs stopped at pc (by Break, Continue or Return). Go on
+	// from the ContinuePoint of the innermost loop if it is in this block
+	// and some state continued to it.
+	bool IntervalEvaluator::Dead(size_t pc, size_t end, Registers& regs)
+	{
+		for (size_t i = m_depth; i > 0; i--) {
+			Frame& f = m_frames[i - 1];
+			if (!f.Loop)
+				continue;
+			if (f.HasNext && f.End > pc && f.End < end) {
+				regs.swap(f.Next);
+				f.HasNext = false;
+				return Run(f.End + 1, end, regs);
+			}
+			break;
+		}
+		return false;
+	}
+
+	// Run executes [pc, end) on regs and returns false if no state reaches end.
+	bool IntervalEvaluator::Run(size_t pc, size_t end, Registers& regs)
+	{
+		const std::vector<Instruction>& code = m_program.Code;
+
+		for (; pc < end; pc++) {
+			const Instruction& in = code[pc];
+			switch (in.Op) {
+			case Opcode::If: {
+				size_t split = in.Target;
+				bool hasElse = code[split].Op == Opcode::Else;
+				size_t endIf = hasElse ? code[split].Target : split;
+
+				const Interval& cond = regs[in.A];
+				bool alive;
+				if (IsTrue(cond))
+					alive = Run(pc + 1, split, regs);
+				else if (IsFalse(cond))
+					alive = hasElse ? Run(split + 1, endIf, regs) : true;
+				else {
+					Registers other = regs;
+					bool thenAlive = Run(pc + 1, split, regs);
+					bool elseAlive = m_failed || !hasElse || Run(split + 1, endIf, other);
+					if (thenAlive && elseAlive) {
+						for (size_t i = 0; i < regs.size(); i++)
+							regs[i] = Union(regs[i], other[i]);
+					} else if (elseAlive)
+						regs.swap(other);
+					alive = thenAlive || elseAlive;
+				}
+				if (m_failed)
+					return false;
+				if (!alive)
+					return Dead(endIf, end, regs);
+				pc = endIf;
+				break;
+			}
+
+			case Opcode::Loop: {
+				size_t endLoop = in.Target;
+				size_t depth = m_depth++;
+				Frame& f = m_frames[depth];
+				f.Loop = true;
+				f.End = UINT32_MAX;
+				f.HasExit = f.HasNext = false;
+
+				bool alive = false;
+				do {
+					if (++m_iterations > MaxLoopIterations)
+						m_failed = true;
+					else
+						alive = Run(pc + 1, endLoop, regs);
+				} while (!m_failed && alive);
+
+				m_depth = depth;
+				if (m_failed)
+					return false;
+				Frame& done = m_frames[depth];
+				if (!done.HasExit)
+					return Dead(endLoop, end, regs);
+				regs.swap(done.Exit);
+				pc = endLoop;
+				break;
+			}
+			case Opcode::BreakIfNot: {
+				const Interval& cond = regs[in.A];
+				if (IsTrue(cond))
+					break;
+				Frame& f = Innermost(true);
+				Merge(f.HasExit, f.Exit, regs);
+				if (IsFalse(cond))
+					return Dead(pc, end, regs);
+				break;
+			}
+			case Opcode::Break: {
+				Frame& f = Innermost(true);
+				Merge(f.HasExit, f.Exit, regs);
+				return Dead(pc, end, regs);
+			}
+			case Opcode::Continue: {
+				Frame& f = Innermost(true);
+				f.End = in.Target;
+				Merge(f.HasNext, f.Next, regs);
+				return Dead(pc, end, regs);
+			}
+			case Opcode::ContinuePoint: {
+				Frame& f = Innermost(true);
+				if (f.HasNext) {
+					for (size_t i = 0; i < regs.size(); i++)
+						regs[i] = Union(regs[i], f.Next[i]);
+					f.HasNext = false;
+				}
+				break;
+			}
+
+			case Opcode::Call: {
+				size_t endCall = in.Target;
+				size_t depth = m_depth++;
+				Frame& f = m_frames[depth];
+				f.Loop = false;
+				f.End = in.Target;
+				f.HasExit = f.HasNext = false;
+
+				bool alive = Run(pc + 1, endCall, regs);
+				m_depth = depth;
+				if (m_failed)
+					return false;
+				Frame& done = m_frames[depth];
+				if (done.HasExit) {
+					if (alive) {
+						for (size_t i = 0; i < regs.size(); i++)
+							regs[i] = Union(regs[i], done.Exit[i]);
+					} else
+						regs.swap(done.Exit);
+					alive = true;
+				}
+				if (!alive)
+					return Dead(endCall, end, regs);
+				pc = endCall;
+				break;
+			}
+			case Opcode::Return: {
+				size_t i = m_depth;
+				while (m_frames[i - 1].Loop || m_frames[i - 1].End != in.Target)
+					i--;
+				Frame& f = m_frames[i - 1];
+				Merge(f.HasExit, f.Exit, regs);
+				return Dead(pc, end, regs);
+			}
+
+			case Opcode::Else:
+			case Opcode::EndIf:
+			case Opcode::EndLoop:
+			case Opcode::EndCall:
+				break;
+
+			default:
+				regs[in.Dst] = ApplyIntervalOp(in.Op, regs[in.A], regs[in.B], regs[in.C]);
+				break;
+			}
+		}
+		return true;
+	}
+
+	bool IntervalEvaluator::Evaluate(const float* min, const float* max, Interval* out)
+	{
+		for (int i = 0; i < Program::NumInputs; i++)
+			m_regs[i] = Interval(min[i], max[i]);
+		for (size_t i = Program::NumInputs + m_program.Constants.size(); i < m_regs.size(); i++)
+			m_regs[i] = Interval();
+
+		Registers& regs = m_regs;
+		m_depth = 0;
+		m_iterations = 0;
+		m_failed = false;
+		bool alive = Run(0, m_program.Code.size(), regs);
+
+		const std::vector<uint16_t>& outputs = m_program.Outputs;
+		for (size_t i = 0; i < outputs.size(); i++)
+			out[i] = (alive && !m_failed) ? regs[outputs[i]] : Whole();
+		return alive && !m_failed;
+	}
+
+	IntervalEvaluator::Content IntervalEvaluator::Classify(const float* min, const float* max, float* values)
+	{
+		Interval bounds[16];
+		if (!Evaluate(min, max, bounds))
+			return Content::Mixed;
+
+		bool empty = true;
+		for (int i = 0; i < GetOutputCount(); i++) {
+			if (!bounds[i].IsPoint())
+				return Content::Mixed;
+			values[i] = bounds[i].Lo;
+			empty = empty && values[i] == 0.0f;
+		}
+		return empty ? Content::Empty : Content::Uniform;
+	}
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <vector>
+#include "program.h"
+
+namespace irmf
+{
+	// Interval is a closed range of floats.
+	struct Interval
+	{
+		float Lo, Hi;
+
+		Interval() : Lo(0.0f), Hi(0.0f) { }
+		Interval(float v) : Lo(v), Hi(v) { }
+		Interval(float lo, float hi) : Lo(lo), Hi(hi) { }
+
+		inline bool IsPoint() const { return Lo == Hi; }
+	};
+
+	// ApplyIntervalOp bounds the result of an arithmetic opcode over all
+	// operands taken from a, b and c. Results are rounded outwards, so
+	// they contain whatever ApplyOp returns for those operands (NaNs aside).
+	Interval ApplyIntervalOp(Opcode op, const Interval& a, const Interval& b, const Interval& c);
+
+	// IntervalEvaluator runs a compiled Program over axis-aligned boxes
+	// instead of points and returns conservative bounds of each material.
+	// Branches whose condition is undecided over the box are both taken and
+	// their results merged. Like Evaluator, use one per thread.
+	class IntervalEvaluator
+	{
+	public:
+		// Evaluate gives up after this many loop iterations for one box,
+		// which happens when a loop condition stays undecided.
+		enum { MaxLoopIterations = 4096 };
+
+		// What a box holds, as far as the bounds tell.
+		enum class Content
+		{
+			Empty,   // every material is 0 everywhere in the box
+			Uniform, // every material has the same value everywhere in the box
+			Mixed    // the box has to be sampled
+		};
+
+		IntervalEvaluator(const Program& program);
+
+		// Evaluate bounds the materials over the box [min, max] and writes
+		// GetOutputCount() intervals to out. If the bounds cannot be
+		// established it returns false and out holds the whole real line.
+		bool Evaluate(const float* min, const float* max, Interval* out);
+
+		// Classify evaluates the box and tells whether it needs sampling;
+		// for Empty and Uniform boxes the material values go to values.
+		Content Classify(const float* min, const float* max, float* values);
+
+		inline const Program& GetProgram() const { return m_program; }
+		inline int GetOutputCount() const { return (int)m_program.Outputs.size(); }
+
+	private:
+		typedef std::vector<Interval> Registers;
+
+		// Frame is an enclosing loop or inlined function. States that leave
+		// it early are merged into Exit (Break, Return) or Next (Continue).
+		struct Frame
+		{
+			bool Loop;
+			uint32_t End;           // Loop: its ContinuePoint, Call: its EndCall
+			bool HasExit, HasNext;
+			Registers Exit, Next;
+		};
+
+		bool Run(size_t pc, size_t end, Registers& regs);
+		bool Dead(size_t pc, size_t end, Registers& regs);
+		void Merge(bool& has, Registers& into, const Registers& regs);
+		Frame& Innermost(bool loop);
+
+		const Program& m_program;
+		Registers m_regs;
+		std::vector<Frame> m_frames;
+		size_t m_depth;
+		int m_iterations;
+		bool m_failed;
+	};
+}
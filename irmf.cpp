@@ -8,6 +8,9 @@
 #include <json11/json11.hpp>
 #include <pugixml/src/pugixml.hpp>
 #include <ghc/filesystem.hpp>
+#include <sstream>
+#include "lexer.h"
+#include "model.h"
 
 #define BUTTON_SPACE_LEFT -40 * GetDPI()
 #define KEYBOARD_TEXTURE_NAME "KeyboardTexture"
@@ -50,7 +53,20 @@ namespace irmf
 		return ret;
 	}
 
-	std::string GenerateVariables()
+	// GenerateVectorValue formats a preamble array such as "min" or "max" as
+	// the value of a float3 variable.
+	std::string GenerateVectorValue(const json11::Json& vec, float fallback)
+	{
+		std::string ret = "<row>";
+		for (int i = 0; i < 3; i++) {
+			float v = vec[i].is_number() ? (float)vec[i].number_value() : fallback;
+			ret += "<value>" + std::to_string(v) + "</value>";
+		}
+		ret += "</row>";
+		return ret;
+	}
+
+	std::string GenerateVariables(const json11::Json& info, PreviewMode mode)
 	{
 		std::string ret =
 			"<variables>"
@@ -59,6 +75,32 @@ namespace irmf
 			"<variable type=\"float\" name=\"iTimeDelta\" system=\"TimeDelta\" />"
 			"<variable type=\"int\" name=\"iFrame\" system=\"FrameIndex\" />"
 			"<variable type=\"float4\" name=\"iMouse\" system=\"MouseButton\" />"
+			"<variable type=\"float3\" name=\"u_ll\">" + GenerateVectorValue(info["min"], -1.0f) + "</variable>"
+			"<variable type=\"float3\" name=\"u_ur\">" + GenerateVectorValue(info["max"], 1.0f) + "</variable>";
+
+		if (mode != PreviewMode::Slice)
+			ret +=
+				"<variable type=\"float4x4\" name=\"u_viewProj\" system=\"ViewProjection\" />"
+				"<variable type=\"float3\" name=\"u_camPos\" system=\"CameraPosition3\" />";
+
+		if (mode != PreviewMode::FullRaymarch) {
+			int coarsest = (mode == PreviewMode::Tiled) ? 1 : (int)ProgressiveScheduler::CoarsestLevel;
+			ret +=
+				"<variable type=\"float4\" name=\"u_tile\" system=\"PluginVariable\" plugin=\"IRMF\" itemname=\"" PROGRESSIVE_TILE_VAR "\" />"
+				"<variable type=\"int\" name=\"u_level\" system=\"PluginVariable\" plugin=\"IRMF\" itemname=\"" PROGRESSIVE_LEVEL_VAR "\" />"
+				"<variable type=\"int\" name=\"u_generation\" system=\"PluginVariable\" plugin=\"IRMF\" itemname=\"" PROGRESSIVE_GENERATION_VAR "\" />"
+				"<variable type=\"int\" name=\"" PROGRESSIVE_COARSEST_VAR "\"><row><value>" + std::to_string(coarsest) + "</value></row></variable>";
+		}
+
+		ret += "</variables>";
+		return ret;
+	}
+
+	std::string GenerateDisplayVariables()
+	{
+		std::string ret =
+			"<variables>"
+			"<variable type=\"int\" name=\"u_generation\" system=\"PluginVariable\" plugin=\"IRMF\" itemname=\"" PROGRESSIVE_GENERATION_VAR "\" />"
 			"</variables>";
 		return ret;
 	}
@@ -103,23 +145,62 @@ void main() {
 		return std::string(vs);
 	}
 
-	std::string GenerateGLSL(const json11::Json& rpassContainer, const std::string& body)
+	std::string GenerateQuadVertexShader()
 	{
-		std::string ret =
-			// "#version 330\n\n"
-			// "uniform vec2 iResolution;\n"
-			// "uniform float iTime;\n"
-			// "uniform float iTimeDelta;\n"
-			// "uniform int iFrame;\n"
-			// "uniform vec4 iMouse;\n"
-			// "uniform sampler2D iChannel0;\n"
-			// "uniform sampler2D iChannel1;\n"
-			// "uniform sampler2D iChannel2;\n"
-			// "uniform sampler2D iChannel3;\n"
-			// "out vec4 irmf_outcolor;\n\n"
-			"#version 300 es\n"
-			"precision highp float;\n"
-			"precision highp int;\n"
+		const char* vs = R"(#version 330
+
+layout (location = 0) in vec2 pos;
+layout (location = 1) in vec2 uv;
+
+void main() {
+	gl_Position = vec4(pos, 0.0, 1.0);
+}
+)";
+		return std::string(vs);
+	}
+
+	// GenerateDisplayShader upsamples the progressively refined preview: every
+	// pixel shows the finest anchor that was shaded in the current generation.
+	std::string GenerateDisplayShader()
+	{
+		const char* ps = R"(#version 330
+
+uniform sampler2D u_color;
+uniform sampler2D u_state;
+uniform int u_generation;
+
+out vec4 out_FragColor;
+
+void main() {
+	ivec2 p = ivec2(gl_FragCoord.xy);
+	out_FragColor = vec4(0);
+	for (int s = 1; s <= 8; s *= 2) {
+		ivec2 anchor = (p / s) * s;
+		if (int(texelFetch(u_state, anchor, 0).r) == u_generation) {
+			out_FragColor = texelFetch(u_color, anchor, 0);
+			return;
+		}
+	}
+}
+)";
+		return std::string(ps);
+	}
+
+	std::string GenerateGLSL(const json11::Json& rpassContainer, const std::string& body, PreviewMode mode, int raymarchSteps)
+	{
+		bool raymarch = (mode != PreviewMode::Slice);
+		bool progressive = (mode != PreviewMode::FullRaymarch);
+
+		std::string ret;
+		if (raymarch)
+			ret = "#version 330\n";
+		else
+			ret =
+				"#version 300 es\n"
+				"precision highp float;\n"
+				"precision highp int;\n";
+
+		ret +=
 			"uniform vec3 u_ll;\n"
 			"uniform vec3 u_ur;\n"
 			"uniform float u_d;\n"
@@ -139,34 +220,96 @@ void main() {
 			"uniform vec4 u_color13;\n"
 			"uniform vec4 u_color14;\n"
 			"uniform vec4 u_color15;\n"
-			"uniform vec4 u_color16;\n"
-			"in vec4 v_xyz;\n"
-			"out vec4 out_FragColor;\n\n"
-			+ body + "\n"
-			// "void main()\n{\n"
-			// "\tmainImage(irmf_outcolor, gl_FragCoord.xy);\n"
-			// "}";
-			"void main() {\n"
-			"	if (any(lessThan(v_xyz.xyz,u_ll))) {\n"
-			"		out_FragColor = vec4(0);\n"
-			"		// out_FragColor = vec4(0,1,0,1);  // DEBUG\n"
-			"		return;\n"
-			"	}\n"
-			"	if (any(greaterThan(v_xyz.xyz,u_ur))) {\n"
-			"		out_FragColor = vec4(0);\n"
-			"		// out_FragColor = vec4(0,0,1,1);  // DEBUG\n"
-			"		return;\n"
-			"	}\n"
-			"	vec4 m;\n"
-			"	mainModel4(m, v_xyz.xyz);\n"
-			"	out_FragColor = %v;\n"
-			"	// out_FragColor = v_xyz/5.0 + 0.5;  // DEBUG\n"
+			"uniform vec4 u_color16;\n";
+
+		if (raymarch)
+			ret +=
+				"uniform vec2 iResolution;\n"
+				"uniform mat4 u_viewProj;\n"
+				"uniform vec3 u_camPos;\n"
+				"#define IRMF_STEPS " + std::to_string(raymarchSteps) + "\n";
+		else
+			ret += "in vec4 v_xyz;\n";
+
+		if (progressive)
+			ret +=
+				"uniform vec4 u_tile;\n"
+				"uniform int u_level;\n"
+				"uniform int u_generation;\n"
+				"uniform int " PROGRESSIVE_COARSEST_VAR ";\n"
+				"layout(location = 0) out vec4 out_FragColor;\n"
+				"layout(location = 1) out vec4 out_State;\n\n";
+		else
+			ret += "out vec4 out_FragColor;\n\n";
+
+		ret += body + "\n"
+			"vec4 irmfColor(vec4 m) {\n"
+			"	return vec4(m.xyz, clamp(m.x + m.y + m.z + m.w, 0.0, 1.0));\n"
+			"}\n\n";
+
+		if (raymarch)
+			ret +=
+				"// march the view ray through the model's bounding box, front to back\n"
+				"vec4 irmfShade() {\n"
+				"	vec2 ndc = gl_FragCoord.xy / iResolution * 2.0 - 1.0;\n"
+				"	vec4 far = inverse(u_viewProj) * vec4(ndc, 1.0, 1.0);\n"
+				"	vec3 dir = normalize(far.xyz / far.w - u_camPos);\n"
+				"	vec3 t0 = (u_ll - u_camPos) / dir;\n"
+				"	vec3 t1 = (u_ur - u_camPos) / dir;\n"
+				"	vec3 tmin = min(t0, t1), tmax = max(t0, t1);\n"
+				"	float tnear = max(max(max(tmin.x, tmin.y), tmin.z), 0.0);\n"
+				"	float tfar = min(min(tmax.x, tmax.y), tmax.z);\n"
+				"	if (tfar <= tnear) {\n"
+				"		return vec4(0);\n"
+				"	}\n"
+				"	float dt = (tfar - tnear) / float(IRMF_STEPS);\n"
+				"	vec4 acc = vec4(0);\n"
+				"	for (int i = 0; i < IRMF_STEPS && acc.a < 0.99; i++) {\n"
+				"		vec4 m;\n"
+				"		mainModel4(m, u_camPos + dir * (tnear + (float(i) + 0.5) * dt));\n"
+				"		vec4 c = irmfColor(m);\n"
+				"		acc.rgb += (1.0 - acc.a) * c.a * c.rgb;\n"
+				"		acc.a += (1.0 - acc.a) * c.a;\n"
+				"	}\n"
+				"	return acc;\n"
+				"}\n\n";
+		else
+			ret +=
+				"vec4 irmfShade() {\n"
+				"	if (any(lessThan(v_xyz.xyz,u_ll))) {\n"
+				"		return vec4(0);\n"
+				"	}\n"
+				"	if (any(greaterThan(v_xyz.xyz,u_ur))) {\n"
+				"		return vec4(0);\n"
+				"	}\n"
+				"	vec4 m;\n"
+				"	mainModel4(m, v_xyz.xyz);\n"
+				"	return irmfColor(m);\n"
+				"}\n\n";
+
+		ret += "void main() {\n";
+		if (progressive)
+			ret +=
+				"	// only shade the anchors of the current level inside the current tile\n"
+				"	ivec2 p = ivec2(gl_FragCoord.xy);\n"
+				"	if (u_level == 0 || any(lessThan(vec2(p), u_tile.xy)) || any(greaterThanEqual(vec2(p), u_tile.xy + u_tile.zw))) {\n"
+				"		discard;\n"
+				"	}\n"
+				"	if (p.x % u_level != 0 || p.y % u_level != 0) {\n"
+				"		discard;\n"
+				"	}\n"
+				"	if (u_level < " PROGRESSIVE_COARSEST_VAR " && p.x % (2 * u_level) == 0 && p.y % (2 * u_level) == 0) {\n"
+				"		discard;\n"
+				"	}\n"
+				"	out_State = vec4(float(u_generation), float(u_level), 0, 1);\n";
+		ret +=
+			"	out_FragColor = irmfShade();\n"
 			"}\n";
 
 		return ret;
 	}
 
-	pugi::xml_document GenerateProject(const json11::Json& rpassContainer, const std::string& body)
+	pugi::xml_document GenerateProject(const json11::Json& rpassContainer, const std::string& body, PreviewMode mode)
 	{
 		pugi::xml_document doc;
 		pugi::xml_node project = doc.append_child("project");
@@ -184,6 +327,19 @@ void main() {
 		std::vector<std::string> textures, textureTypes;
 		std::map<std::string, std::vector<std::pair<std::string, int>>> texBinds;
 
+		bool progressive = (mode != PreviewMode::FullRaymarch);
+		if (progressive) {
+			// the refined samples accumulate over several frames, so the render
+			// textures are never cleared and the display pass reads them back
+			rts.push_back("IRMFColor");
+			rtIds.push_back(0);
+			rtBind[0].push_back(std::make_pair(std::string("irmfDisplay"), 0));
+
+			rts.push_back("IRMFState");
+			rtIds.push_back(1);
+			rtBind[1].push_back(std::make_pair(std::string("irmfDisplay"), 1));
+		}
+
 		/////// PIPELINE ///////
 		pugi::xml_node node = pipelineNode.append_child("pass");
 		node.append_attribute("name").set_value("irmf");
@@ -192,34 +348,62 @@ void main() {
 
 		pugi::xml_node vsNode = node.append_child("shader");
 		vsNode.append_attribute("type").set_value("vs");
-		vsNode.append_attribute("path").set_value("shaders/irmfVS.glsl");
+		vsNode.append_attribute("path").set_value(mode == PreviewMode::Slice ? "shaders/irmfVS.glsl" : "shaders/quadVS.glsl");
 
 		pugi::xml_node psNode = node.append_child("shader");
 		psNode.append_attribute("type").set_value("ps");
 		psNode.append_attribute("path").set_value("shaders/irmfFS.glsl");
 
-		node.append_child("rendertexture");
+		if (progressive) {
+			for (size_t i = 0; i < rts.size(); i++)
+				node.append_child("rendertexture").append_attribute("name").set_value(rts[i].c_str());
+		} else
+			node.append_child("rendertexture");
 
-		std::string itemsNode = GenerateItems(0);
+		std::string itemsNode = GenerateItems(index++);
 		node.append_buffer(itemsNode.c_str(), itemsNode.size());
 
-		std::string varNode = GenerateVariables();
+		std::string varNode = GenerateVariables(rpassContainer, mode);
 		node.append_buffer(varNode.c_str(), varNode.size());
 
+		if (progressive) {
+			pugi::xml_node dispNode = pipelineNode.append_child("pass");
+			dispNode.append_attribute("name").set_value("irmfDisplay");
+			dispNode.append_attribute("type").set_value("shader");
+			dispNode.append_attribute("active").set_value("true");
+
+			pugi::xml_node dispVS = dispNode.append_child("shader");
+			dispVS.append_attribute("type").set_value("vs");
+			dispVS.append_attribute("path").set_value("shaders/quadVS.glsl");
+
+			pugi::xml_node dispPS = dispNode.append_child("shader");
+			dispPS.append_attribute("type").set_value("ps");
+			dispPS.append_attribute("path").set_value("shaders/displayFS.glsl");
+
+			dispNode.append_child("rendertexture");
+
+			std::string dispItems = GenerateItems(index++);
+			dispNode.append_buffer(dispItems.c_str(), dispItems.size());
+
+			std::string dispVars = GenerateDisplayVariables();
+			dispNode.append_buffer(dispVars.c_str(), dispVars.size());
+		}
+
 		/////// OBJECTS ///////
-		for (int i = 0; i < rts.size(); i++) {
+		for (size_t i = 0; i < rts.size(); i++) {
 			pugi::xml_node node = objectsNode.append_child("object");
 			node.append_attribute("type").set_value("rendertexture");
 			node.append_attribute("name").set_value(rts[i].c_str());
+			node.append_attribute("format").set_value("R32G32B32A32_FLOAT");
 			node.append_attribute("rsize").set_value("1.00,1.00");
-			node.append_attribute("clear").set_value("true");
+			node.append_attribute("clear").set_value(progressive ? "false" : "true");
 			node.append_attribute("r").set_value("0");
 			node.append_attribute("g").set_value("0");
 			node.append_attribute("b").set_value("0");
 			node.append_attribute("a").set_value("1");
 
 			const std::vector<std::pair<std::string, int>>& myBind = rtBind[rtIds[i]];
-			for (int j = 0; j < myBind.size(); j++) {
+			for (size_t j = 0; j < myBind.size(); j++) {
 				auto& pair = myBind[j];
 				pugi::xml_node bindNode = node.append_child("bind");
 				bindNode.append_attribute("slot").set_value(pair.second);
@@ -241,7 +425,12 @@ void main() {
 		file.close();
 	}
 
-	bool Generate(const std::string& inURL, const std::string& outPath)
+	// Generate downloads the IRMF shader at inURL and writes a SHADERed project
+	// for it to outPath. The preview mode is picked from the static cost
+	// estimate unless autoPreview is false, in which case 'mode' is used.
+	// cpuErr is set if the shader cannot be evaluated on the CPU (and so
+	// cannot be exported with irmf-export), empty otherwise.
+	bool Generate(const std::string& inURL, const std::string& outPath, bool autoPreview, PreviewMode mode, float frameBudgetMs, CostEstimate& estimate, std::string& cpuErr)
 	{
 		// Examples:
 		// https://gmlewis.github.io/irmf-editor/?s=github.com/gmlewis/irmf/blob/master/examples/001-sphere/sphere-1.irmf
@@ -268,20 +457,13 @@ void main() {
 			return false;
 		}
 
-		if (res->body.substr(0, 3) != "/*{") {
-			std::cerr << "IRMF shader must start with: '/*{'" << std::endl;
-			return false;
-		}
-
-		size_t endJSON = res->body.find("}*/");
-		if (endJSON == std::string::npos) {
-			std::cerr << "IRMF shader must have JSON preamble ending with: '}*/'" << std::endl;
+		std::string err;
+		std::string jsonBody, glslBody;
+		if (!SplitIRMF(res->body, jsonBody, glslBody, err)) {
+			std::cerr << err << std::endl;
 			return false;
 		}
 
-		std::string jsonBody = res->body.substr(2, endJSON-1);
-
-		std::string err;
 		json11::Json jdata = json11::Json::parse(jsonBody, err);
 
 		if (err != "") {
@@ -294,6 +476,25 @@ void main() {
 			return false;
 		}
 
+		// cost estimate & preview mode
+		std::string costErr;
+		if (EstimateCost(glslBody, estimate, costErr))
+			ChoosePreview(estimate, frameBudgetMs);
+		else {
+			// not fatal: the GPU compiler reports real errors in the editor
+			std::cerr << "IRMF cost estimation failed: " << costErr << std::endl;
+			estimate.Mode = PreviewMode::Progressive;
+		}
+		if (!autoPreview)
+			estimate.Mode = mode;
+		if (estimate.Mode != PreviewMode::Slice && estimate.RaymarchSteps == 0)
+			estimate.RaymarchSteps = 32;
+
+		// validate the shader with the CPU evaluator that irmf-export uses
+		Model model;
+		cpuErr.clear();
+		LoadModel(res->body, model, cpuErr);
+
 		if (!ghc::filesystem::exists(outPath)) {
 			ghc::filesystem::create_directories(outPath);
 		}
@@ -303,19 +504,26 @@ void main() {
 			ghc::filesystem::create_directories(shadersDir);
 		}
 
-		// README.txt
-		WriteFile(outPath + "/README.txt", GenerateReadMe(jdata, inURL));
+		// model.irmf is kept next to the project for irmf-export
+		WriteFile(outPath + "/model.irmf", res->body);
+
+		// README.txt & cost.json
+		WriteFile(outPath + "/README.txt", GenerateReadMe(jdata, inURL) + "\n" + FormatCostEstimate(estimate));
+		WriteFile(outPath + "/cost.json", CostEstimateToJson(estimate).dump());
 
 		// project.sprj
-		pugi::xml_document doc = GenerateProject(jdata, res->body);
+		pugi::xml_document doc = GenerateProject(jdata, res->body, estimate.Mode);
 		std::ofstream sprjFile(outPath + "/project.sprj");
 		doc.print(sprjFile);
 		sprjFile.close();
 
 		// shaders
 		std::string shaderPath = outPath + "/shaders/irmfFS.glsl";
-		WriteFile(shaderPath, GenerateGLSL(jdata, res->body));
+		WriteFile(shaderPath, GenerateGLSL(jdata, res->body, estimate.Mode, estimate.RaymarchSteps));
 		WriteFile(outPath + "/shaders/irmfVS.glsl", GenerateVertexShader());
+		WriteFile(outPath + "/shaders/quadVS.glsl", GenerateQuadVertexShader());
+		if (estimate.Mode != PreviewMode::FullRaymarch)
+			WriteFile(outPath + "/shaders/displayFS.glsl", GenerateDisplayShader());
 
 		return err.size() == 0;
 	}
@@ -323,6 +531,12 @@ void main() {
 	bool IRMF::Init(bool isWeb, int sedVersion) {
 		m_isPopupOpened = false;
 
+		m_autoPreview = true;
+		m_previewMode = PreviewMode::Progressive;
+		m_previewActive = false;
+		m_step = ProgressiveStep{ 0, 0, 0, 0, 0, 0 };
+		m_idleFrameMs = 0.0f;
+
 		if (sedVersion == 1003005)
 			m_hostVersion = 1;
 		else
@@ -331,6 +545,84 @@ void main() {
 		return true;
 	}
 
+	void IRMF::Project_EndLoad()
+	{
+		// only projects generated by this plugin carry the refinement level
+		m_previewActive = false;
+		if (!ExistsPipelineItem(PipelineManager, "irmf"))
+			return;
+
+		void* pass = GetPipelineItem(PipelineManager, "irmf");
+		int count = GetPipelineItemVariableCount(pass);
+		for (int i = 0; i < count; i++) {
+			if (strcmp(GetPipelineItemVariableName(pass, i), PROGRESSIVE_COARSEST_VAR) == 0) {
+				int coarsest = 0;
+				memcpy(&coarsest, GetPipelineItemVariableValue(pass, i), sizeof(int));
+				m_scheduler.SetCoarsestLevel(coarsest);
+				m_scheduler.Restart();
+				m_previewActive = true;
+			}
+		}
+	}
+
+	// VariableSize returns the bytes a pipeline variable's value takes
+	int VariableSize(ed::plugin::VariableType type)
+	{
+		switch (type) {
+		case ed::plugin::VariableType::Boolean1: return 1;
+		case ed::plugin::VariableType::Boolean2: return 2;
+		case ed::plugin::VariableType::Boolean3: return 3;
+		case ed::plugin::VariableType::Boolean4: return 4;
+		case ed::plugin::VariableType::Integer1:
+		case ed::plugin::VariableType::Float1: return 4;
+		case ed::plugin::VariableType::Integer2:
+		case ed::plugin::VariableType::Float2: return 8;
+		case ed::plugin::VariableType::Integer3:
+		case ed::plugin::VariableType::Float3: return 12;
+		case ed::plugin::VariableType::Integer4:
+		case ed::plugin::VariableType::Float4:
+		case ed::plugin::VariableType::Float2x2: return 16;
+		case ed::plugin::VariableType::Float3x3: return 36;
+		case ed::plugin::VariableType::Float4x4: return 64;
+		default: return 0;
+		}
+	}
+
+	// HashUniforms hashes (FNV-1a) the values of the preview passes'
+	// variables, such as material colors, so that editing one restarts the
+	// refinement. Variables the host or this plugin update every frame are
+	// left out: the camera and frame index are observed on their own.
+	unsigned long long IRMF::HashUniforms()
+	{
+		static const char* perFrame[] = {
+			"iResolution", "iTime", "iTimeDelta", "iFrame", "iMouse", "u_viewProj", "u_camPos",
+			"u_tile", "u_level", "u_generation"
+		};
+		unsigned long long hash = 14695981039346656037ull;
+		auto add = [&](const void* data, size_t size) {
+			const unsigned char* bytes = (const unsigned char*)data;
+			for (size_t i = 0; i < size; i++)
+				hash = (hash ^ bytes[i]) * 1099511628211ull;
+		};
+		for (const char* name : { "irmf", "irmfDisplay" }) {
+			if (!ExistsPipelineItem(PipelineManager, name))
+				continue;
+			void* pass = GetPipelineItem(PipelineManager, name);
+			int count = GetPipelineItemVariableCount(pass);
+			for (int i = 0; i < count; i++) {
+				const char* varName = GetPipelineItemVariableName(pass, i);
+				bool skip = false;
+				for (const char* p : perFrame)
+					skip = skip || strcmp(varName, p) == 0;
+				if (skip)
+					continue;
+				add(varName, strlen(varName) + 1);
+				add(GetPipelineItemVariableValue(pass, i), VariableSize(GetPipelineItemVariableType(pass, i)));
+			}
+		}
+		return hash;
+	}
+
 	void IRMF::InitUI(void* ctx)
 	{
 		ImGui::SetCurrentContext((ImGuiContext*)ctx);
@@ -338,6 +630,27 @@ void main() {
 
 	void IRMF::Update(float delta)
 	{
+		// ##### PROGRESSIVE PREVIEW #####
+		if (m_previewActive) {
+			float view[16];
+			float width = 0, height = 0;
+			GetViewMatrix(view);
+			GetViewportSize(width, height);
+
+			// the frame time also contains the cost of the editor itself, which
+			// is learned while there is nothing left to refine
+			float frameMs = delta * 1000.0f;
+			float stepMs = 0.0f;
+			if (m_scheduler.IsDone())
+				m_idleFrameMs = (m_idleFrameMs == 0.0f) ? frameMs : 0.9f * m_idleFrameMs + 0.1f * frameMs;
+			else
+				stepMs = std::max(frameMs - m_idleFrameMs, 0.01f);
+
+			m_scheduler.SetViewport((int)width, (int)height);
+			m_scheduler.Observe(view, GetFrameIndex(), HashUniforms());
+			m_step = m_scheduler.Next(stepMs);
+		}
+
 		// ##### UNIFORM MANAGER POPUP #####
 		if (m_isPopupOpened) {
 			ImGui::OpenPopup("Import IRMF shader##irmf_import");
@@ -396,11 +709,21 @@ void main() {
 					if (outPath.size() == 0)
 						errMessage = "Please set the output path.";
 					else {
-						bool res = Generate(irmfLink, outPath);
+						CostEstimate estimate;
+						std::string cpuErr;
+						bool res = Generate(irmfLink, outPath, m_autoPreview, m_previewMode, m_scheduler.GetBudget(), estimate, cpuErr);
 						if (!res)
 							errMessage = "Could not find IRMF shader.";
-						else
+						else {
 							OpenProject(UI, (outPath + "/project.sprj").c_str());
+
+							std::istringstream lines(FormatCostEstimate(estimate));
+							std::string line;
+							while (std::getline(lines, line))
+								AddMessage(Messages, ed::plugin::MessageType::Message, "irmf", line.c_str(), -1);
+							if (!cpuErr.empty())
+								AddMessage(Messages, ed::plugin::MessageType::Warning, "irmf", ("irmf-export cannot evaluate this shader: " + cpuErr).c_str(), -1);
+						}
 					}
 				}
 
@@ -417,6 +740,96 @@ void main() {
 		}
 	}
 
+	int IRMF::SystemVariables_GetNameCount(ed::plugin::VariableType varType)
+	{
+		if (varType == ed::plugin::VariableType::Float4)
+			return 1;
+		if (varType == ed::plugin::VariableType::Integer1)
+			return 2;
+		return 0;
+	}
+
+	const char* IRMF::SystemVariables_GetName(ed::plugin::VariableType varType, int index)
+	{
+		if (varType == ed::plugin::VariableType::Float4 && index == 0)
+			return PROGRESSIVE_TILE_VAR;
+		if (varType == ed::plugin::VariableType::Integer1) {
+			if (index == 0)
+				return PROGRESSIVE_LEVEL_VAR;
+			if (index == 1)
+				return PROGRESSIVE_GENERATION_VAR;
+		}
+		return 0;
+	}
+
+	void IRMF::SystemVariables_UpdateValue(char* data, char* name, ed::plugin::VariableType varType, bool isLastFrame)
+	{
+		if (strcmp(name, PROGRESSIVE_TILE_VAR) == 0) {
+			float tile[4] = { (float)m_step.X, (float)m_step.Y, (float)m_step.Width, (float)m_step.Height };
+			memcpy(data, tile, sizeof(tile));
+		} else if (strcmp(name, PROGRESSIVE_LEVEL_VAR) == 0) {
+			memcpy(data, &m_step.Level, sizeof(int));
+		} else if (strcmp(name, PROGRESSIVE_GENERATION_VAR) == 0) {
+			int generation = m_scheduler.GetGeneration();
+			memcpy(data, &generation, sizeof(int));
+		}
+	}
+
+	void IRMF::Options_RenderSection()
+	{
+		// "auto" followed by every PreviewMode
+		int current = m_autoPreview ? 0 : (int)m_previewMode + 1;
+		ImGui::Text("Preview mode: "); ImGui::SameLine();
+		ImGui::PushItemWidth(-1);
+		if (ImGui::BeginCombo("##irmf_preview_mode", current == 0 ? "auto" : PreviewModeName(m_previewMode))) {
+			if (ImGui::Selectable("auto", current == 0))
+				m_autoPreview = true;
+			for (int i = 0; i < (int)PreviewMode::Count; i++) {
+				if (ImGui::Selectable(PreviewModeName((PreviewMode)i), current == i + 1)) {
+					m_autoPreview = false;
+					m_previewMode = (PreviewMode)i;
+				}
+			}
+			ImGui::EndCombo();
+		}
+		ImGui::PopItemWidth();
+
+		float budget = m_scheduler.GetBudget();
+		ImGui::Text("Preview frame budget (ms): "); ImGui::SameLine();
+		ImGui::PushItemWidth(-1);
+		if (ImGui::DragFloat("##irmf_frame_budget", &budget, 0.5f, 1.0f, 100.0f, "%.1f"))
+			m_scheduler.SetBudget(budget);
+		ImGui::PopItemWidth();
+	}
+
+	void IRMF::Options_Parse(const char* key, const char* val)
+	{
+		if (strcmp(key, "preview_mode") == 0)
+			m_autoPreview = !ParsePreviewMode(val, m_previewMode);
+		else if (strcmp(key, "frame_budget") == 0)
+			m_scheduler.SetBudget((float)atof(val));
+	}
+
+	const char* IRMF::Options_GetKey(int index)
+	{
+		if (index == 0)
+			return "preview_mode";
+		if (index == 1)
+			return "frame_budget";
+		return 0;
+	}
+
+	const char* IRMF::Options_GetValue(int index)
+	{
+		if (index == 0)
+			m_optionValue = m_autoPreview ? "auto" : PreviewModeName(m_previewMode);
+		else if (index == 1)
+			m_optionValue = std::to_string(m_scheduler.GetBudget());
+		else
+			return 0;
+		return m_optionValue.c_str();
+	}
+
 	bool IRMF::HasMenuItems(const char* name)
 	{
 		return strcmp(name, "file") == 0;
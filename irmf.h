@@ -2,9 +2,18 @@
 #include <PluginAPI/Plugin.h>
 #include <vector>
 #include <string>
+#include "progressive.h"
+#include "cost.h"
 
 #define MY_PATH_LENGTH 512 // TODO: use MAX_PATH or sth
 
+// system variables provided to the generated project for progressive preview
+#define PROGRESSIVE_TILE_VAR "IRMFProgressiveTile"
+#define PROGRESSIVE_LEVEL_VAR "IRMFProgressiveLevel"
+#define PROGRESSIVE_GENERATION_VAR "IRMFProgressiveGeneration"
+// pass variable holding the coarsest refinement level of a generated project
+#define PROGRESSIVE_COARSEST_VAR "u_coarsest"
+
 namespace irmf
 {
 	class IRMF : public ed::IPlugin2
@@ -23,7 +32,7 @@ namespace irmf
 		virtual void EndRender() { }
 
 		virtual void Project_BeginLoad() { }
-		virtual void Project_EndLoad() { }
+		virtual void Project_EndLoad();
 		virtual void Project_BeginSave() { }
 		virtual void Project_EndSave() { }
 		virtual bool Project_HasAdditionalData() { return 0; }
@@ -41,10 +50,10 @@ namespace irmf
 		virtual void ShowContextItems(const char* name, void* owner = nullptr, void* extraData = nullptr) { }
 
 		// system variable methods
-		virtual int SystemVariables_GetNameCount(ed::plugin::VariableType varType) { return 0; }
-		virtual const char* SystemVariables_GetName(ed::plugin::VariableType varType, int index) { return 0; }
+		virtual int SystemVariables_GetNameCount(ed::plugin::VariableType varType);
+		virtual const char* SystemVariables_GetName(ed::plugin::VariableType varType, int index);
 		virtual bool SystemVariables_HasLastFrame(char* name, ed::plugin::VariableType varType) { return 0; }
-		virtual void SystemVariables_UpdateValue(char* data, char* name, ed::plugin::VariableType varType, bool isLastFrame) { }
+		virtual void SystemVariables_UpdateValue(char* data, char* name, ed::plugin::VariableType varType, bool isLastFrame);
 
 		// function variables
 		virtual int VariableFunctions_GetNameCount(ed::plugin::VariableType vtype) { return 0; }
@@ -124,12 +133,12 @@ namespace irmf
 		virtual void PipelineItem_DebugGetTextureSize(const char* type, void* data, int loc, const char* variableName, int& x, int& y, int& z) { }
 
 		// options
-		virtual bool Options_HasSection() { return 0; }
-		virtual void Options_RenderSection() { }
-		virtual void Options_Parse(const char* key, const char* val) { }
-		virtual int Options_GetCount() { return 0; }
-		virtual const char* Options_GetKey(int index) { return 0; }
-		virtual const char* Options_GetValue(int index) { return 0; }
+		virtual bool Options_HasSection() { return 1; }
+		virtual void Options_RenderSection();
+		virtual void Options_Parse(const char* key, const char* val);
+		virtual int Options_GetCount() { return 2; }
+		virtual const char* Options_GetKey(int index);
+		virtual const char* Options_GetValue(int index);
 
 		// languages
 		virtual int CustomLanguage_GetCount() { return 0; }
@@ -211,11 +220,22 @@ namespace irmf
 		virtual int ImmediateMode_GetResultID() { return 0; }
 
 	private:
+		unsigned long long HashUniforms();
+
 		bool m_errorOccured;
 		std::string m_error;
 		char m_link[256], m_path[MY_PATH_LENGTH];
 		bool m_isPopupOpened;
 
 		int m_hostVersion;
+
+		// preview
+		bool m_autoPreview;
+		PreviewMode m_previewMode;
+		bool m_previewActive;
+		ProgressiveScheduler m_scheduler;
+		ProgressiveStep m_step;
+		float m_idleFrameMs;
+		std::string m_optionValue;
 	};
 }
\ No newline at end of file
@@ -0,0 +1,198 @@
+#include "lexer.h"
+#include <cctype>
+#include <cstring>
+#include <map>
+
+namespace irmf
+{
+	static bool IsIdentStart(char c) { return isalpha((unsigned char)c) || c == '_'; }
+	static bool IsIdentChar(char c) { return isalnum((unsigned char)c) || c == '_'; }
+
+	// multi-character operators, longest first
+	static const char* Operators[] = {
+		"<<=", ">>=",
+		"++", "--", "<=", ">=", "==", "!=", "&&", "||", "^^", "+=", "-=", "*=", "/=", "%=",
+		"&=", "|=", "^=", "<<", ">>",
+		0
+	};
+
+	bool Lex(const std::string& src, std::vector<Token>& out, std::string& err)
+	{
+		std::map<std::string, std::vector<Token>> macros;
+		size_t i = 0, n = src.size();
+		int line = 1;
+		bool lineStart = true;
+
+		out.clear();
+		while (i < n) {
+			char c = src[i];
+
+			if (c == '\n') {
+				line++;
+				lineStart = true;
+				i++;
+				continue;
+			}
+			if (isspace((unsigned char)c)) {
+				i++;
+				continue;
+			}
+
+			// comments
+			if (c == '/' && i + 1 < n && src[i + 1] == '/') {
+				while (i < n && src[i] != '\n')
+					i++;
+				continue;
+			}
+			if (c == '/' && i + 1 < n && src[i + 1] == '*') {
+				size_t end = src.find("*/", i + 2);
+				if (end == std::string::npos) {
+					err = "line " + std::to_string(line) + ": unterminated comment";
+					return false;
+				}
+				for (size_t j = i; j < end; j++)
+					if (src[j] == '\n')
+						line++;
+				i = end + 2;
+				continue;
+			}
+
+			// preprocessor
+			if (c == '#' && lineStart) {
+				size_t end = i;
+				while (end < n && src[end] != '\n') {
+					if (src[end] == '\\' && end + 1 < n && src[end + 1] == '\n')
+						end++;
+					end++;
+				}
+				std::string directive = src.substr(i + 1, end - i - 1);
+				size_t p = directive.find_first_not_of(" \t");
+				if (p != std::string::npos && directive.compare(p, 6, "define") == 0) {
+					p += 6;
+					while (p < directive.size() && (directive[p] == ' ' || directive[p] == '\t'))
+						p++;
+					size_t nameEnd = p;
+					while (nameEnd < directive.size() && IsIdentChar(directive[nameEnd]))
+						nameEnd++;
+					std::string name = directive.substr(p, nameEnd - p);
+					if (name.empty()) {
+						err = "line " + std::to_string(line) + ": malformed #define";
+						return false;
+					}
+					if (nameEnd < directive.size() && directive[nameEnd] == '(') {
+						err = "line " + std::to_string(line) + ": function-like macro '" + name + "' is not supported";
+						return false;
+					}
+					std::vector<Token> value;
+					if (!Lex(directive.substr(nameEnd), value, err))
+						return false;
+					value.pop_back(); // End
+
+					// expand previously defined macros so that lookups stay single-level
+					std::vector<Token> expanded;
+					for (Token& t : value) {
+						auto macro = macros.find(t.Text);
+						if (t.Type == TokenType::Identifier && macro != macros.end())
+							expanded.insert(expanded.end(), macro->second.begin(), macro->second.end());
+						else
+							expanded.push_back(t);
+					}
+					for (Token& t : expanded)
+						t.Line = line;
+					macros[name] = expanded;
+				}
+				for (size_t j = i; j < end; j++)
+					if (src[j] == '\n')
+						line++;
+				i = end;
+				continue;
+			}
+			lineStart = false;
+
+			Token tok;
+			tok.Line = line;
+
+			if (IsIdentStart(c)) {
+				size_t start = i;
+				while (i < n && IsIdentChar(src[i]))
+					i++;
+				tok.Type = TokenType::Identifier;
+				tok.Text = src.substr(start, i - start);
+
+				auto macro = macros.find(tok.Text);
+				if (macro != macros.end()) {
+					for (Token t : macro->second) {
+						t.Line = line;
+						out.push_back(t);
+					}
+					continue;
+				}
+			} else if (isdigit((unsigned char)c) || (c == '.' && i + 1 < n && isdigit((unsigned char)src[i + 1]))) {
+				size_t start = i;
+				if (c == '0' && i + 1 < n && (src[i + 1] == 'x' || src[i + 1] == 'X')) {
+					i += 2;
+					while (i < n && isxdigit((unsigned char)src[i]))
+						i++;
+				} else {
+					while (i < n && (isdigit((unsigned char)src[i]) || src[i] == '.'))
+						i++;
+					if (i < n && (src[i] == 'e' || src[i] == 'E')) {
+						i++;
+						if (i < n && (src[i] == '+' || src[i] == '-'))
+							i++;
+						while (i < n && isdigit((unsigned char)src[i]))
+							i++;
+					}
+				}
+				// suffixes: 1.0f, 2u, 1.0lf
+				while (i < n && (src[i] == 'f' || src[i] == 'F' || src[i] == 'u' || src[i] == 'U' || src[i] == 'l' || src[i] == 'L'))
+					i++;
+				tok.Type = TokenType::Number;
+				tok.Text = src.substr(start, i - start);
+			} else {
+				tok.Type = TokenType::Punctuation;
+				tok.Text = std::string(1, c);
+				for (int k = 0; Operators[k]; k++) {
+					size_t len = strlen(Operators[k]);
+					if (src.compare(i, len, Operators[k]) == 0) {
+						tok.Text = Operators[k];
+						break;
+					}
+				}
+				i += tok.Text.size();
+			}
+
+			out.push_back(tok);
+		}
+
+		Token end;
+		end.Type = TokenType::End;
+		end.Line = line;
+		out.push_back(end);
+		return true;
+	}
+
+	bool SplitIRMF(const std::string& src, std::string& preamble, std::string& body, std::string& err)
+	{
+		if (src.substr(0, 3) != "/*{") {
+			err = "IRMF shader must start with: '/*{'";
+			return false;
+		}
+
+		size_t endJSON = src.find("}*/");
+		if (endJSON == std::string::npos) {
+			err = "IRMF shader must have JSON preamble ending with: '}*/'";
+			return false;
+		}
+
+		preamble = src.substr(2, endJSON - 1);
+
+		// keep the line numbers of the body identical to the original file
+		size_t lines = 0;
+		for (size_t i = 0; i < endJSON; i++)
+			if (src[i] == '\n')
+				lines++;
+		body = std::string(lines, '\n') + src.substr(endJSON + 3);
+		return true;
+	}
+}
@@ -0,0 +1,33 @@
+#pragma once
+#include <string>
+#include <vector>
+
+namespace irmf
+{
+	enum class TokenType
+	{
+		Identifier,
+		Number,
+		Punctuation,
+		End
+	};
+
+	struct Token
+	{
+		TokenType Type;
+		std::string Text;
+		int Line;
+
+		bool Is(const char* text) const { return Type != TokenType::End && Text == text; }
+	};
+
+	// Lex splits GLSL source into tokens. Comments are dropped and so are
+	// preprocessor directives, except for object-like '#define NAME value'
+	// macros which are expanded in place. Returns false and sets err on
+	// malformed input (e.g. unterminated comments or function-like macros).
+	bool Lex(const std::string& src, std::vector<Token>& out, std::string& err);
+
+	// SplitIRMF separates the JSON preamble ('/*{ ... }*/') of an IRMF shader
+	// from its GLSL body.
+	bool SplitIRMF(const std::string& src, std::string& preamble, std::string& body, std::string& err);
+}
@@ -0,0 +1,508 @@
+#include "mesher.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include "decimate.h"
+#include "sampler.h"
+#include "threadpool.h"
+
+namespace irmf
+{
+	namespace
+	{
+		// Corners of a cell are numbered x + 2y + 4z. Edge e runs along axis
+		// e / 4; e % 4 holds its position on the two other axes, the lower
+		// axis in bit 0.
+		int EdgeOf(int a, int b)
+		{
+			int axis = a ^ b;
+			axis = axis == 1 ? 0 : axis == 2 ? 1 : 2;
+			int other0 = axis == 0 ? 1 : 0, other1 = axis == 2 ? 1 : 2;
+			return axis * 4 + ((a >> other0) & 1) + 2 * ((a >> other1) & 1);
+		}
+
+		// Case lists the triangles of one corner configuration as edge
+		// triples.
+		struct Case
+		{
+			uint8_t Count;
+			int8_t Edges[36];
+		};
+
+		// BuildCases derives the triangle table instead of spelling it out.
+		// On every face of the cell, walked counter-clockwise as seen from
+		// outside, each run of inside corners is cut off by a segment from
+		// the edge where the walk enters it to the edge where it leaves.
+		// Neighbouring cells see the same segments in the opposite
+		// direction, so the surface is closed and consistently oriented.
+		// The segments form loops around the cell, which are triangulated
+		// as fans, counter-clockwise seen from outside the material.
+		std::vector<Case> BuildCases()
+		{
+			std::vector<Case> cases(256);
+			for (int config = 0; config < 256; config++) {
+				int next[12];
+				std::fill(next, next + 12, -1);
+				for (int axis = 0; axis < 3; axis++)
+					for (int side = 0; side < 2; side++) {
+						int b = (axis + 1) % 3, c = (axis + 2) % 3;
+						int uv[4][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 } };
+						int corners[4];
+						for (int k = 0; k < 4; k++) {
+							int* p = uv[side ? k : 3 - k];
+							corners[k] = (side << axis) | (p[0] << b) | (p[1] << c);
+						}
+						auto inside = [&](int k) { return (config >> corners[k & 3]) & 1; };
+						for (int k = 0; k < 4; k++) {
+							if (inside(k) || !inside(k + 1))
+								continue;
+							int m = k + 1;
+							while (!(inside(m) && !inside(m + 1)))
+								m++;
+							next[EdgeOf(corners[k & 3], corners[(k + 1) & 3])] = EdgeOf(corners[m & 3], corners[(m + 1) & 3]);
+						}
+					}
+
+				Case& out = cases[config];
+				out.Count = 0;
+				bool visited[12] = {};
+				for (int e = 0; e < 12; e++) {
+					if (next[e] < 0 || visited[e])
+						continue;
+					int loop[12], length = 0;
+					for (int f = e; !visited[f]; f = next[f]) {
+						visited[f] = true;
+						loop[length++] = f;
+					}
+					for (int k = 1; k + 1 < length; k++) {
+						int8_t* t = out.Edges + 3 * out.Count++;
+						t[0] = (int8_t)loop[0];
+						t[1] = (int8_t)loop[k];
+						t[2] = (int8_t)loop[k + 1];
+					}
+				}
+			}
+			return cases;
+		}
+
+		const Case* Cases()
+		{
+			static const std::vector<Case> cases = BuildCases();
+			return cases.data();
+		}
+
+		// The lattice is the grid's cell centers with one more plane of empty
+		// samples on every side. A plane holds its samples and, per
+		// material, the vertices on the edges that leave each sample along
+		// +x and +y.
+		struct Plane
+		{
+			std::vector<float> Values;   // material * nx * ny + j * nx + i
+			std::vector<uint32_t> Edges; // (material * nx * ny + j * nx + i) * 2 + axis
+		};
+
+		// per thread state, created by the thread on its first slab
+		struct Worker
+		{
+			std::unique_ptr<RowSampler> Sampler;
+			// without a sampler, layer k sampled before, as in a Slab
+			std::function<const float*(int k)> Layers;
+			Plane Planes[2];
+			std::vector<uint32_t> Up; // vertices on the edges between the planes
+		};
+
+		class SlabMesher
+		{
+		public:
+			SlabMesher(const Grid& grid, int materials, float iso)
+				: m_grid(grid)
+				, m_materials(materials)
+				, m_iso(iso)
+				, m_nx(grid.Size[0] + 2)
+				, m_ny(grid.Size[1] + 2)
+			{
+			}
+
+			inline int GetPlaneCount() const { return m_grid.Size[2] + 2; }
+
+			// Mesh triangulates the cells between planes [p0, p1] into one
+			// part per material.
+			bool Mesh(Worker& worker, int p0, int p1, MeshPart* parts) const
+			{
+				size_t cells = (size_t)m_nx * m_ny;
+				for (Plane& plane : worker.Planes) {
+					plane.Values.resize(m_materials * cells);
+					plane.Edges.resize(m_materials * cells * 2);
+				}
+				worker.Up.resize(cells);
+
+				Plane* bottom = &worker.Planes[0];
+				Plane* top = &worker.Planes[1];
+				if (!Sample(worker, p0, *bottom))
+					return false;
+				for (int m = 0; m < m_materials; m++) {
+					parts[m].Clear();
+					PlaneVertices(*bottom, m, p0, parts[m], &parts[m].Bottom);
+				}
+				for (int p = p0; p < p1; p++) {
+					if (!Sample(worker, p + 1, *top))
+						return false;
+					for (int m = 0; m < m_materials; m++) {
+						PlaneVertices(*top, m, p + 1, parts[m], p + 1 == p1 ? &parts[m].Top : nullptr);
+						UpVertices(*bottom, *top, m, p, parts[m], worker.Up.data());
+						Cells(*bottom, *top, m, worker.Up.data(), parts[m]);
+					}
+					std::swap(bottom, top);
+				}
+				return true;
+			}
+
+		private:
+			float Position(int axis, int i) const
+			{
+				return m_grid.Min[axis] + (i - 0.5f) * m_grid.Pitch[axis];
+			}
+
+			bool Sample(Worker& worker, int p, Plane& plane) const
+			{
+				size_t cells = (size_t)m_nx * m_ny;
+				if (p == 0 || p == GetPlaneCount() - 1) {
+					std::fill(plane.Values.begin(), plane.Values.end(), 0.0f);
+					return true;
+				}
+				for (int m = 0; m < m_materials; m++) {
+					float* values = plane.Values.data() + m * cells;
+					std::fill(values, values + m_nx, 0.0f);
+					std::fill(values + cells - m_nx, values + cells, 0.0f);
+				}
+				const float* layer = worker.Sampler ? nullptr : worker.Layers(p - 1);
+				for (int j = 1; j + 1 < m_ny; j++) {
+					if (worker.Sampler && !worker.Sampler->Sample(j - 1, p - 1))
+						return false;
+					for (int m = 0; m < m_materials; m++) {
+						float* row = plane.Values.data() + m * cells + (size_t)j * m_nx;
+						const float* values = worker.Sampler ? worker.Sampler->GetValues(m)
+															 : layer + ((size_t)m * (m_ny - 2) + j - 1) * (m_nx - 2);
+						row[0] = row[m_nx - 1] = 0.0f;
+						std::copy(values, values + m_nx - 2, row + 1);
+					}
+				}
+				return true;
+			}
+
+			uint32_t AddVertex(MeshPart& part, float x, float y, float z) const
+			{
+				uint32_t index = part.GetVertexCount();
+				part.Positions.push_back(x);
+				part.Positions.push_back(y);
+				part.Positions.push_back(z);
+				return index;
+			}
+
+			// PlaneVertices adds the vertices on the +x and +y edges of plane p
+			// where the surface of material m crosses them, and lists them in
+			// shared if the plane is a slab boundary
+			void PlaneVertices(Plane& plane, int m, int p, MeshPart& part, std::vector<std::pair<uint32_t, uint32_t>>* shared) const
+			{
+				size_t cells = (size_t)m_nx * m_ny;
+				const float* values = plane.Values.data() + m * cells;
+				uint32_t* edges = plane.Edges.data() + m * cells * 2;
+				float z = Position(2, p);
+				for (int j = 0; j < m_ny; j++) {
+					const float* row = values + (size_t)j * m_nx;
+					float y = Position(1, j);
+					for (int i = 0; i < m_nx; i++) {
+						float v = row[i];
+						bool inside = v >= m_iso;
+						size_t key = ((size_t)j * m_nx + i) * 2;
+						if (i + 1 < m_nx && inside != (row[i + 1] >= m_iso)) {
+							float t = (m_iso - v) / (row[i + 1] - v);
+							edges[key] = AddVertex(part, Position(0, i) + t * m_grid.Pitch[0], y, z);
+							if (shared)
+								shared->emplace_back((uint32_t)key, edges[key]);
+						}
+						if (j + 1 < m_ny && inside != (row[i + m_nx] >= m_iso)) {
+							float t = (m_iso - v) / (row[i + m_nx] - v);
+							edges[key + 1] = AddVertex(part, Position(0, i), y + t * m_grid.Pitch[1], z);
+							if (shared)
+								shared->emplace_back((uint32_t)key + 1, edges[key + 1]);
+						}
+					}
+				}
+			}
+
+			// UpVertices adds the vertices on the edges from plane p to p + 1
+			void UpVertices(const Plane& bottom, const Plane& top, int m, int p, MeshPart& part, uint32_t* up) const
+			{
+				size_t cells = (size_t)m_nx * m_ny;
+				const float* lower = bottom.Values.data() + m * cells;
+				const float* upper = top.Values.data() + m * cells;
+				float z = Position(2, p);
+				for (int j = 0; j < m_ny; j++)
+					for (int i = 0; i < m_nx; i++) {
+						size_t at = (size_t)j * m_nx + i;
+						float v = lower[at];
+						if ((v >= m_iso) != (upper[at] >= m_iso)) {
+							float t = (m_iso - v) / (upper[at] - v);
+							up[at] = AddVertex(part, Position(0, i), Position(1, j), z + t * m_grid.Pitch[2]);
+						}
+					}
+			}
+
+			void Cells(const Plane& bottom, const Plane& top, int m, const uint32_t* up, MeshPart& part) const
+			{
+				size_t cells = (size_t)m_nx * m_ny;
+				const float* values[2] = { bottom.Values.data() + m * cells, top.Values.data() + m * cells };
+				const uint32_t* edges[2] = { bottom.Edges.data() + m * cells * 2, top.Edges.data() + m * cells * 2 };
+				const Case* cases = Cases();
+				for (int j = 0; j + 1 < m_ny; j++)
+					for (int i = 0; i + 1 < m_nx; i++) {
+						size_t at = (size_t)j * m_nx + i;
+						int config = 0;
+						for (int c = 0; c < 8; c++) {
+							size_t corner = at + (c & 1) + ((c >> 1) & 1) * m_nx;
+							config |= (values[c >> 2][corner] >= m_iso) << c;
+						}
+						const Case& cell = cases[config];
+						for (int k = 0; k < 3 * cell.Count; k++) {
+							int e = cell.Edges[k], axis = e >> 2, a = e & 1, b = (e >> 1) & 1;
+							uint32_t vertex;
+							if (axis == 0)
+								vertex = edges[b][(at + a * m_nx) * 2];
+							else if (axis == 1)
+								vertex = edges[b][(at + a) * 2 + 1];
+							else
+								vertex = up[at + a + b * m_nx];
+							part.Triangles.push_back(vertex);
+						}
+					}
+			}
+
+			const Grid& m_grid;
+			int m_materials;
+			float m_iso;
+			int m_nx, m_ny;
+		};
+
+		// MeshSink meshes the slabs of RunPipeline with marching cubes:
+		// Encode triangulates the cells within a slab, Write the ones
+		// between it and the slab before, from a copy of that one's last
+		// layer.
+		class MeshSink : public SlabSink
+		{
+		public:
+			MeshSink(const MeshSettings& settings, const std::vector<std::string>& filenames, MeshStats& stats)
+				: m_settings(settings)
+				, m_filenames(filenames)
+				, m_stats(stats)
+				, m_layers(0)
+			{
+			}
+
+			bool Begin(const Grid& grid, int materials, int slots, int workers, std::string& err) override
+			{
+				if (!(m_settings.IsoLevel > 0.0f && m_settings.IsoLevel <= 1.0f)) {
+					err = "the iso level must be in (0, 1]";
+					return false;
+				}
+				if ((int)m_filenames.size() != materials) {
+					err = "one file name per material is needed";
+					return false;
+				}
+				if ((uint64_t)(grid.Size[0] + 2) * (grid.Size[1] + 2) * 2 > 0xffffffffu) {
+					err = "the pitch is too small for the size of the model";
+					return false;
+				}
+				for (int m = 0; m < materials; m++) {
+					m_writers.emplace_back(new MeshWriter());
+					if (!m_writers[m]->Open(m_filenames[m], m_settings.Format, err)) {
+						m_writers.clear();
+						Discard();
+						return false;
+					}
+				}
+				m_grid = grid;
+				m_mesher.reset(new SlabMesher(m_grid, materials, m_settings.IsoLevel));
+				m_slots.assign(slots, std::vector<MeshPart>(materials));
+				m_workers.resize(workers);
+				m_gap.resize(materials);
+				return true;
+			}
+
+			void Encode(const Slab& slab, int slot, int w) override
+			{
+				Worker& worker = m_workers[w];
+				worker.Layers = [&slab](int k) { return slab.Layer(k - slab.First); };
+				// plane p holds layer p - 1
+				std::vector<MeshPart>& parts = m_slots[slot];
+				m_mesher->Mesh(worker, slab.First + 1, slab.First + slab.Count, parts.data());
+				if (slab.Count == 1)
+					for (MeshPart& part : parts)
+						part.Top = part.Bottom;
+			}
+
+			bool Write(const Slab& slab, int slot) override
+			{
+				if (!Gap(slab.First, &slab))
+					return false;
+				for (size_t m = 0; m < m_writers.size(); m++)
+					if (!m_writers[m]->Add(m_slots[slot][m]))
+						return false;
+				const float* last = slab.Layer(slab.Count - 1);
+				m_last.assign(last, last + slab.LayerSize);
+				m_layers = slab.First + slab.Count;
+				return true;
+			}
+
+			bool Finish(std::string& err) override
+			{
+				// the cells above the last layer, if it was reached
+				bool ok = m_layers < m_grid.Size[2] || Gap(m_layers, nullptr);
+				m_stats.Triangles.assign(m_writers.size(), 0);
+				m_stats.Vertices.assign(m_writers.size(), 0);
+				for (size_t m = 0; m < m_writers.size(); m++) {
+					std::string writeErr;
+					if (!m_writers[m]->Close(writeErr) && ok) {
+						err = writeErr;
+						ok = false;
+					}
+					m_stats.Triangles[m] = m_writers[m]->GetTriangleCount();
+					m_stats.Vertices[m] = m_writers[m]->GetVertexCount();
+				}
+				return ok;
+			}
+
+			void Discard() override
+			{
+				for (const std::string& filename : m_filenames)
+					remove(filename.c_str());
+			}
+
+		private:
+			// Gap writes the cells between planes p and p + 1: the last layer
+			// kept and the first of slab
+			bool Gap(int p, const Slab* slab)
+			{
+				m_worker.Layers = [&](int k) { return k == p - 1 ? m_last.data() : slab->Layer(k - slab->First); };
+				m_mesher->Mesh(m_worker, p, p + 1, m_gap.data());
+				for (size_t m = 0; m < m_writers.size(); m++)
+					if (!m_writers[m]->Add(m_gap[m]))
+						return false;
+				return true;
+			}
+
+			MeshSettings m_settings;
+			std::vector<std::string> m_filenames;
+			MeshStats& m_stats;
+			Grid m_grid;
+			std::unique_ptr<SlabMesher> m_mesher;
+			std::vector<std::unique_ptr<MeshWriter>> m_writers;
+			std::vector<std::vector<MeshPart>> m_slots;
+			std::vector<Worker> m_workers;
+			Worker m_worker; // for Write
+			std::vector<MeshPart> m_gap;
+			std::vector<float> m_last;
+			int m_layers; // written so far
+		};
+	}
+
+	bool MarchingCubes(const Model& model, const MeshSettings& settings, const MeshConsumer& consume, std::string& err)
+	{
+		int materials = (int)model.Materials.size();
+		if (!(settings.IsoLevel > 0.0f && settings.IsoLevel <= 1.0f)) {
+			err = "the iso level must be in (0, 1]";
+			return false;
+		}
+		Grid grid;
+		if (settings.Source ? !GetSourceGrid(model, *settings.Source, grid, err)
+						   : !MakeGrid(model, settings.Pitch, 0.0f, grid, err))
+			return false;
+		if ((uint64_t)(grid.Size[0] + 2) * (grid.Size[1] + 2) * 2 > 0xffffffffu) {
+			err = "the pitch is too small for the size of the model";
+			return false;
+		}
+
+		ThreadPool pool(settings.Threads);
+		int threads = pool.GetThreadCount();
+		std::vector<Worker> workers(threads);
+		SlabMesher mesher(grid, materials, settings.IsoLevel);
+
+		// thin slabs keep every thread busy, thick ones sample the planes
+		// between slabs (twice) less often
+		int layers = mesher.GetPlaneCount() - 1;
+		int thickness = std::min(16, std::max(4, layers / (4 * threads)));
+		int slabs = (layers + thickness - 1) / thickness;
+
+		int window = 2 * threads;
+		std::vector<std::vector<MeshPart>> slots(window, std::vector<MeshPart>(materials));
+		std::atomic<bool> runaway(false);
+
+		auto mesh = [&](int s, int slot, int w) {
+			Worker& worker = workers[w];
+			if (!worker.Sampler)
+				worker.Sampler.reset(new RowSampler(model, grid, 0, settings.Source));
+			int p0 = s * thickness, p1 = std::min(p0 + thickness, layers);
+			if (!mesher.Mesh(worker, p0, p1, slots[slot].data())) {
+				runaway = true;
+				return false;
+			}
+			return true;
+		};
+
+		auto write = [&](int s, int slot) {
+			for (int m = 0; m < materials; m++)
+				if (!consume(m, slots[slot][m]))
+					return false;
+			if (settings.Progress)
+				settings.Progress(s + 1, slabs);
+			return true;
+		};
+
+		bool ok = RunOrdered(pool, slabs, window, mesh, write);
+		if (runaway)
+			err = "a loop in the model did not terminate";
+		return ok;
+	}
+
+	bool WriteMeshFiles(Mesher mesher, const Model& model, const MeshSettings& settings, const std::vector<std::string>& filenames, MeshStats& stats, std::string& err)
+	{
+		int materials = (int)model.Materials.size();
+		if ((int)filenames.size() != materials) {
+			err = "one file name per material is needed";
+			return false;
+		}
+
+		std::vector<std::unique_ptr<MeshWriter>> writers;
+		for (int m = 0; m < materials; m++) {
+			writers.emplace_back(new MeshWriter());
+			if (!writers[m]->Open(filenames[m], settings.Format, err))
+				return false;
+		}
+
+		auto consume = [&](int m, const MeshPart& part) {
+			return writers[m]->Add(part);
+		};
+		bool ok = settings.MaxError > 0.0f ? Decimate(mesher, model, settings, consume, stats, err) : mesher(model, settings, consume, err);
+
+		stats.Triangles.assign(materials, 0);
+		stats.Vertices.assign(materials, 0);
+		for (int m = 0; m < materials; m++) {
+			std::string writeErr;
+			if (!writers[m]->Close(writeErr) && err.empty()) {
+				err = writeErr;
+				ok = false;
+			}
+			stats.Triangles[m] = writers[m]->GetTriangleCount();
+			stats.Vertices[m] = writers[m]->GetVertexCount();
+		}
+		if (!ok)
+			for (const std::string& filename : filenames)
+				remove(filename.c_str());
+		return ok;
+	}
+
+	std::unique_ptr<SlabSink> NewMeshSink(const MeshSettings& settings, const std::vector<std::string>& filenames, MeshStats& stats)
+	{
+		return std::unique_ptr<SlabSink>(new MeshSink(settings, filenames, stats));
+	}
+}
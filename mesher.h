@@ -0,0 +1,81 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "meshwriter.h"
+#include "model.h"
+#include "pipeline.h"
+
+namespace irmf
+{
+	class VoxelSource;
+
+	// MeshSettings controls the resolution and parallelism of a mesh export.
+	struct MeshSettings
+	{
+		float Pitch;       // sample spacing, in model units
+		float IsoLevel;    // material value of the surface, in (0, 1]
+		float Tolerance;   // dual contouring: how far merging cells may move
+		                   // the surface, in model units (<= 0: Pitch / 10)
+		float MaxError;    // decimation: how far simplifying may move the
+		                   // surface, in cells (<= 0: no decimation)
+		MeshFormat Format;
+		int Threads;       // <= 0: one per hardware thread
+		VoxelSource* Source; // marching cubes: if set, samples are read from
+		                     // it (and its grid) instead of evaluating the model
+
+		// Progress is called on the calling thread as the export goes on,
+		// with the number of slabs (or bricks) done and the total
+		std::function<void(int, int)> Progress;
+
+		MeshSettings()
+			: Pitch(0.1f)
+			, IsoLevel(0.5f)
+			, Tolerance(0.0f)
+			, MaxError(0.0f)
+			, Format(MeshFormat::STL)
+			, Threads(0)
+			, Source(nullptr)
+		{
+		}
+	};
+
+	// MeshStats is what an export wrote, per material.
+	struct MeshStats
+	{
+		std::vector<uint64_t> Triangles;
+		std::vector<uint64_t> Vertices;
+		std::vector<double> MaxDeviation; // decimated: from the model's surface, in cells (see Decimate)
+	};
+
+	// MeshConsumer receives the mesh of each material in parts, on the
+	// calling thread and in order; a part may share vertices with the
+	// previous part of its material (see MeshPart). Returning false stops
+	// the export.
+	typedef std::function<bool(int material, const MeshPart& part)> MeshConsumer;
+
+	// MarchingCubes samples the model on a grid of Pitch sized cells and
+	// passes the surface of every material to consume. Outside the bounding
+	// box counts as empty, so every mesh is closed. The grid is cut into Z
+	// slabs that are sampled and triangulated in parallel, each with its own
+	// vertex caches, and handed over in order; a worker holds two planes of
+	// samples and edge vertices per material, about 30 bytes per XY cell per
+	// material. err is left empty if consume stopped it.
+	bool MarchingCubes(const Model& model, const MeshSettings& settings, const MeshConsumer& consume, std::string& err);
+
+	// Mesher is MarchingCubes or DualContour.
+	typedef bool (*Mesher)(const Model& model, const MeshSettings& settings, const MeshConsumer& consume, std::string& err);
+
+	// WriteMeshFiles meshes the model with mesher and writes material m to
+	// filenames[m] in settings.Format. Nothing is left behind on failure.
+	bool WriteMeshFiles(Mesher mesher, const Model& model, const MeshSettings& settings, const std::vector<std::string>& filenames, MeshStats& stats, std::string& err);
+
+	// NewMeshSink makes a RunPipeline sink that writes material m to
+	// filenames[m] with marching cubes, like WriteMeshFiles, using
+	// settings.IsoLevel and Format. The cells within a slab are meshed on
+	// the workers and the ones between slabs as they are written, so the
+	// triangles are those of MarchingCubes in another order.
+	std::unique_ptr<SlabSink> NewMeshSink(const MeshSettings& settings, const std::vector<std::string>& filenames, MeshStats& stats);
+}
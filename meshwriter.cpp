@@ -0,0 +1,228 @@
+#include "meshwriter.h"
+#include <cmath>
+#include <cstring>
+
+namespace irmf
+{
+	namespace
+	{
+		const size_t Flush = 1 << 20;
+
+		std::string PlyHeader(uint64_t vertices, uint64_t faces)
+		{
+			// fixed width counts, so the header can be rewritten in place
+			char header[512];
+			snprintf(header, sizeof(header),
+				"ply\n"
+				"format binary_little_endian 1.0\n"
+				"comment written by irmf-export\n"
+				"element vertex %010llu\n"
+				"property float x\n"
+				"property float y\n"
+				"property float z\n"
+				"element face %010llu\n"
+				"property list uchar int vertex_indices\n"
+				"end_header\n",
+				(unsigned long long)vertices, (unsigned long long)faces);
+			return header;
+		}
+
+		void Put(std::vector<uint8_t>& out, const void* data, size_t size)
+		{
+			const uint8_t* p = (const uint8_t*)data;
+			out.insert(out.end(), p, p + size);
+		}
+	}
+
+	void MeshPart::Clear()
+	{
+		Positions.clear();
+		Triangles.clear();
+		Bottom.clear();
+		Top.clear();
+	}
+
+	MeshWriter::MeshWriter()
+		: m_file(nullptr)
+		, m_faces(nullptr)
+		, m_format(MeshFormat::STL)
+		, m_vertices(0)
+		, m_triangles(0)
+		, m_header(0)
+	{
+	}
+
+	MeshWriter::~MeshWriter()
+	{
+		if (m_faces)
+			fclose(m_faces);
+		if (m_file)
+			fclose(m_file);
+	}
+
+	bool MeshWriter::Open(const std::string& filename, MeshFormat format, std::string& err)
+	{
+		m_file = fopen(filename.c_str(), "wb");
+		if (!m_file) {
+			err = "failed to create " + filename;
+			return false;
+		}
+		m_format = format;
+		m_vertices = m_triangles = 0;
+		m_boundary.clear();
+		m_error.clear();
+
+		if (format == MeshFormat::PLY) {
+			m_faces = tmpfile();
+			if (!m_faces) {
+				err = "failed to create a temporary file";
+				return false;
+			}
+			std::string header = PlyHeader(0, 0);
+			m_header = (long)header.size();
+			return Write(m_file, header.data(), header.size());
+		}
+
+		char header[84] = "binary STL written by irmf-export";
+		return Write(m_file, header, sizeof(header));
+	}
+
+	bool MeshWriter::Fail(const std::string& err)
+	{
+		if (m_error.empty())
+			m_error = err;
+		return false;
+	}
+
+	bool MeshWriter::Write(FILE* file, const void* data, size_t size)
+	{
+		if (!m_error.empty())
+			return false;
+		if (size > 0 && fwrite(data, 1, size, file) != size)
+			return Fail("failed to write the mesh (disk full?)");
+		return true;
+	}
+
+	bool MeshWriter::Add(const MeshPart& part)
+	{
+		const float* p = part.Positions.data();
+		const uint32_t* t = part.Triangles.data();
+		uint32_t triangles = part.GetTriangleCount();
+		m_buffer.clear();
+
+		if (m_format == MeshFormat::STL) {
+			if (m_triangles + triangles > 0xffffffffu)
+				return Fail("too many triangles for STL");
+			for (uint32_t i = 0; i < triangles; i++, t += 3) {
+				const float* a = p + 3 * t[0];
+				const float* b = p + 3 * t[1];
+				const float* c = p + 3 * t[2];
+				float u[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+				float v[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+				float n[3] = { u[1] * v[2] - u[2] * v[1], u[2] * v[0] - u[0] * v[2], u[0] * v[1] - u[1] * v[0] };
+				float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+				for (int k = 0; k < 3; k++)
+					n[k] = length > 0.0f ? n[k] / length : 0.0f;
+				uint16_t attributes = 0;
+				Put(m_buffer, n, 12);
+				Put(m_buffer, a, 12);
+				Put(m_buffer, b, 12);
+				Put(m_buffer, c, 12);
+				Put(m_buffer, &attributes, 2);
+				if (m_buffer.size() >= Flush) {
+					if (!Write(m_file, m_buffer.data(), m_buffer.size()))
+						return false;
+					m_buffer.clear();
+				}
+			}
+			m_triangles += triangles;
+			m_vertices += 3 * (uint64_t)triangles;
+			return Write(m_file, m_buffer.data(), m_buffer.size());
+		}
+
+		// vertices shared with the previous part were written with it
+		const uint32_t none = 0xffffffffu;
+		uint32_t vertices = part.GetVertexCount();
+		m_remap.assign(vertices, none);
+		for (const auto& shared : part.Bottom) {
+			auto it = m_boundary.find(shared.first);
+			if (it != m_boundary.end())
+				m_remap[shared.second] = it->second;
+		}
+		for (uint32_t i = 0; i < vertices; i++) {
+			if (m_remap[i] != none)
+				continue;
+			if (m_vertices >= 0x7fffffff)
+				return Fail("too many vertices for PLY");
+			m_remap[i] = (uint32_t)m_vertices++;
+			Put(m_buffer, p + 3 * i, 12);
+			if (m_buffer.size() >= Flush) {
+				if (!Write(m_file, m_buffer.data(), m_buffer.size()))
+					return false;
+				m_buffer.clear();
+			}
+		}
+		if (!Write(m_file, m_buffer.data(), m_buffer.size()))
+			return false;
+
+		m_boundary.clear();
+		for (const auto& shared : part.Top)
+			m_boundary[shared.first] = m_remap[shared.second];
+
+		m_buffer.clear();
+		for (uint32_t i = 0; i < triangles; i++, t += 3) {
+			uint8_t count = 3;
+			int32_t face[3] = { (int32_t)m_remap[t[0]], (int32_t)m_remap[t[1]], (int32_t)m_remap[t[2]] };
+			Put(m_buffer, &count, 1);
+			Put(m_buffer, face, 12);
+			if (m_buffer.size() >= Flush) {
+				if (!Write(m_faces, m_buffer.data(), m_buffer.size()))
+					return false;
+				m_buffer.clear();
+			}
+		}
+		m_triangles += triangles;
+		return Write(m_faces, m_buffer.data(), m_buffer.size());
+	}
+
+	bool MeshWriter::Close(std::string& err)
+	{
+		if (!m_file) {
+			err = "the mesh is not open";
+			return false;
+		}
+
+		if (m_format == MeshFormat::PLY) {
+			// append the faces, then fill in the counts
+			m_buffer.resize(Flush);
+			if (m_error.empty() && fseek(m_faces, 0, SEEK_SET) != 0)
+				Fail("failed to read the temporary file");
+			while (m_error.empty()) {
+				size_t n = fread(m_buffer.data(), 1, m_buffer.size(), m_faces);
+				if (n == 0)
+					break;
+				Write(m_file, m_buffer.data(), n);
+			}
+			std::string header = PlyHeader(m_vertices, m_triangles);
+			if (m_error.empty() && (fseek(m_file, 0, SEEK_SET) != 0 || (long)header.size() != m_header))
+				Fail("failed to write the mesh");
+			Write(m_file, header.data(), header.size());
+			fclose(m_faces);
+			m_faces = nullptr;
+		} else {
+			uint32_t count = (uint32_t)m_triangles;
+			if (m_error.empty() && fseek(m_file, 80, SEEK_SET) != 0)
+				Fail("failed to write the mesh");
+			Write(m_file, &count, 4);
+		}
+
+		if (fclose(m_file) != 0)
+			Fail("failed to write the mesh");
+		m_file = nullptr;
+		if (!m_error.empty()) {
+			err = m_error;
+			return false;
+		}
+		return true;
+	}
+}
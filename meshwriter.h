@@ -0,0 +1,66 @@
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace irmf
+{
+	// MeshPart is a piece of a mesh built independently of the others, e.g.
+	// one slab of a model. Vertices it shares with the previous part are
+	// listed in Bottom and the ones it shares with the next part in Top, as
+	// (key, vertex) pairs whose keys match across the boundary, so that
+	// MeshWriter can weld the parts back together.
+	struct MeshPart
+	{
+		std::vector<float> Positions;     // x, y, z per vertex
+		std::vector<uint32_t> Triangles;  // counter-clockwise seen from outside
+		std::vector<std::pair<uint32_t, uint32_t>> Bottom, Top;
+
+		inline uint32_t GetVertexCount() const { return (uint32_t)(Positions.size() / 3); }
+		inline uint32_t GetTriangleCount() const { return (uint32_t)(Triangles.size() / 3); }
+		void Clear();
+	};
+
+	enum class MeshFormat
+	{
+		STL, // binary STL
+		PLY  // binary little endian PLY, indexed
+	};
+
+	// MeshWriter streams a mesh to a file part by part, in order; parts are
+	// not kept. PLY faces are spooled to a temporary file until Close, as
+	// they have to follow all the vertices.
+	class MeshWriter
+	{
+	public:
+		MeshWriter();
+		~MeshWriter();
+
+		bool Open(const std::string& filename, MeshFormat format, std::string& err);
+		bool Add(const MeshPart& part);
+		// Close fills in the counts. Returns false, with err set, if this or
+		// any earlier write failed.
+		bool Close(std::string& err);
+
+		inline uint64_t GetVertexCount() const { return m_vertices; }
+		inline uint64_t GetTriangleCount() const { return m_triangles; }
+
+	private:
+		bool Write(FILE* file, const void* data, size_t size);
+		bool Fail(const std::string& err);
+
+		FILE* m_file;
+		FILE* m_faces;
+		MeshFormat m_format;
+		uint64_t m_vertices, m_triangles;
+		long m_header; // PLY: offset of the counts in the header
+		std::string m_error;
+
+		std::unordered_map<uint32_t, uint32_t> m_boundary; // Top of the last part: key -> vertex
+		std::vector<uint32_t> m_remap;
+		std::vector<uint8_t> m_buffer;
+	};
+}
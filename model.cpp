@@ -0,0 +1,82 @@
+#include "model.h"
+#include "compiler.h"
+#include "lexer.h"
+#include "optimize.h"
+#include <fstream>
+#include <sstream>
+
+namespace irmf
+{
+	static bool ParseBound(const json11::Json& info, const char* key, float* out, std::string& err)
+	{
+		const json11::Json& value = info[key];
+		if (!value.is_array() || value.array_items().size() != 3) {
+			err = std::string("preamble: '") + key + "' must be an array of 3 numbers";
+			return false;
+		}
+		for (int i = 0; i < 3; i++)
+			out[i] = (float)value.array_items()[i].number_value();
+		return true;
+	}
+
+	bool LoadModel(const std::string& src, Model& model, std::string& err)
+	{
+		std::string preamble;
+		if (!SplitIRMF(src, preamble, model.Body, err))
+			return false;
+
+		model.Info = json11::Json::parse(preamble, err);
+		if (!err.empty()) {
+			err = "preamble: " + err;
+			return false;
+		}
+		if (!ParseBound(model.Info, "min", model.Min, err) || !ParseBound(model.Info, "max", model.Max, err))
+			return false;
+
+		model.Materials.clear();
+		for (const json11::Json& m : model.Info["materials"].array_items())
+			model.Materials.push_back(m.string_value());
+
+		if (!CompileIRMF(model.Body, model.Code, err))
+			return false;
+
+		if (model.Materials.empty() || model.Materials.size() > model.Code.Outputs.size()) {
+			err = "preamble: " + model.Code.Entry + " supports 1 to " + std::to_string(model.Code.Outputs.size()) + " materials";
+			return false;
+		}
+
+		// outputs without a material are dropped with the code computing them
+		Program optimized;
+		OptimizeProgram(model.Code, (int)model.Materials.size(), optimized);
+		model.Code = std::move(optimized);
+		return true;
+	}
+
+	bool LoadModelFile(const std::string& filename, Model& model, std::string& err)
+	{
+		std::ifstream file(filename);
+		if (!file) {
+			err = "failed to open " + filename;
+			return false;
+		}
+		std::stringstream ss;
+		ss << file.rdbuf();
+		return LoadModel(ss.str(), model, err);
+	}
+
+	double UnitLength(const Model& model)
+	{
+		std::string units = model.Info["units"].string_value();
+		if (units == "cm")
+			return 0.01;
+		if (units == "m")
+			return 1.0;
+		if (units == "in" || units == "inch")
+			return 0.0254;
+		if (units == "ft")
+			return 0.3048;
+		if (units == "um" || units == "micron")
+			return 1e-6;
+		return 0.001;
+	}
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <json11/json11.hpp>
+#include "program.h"
+
+namespace irmf
+{
+	// Model is an IRMF shader prepared for evaluation on the CPU.
+	struct Model
+	{
+		json11::Json Info;                  // the JSON preamble
+		std::string Body;                   // the GLSL body
+		float Min[3], Max[3];               // bounding box from the preamble
+		std::vector<std::string> Materials; // material names, in output order
+		Program Code;                       // compiled entry point, one output per material
+	};
+
+	// LoadModel parses the preamble of an IRMF shader, compiles its body and
+	// optimizes the program (see OptimizeProgram).
+	bool LoadModel(const std::string& src, Model& model, std::string& err);
+	bool LoadModelFile(const std::string& filename, Model& model, std::string& err);
+
+	// UnitLength returns the length of the model's "units" in meters;
+	// millimeters if the preamble does not say.
+	double UnitLength(const Model& model);
+}
@@ -0,0 +1,401 @@
+#include "native.h"
+#include "cpu.h"
+#include "hash.h"
+#include "interpreter.h"
+#include <cstdio>
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <vector>
+#include <ghc/filesystem.hpp>
+
+#if !defined(_WIN32)
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+namespace irmf
+{
+	// Small math header put in front of every generated unit. Vectors and
+	// matrices are already split into floats by the compiler, so only the
+	// scalar built-ins with GLSL semantics are needed.
+	static const char* NativePrelude = R"(#include <cmath>
+#include <cstddef>
+
+#if defined(_WIN32)
+#define IRMF_EXPORT extern "C" __declspec(dllexport)
+#else
+#define IRMF_EXPORT extern "C" __attribute__((visibility("default")))
+#endif
+
+namespace {
+	inline float irmf_sign(float a) { return (float)((a > 0.0f) - (a < 0.0f)); }
+	inline float irmf_min(float a, float b) { return b < a ? b : a; }
+	inline float irmf_max(float a, float b) { return a < b ? b : a; }
+	inline float irmf_mod(float a, float b) { return a - b * std::floor(a / b); }
+	inline float irmf_clamp(float a, float b, float c) { float t = a < b ? b : a; return c < t ? c : t; }
+	inline float irmf_smoothstep(float a, float b, float c)
+	{
+		float t = (c - a) / (b - a);
+		t = t < 0.0f ? 0.0f : (t > 1.0f ? 1.0f : t);
+		return t * t * (3.0f - 2.0f * t);
+	}
+	inline float irmf_bool(bool b) { return b ? 1.0f : 0.0f; }
+}
+
+)";
+
+	static std::string Operand(const Program& program, uint16_t reg)
+	{
+		if (!program.IsConstant(reg))
+			return "r" + std::to_string(reg);
+
+		// hexadecimal literals keep the constants exact
+		float v = program.Constants[reg - program.ConstantBase()];
+		if (std::isnan(v))
+			return "NAN";
+		if (std::isinf(v))
+			return v < 0.0f ? "-INFINITY" : "INFINITY";
+		char buf[64];
+		snprintf(buf, sizeof(buf), "%af", v);
+		return v < 0.0f ? std::string("(") + buf + ")" : buf;
+	}
+
+	// mirrors ApplyOp
+	static std::string Expression(Opcode op, const std::string& a, const std::string& b, const std::string& c)
+	{
+		switch (op) {
+		case Opcode::Mov: return a;
+		case Opcode::Neg: return "-" + a;
+		case Opcode::Not: return "irmf_bool(" + a + " == 0.0f)";
+		case Opcode::Abs: return "std::fabs(" + a + ")";
+		case Opcode::Sign: return "irmf_sign(" + a + ")";
+		case Opcode::Floor: return "std::floor(" + a + ")";
+		case Opcode::Ceil: return "std::ceil(" + a + ")";
+		case Opcode::Fract: return a + " - std::floor(" + a + ")";
+		case Opcode::Trunc: return "std::trunc(" + a + ")";
+		case Opcode::Round: return "std::round(" + a + ")";
+		case Opcode::RoundEven: return "std::nearbyint(" + a + ")";
+		case Opcode::Sqrt: return "std::sqrt(" + a + ")";
+		case Opcode::InvSqrt: return "1.0f / std::sqrt(" + a + ")";
+		case Opcode::Exp: return "std::exp(" + a + ")";
+		case Opcode::Exp2: return "std::exp2(" + a + ")";
+		case Opcode::Log: return "std::log(" + a + ")";
+		case Opcode::Log2: return "std::log2(" + a + ")";
+		case Opcode::Sin: return "std::sin(" + a + ")";
+		case Opcode::Cos: return "std::cos(" + a + ")";
+		case Opcode::Tan: return "std::tan(" + a + ")";
+		case Opcode::Asin: return "std::asin(" + a + ")";
+		case Opcode::Acos: return "std::acos(" + a + ")";
+		case Opcode::Atan: return "std::atan(" + a + ")";
+		case Opcode::Sinh: return "std::sinh(" + a + ")";
+		case Opcode::Cosh: return "std::cosh(" + a + ")";
+		case Opcode::Tanh: return "std::tanh(" + a + ")";
+
+		case Opcode::Add: return a + " + " + b;
+		case Opcode::Sub: return a + " - " + b;
+		case Opcode::Mul: return a + " * " + b;
+		case Opcode::Div: return a + " / " + b;
+		case Opcode::Mod: return "irmf_mod(" + a + ", " + b + ")";
+		case Opcode::Min: return "irmf_min(" + a + ", " + b + ")";
+		case Opcode::Max: return "irmf_max(" + a + ", " + b + ")";
+		case Opcode::Pow: return "std::pow(" + a + ", " + b + ")";
+		case Opcode::Atan2: return "std::atan2(" + a + ", " + b + ")";
+		case Opcode::Step: return "irmf_bool(!(" + b + " < " + a + "))";
+		case Opcode::Lt: return "irmf_bool(" + a + " < " + b + ")";
+		case Opcode::Le: return "irmf_bool(" + a + " <= " + b + ")";
+		case Opcode::Gt: return "irmf_bool(" + a + " > " + b + ")";
+		case Opcode::Ge: return "irmf_bool(" + a + " >= " + b + ")";
+		case Opcode::Eq: return "irmf_bool(" + a + " == " + b + ")";
+		case Opcode::Ne: return "irmf_bool(" + a + " != " + b + ")";
+		case Opcode::And: return "irmf_bool(" + a + " != 0.0f && " + b + " != 0.0f)";
+		case Opcode::Or: return "irmf_bool(" + a + " != 0.0f || " + b + " != 0.0f)";
+		case Opcode::Xor: return "irmf_bool((" + a + " != 0.0f) != (" + b + " != 0.0f))";
+
+		case Opcode::Clamp: return "irmf_clamp(" + a + ", " + b + ", " + c + ")";
+		case Opcode::Mix: return a + " * (1.0f - " + c + ") + " + b + " * " + c;
+		case Opcode::Smoothstep: return "irmf_smoothstep(" + a + ", " + b + ", " + c + ")";
+		case Opcode::Select: return a + " != 0.0f ? " + b + " : " + c;
+
+		default: return "0.0f";
+		}
+	}
+
+	std::string TranspileProgram(const Program& program)
+	{
+		const std::vector<Instruction>& code = program.Code;
+		std::ostringstream src;
+
+		src << "// " << program.Entry << ", generated from the IRMF bytecode\n";
+		src << NativePrelude;
+		src << "static inline bool irmf_point(float r0, float r1, float r2, float* out, size_t stride)\n{\n";
+		src << "\tlong long iterations = " << (long long)Evaluator::MaxLoopIterations << ";\n";
+		for (uint16_t r = Program::NumInputs; r < program.NumRegisters; r++)
+			if (!program.IsConstant(r))
+				src << "\tfloat r" << r << " = 0.0f;\n";
+		src << "\t(void)iterations;\n\n";
+
+		// only jump targets that are used get a label
+		std::vector<bool> label(code.size(), false);
+		for (const Instruction& in : code)
+			if (in.Op == Opcode::Continue || in.Op == Opcode::Return)
+				label[in.Target] = true;
+
+		std::string indent = "\t";
+		for (size_t pc = 0; pc < code.size(); pc++) {
+			const Instruction& in = code[pc];
+			switch (in.Op) {
+			case Opcode::If:
+				src << indent << "if (" << Operand(program, in.A) << " != 0.0f) {\n";
+				indent += '\t';
+				break;
+			case Opcode::Else:
+				indent.pop_back();
+				src << indent << "} else {\n";
+				indent += '\t';
+				break;
+			case Opcode::EndIf:
+				indent.pop_back();
+				src << indent << "}\n";
+				break;
+			case Opcode::Loop:
+				src << indent << "for (;;) {\n";
+				indent += '\t';
+				break;
+			case Opcode::BreakIfNot:
+				src << indent << "if (" << Operand(program, in.A) << " == 0.0f) break;\n";
+				break;
+			case Opcode::Break:
+				src << indent << "break;\n";
+				break;
+			case Opcode::Continue:
+				src << indent << "goto l" << in.Target << ";\n";
+				break;
+			case Opcode::ContinuePoint:
+				if (label[pc])
+					src << indent << "l" << pc << ":;\n";
+				break;
+			case Opcode::EndLoop:
+				src << indent << "if (--iterations < 0) return false;\n";
+				indent.pop_back();
+				src << indent << "}\n";
+				break;
+			case Opcode::Call:
+				src << indent << "{\n";
+				indent += '\t';
+				break;
+			case Opcode::Return:
+				src << indent << "goto l" << in.Target << ";\n";
+				break;
+			case Opcode::EndCall:
+				indent.pop_back();
+				src << indent << "}\n";
+				if (label[pc])
+					src << indent << "l" << pc << ":;\n";
+				break;
+			default:
+				src << indent << "r" << in.Dst << " = " << Expression(in.Op, Operand(program, in.A), Operand(program, in.B), Operand(program, in.C)) << ";\n";
+				break;
+			}
+		}
+
+		src << "\n";
+		for (size_t i = 0; i < program.Outputs.size(); i++)
+			src << "\tout[" << i << " * stride] = " << Operand(program, program.Outputs[i]) << ";\n";
+		src << "\treturn true;\n}\n\n";
+
+		src << "IRMF_EXPORT int irmf_output_count() { return " << program.Outputs.size() << "; }\n\n";
+		src << "IRMF_EXPORT int irmf_evaluate(const float* x, const float* y, const float* z, size_t count, float* out)\n{\n";
+		src << "\tfor (size_t i = 0; i < count; i++)\n";
+		src << "\t\tif (!irmf_point(x[i], y[i], z[i], out + i, count))\n";
+		src << "\t\t\treturn 0;\n";
+		src << "\treturn 1;\n}\n";
+
+		return src.str();
+	}
+
+	std::string NativeCacheDirectory()
+	{
+		const char* xdg = getenv("XDG_CACHE_HOME");
+		if (xdg != nullptr && xdg[0] != 0)
+			return std::string(xdg) + "/irmf";
+		const char* home = getenv("HOME");
+		if (home != nullptr && home[0] != 0)
+			return std::string(home) + "/.cache/irmf";
+
+		std::error_code ec;
+		ghc::filesystem::path tmp = ghc::filesystem::temp_directory_path(ec);
+		return ((ec ? ghc::filesystem::path(".") : tmp) / "irmf").string();
+	}
+
+#if !defined(_WIN32)
+	static std::vector<std::string> Words(const std::string& text)
+	{
+		std::vector<std::string> words;
+		std::istringstream in(text);
+		for (std::string word; in >> word;)
+			words.push_back(word);
+		return words;
+	}
+
+	// Run runs a program found on the PATH with the given arguments, without
+	// a shell, its output and errors going to log. Returns its exit status,
+	// or -1 if it could not be started.
+	static int Run(const std::vector<std::string>& args, const std::string& log)
+	{
+		std::vector<char*> argv;
+		for (const std::string& arg : args)
+			argv.push_back(const_cast<char*>(arg.c_str()));
+		argv.push_back(nullptr);
+
+		pid_t pid = fork();
+		if (pid < 0)
+			return -1;
+		if (pid == 0) {
+			int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd >= 0) {
+				dup2(fd, 1);
+				dup2(fd, 2);
+				close(fd);
+			}
+			execvp(argv[0], argv.data());
+			_exit(127);
+		}
+		int status;
+		while (waitpid(pid, &status, 0) < 0)
+			if (errno != EINTR)
+				return -1;
+		return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+	}
+#endif
+
+	static std::string ReadLog(const std::string& filename)
+	{
+		std::ifstream file(filename);
+		std::string log((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		if (log.size() > 2000)
+			log = log.substr(0, 2000) + "\n...";
+		return log;
+	}
+
+	NativeEvaluator::NativeEvaluator()
+		: m_library(nullptr)
+		, m_evaluate(nullptr)
+		, m_outputs(0)
+	{
+	}
+	NativeEvaluator::~NativeEvaluator()
+	{
+		Unload();
+	}
+
+	void NativeEvaluator::Unload()
+	{
+#if !defined(_WIN32)
+		if (m_library != nullptr)
+			dlclose(m_library);
+#endif
+		m_library = nullptr;
+		m_evaluate = nullptr;
+		m_outputs = 0;
+		m_path.clear();
+	}
+
+	bool NativeEvaluator::Load(const Program& program, const std::string& cacheDir, std::string& err)
+	{
+		Unload();
+
+#if defined(_WIN32)
+		err = "native compilation of IRMF models is not supported on Windows";
+		return false;
+#else
+		const char* cxxEnv = getenv("CXX");
+		std::string cxx = (cxxEnv != nullptr && cxxEnv[0] != 0) ? cxxEnv : "c++";
+		std::string flags = "-O3 -march=native -fno-math-errno -shared -fPIC";
+
+		std::string source = TranspileProgram(program);
+		std::string key = HashHex(source + '\n' + cxx + ' ' + flags + '\n' + CpuFeatureString(), 16);
+		std::string base = cacheDir + "/irmf-" + key;
+		std::string library = base + ".so";
+
+		if (!ghc::filesystem::exists(library)) {
+			// $CXX is split into words, as make does, so it can be e.g.
+			// "ccache g++"; no shell sees it or the paths
+			std::vector<std::string> version = Words(cxx);
+			version.push_back("--version");
+			if (version.size() == 1 || Run(version, "/dev/null") != 0) {
+				err = "no C++ compiler found: '" + cxx + "' could not be run (set CXX to the compiler to use)";
+				return false;
+			}
+
+			std::error_code ec;
+			ghc::filesystem::create_directories(cacheDir, ec);
+			if (ec) {
+				err = "cannot create the cache directory " + cacheDir + ": " + ec.message();
+				return false;
+			}
+
+			// build under a unique name and rename, so that concurrent
+			// builds of the same model never see a partial library
+			std::string tmp = base + "." + std::to_string(getpid());
+			std::ofstream file(tmp + ".cpp");
+			file << source;
+			file.close();
+			if (!file) {
+				err = "cannot write " + tmp + ".cpp";
+				return false;
+			}
+
+			std::vector<std::string> build = Words(cxx + " " + flags);
+			build.insert(build.end(), { "-o", tmp + ".so", tmp + ".cpp" });
+			int status = Run(build, tmp + ".log");
+			std::string log = ReadLog(tmp + ".log");
+			ghc::filesystem::remove(tmp + ".cpp", ec);
+			ghc::filesystem::remove(tmp + ".log", ec);
+			if (status != 0) {
+				ghc::filesystem::remove(tmp + ".so", ec);
+				err = "compiling the model with " + cxx + " failed:\n" + log;
+				return false;
+			}
+
+			ghc::filesystem::rename(tmp + ".so", library, ec);
+			if (ec) {
+				ghc::filesystem::remove(tmp + ".so", ec);
+				err = "cannot move the compiled model to " + library;
+				return false;
+			}
+		}
+
+		m_library = dlopen(library.c_str(), RTLD_NOW | RTLD_LOCAL);
+		if (m_library == nullptr) {
+			const char* msg = dlerror();
+			err = "cannot load " + library + ": " + (msg ? msg : "unknown error");
+			return false;
+		}
+
+		typedef int (*OutputCountFunction)();
+		OutputCountFunction count = (OutputCountFunction)dlsym(m_library, "irmf_output_count");
+		m_evaluate = (EvaluateFunction)dlsym(m_library, "irmf_evaluate");
+		if (count == nullptr || m_evaluate == nullptr || count() != (int)program.Outputs.size()) {
+			err = library + " is not a compiled IRMF model";
+			Unload();
+			return false;
+		}
+
+		m_outputs = count();
+		m_path = library;
+		return true;
+#endif
+	}
+
+	bool NativeEvaluator::Evaluate(const float* x, const float* y, const float* z, size_t count, float* out) const
+	{
+		if (m_evaluate == nullptr)
+			return false;
+		return m_evaluate(x, y, z, count, out) != 0;
+	}
+}
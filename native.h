@@ -0,0 +1,59 @@
+#pragma once
+#include <cstddef>
+#include <string>
+#include "program.h"
+
+namespace irmf
+{
+	// TranspileProgram translates a compiled Program into a standalone C++
+	// translation unit exporting
+	//   extern "C" int irmf_output_count();
+	//   extern "C" int irmf_evaluate(const float* x, const float* y, const float* z, size_t count, float* out);
+	// with the same output layout and loop limit as BatchEvaluator::Evaluate.
+	std::string TranspileProgram(const Program& program);
+
+	// NativeCacheDirectory is where compiled models are kept unless told
+	// otherwise: $XDG_CACHE_HOME/irmf, ~/.cache/irmf or the temp directory.
+	std::string NativeCacheDirectory();
+
+	// NativeEvaluator runs a Program compiled ahead of time to machine code.
+	// Load transpiles the program, builds it with the system C++ compiler
+	// ($CXX, or c++) at -O3 -march=native and loads the resulting shared
+	// object. Builds are cached by a hash of the generated source, the
+	// compiler and the CPU features, so a model is only compiled once per
+	// machine. The loaded code keeps no state, so one NativeEvaluator can be
+	// used by many threads at once. Only the benchmark uses it, and Load
+	// always fails on Windows.
+	class NativeEvaluator
+	{
+	public:
+		NativeEvaluator();
+		~NativeEvaluator();
+
+		// Load fails with a message in err when no compiler is available,
+		// the build fails or the platform has no dynamic loader support.
+		bool Load(const Program& program, const std::string& cacheDir, std::string& err);
+		bool Load(const Program& program, std::string& err) { return Load(program, NativeCacheDirectory(), err); }
+		void Unload();
+
+		// Evaluate computes the materials of count points. Material m of
+		// point i is written to out[m * count + i]. Returns false if the
+		// evaluator is not loaded or a loop ran away.
+		bool Evaluate(const float* x, const float* y, const float* z, size_t count, float* out) const;
+
+		inline bool IsLoaded() const { return m_evaluate != nullptr; }
+		inline int GetOutputCount() const { return m_outputs; }
+		inline const std::string& GetLibraryPath() const { return m_path; }
+
+	private:
+		typedef int (*EvaluateFunction)(const float* x, const float* y, const float* z, size_t count, float* out);
+
+		NativeEvaluator(const NativeEvaluator&) = delete;
+		NativeEvaluator& operator=(const NativeEvaluator&) = delete;
+
+		void* m_library;
+		EvaluateFunction m_evaluate;
+		int m_outputs;
+		std::string m_path;
+	};
+}
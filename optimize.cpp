@@ -0,0 +1,949 @@
+#include "optimize.h"
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <set>
+#include <unordered_map>
+
+namespace irmf
+{
+	namespace
+	{
+		const uint32_t NoTarget = 0xffffffff;
+
+		// Operands of the code being built are registers (>= 0) in the
+		// original numbering extended with fresh ones, or constants (< 0,
+		// -1 - index).
+		struct WideInstruction
+		{
+			Opcode Op;
+			int Dst, A, B, C;
+			uint32_t Target;
+		};
+
+		// a value of the DAG
+		struct Node
+		{
+			enum { Constant, Opaque, Value }; // Opaque: contents of a register at a merge point
+
+			int Kind;
+			Opcode Op;
+			int A, B, C; // operand nodes of a Value
+			float Number; // Constant
+		};
+
+		struct Key
+		{
+			Opcode Op;
+			int A, B, C;
+
+			bool operator==(const Key& k) const { return Op == k.Op && A == k.A && B == k.B && C == k.C; }
+		};
+		struct KeyHash
+		{
+			size_t operator()(const Key& k) const
+			{
+				size_t h = (size_t)k.Op;
+				h = h * 0x9E3779B1u + (size_t)k.A;
+				h = h * 0x9E3779B1u + (size_t)k.B;
+				h = h * 0x9E3779B1u + (size_t)k.C;
+				return h;
+			}
+		};
+
+		inline uint32_t Bits(float v)
+		{
+			uint32_t u;
+			memcpy(&u, &v, sizeof(u));
+			return u;
+		}
+
+		inline bool IsIntegral(Opcode op)
+		{
+			return op == Opcode::Floor || op == Opcode::Ceil || op == Opcode::Trunc || op == Opcode::Round || op == Opcode::RoundEven;
+		}
+		inline bool IsCommutative(Opcode op)
+		{
+			return op == Opcode::Add || op == Opcode::Mul || op == Opcode::Eq || op == Opcode::Ne ||
+				op == Opcode::And || op == Opcode::Or || op == Opcode::Xor;
+		}
+
+		class Optimizer
+		{
+		public:
+			Optimizer(const Program& program)
+				: m_program(program)
+				, m_value(program.NumRegisters)
+				, m_held(program.NumRegisters, -1)
+				, m_next(program.NumRegisters)
+				, m_emitted(program.Code.size(), NoTarget)
+			{
+				for (uint16_t r = 0; r < program.NumRegisters; r++) {
+					if (program.IsConstant(r))
+						m_value[r] = Number(program.Constants[r - program.ConstantBase()]);
+					else
+						Forget(r);
+				}
+			}
+
+			void Run(int outputs, Program& optimized)
+			{
+				const Program& src = m_program;
+				Block(0, src.Code.size());
+
+				for (WideInstruction& in : m_code)
+					if (IsControlFlow(in.Op) && in.Target != NoTarget)
+						in.Target = m_emitted[in.Target];
+
+				std::vector<int> results;
+				for (int m = 0; m < outputs && m < (int)src.Outputs.size(); m++)
+					results.push_back(Operand(m_value[src.Outputs[m]]));
+
+				m_keep.assign(m_code.size(), true);
+				for (bool changed = true; changed; ) {
+					while (Liveness(results, true)) { }
+					changed = Coalesce(results);
+					changed = RemoveEmptyBranches() || changed;
+				}
+				Liveness(results, false);
+
+				if (!Emit(results, optimized)) {
+					// too many registers to encode: keep the original code
+					optimized = src;
+					optimized.Outputs.resize(results.size());
+				}
+			}
+
+		private:
+			// what is known at a point of the program, to go back to after
+			// a branch
+			struct Snapshot
+			{
+				std::vector<int> Value, Held, Holder;
+				size_t Nodes, Log;
+			};
+
+			// an enclosing loop or inlined function
+			struct Frame
+			{
+				bool Loop;
+				uint32_t End;                 // Call: index of its EndCall
+				std::vector<uint16_t> Writes; // registers written inside
+				bool Jumped;                  // a Return or Continue was emitted
+				Snapshot Entry;               // state at the start of the body
+			};
+
+			// ---- the DAG ----
+
+			int AddNode(const Node& n, int holder)
+			{
+				m_nodes.push_back(n);
+				m_holder.push_back(holder);
+				return (int)m_nodes.size() - 1;
+			}
+
+			int Number(float v)
+			{
+				auto it = m_numbers.find(Bits(v));
+				if (it != m_numbers.end())
+					return it->second;
+				m_constants.push_back(v);
+				int n = AddNode(Node{ Node::Constant, Opcode::Mov, -1, -1, -1, v }, -(int)m_constants.size());
+				m_numbers[Bits(v)] = n;
+				return n;
+			}
+
+			bool IsNumber(int n) const { return m_nodes[n].Kind == Node::Constant; }
+			bool IsNumber(int n, float v) const { return IsNumber(n) && Bits(m_nodes[n].Number) == Bits(v); }
+			bool IsOp(int n, Opcode op) const { return m_nodes[n].Kind == Node::Value && m_nodes[n].Op == op; }
+
+			int Operand(int n) const { return m_holder[n]; }
+
+			// the node for op(a, b, c), simplified and shared with an equal
+			// node computed earlier on every path to this point
+			int Value(Opcode op, int a, int b = -1, int c = -1)
+			{
+				int count = OperandCount(op);
+				if (op == Opcode::Mov)
+					return a;
+				if (op == Opcode::Select && IsNumber(a))
+					return m_nodes[a].Number != 0.0f ? b : c;
+
+				bool known = true;
+				int ops[3] = { a, b, c };
+				for (int i = 0; i < count; i++)
+					known = known && IsNumber(ops[i]);
+				if (known)
+					return Number(ApplyOp(op, m_nodes[a].Number, count > 1 ? m_nodes[b].Number : 0.0f, count > 2 ? m_nodes[c].Number : 0.0f));
+
+				const Node& na = m_nodes[a];
+				switch (op) {
+				case Opcode::Neg:
+					if (IsOp(a, Opcode::Neg))
+						return na.A;
+					break;
+				case Opcode::Abs:
+					if (IsOp(a, Opcode::Abs))
+						return a;
+					if (IsOp(a, Opcode::Neg))
+						return Value(Opcode::Abs, na.A);
+					break;
+				case Opcode::Floor:
+				case Opcode::Ceil:
+				case Opcode::Trunc:
+				case Opcode::Round:
+				case Opcode::RoundEven:
+					if (na.Kind == Node::Value && IsIntegral(na.Op))
+						return a;
+					break;
+
+				case Opcode::Add:
+					if (IsNumber(b, -0.0f))
+						return a;
+					if (IsNumber(a, -0.0f))
+						return b;
+					if (IsOp(b, Opcode::Neg))
+						return Value(Opcode::Sub, a, m_nodes[b].A);
+					if (IsOp(a, Opcode::Neg))
+						return Value(Opcode::Sub, b, na.A);
+					break;
+				case Opcode::Sub:
+					if (IsNumber(b, 0.0f))
+						return a;
+					if (IsNumber(a, -0.0f))
+						return Value(Opcode::Neg, b);
+					if (IsOp(b, Opcode::Neg))
+						return Value(Opcode::Add, a, m_nodes[b].A);
+					break;
+				case Opcode::Mul:
+					if (IsNumber(a))
+						std::swap(a, b);
+					if (IsNumber(b, 1.0f))
+						return a;
+					if (IsNumber(b, -1.0f))
+						return Value(Opcode::Neg, a);
+					if (IsOp(a, Opcode::Neg) && IsOp(b, Opcode::Neg))
+						return Value(Opcode::Mul, m_nodes[a].A, m_nodes[b].A);
+					break;
+				case Opcode::Div:
+					if (IsNumber(b, 1.0f))
+						return a;
+					if (IsNumber(b, -1.0f))
+						return Value(Opcode::Neg, a);
+					if (IsNumber(b)) {
+						// dividing by a power of two is multiplying by its
+						// exact reciprocal
+						int e;
+						float d = m_nodes[b].Number;
+						float r = 1.0f / d;
+						if (std::isnormal(d) && std::isnormal(r) && std::fabs(std::frexp(d, &e)) == 0.5f)
+							return Value(Opcode::Mul, a, Number(r));
+					}
+					break;
+				case Opcode::Min:
+				case Opcode::Max:
+					if (a == b)
+						return a;
+					break;
+				case Opcode::Pow:
+					if (IsNumber(b, 1.0f))
+						return a;
+					break;
+				case Opcode::Gt:
+					return Value(Opcode::Lt, b, a);
+				case Opcode::Ge:
+					return Value(Opcode::Le, b, a);
+
+				case Opcode::Select:
+					if (b == c)
+						return b;
+					if (IsOp(a, Opcode::Not))
+						return Value(Opcode::Select, na.A, c, b);
+					break;
+				default:
+					break;
+				}
+
+				if (IsCommutative(op) && a > b)
+					std::swap(a, b);
+				Key key{ op, a, count > 1 ? b : -1, count > 2 ? c : -1 };
+				auto it = m_values.find(key);
+				if (it != m_values.end())
+					return it->second;
+
+				int reg = m_next++;
+				Emit(op, reg, Operand(a), count > 1 ? Operand(b) : 0, count > 2 ? Operand(c) : 0, NoTarget, NoTarget);
+				int n = AddNode(Node{ Node::Value, op, key.A, key.B, key.C, 0.0f }, reg);
+				m_values[key] = n;
+				m_log.push_back(key);
+				return n;
+			}
+
+			// ---- state of the registers ----
+
+			// r holds a value only known at run time from here on
+			void Forget(uint16_t r)
+			{
+				int n = AddNode(Node{ Node::Opaque, Opcode::Mov, -1, -1, -1, 0.0f }, r);
+				m_value[r] = n;
+				m_held[r] = n;
+			}
+			void Forget(const std::vector<uint16_t>& regs)
+			{
+				for (uint16_t r : regs)
+					Forget(r);
+			}
+
+			// stores r's value in r, first moving away what r holds if
+			// another register still refers to it
+			void Store(uint16_t r)
+			{
+				int old = m_held[r];
+				if (old >= 0 && m_holder[old] == r) {
+					bool used = false;
+					for (size_t q = 0; q < m_value.size() && !used; q++)
+						used = q != r && m_value[q] == old;
+					if (used) {
+						int other = -1;
+						for (size_t q = 0; q < m_held.size() && other < 0; q++)
+							if (q != r && m_held[q] == old)
+								other = (int)q;
+						if (other < 0) {
+							other = m_next++;
+							Emit(Opcode::Mov, other, r, 0, 0, NoTarget, NoTarget);
+						}
+						m_holder[old] = other;
+					}
+				}
+				Emit(Opcode::Mov, r, Operand(m_value[r]), 0, 0, NoTarget, NoTarget);
+				m_held[r] = m_value[r];
+			}
+
+			// stores the registers whose value is not in the register file
+			// before control flow merges paths
+			void Materialize(const std::vector<uint16_t>& regs)
+			{
+				for (uint16_t r : regs)
+					if (m_held[r] != m_value[r])
+						Store(r);
+			}
+
+			// values that registers outside `regs` refer to must not only
+			// be held by registers in `regs`, which a branch may overwrite
+			void Evacuate(const std::vector<uint16_t>& regs)
+			{
+				std::vector<bool> written(m_value.size(), false);
+				for (uint16_t r : regs)
+					written[r] = true;
+				std::vector<bool> used(m_nodes.size(), false);
+				for (size_t q = 0; q < m_value.size(); q++)
+					if (!written[q])
+						used[m_value[q]] = true;
+
+				for (uint16_t r : regs) {
+					int old = m_held[r];
+					if (old < 0 || m_holder[old] != r || !used[old])
+						continue;
+					int reg = m_next++;
+					Emit(Opcode::Mov, reg, r, 0, 0, NoTarget, NoTarget);
+					m_holder[old] = reg;
+				}
+			}
+
+			Snapshot Save() const
+			{
+				return Snapshot{ m_value, m_held, m_holder, m_nodes.size(), m_log.size() };
+			}
+			// goes back to a saved state; values computed since are no
+			// longer available
+			void Restore(const Snapshot& s)
+			{
+				m_value = s.Value;
+				m_held = s.Held;
+				std::copy(s.Holder.begin(), s.Holder.end(), m_holder.begin());
+				while (m_log.size() > s.Log) {
+					m_values.erase(m_log.back());
+					m_log.pop_back();
+				}
+			}
+
+			// ---- walking the original code ----
+
+			void Emit(Opcode op, int dst, int a, int b, int c, uint32_t target, size_t from)
+			{
+				if (from != NoTarget)
+					m_emitted[from] = (uint32_t)m_code.size();
+				m_code.push_back(WideInstruction{ op, dst, a, b, c, target });
+			}
+			void EmitControl(const Instruction& in, size_t pc, int a = 0)
+			{
+				bool hasTarget = in.Op != Opcode::EndIf && in.Op != Opcode::ContinuePoint && in.Op != Opcode::EndCall;
+				Emit(in.Op, 0, a, 0, 0, hasTarget ? in.Target : NoTarget, pc);
+			}
+
+			std::vector<uint16_t> Writes(size_t begin, size_t end) const
+			{
+				std::vector<bool> seen(m_program.NumRegisters, false);
+				std::vector<uint16_t> ret;
+				for (size_t pc = begin; pc < end; pc++) {
+					const Instruction& in = m_program.Code[pc];
+					if (!IsControlFlow(in.Op) && !seen[in.Dst]) {
+						seen[in.Dst] = true;
+						ret.push_back(in.Dst);
+					}
+				}
+				return ret;
+			}
+
+			Frame& Innermost(bool loop)
+			{
+				size_t i = m_frames.size();
+				while (m_frames[i - 1].Loop != loop)
+					i--;
+				return m_frames[i - 1];
+			}
+
+			void Block(size_t pc, size_t end)
+			{
+				const std::vector<Instruction>& code = m_program.Code;
+
+				for (; pc < end; pc++) {
+					const Instruction& in = code[pc];
+					switch (in.Op) {
+					case Opcode::If: {
+						size_t split = in.Target;
+						bool hasElse = code[split].Op == Opcode::Else;
+						size_t endIf = hasElse ? code[split].Target : split;
+						int cond = m_value[in.A];
+
+						if (IsNumber(cond)) {
+							if (m_nodes[cond].Number != 0.0f)
+								Block(pc + 1, split);
+							else if (hasElse)
+								Block(split + 1, endIf);
+							pc = endIf;
+							break;
+						}
+
+						std::vector<uint16_t> writes = Writes(pc + 1, endIf);
+						Evacuate(writes);
+						Materialize(writes);
+						Snapshot entry = Save();
+
+						EmitControl(in, pc, Operand(cond));
+						Block(pc + 1, split);
+						Materialize(writes);
+						std::vector<int> thenValue = m_value;
+
+						Restore(entry);
+						if (hasElse) {
+							EmitControl(code[split], split);
+							Block(split + 1, endIf);
+							Materialize(writes);
+						}
+						std::vector<int> elseValue = m_value;
+						Restore(entry);
+						EmitControl(code[endIf], endIf);
+
+						// a register keeps its value if both paths agree on
+						// one that exists after the merge
+						std::vector<bool> written(m_value.size(), false);
+						for (uint16_t r : writes)
+							written[r] = true;
+						for (uint16_t r : writes) {
+							int n = thenValue[r];
+							if (n == elseValue[r] && (n < (int)entry.Nodes || IsNumber(n))) {
+								m_value[r] = m_held[r] = n;
+								if (m_holder[n] >= 0 && m_holder[n] < (int)written.size() && written[m_holder[n]])
+									m_holder[n] = r;
+							} else
+								Forget(r);
+						}
+						pc = endIf;
+						break;
+					}
+
+					case Opcode::Loop: {
+						size_t endLoop = in.Target;
+						std::vector<uint16_t> writes = Writes(pc + 1, endLoop);
+						Evacuate(writes);
+						Materialize(writes);
+						Forget(writes);
+
+						EmitControl(in, pc);
+						m_frames.push_back(Frame{ true, 0, writes, false, Save() });
+						Block(pc + 1, endLoop);
+						Materialize(writes);
+						Restore(m_frames.back().Entry);
+						m_frames.pop_back();
+						EmitControl(code[endLoop], endLoop);
+
+						Forget(writes);
+						pc = endLoop;
+						break;
+					}
+					case Opcode::BreakIfNot: {
+						int cond = m_value[in.A];
+						if (IsNumber(cond) && m_nodes[cond].Number != 0.0f)
+							break;
+						Materialize(Innermost(true).Writes);
+						if (IsNumber(cond))
+							Emit(Opcode::Break, 0, 0, 0, 0, in.Target, pc);
+						else
+							EmitControl(in, pc, Operand(cond));
+						break;
+					}
+					case Opcode::Break:
+						Materialize(Innermost(true).Writes);
+						EmitControl(in, pc);
+						break;
+					case Opcode::Continue: {
+						Frame& f = Innermost(true);
+						Materialize(f.Writes);
+						f.Jumped = true;
+						EmitControl(in, pc);
+						break;
+					}
+					case Opcode::ContinuePoint: {
+						Frame& f = Innermost(true);
+						Materialize(f.Writes);
+						if (f.Jumped) {
+							Restore(f.Entry);
+							Forget(f.Writes);
+						}
+						EmitControl(in, pc);
+						break;
+					}
+
+					case Opcode::Call: {
+						size_t endCall = in.Target;
+						std::vector<uint16_t> writes = Writes(pc + 1, endCall);
+						for (size_t i = pc + 1; i < endCall; i++) {
+							if (code[i].Op == Opcode::Return && code[i].Target == endCall) {
+								Evacuate(writes);
+								break;
+							}
+						}
+						EmitControl(in, pc);
+						m_frames.push_back(Frame{ false, (uint32_t)endCall, writes, false, Save() });
+						Block(pc + 1, endCall);
+						Frame& f = m_frames.back();
+						if (f.Jumped) {
+							Materialize(f.Writes);
+							Restore(f.Entry);
+							Forget(f.Writes);
+						}
+						m_frames.pop_back();
+						EmitControl(code[endCall], endCall);
+						pc = endCall;
+						break;
+					}
+					case Opcode::Return: {
+						size_t i = m_frames.size();
+						while (m_frames[i - 1].Loop || m_frames[i - 1].End != in.Target)
+							i--;
+						Frame& f = m_frames[i - 1];
+						Materialize(f.Writes);
+						f.Jumped = true;
+						EmitControl(in, pc);
+						break;
+					}
+
+					case Opcode::Else:
+					case Opcode::EndIf:
+					case Opcode::EndLoop:
+					case Opcode::EndCall:
+						break;
+
+					default: {
+						int n = OperandCount(in.Op);
+						m_value[in.Dst] = Value(in.Op, m_value[in.A], n > 1 ? m_value[in.B] : -1, n > 2 ? m_value[in.C] : -1);
+						break;
+					}
+					}
+				}
+			}
+
+			// ---- liveness, dead code and register allocation ----
+
+			// A value computed into a fresh register and only moved into a
+			// register of the original program (v = a + b; r = v) is computed
+			// into that register directly when nothing in between uses it.
+			bool Coalesce(const std::vector<int>& results)
+			{
+				bool changed = false;
+				int first = m_program.NumRegisters;
+				std::vector<int> uses(m_next, 0), def(m_next, -1);
+				int regs[3];
+				for (size_t i = 0; i < m_code.size(); i++) {
+					const WideInstruction& in = m_code[i];
+					if (!m_keep[i])
+						continue;
+					int n = Reads(in, regs);
+					for (int k = 0; k < n; k++)
+						uses[regs[k]]++;
+					if (!IsControlFlow(in.Op))
+						def[in.Dst] = (int)i;
+				}
+				for (int r : results)
+					if (r >= 0)
+						uses[r]++;
+
+				for (size_t j = 0; j < m_code.size(); j++) {
+					const WideInstruction& mov = m_code[j];
+					if (!m_keep[j] || mov.Op != Opcode::Mov || mov.Dst >= first || mov.A < first || uses[mov.A] != 1)
+						continue;
+					size_t k = def[mov.A];
+					bool free = true;
+					for (size_t i = k + 1; i < j && free; i++) {
+						const WideInstruction& in = m_code[i];
+						if (!m_keep[i])
+							continue;
+						int n = Reads(in, regs);
+						free = !IsControlFlow(in.Op) && in.Dst != mov.Dst;
+						for (int q = 0; q < n; q++)
+							free = free && regs[q] != mov.Dst;
+					}
+					if (!free)
+						continue;
+					m_code[k].Dst = mov.Dst;
+					m_keep[j] = false;
+					changed = true;
+				}
+				return changed;
+			}
+
+			typedef std::vector<uint64_t> RegSet;
+
+			static bool Test(const RegSet& s, int r) { return (s[r >> 6] >> (r & 63)) & 1; }
+			static void Set(RegSet& s, int r) { s[r >> 6] |= 1ull << (r & 63); }
+			static void Clear(RegSet& s, int r) { s[r >> 6] &= ~(1ull << (r & 63)); }
+
+			int Reads(const WideInstruction& in, int* regs) const
+			{
+				int count = 0;
+				int ops[3] = { in.A, in.B, in.C };
+				for (int k = 0; k < OperandCount(in.Op); k++)
+					if (ops[k] >= 0)
+						regs[count++] = ops[k];
+				return count;
+			}
+
+			size_t NextKept(size_t i) const
+			{
+				while (++i < m_code.size() && !m_keep[i]) { }
+				return i;
+			}
+
+			// drops else branches and ifs that are left without code
+			bool RemoveEmptyBranches()
+			{
+				bool changed = false;
+				for (size_t i = 0; i < m_code.size(); i++) {
+					WideInstruction& in = m_code[i];
+					if (!m_keep[i] || in.Op != Opcode::If)
+						continue;
+					if (m_code[in.Target].Op == Opcode::Else) {
+						uint32_t split = in.Target;
+						if (NextKept(split) != m_code[split].Target)
+							continue;
+						m_keep[split] = false;
+						in.Target = m_code[split].Target;
+						changed = true;
+					}
+					if (NextKept(i) == in.Target) {
+						m_keep[i] = false;
+						m_keep[in.Target] = false;
+						changed = true;
+					}
+				}
+				return changed;
+			}
+
+			// instructions control may continue at after code[i]; size()
+			// stands for the end of the program
+			int Successors(size_t i, size_t* next) const
+			{
+				const WideInstruction& in = m_code[i];
+				if (!m_keep[i]) {
+					next[0] = i + 1;
+					return 1;
+				}
+				switch (in.Op) {
+				case Opcode::If:
+				case Opcode::BreakIfNot:
+					next[0] = i + 1;
+					next[1] = in.Target + 1;
+					return 2;
+				case Opcode::Else:
+				case Opcode::Break:
+				case Opcode::Continue:
+				case Opcode::Return:
+				case Opcode::EndLoop:
+					next[0] = in.Target + 1;
+					return 1;
+				default:
+					next[0] = i + 1;
+					return 1;
+				}
+			}
+
+			// Computes which registers are live where. With removeDead,
+			// drops the instructions whose result is never read and returns
+			// whether there were any; otherwise records the live range of
+			// every register.
+			bool Liveness(const std::vector<int>& results, bool removeDead)
+			{
+				size_t count = m_code.size();
+				size_t words = ((size_t)m_next + 63) / 64;
+
+				// blocks of straight-line code; control flow instructions
+				// are blocks of their own
+				std::vector<size_t> start;
+				std::vector<int> blockOf(count + 1);
+				for (size_t i = 0; i < count; i++) {
+					if (i == 0 || IsControlFlow(m_code[i].Op) || IsControlFlow(m_code[i - 1].Op))
+						start.push_back(i);
+					blockOf[i] = (int)start.size() - 1;
+				}
+				size_t blocks = start.size();
+				start.push_back(count);
+				blockOf[count] = (int)blocks;
+
+				RegSet exit(words, 0);
+				for (int r : results)
+					if (r >= 0)
+						Set(exit, r);
+
+				std::vector<RegSet> liveIn(blocks + 1, RegSet(words, 0)), liveOut(blocks, RegSet(words, 0));
+				liveIn[blocks] = exit;
+
+				auto transfer = [&](size_t b, RegSet& live) {
+					int regs[3];
+					for (size_t i = start[b + 1]; i-- > start[b]; ) {
+						const WideInstruction& in = m_code[i];
+						if (!m_keep[i])
+							continue;
+						if (!IsControlFlow(in.Op))
+							Clear(live, in.Dst);
+						int n = Reads(in, regs);
+						for (int k = 0; k < n; k++)
+							Set(live, regs[k]);
+					}
+				};
+
+				for (bool changed = true; changed; ) {
+					changed = false;
+					for (size_t b = blocks; b-- > 0; ) {
+						size_t next[2];
+						int n = Successors(start[b + 1] - 1, next);
+						RegSet out(words, 0);
+						for (int k = 0; k < n; k++) {
+							const RegSet& in = liveIn[blockOf[next[k]]];
+							for (size_t w = 0; w < words; w++)
+								out[w] |= in[w];
+						}
+						liveOut[b] = out;
+						transfer(b, out);
+						if (out != liveIn[b]) {
+							liveIn[b] = out;
+							changed = true;
+						}
+					}
+				}
+
+				if (removeDead) {
+					bool removed = false;
+					int regs[3];
+					for (size_t b = 0; b < blocks; b++) {
+						RegSet live = liveOut[b];
+						for (size_t i = start[b + 1]; i-- > start[b]; ) {
+							const WideInstruction& in = m_code[i];
+							if (!m_keep[i])
+								continue;
+							if (!IsControlFlow(in.Op)) {
+								if (!Test(live, in.Dst)) {
+									m_keep[i] = false;
+									removed = true;
+									continue;
+								}
+								Clear(live, in.Dst);
+							}
+							int n = Reads(in, regs);
+							for (int k = 0; k < n; k++)
+								Set(live, regs[k]);
+						}
+					}
+					return removed;
+				}
+
+				// a register's range spans every point it is live at
+				m_first.assign(m_next, -1);
+				m_last.assign(m_next, -1);
+				auto extend = [&](int r, int at) {
+					if (m_first[r] < 0 || at < m_first[r])
+						m_first[r] = at;
+					m_last[r] = std::max(m_last[r], at);
+				};
+				auto extendSet = [&](const RegSet& s, int at) {
+					for (size_t w = 0; w < words; w++)
+						if (s[w])
+							for (int k = 0; k < 64; k++)
+								if ((s[w] >> k) & 1)
+									extend((int)(w * 64 + k), at);
+				};
+				int regs[3];
+				for (size_t b = 0; b < blocks; b++) {
+					extendSet(liveIn[b], (int)start[b]);
+					extendSet(liveOut[b], (int)start[b + 1] - 1);
+					for (size_t i = start[b]; i < start[b + 1]; i++) {
+						if (!m_keep[i])
+							continue;
+						const WideInstruction& in = m_code[i];
+						if (!IsControlFlow(in.Op))
+							extend(in.Dst, (int)i);
+						int n = Reads(in, regs);
+						for (int k = 0; k < n; k++)
+							extend(regs[k], (int)i);
+					}
+				}
+				extendSet(exit, (int)count);
+				return false;
+			}
+
+			// assigns registers by linear scan over the live ranges and
+			// builds the program
+			bool Emit(const std::vector<int>& results, Program& optimized)
+			{
+				const Program& src = m_program;
+
+				// constants that are still used, in order of first use
+				std::vector<int> constant(m_constants.size(), -1);
+				std::vector<float> constants;
+				auto useConstant = [&](int op) {
+					if (op < 0 && constant[-1 - op] < 0) {
+						constant[-1 - op] = (int)constants.size();
+						constants.push_back(m_constants[-1 - op]);
+					}
+				};
+				for (size_t i = 0; i < m_code.size(); i++) {
+					const WideInstruction& in = m_code[i];
+					if (!m_keep[i])
+						continue;
+					int ops[3] = { in.A, in.B, in.C };
+					for (int k = 0; k < OperandCount(in.Op); k++)
+						useConstant(ops[k]);
+				}
+				for (int r : results)
+					useConstant(r);
+
+				int base = Program::NumInputs + (int)constants.size();
+
+				// a move may reuse the register of its source if that dies there
+				std::vector<int> hint(m_next, -1);
+				for (size_t i = 0; i < m_code.size(); i++) {
+					const WideInstruction& in = m_code[i];
+					if (m_keep[i] && in.Op == Opcode::Mov && in.A >= Program::NumInputs && m_first[in.Dst] == (int)i && m_last[in.A] == (int)i)
+						hint[in.Dst] = in.A;
+				}
+
+				std::vector<int> order;
+				for (int r = Program::NumInputs; r < m_next; r++)
+					if (m_first[r] >= 0)
+						order.push_back(r);
+				std::sort(order.begin(), order.end(), [&](int a, int b) { return m_first[a] < m_first[b]; });
+
+				std::vector<int> phys(m_next, -1);
+				for (int r = 0; r < Program::NumInputs; r++)
+					phys[r] = r;
+				std::set<int> free;
+				std::multimap<int, int> active; // end of range -> register
+				int used = 0;
+				for (int r : order) {
+					while (!active.empty() && active.begin()->first <= m_first[r]) {
+						free.insert(active.begin()->second);
+						active.erase(active.begin());
+					}
+					int p;
+					if (hint[r] >= 0 && free.count(phys[hint[r]]))
+						p = phys[hint[r]];
+					else if (!free.empty())
+						p = *free.begin();
+					else
+						p = base + used++;
+					free.erase(p);
+					phys[r] = p;
+					active.insert(std::make_pair(m_last[r], p));
+				}
+				if (base + used > 0xFFFF)
+					return false;
+
+				auto map = [&](int op) -> uint16_t {
+					return (uint16_t)(op < 0 ? Program::NumInputs + constant[-1 - op] : phys[op]);
+				};
+
+				optimized = Program();
+				optimized.Entry = src.Entry;
+				optimized.Constants = constants;
+				optimized.NumRegisters = (uint16_t)(base + used);
+
+				std::vector<uint32_t> index(m_code.size(), NoTarget);
+				for (size_t i = 0; i < m_code.size(); i++) {
+					const WideInstruction& w = m_code[i];
+					if (!m_keep[i] || (w.Op == Opcode::Mov && map(w.Dst) == map(w.A)))
+						continue;
+					index[i] = (uint32_t)optimized.Code.size();
+
+					Instruction in{ w.Op, 0, 0, 0, 0, 0 };
+					int n = OperandCount(w.Op);
+					if (!IsControlFlow(w.Op))
+						in.Dst = map(w.Dst);
+					in.A = n > 0 ? map(w.A) : 0;
+					in.B = n > 1 ? map(w.B) : 0;
+					in.C = n > 2 ? map(w.C) : 0;
+					in.Target = w.Target;
+					optimized.Code.push_back(in);
+				}
+
+				int depth = 0;
+				for (Instruction& in : optimized.Code) {
+					if (!IsControlFlow(in.Op))
+						continue;
+					in.Target = in.Target != NoTarget ? index[in.Target] : 0;
+					if (in.Op == Opcode::If || in.Op == Opcode::Loop || in.Op == Opcode::Call)
+						optimized.MaxDepth = std::max(optimized.MaxDepth, ++depth);
+					else if (in.Op == Opcode::EndIf || in.Op == Opcode::EndLoop || in.Op == Opcode::EndCall)
+						depth--;
+				}
+
+				for (int r : results)
+					optimized.Outputs.push_back(map(r));
+				return true;
+			}
+
+			const Program& m_program;
+
+			std::vector<Node> m_nodes;
+			std::vector<int> m_holder;   // register (or constant) each node is read from
+			std::unordered_map<Key, int, KeyHash> m_values;
+			std::vector<Key> m_log;      // keys of m_values in order of insertion
+			std::unordered_map<uint32_t, int> m_numbers;
+			std::vector<float> m_constants;
+
+			std::vector<int> m_value;    // node of each register of the original program
+			std::vector<int> m_held;     // node each of those registers holds at run time
+			int m_next;                  // next fresh register
+			std::vector<Frame> m_frames;
+
+			std::vector<WideInstruction> m_code; // targets are indices in m_code once Block is done
+			std::vector<uint32_t> m_emitted;     // index in m_code of each original control flow instruction
+			std::vector<bool> m_keep;
+			std::vector<int> m_first, m_last;    // live range of each register
+		};
+	}
+
+	void OptimizeProgram(const Program& program, int outputs, Program& optimized)
+	{
+		Optimizer(program).Run(outputs, optimized);
+	}
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include "program.h"
+
+namespace irmf
+{
+	// OptimizeProgram rewrites a Program into an equivalent, usually smaller
+	// one. The code is lowered to a hash-consed DAG of values (SSA within
+	// each region of straight-line code, with the registers written by an
+	// if, loop or returning function merged at its end), so that:
+	//   - common subexpressions are computed once, copies disappear,
+	//   - constants are folded and exact algebraic identities applied
+	//     (x * 1, x - 0, -(-x), a + -b, floor(floor(x)), ...),
+	//   - branches on constant conditions are removed,
+	//   - only the first `outputs` outputs are kept (a model with fewer
+	//     materials than its entry point has slots) and everything they do
+	//     not depend on is dropped,
+	// and the result is emitted with registers reallocated by liveness.
+	// Only rewrites that give the same floats bit for bit are made.
+	void OptimizeProgram(const Program& program, int outputs, Program& optimized);
+}
@@ -0,0 +1,637 @@
+#include "parser.h"
+#include <cstdlib>
+#include <set>
+
+namespace irmf
+{
+	bool IsTypeName(const std::string& name)
+	{
+		static const std::set<std::string> types = {
+			"void", "float", "int", "uint", "bool",
+			"vec2", "vec3", "vec4", "ivec2", "ivec3", "ivec4", "uvec2", "uvec3", "uvec4", "bvec2", "bvec3", "bvec4",
+			"mat2", "mat3", "mat4", "mat2x2", "mat2x3", "mat2x4", "mat3x2", "mat3x3", "mat3x4", "mat4x2", "mat4x3", "mat4x4",
+		};
+		return types.count(name) > 0;
+	}
+
+	static bool IsQualifier(const std::string& name)
+	{
+		static const std::set<std::string> qualifiers = {
+			"const", "highp", "mediump", "lowp", "in", "out", "inout", "precise", "invariant",
+		};
+		return qualifiers.count(name) > 0;
+	}
+
+	class Parser
+	{
+	public:
+		Parser(const std::vector<Token>& tokens) : m_tokens(tokens), m_pos(0) { }
+
+		bool ParseUnit(NodePtr& unit, std::string& err)
+		{
+			unit.reset(new Node(NodeKind::Unit, 1));
+			while (Peek().Type != TokenType::End) {
+				NodePtr item = TopLevel();
+				if (!item) {
+					err = m_err;
+					return false;
+				}
+				if (item->Kind != NodeKind::Empty)
+					unit->Children.push_back(std::move(item));
+			}
+			return true;
+		}
+
+	private:
+		const std::vector<Token>& m_tokens;
+		size_t m_pos;
+		std::string m_err;
+
+		const Token& Peek(size_t ahead = 0) const
+		{
+			size_t i = m_pos + ahead;
+			return m_tokens[i < m_tokens.size() ? i : m_tokens.size() - 1];
+		}
+
+		const Token& Next()
+		{
+			const Token& t = Peek();
+			if (m_pos < m_tokens.size() - 1)
+				m_pos++;
+			return t;
+		}
+
+		bool Accept(const char* text)
+		{
+			if (Peek().Is(text)) {
+				Next();
+				return true;
+			}
+			return false;
+		}
+
+		NodePtr Fail(const std::string& msg)
+		{
+			if (m_err.empty())
+				m_err = "line " + std::to_string(Peek().Line) + ": " + msg;
+			return NodePtr();
+		}
+
+		bool Expect(const char* text)
+		{
+			if (Accept(text))
+				return true;
+			Fail(std::string("expected '") + text + "' but found '" + Peek().Text + "'");
+			return false;
+		}
+
+		// [qualifiers] type; returns false if the tokens do not start a type
+		bool ParseType(std::string& type, bool& isConst, std::string* qualifier = 0)
+		{
+			size_t start = m_pos;
+			isConst = false;
+			while (Peek().Type == TokenType::Identifier && IsQualifier(Peek().Text)) {
+				const std::string& q = Next().Text;
+				if (q == "const")
+					isConst = true;
+				else if (qualifier && (q == "in" || q == "out" || q == "inout"))
+					*qualifier = q;
+			}
+			if (Peek().Type != TokenType::Identifier || !IsTypeName(Peek().Text)) {
+				m_pos = start;
+				return false;
+			}
+			type = Next().Text;
+			return true;
+		}
+
+		bool ParseArraySize(int& size)
+		{
+			size = 0;
+			if (!Accept("["))
+				return true;
+			if (Accept("]")) {
+				size = -1;
+				return true;
+			}
+			const Token& t = Next();
+			if (t.Type != TokenType::Number) {
+				Fail("array sizes must be integer literals");
+				return false;
+			}
+			size = atoi(t.Text.c_str());
+			return Expect("]");
+		}
+
+		NodePtr TopLevel()
+		{
+			int line = Peek().Line;
+
+			if (Accept(";"))
+				return NodePtr(new Node(NodeKind::Empty, line));
+
+			// precision highp float;
+			if (Peek().Is("precision")) {
+				while (!Peek().Is(";") && Peek().Type != TokenType::End)
+					Next();
+				Expect(";");
+				return NodePtr(new Node(NodeKind::Empty, line));
+			}
+
+			if (Peek().Is("struct"))
+				return Fail("structs are not supported");
+			if (Peek().Is("uniform") || Peek().Is("layout"))
+				return Fail("uniforms are not supported in IRMF bodies");
+
+			std::string type;
+			bool isConst;
+			if (!ParseType(type, isConst))
+				return Fail("expected a declaration but found '" + Peek().Text + "'");
+
+			if (Peek().Type == TokenType::Identifier && Peek(1).Is("("))
+				return FunctionDef(type, line);
+
+			return DeclarationRest(type, isConst, line);
+		}
+
+		NodePtr FunctionDef(const std::string& type, int line)
+		{
+			NodePtr fn(new Node(NodeKind::Function, line));
+			fn->TypeName = type;
+			fn->Text = Next().Text;
+			Expect("(");
+
+			if (!(Peek().Is("void") && Peek(1).Is(")"))) {
+				while (!Peek().Is(")") && m_err.empty()) {
+					Param p;
+					bool isConst;
+					p.Qualifier = "in";
+					if (!ParseType(p.TypeName, isConst, &p.Qualifier))
+						return Fail("expected a parameter type but found '" + Peek().Text + "'");
+					if (Peek().Type == TokenType::Identifier)
+						p.Name = Next().Text;
+					if (!ParseArraySize(p.ArraySize))
+						return NodePtr();
+					fn->Params.push_back(p);
+					if (!Accept(","))
+						break;
+				}
+			} else
+				Next();
+
+			if (!Expect(")"))
+				return NodePtr();
+
+			if (Accept(";"))
+				return fn; // prototype
+
+			NodePtr body = Block();
+			if (!body)
+				return NodePtr();
+			fn->Children.push_back(std::move(body));
+			return fn;
+		}
+
+		NodePtr DeclarationRest(const std::string& type, bool isConst, int line)
+		{
+			NodePtr decl(new Node(NodeKind::Declaration, line));
+			decl->TypeName = type;
+			decl->IsConst = isConst;
+
+			// float[3] a = ...
+			int typeArray = 0;
+			if (!ParseArraySize(typeArray))
+				return NodePtr();
+
+			do {
+				Declarator d;
+				d.Line = Peek().Line;
+				if (Peek().Type != TokenType::Identifier)
+					return Fail("expected a variable name but found '" + Peek().Text + "'");
+				d.Name = Next().Text;
+				if (!ParseArraySize(d.ArraySize))
+					return NodePtr();
+				if (typeArray != 0)
+					d.ArraySize = typeArray;
+				if (Accept("=")) {
+					d.Init = Assignment();
+					if (!d.Init)
+						return NodePtr();
+				}
+				decl->Declarators.push_back(std::move(d));
+			} while (Accept(","));
+
+			if (!Expect(";"))
+				return NodePtr();
+			return decl;
+		}
+
+		NodePtr Block()
+		{
+			NodePtr block(new Node(NodeKind::Block, Peek().Line));
+			if (!Expect("{"))
+				return NodePtr();
+			while (!Peek().Is("}")) {
+				if (Peek().Type == TokenType::End)
+					return Fail("unexpected end of input, missing '}'");
+				NodePtr stmt = Statement();
+				if (!stmt)
+					return NodePtr();
+				block->Children.push_back(std::move(stmt));
+			}
+			Next();
+			return block;
+		}
+
+		bool StartsDeclaration() const
+		{
+			size_t i = 0;
+			while (Peek(i).Type == TokenType::Identifier && IsQualifier(Peek(i).Text))
+				i++;
+			if (Peek(i).Type != TokenType::Identifier || !IsTypeName(Peek(i).Text))
+				return false;
+			// 'vec3 a' or 'float[2] a', but not the constructor call 'vec3(...)'
+			return Peek(i + 1).Type == TokenType::Identifier || (Peek(i + 1).Is("[") && !Peek(i + 2).Is("]") && Peek(i + 3).Is("]") && Peek(i + 4).Type == TokenType::Identifier);
+		}
+
+		NodePtr Statement()
+		{
+			int line = Peek().Line;
+
+			if (Peek().Is("{"))
+				return Block();
+			if (Accept(";"))
+				return NodePtr(new Node(NodeKind::Empty, line));
+
+			if (Accept("if")) {
+				NodePtr n(new Node(NodeKind::If, line));
+				if (!Expect("("))
+					return NodePtr();
+				NodePtr cond = Expression();
+				if (!cond || !Expect(")"))
+					return NodePtr();
+				NodePtr then = Statement();
+				if (!then)
+					return NodePtr();
+				n->Children.push_back(std::move(cond));
+				n->Children.push_back(std::move(then));
+				if (Accept("else")) {
+					NodePtr other = Statement();
+					if (!other)
+						return NodePtr();
+					n->Children.push_back(std::move(other));
+				}
+				return n;
+			}
+
+			if (Accept("for")) {
+				NodePtr n(new Node(NodeKind::For, line));
+				if (!Expect("("))
+					return NodePtr();
+
+				NodePtr init;
+				if (StartsDeclaration()) {
+					std::string type;
+					bool isConst;
+					ParseType(type, isConst);
+					init = DeclarationRest(type, isConst, line);
+				} else if (Accept(";"))
+					init.reset(new Node(NodeKind::Empty, line));
+				else {
+					init = ExpressionStatement();
+				}
+				if (!init)
+					return NodePtr();
+
+				NodePtr cond = Peek().Is(";") ? NodePtr(new Node(NodeKind::Empty, line)) : Expression();
+				if (!cond || !Expect(";"))
+					return NodePtr();
+				NodePtr incr = Peek().Is(")") ? NodePtr(new Node(NodeKind::Empty, line)) : Expression();
+				if (!incr || !Expect(")"))
+					return NodePtr();
+				NodePtr body = Statement();
+				if (!body)
+					return NodePtr();
+
+				n->Children.push_back(std::move(init));
+				n->Children.push_back(std::move(cond));
+				n->Children.push_back(std::move(incr));
+				n->Children.push_back(std::move(body));
+				return n;
+			}
+
+			if (Accept("while")) {
+				NodePtr n(new Node(NodeKind::While, line));
+				if (!Expect("("))
+					return NodePtr();
+				NodePtr cond = Expression();
+				if (!cond || !Expect(")"))
+					return NodePtr();
+				NodePtr body = Statement();
+				if (!body)
+					return NodePtr();
+				n->Children.push_back(std::move(cond));
+				n->Children.push_back(std::move(body));
+				return n;
+			}
+
+			if (Accept("do")) {
+				NodePtr n(new Node(NodeKind::DoWhile, line));
+				NodePtr body = Statement();
+				if (!body || !Expect("while") || !Expect("("))
+					return NodePtr();
+				NodePtr cond = Expression();
+				if (!cond || !Expect(")") || !Expect(";"))
+					return NodePtr();
+				n->Children.push_back(std::move(body));
+				n->Children.push_back(std::move(cond));
+				return n;
+			}
+
+			if (Accept("break")) {
+				if (!Expect(";"))
+					return NodePtr();
+				return NodePtr(new Node(NodeKind::Break, line));
+			}
+			if (Accept("continue")) {
+				if (!Expect(";"))
+					return NodePtr();
+				return NodePtr(new Node(NodeKind::Continue, line));
+			}
+			if (Accept("discard")) {
+				if (!Expect(";"))
+					return NodePtr();
+				return NodePtr(new Node(NodeKind::Discard, line));
+			}
+			if (Accept("return")) {
+				NodePtr n(new Node(NodeKind::Return, line));
+				if (!Peek().Is(";")) {
+					NodePtr value = Expression();
+					if (!value)
+						return NodePtr();
+					n->Children.push_back(std::move(value));
+				}
+				if (!Expect(";"))
+					return NodePtr();
+				return n;
+			}
+
+			if (StartsDeclaration()) {
+				std::string type;
+				bool isConst;
+				ParseType(type, isConst);
+				return DeclarationRest(type, isConst, line);
+			}
+
+			return ExpressionStatement();
+		}
+
+		NodePtr ExpressionStatement()
+		{
+			NodePtr n(new Node(NodeKind::ExprStmt, Peek().Line));
+			NodePtr e = Expression();
+			if (!e || !Expect(";"))
+				return NodePtr();
+			n->Children.push_back(std::move(e));
+			return n;
+		}
+
+		NodePtr MakeNode(NodeKind kind, int line, const std::string& text, NodePtr a, NodePtr b = NodePtr(), NodePtr c = NodePtr())
+		{
+			NodePtr n(new Node(kind, line));
+			n->Text = text;
+			n->Children.push_back(std::move(a));
+			if (b)
+				n->Children.push_back(std::move(b));
+			if (c)
+				n->Children.push_back(std::move(c));
+			return n;
+		}
+
+		NodePtr Expression()
+		{
+			NodePtr left = Assignment();
+			if (!left)
+				return NodePtr();
+			if (!Peek().Is(","))
+				return left;
+
+			NodePtr comma(new Node(NodeKind::Comma, left->Line));
+			comma->Children.push_back(std::move(left));
+			while (Accept(",")) {
+				NodePtr next = Assignment();
+				if (!next)
+					return NodePtr();
+				comma->Children.push_back(std::move(next));
+			}
+			return comma;
+		}
+
+		NodePtr Assignment()
+		{
+			NodePtr left = Ternary();
+			if (!left)
+				return NodePtr();
+
+			static const char* ops[] = { "=", "+=", "-=", "*=", "/=", "%=", 0 };
+			for (int i = 0; ops[i]; i++) {
+				if (Peek().Is(ops[i])) {
+					int line = Next().Line;
+					NodePtr right = Assignment();
+					if (!right)
+						return NodePtr();
+					return MakeNode(NodeKind::Assign, line, ops[i], std::move(left), std::move(right));
+				}
+			}
+			if (Peek().Is("&=") || Peek().Is("|=") || Peek().Is("^=") || Peek().Is("<<=") || Peek().Is(">>="))
+				return Fail("bitwise operators are not supported");
+			return left;
+		}
+
+		NodePtr Ternary()
+		{
+			NodePtr cond = Binary(0);
+			if (!cond)
+				return NodePtr();
+			if (!Peek().Is("?"))
+				return cond;
+
+			int line = Next().Line;
+			NodePtr a = Assignment();
+			if (!a || !Expect(":"))
+				return NodePtr();
+			NodePtr b = Assignment();
+			if (!b)
+				return NodePtr();
+			return MakeNode(NodeKind::Ternary, line, "?", std::move(cond), std::move(a), std::move(b));
+		}
+
+		// binary operators by increasing precedence
+		NodePtr Binary(int level)
+		{
+			static const std::vector<std::vector<std::string>> levels = {
+				{ "||" }, { "^^" }, { "&&" }, { "==", "!=" }, { "<", ">", "<=", ">=" }, { "+", "-" }, { "*", "/", "%" },
+			};
+			if (level == (int)levels.size())
+				return Unary();
+
+			NodePtr left = Binary(level + 1);
+			if (!left)
+				return NodePtr();
+
+			for (;;) {
+				if (Peek().Type == TokenType::Punctuation && (Peek().Is("&") || Peek().Is("|") || Peek().Is("^") || Peek().Is("<<") || Peek().Is(">>")))
+					return Fail("bitwise operators are not supported");
+
+				bool matched = false;
+				for (const std::string& op : levels[level]) {
+					if (Peek().Type == TokenType::Punctuation && Peek().Text == op) {
+						int line = Next().Line;
+						NodePtr right = Binary(level + 1);
+						if (!right)
+							return NodePtr();
+						left = MakeNode(NodeKind::Binary, line, op, std::move(left), std::move(right));
+						matched = true;
+						break;
+					}
+				}
+				if (!matched)
+					return left;
+			}
+		}
+
+		NodePtr Unary()
+		{
+			int line = Peek().Line;
+			if (Peek().Is("-") || Peek().Is("+") || Peek().Is("!")) {
+				std::string op = Next().Text;
+				NodePtr operand = Unary();
+				if (!operand)
+					return NodePtr();
+				return MakeNode(NodeKind::Unary, line, op, std::move(operand));
+			}
+			if (Peek().Is("++") || Peek().Is("--")) {
+				std::string op = Next().Text;
+				NodePtr operand = Unary();
+				if (!operand)
+					return NodePtr();
+				return MakeNode(NodeKind::PreIncDec, line, op, std::move(operand));
+			}
+			if (Peek().Is("~"))
+				return Fail("bitwise operators are not supported");
+			return Postfix();
+		}
+
+		bool Arguments(Node* call)
+		{
+			if (!Expect("("))
+				return false;
+			if (Accept(")"))
+				return true;
+			// 'float f(void)' style calls never happen, but 'vec3 v = vec3()' is invalid anyway
+			do {
+				NodePtr arg = Assignment();
+				if (!arg)
+					return false;
+				call->Children.push_back(std::move(arg));
+			} while (Accept(","));
+			return Expect(")");
+		}
+
+		NodePtr Postfix()
+		{
+			NodePtr n = Primary();
+			while (n) {
+				int line = Peek().Line;
+				if (Accept("[")) {
+					NodePtr index = Expression();
+					if (!index || !Expect("]"))
+						return NodePtr();
+					n = MakeNode(NodeKind::Index, line, "[]", std::move(n), std::move(index));
+				} else if (Accept(".")) {
+					if (Peek().Type != TokenType::Identifier)
+						return Fail("expected a field name after '.'");
+					std::string field = Next().Text;
+					if (Peek().Is("("))
+						return Fail("method calls such as '." + field + "()' are not supported");
+					n = MakeNode(NodeKind::Member, line, field, std::move(n));
+				} else if (Peek().Is("++") || Peek().Is("--")) {
+					std::string op = Next().Text;
+					n = MakeNode(NodeKind::PostIncDec, line, op, std::move(n));
+				} else
+					break;
+			}
+			return n;
+		}
+
+		NodePtr Primary()
+		{
+			const Token& t = Peek();
+			int line = t.Line;
+
+			if (t.Type == TokenType::Number) {
+				Next();
+				NodePtr n(new Node(NodeKind::Number, line));
+				n->Text = t.Text;
+				bool isFloat = t.Text.find_first_of(".eE") != std::string::npos && t.Text.compare(0, 2, "0x") != 0;
+				if (t.Text.back() == 'f' || t.Text.back() == 'F')
+					isFloat = true;
+				n->IsInt = !isFloat;
+				n->Number = isFloat ? strtod(t.Text.c_str(), 0) : (double)strtoll(t.Text.c_str(), 0, 0);
+				return n;
+			}
+
+			if (t.Is("true") || t.Is("false")) {
+				Next();
+				NodePtr n(new Node(NodeKind::Bool, line));
+				n->Number = t.Is("true") ? 1 : 0;
+				return n;
+			}
+
+			if (t.Is("(")) {
+				Next();
+				NodePtr e = Expression();
+				if (!e || !Expect(")"))
+					return NodePtr();
+				return e;
+			}
+
+			if (t.Type == TokenType::Identifier) {
+				std::string name = Next().Text;
+
+				// float[3](...) / float[](...)
+				if (IsTypeName(name) && Peek().Is("[")) {
+					NodePtr n(new Node(NodeKind::ArrayCtor, line));
+					n->Text = name;
+					if (!ParseArraySize(n->ArraySize) || !Arguments(n.get()))
+						return NodePtr();
+					return n;
+				}
+
+				if (Peek().Is("(")) {
+					NodePtr n(new Node(NodeKind::Call, line));
+					n->Text = name;
+					if (!Arguments(n.get()))
+						return NodePtr();
+					return n;
+				}
+
+				NodePtr n(new Node(NodeKind::Identifier, line));
+				n->Text = name;
+				return n;
+			}
+
+			return Fail("unexpected '" + t.Text + "'");
+		}
+	};
+
+	bool Parse(const std::string& src, NodePtr& unit, std::string& err)
+	{
+		std::vector<Token> tokens;
+		if (!Lex(src, tokens, err))
+			return false;
+
+		Parser parser(tokens);
+		return parser.ParseUnit(unit, err);
+	}
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include "lexer.h"
+
+namespace irmf
+{
+	enum class NodeKind
+	{
+		// expressions
+		Number,      // Text holds the literal, Number its value, IsInt the type
+		Bool,        // Number is 0 or 1
+		Identifier,  // Text
+		Unary,       // Text is the operator, Children[0] the operand
+		PreIncDec,   // Text is "++" or "--"
+		PostIncDec,
+		Binary,      // Text is the operator
+		Assign,      // Text is "=", "+=", ...
+		Ternary,     // Children: condition, then, else
+		Call,        // Text is the function or type name, Children the arguments
+		ArrayCtor,   // Text is the element type, ArraySize the length (0 = implicit)
+		Member,      // Text is the field/swizzle, Children[0] the object
+		Index,       // Children: object, index
+		Comma,
+
+		// statements
+		Block,
+		Declaration, // Declarators
+		ExprStmt,    // Children[0]
+		If,          // Children: condition, then, [else]
+		For,         // Children: init (or Empty), condition (or Empty), increment (or Empty), body
+		While,       // Children: condition, body
+		DoWhile,     // Children: body, condition
+		Break,
+		Continue,
+		Return,      // Children: [value]
+		Discard,
+		Empty,
+
+		// top level
+		Function,    // Text is the name, TypeName the return type, Params, Children[0] the body (or none for prototypes)
+		Unit         // Children: global declarations and functions
+	};
+
+	struct Node;
+	typedef std::unique_ptr<Node> NodePtr;
+
+	struct Declarator
+	{
+		std::string Name;
+		int ArraySize;    // 0 when not an array, -1 for 'float a[] = ...'
+		NodePtr Init;     // may be null
+		int Line;
+	};
+
+	struct Param
+	{
+		std::string TypeName;
+		std::string Name;
+		std::string Qualifier; // "in", "out" or "inout"
+		int ArraySize;
+	};
+
+	struct Node
+	{
+		NodeKind Kind;
+		int Line;
+		std::string Text;
+		double Number;
+		bool IsInt;
+		int ArraySize;
+
+		// declarations & functions
+		std::string TypeName;
+		bool IsConst;
+		std::vector<Declarator> Declarators;
+		std::vector<Param> Params;
+
+		std::vector<NodePtr> Children;
+
+		Node(NodeKind kind, int line) : Kind(kind), Line(line), Number(0), IsInt(false), ArraySize(0), IsConst(false) { }
+	};
+
+	// IsTypeName reports whether name is one of the GLSL types understood by
+	// the CPU evaluator (scalars, vectors and square or non-square matrices).
+	bool IsTypeName(const std::string& name);
+
+	// Parse builds the syntax tree of the GLSL subset used by IRMF bodies.
+	bool Parse(const std::string& src, NodePtr& unit, std::string& err);
+}
@@ -0,0 +1,84 @@
+#include "pipeline.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include "threadpool.h"
+
+namespace irmf
+{
+	bool RunPipeline(const Model& model, const PipelineSettings& settings, const std::vector<SlabSink*>& sinks, std::string& err)
+	{
+		Grid grid;
+		if (!MakeGrid(model, settings.Pitch, settings.LayerHeight, grid, err))
+			return false;
+		int materials = (int)model.Materials.size();
+		int width = grid.Size[0], height = grid.Size[1], layers = grid.Size[2];
+
+		ThreadPool pool(settings.Threads);
+		int threads = pool.GetThreadCount();
+		// thin slabs keep every thread busy and the slots small
+		int thickness = std::min(8, std::max(1, layers / (4 * threads)));
+		int slabs = (layers + thickness - 1) / thickness;
+		int window = 2 * threads;
+
+		size_t begun = 0;
+		for (; begun < sinks.size(); begun++)
+			if (!sinks[begun]->Begin(grid, materials, window, threads, err))
+				break;
+		bool ok = begun == sinks.size();
+
+		std::vector<Slab> slots(window);
+		std::vector<std::unique_ptr<RowSampler>> samplers(threads);
+		std::atomic<bool> runaway(false);
+
+		auto sample = [&](int s, int slot, int w) {
+			if (!samplers[w])
+				samplers[w].reset(new RowSampler(model, grid));
+			Slab& slab = slots[slot];
+			slab.First = s * thickness;
+			slab.Count = std::min(thickness, layers - slab.First);
+			slab.Materials = materials;
+			slab.LayerSize = (size_t)materials * width * height;
+			slab.Values.resize(slab.Count * slab.LayerSize);
+			for (int l = 0; l < slab.Count; l++)
+				for (int j = 0; j < height; j++) {
+					if (!samplers[w]->Sample(j, slab.First + l)) {
+						runaway = true;
+						return false;
+					}
+					for (int m = 0; m < materials; m++) {
+						const float* values = samplers[w]->GetValues(m);
+						std::copy(values, values + width, slab.Values.begin() + l * slab.LayerSize + ((size_t)m * height + j) * width);
+					}
+				}
+			for (SlabSink* sink : sinks)
+				sink->Encode(slab, slot, w);
+			return true;
+		};
+
+		auto write = [&](int s, int slot) {
+			for (SlabSink* sink : sinks)
+				if (!sink->Write(slots[slot], slot))
+					return false;
+			if (settings.Progress)
+				settings.Progress(s + 1, slabs);
+			return true;
+		};
+
+		if (ok)
+			ok = RunOrdered(pool, slabs, window, sample, write);
+		if (runaway)
+			err = "a loop in the model did not terminate";
+		for (size_t i = 0; i < begun; i++) {
+			std::string sinkErr;
+			if (!sinks[i]->Finish(sinkErr) && err.empty()) {
+				err = sinkErr;
+				ok = false;
+			}
+		}
+		if (!ok)
+			for (size_t i = 0; i < begun; i++)
+				sinks[i]->Discard();
+		return ok;
+	}
+}
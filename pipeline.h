@@ -0,0 +1,73 @@
+#pragma once
+#include <functional>
+#include <string>
+#include <vector>
+#include "model.h"
+#include "sampler.h"
+
+namespace irmf
+{
+	// Slab is layers [First, First + Count) of a Grid, sampled once for
+	// every sink: material m of cell (i, j) of layer First + l is
+	// Layer(l)[(m * Size[1] + j) * Size[0] + i].
+	struct Slab
+	{
+		int First, Count;
+		int Materials;
+		size_t LayerSize; // Materials * Size[0] * Size[1]
+		std::vector<float> Values;
+
+		inline const float* Layer(int l) const { return Values.data() + l * LayerSize; }
+	};
+
+	// SlabSink is an output of RunPipeline. Encode does the work that can
+	// run in parallel and leaves its result in a slot, Write hands it to the
+	// output in order.
+	class SlabSink
+	{
+	public:
+		virtual ~SlabSink() {}
+
+		// Begin is called once before the first slab; at most slots slabs
+		// are in flight, and Encode runs on workers [0, workers).
+		virtual bool Begin(const Grid& grid, int materials, int slots, int workers, std::string& err) = 0;
+		// Encode is called on a worker for every slab, in any order
+		virtual void Encode(const Slab& slab, int slot, int worker) = 0;
+		// Write is called on the calling thread for every slab, in order,
+		// once it is encoded. Returning false stops the export.
+		virtual bool Write(const Slab& slab, int slot) = 0;
+		// Finish completes the output after the last slab; false, with err
+		// set, if it could not be written.
+		virtual bool Finish(std::string& err) = 0;
+		// Discard removes what the sink wrote, when the export failed
+		virtual void Discard() = 0;
+	};
+
+	// PipelineSettings controls the grid and parallelism of RunPipeline.
+	struct PipelineSettings
+	{
+		float Pitch;       // cell size in X and Y, in model units
+		float LayerHeight; // <= 0: same as Pitch
+		int Threads;       // <= 0: one per hardware thread
+
+		// Progress is called on the calling thread after each slab is
+		// written, with the number of slabs done and the total
+		std::function<void(int, int)> Progress;
+
+		PipelineSettings()
+			: Pitch(0.1f)
+			, LayerHeight(0.0f)
+			, Threads(0)
+		{
+		}
+	};
+
+	// RunPipeline samples the model's grid once, in Z slabs of a few layers
+	// that are evaluated and then encoded by every sink on a pool of
+	// workers, and written to the sinks in order. At most two slabs per
+	// worker are in flight: when a sink's writes fall behind, sampling
+	// waits, so memory stays bounded and the export takes about as long as
+	// sampling once plus encoding for every sink. If any sink fails, every
+	// sink discards its output.
+	bool RunPipeline(const Model& model, const PipelineSettings& settings, const std::vector<SlabSink*>& sinks, std::string& err);
+}
@@ -0,0 +1,132 @@
+#include "png.h"
+#include <algorithm>
+#include <cstring>
+
+namespace irmf
+{
+	namespace
+	{
+		void PutBE32(uint8_t* p, uint32_t v)
+		{
+			p[0] = (uint8_t)(v >> 24);
+			p[1] = (uint8_t)(v >> 16);
+			p[2] = (uint8_t)(v >> 8);
+			p[3] = (uint8_t)v;
+		}
+	}
+
+	PngEncoder::PngEncoder()
+		: m_zs(z_stream())
+		, m_length(0)
+		, m_width(0)
+		, m_idat(0)
+		, m_first(true)
+	{
+		// slices are mostly runs of equal pixels, and the Up filter turns
+		// rows equal to the previous one into zeros: RLE matching finds
+		// nearly all of it at a fraction of the cost of a full search
+		deflateInit2(&m_zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15, 8, Z_RLE);
+	}
+
+	PngEncoder::~PngEncoder()
+	{
+		deflateEnd(&m_zs);
+	}
+
+	uint8_t* PngEncoder::Reserve(size_t size)
+	{
+		if (m_length + size > m_data.size())
+			m_data.resize(std::max(m_data.size() * 2, m_length + size + 4096));
+		return m_data.data() + m_length;
+	}
+
+	// a chunk header; the data follows and FinishChunk adds the CRC
+	size_t PngEncoder::BeginChunk(const char* type)
+	{
+		size_t at = m_length;
+		memcpy(Reserve(8) + 4, type, 4);
+		m_length += 8;
+		return at;
+	}
+	void PngEncoder::FinishChunk(size_t at)
+	{
+		size_t length = m_length - at - 8;
+		Reserve(4);
+		PutBE32(&m_data[at], (uint32_t)length);
+		uint32_t crc = (uint32_t)crc32(0, &m_data[at + 4], (uInt)(length + 4));
+		PutBE32(&m_data[m_length], crc);
+		m_length += 4;
+	}
+
+	void PngEncoder::Begin(int width, int height, int bitDepth)
+	{
+		static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+		m_width = ((size_t)width * bitDepth + 7) / 8;
+		m_row.resize(m_width + 1);
+		m_previous.resize(m_width);
+		m_first = true;
+		deflateReset(&m_zs);
+
+		m_length = 0;
+		memcpy(Reserve(8), signature, 8);
+		m_length += 8;
+
+		size_t at = BeginChunk("IHDR");
+		uint8_t* p = Reserve(13);
+		PutBE32(p, (uint32_t)width);
+		PutBE32(p + 4, (uint32_t)height);
+		p[8] = (uint8_t)bitDepth;
+		p[9] = 0;  // grayscale
+		p[10] = 0; // deflate
+		p[11] = 0; // filter method 0
+		p[12] = 0; // no interlacing
+		m_length += 13;
+		FinishChunk(at);
+
+		m_idat = BeginChunk("IDAT");
+	}
+
+	void PngEncoder::Row(const uint8_t* pixels)
+	{
+		uint8_t* row = m_row.data();
+		if (m_first) {
+			row[0] = 0; // None
+			memcpy(row + 1, pixels, m_width);
+			m_first = false;
+		} else {
+			row[0] = 2; // Up
+			const uint8_t* up = m_previous.data();
+			for (size_t i = 0; i < m_width; i++)
+				row[i + 1] = (uint8_t)(pixels[i] - up[i]);
+		}
+		memcpy(m_previous.data(), pixels, m_width);
+
+		m_zs.next_in = row;
+		m_zs.avail_in = (uInt)(m_width + 1);
+		Compress(Z_NO_FLUSH);
+	}
+
+	void PngEncoder::End(std::vector<uint8_t>& out)
+	{
+		m_zs.next_in = nullptr;
+		m_zs.avail_in = 0;
+		Compress(Z_FINISH);
+		FinishChunk(m_idat);
+		FinishChunk(BeginChunk("IEND"));
+		out.assign(m_data.begin(), m_data.begin() + m_length);
+	}
+
+	void PngEncoder::Compress(int flush)
+	{
+		for (;;) {
+			size_t room = m_width + 1024;
+			m_zs.next_out = Reserve(room);
+			m_zs.avail_out = (uInt)room;
+			int ret = deflate(&m_zs, flush);
+			m_length += room - m_zs.avail_out;
+			if (flush == Z_FINISH ? ret == Z_STREAM_END : (m_zs.avail_in == 0 && m_zs.avail_out > 0))
+				break;
+		}
+	}
+}
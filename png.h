@@ -0,0 +1,42 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <zlib.h>
+
+namespace irmf
+{
+	// PngEncoder writes grayscale PNG images row by row, so an image never
+	// has to be held uncompressed. The compressor and the buffers are
+	// kept between images: use one per thread (and channel) and reuse it.
+	class PngEncoder
+	{
+	public:
+		PngEncoder();
+		~PngEncoder();
+		PngEncoder(const PngEncoder&) = delete;
+		PngEncoder& operator=(const PngEncoder&) = delete;
+
+		// Begin starts an image of 1, 2, 4 or 8 bits per pixel.
+		void Begin(int width, int height, int bitDepth = 8);
+		// Row adds the next row, top to bottom: width bytes, or below 8 bits
+		// the pixels packed from the high bits of each byte.
+		void Row(const uint8_t* pixels);
+		// End finishes the image and copies the file to out.
+		void End(std::vector<uint8_t>& out);
+
+	private:
+		uint8_t* Reserve(size_t size);
+		size_t BeginChunk(const char* type);
+		void FinishChunk(size_t at);
+		void Compress(int flush);
+
+		z_stream m_zs;
+		std::vector<uint8_t> m_data; // the file so far, m_length bytes
+		size_t m_length;
+		std::vector<uint8_t> m_row, m_previous;
+		size_t m_width; // bytes per row
+		size_t m_idat; // offset of the IDAT chunk
+		bool m_first;
+	};
+}
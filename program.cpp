@@ -0,0 +1,354 @@
+#include "program.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+
+namespace irmf
+{
+	static const char* OpcodeNames[] = {
+		"mov", "neg", "not", "abs", "sign", "floor", "ceil", "fract", "trunc", "round", "roundeven",
+		"sqrt", "invsqrt", "exp", "exp2", "log", "log2", "sin", "cos", "tan", "asin", "acos", "atan", "sinh", "cosh", "tanh",
+		"add", "sub", "mul", "div", "mod", "min", "max", "pow", "atan2", "step",
+		"lt", "le", "gt", "ge", "eq", "ne", "and", "or", "xor",
+		"clamp", "mix", "smoothstep", "select",
+		"if", "else", "endif", "loop", "breakifnot", "break", "continue", "continuepoint", "endloop", "call", "return", "endcall",
+	};
+
+	int OperandCount(Opcode op)
+	{
+		if (op <= Opcode::Tanh)
+			return 1;
+		if (op <= Opcode::Xor)
+			return 2;
+		if (op <= Opcode::Select)
+			return 3;
+		if (op == Opcode::If || op == Opcode::BreakIfNot)
+			return 1;
+		return 0;
+	}
+
+	bool IsControlFlow(Opcode op)
+	{
+		return op >= Opcode::If && op < Opcode::Count;
+	}
+
+	const char* OpcodeName(Opcode op)
+	{
+		return op < Opcode::Count ? OpcodeNames[(int)op] : "?";
+	}
+
+	std::string Disassemble(const Program& program)
+	{
+		std::ostringstream ss;
+		auto reg = [&](uint16_t r) {
+			std::ostringstream rs;
+			if (r < Program::NumInputs)
+				rs << "xyz"[r];
+			else if (program.IsConstant(r))
+				rs << program.Constants[r - program.ConstantBase()];
+			else
+				rs << "r" << r;
+			return rs.str();
+		};
+
+		ss << "; " << program.Entry << ": " << program.Code.size() << " instructions, "
+			<< program.NumRegisters << " registers, " << program.Constants.size() << " constants\n";
+
+		int depth = 0;
+		for (size_t i = 0; i < program.Code.size(); i++) {
+			const Instruction& in = program.Code[i];
+			if (in.Op == Opcode::Else || in.Op == Opcode::EndIf || in.Op == Opcode::EndLoop || in.Op == Opcode::EndCall)
+				depth--;
+
+			ss << i << ":\t" << std::string(depth * 2, ' ') << OpcodeName(in.Op);
+			if (!IsControlFlow(in.Op)) {
+				ss << " r" << in.Dst;
+				int n = OperandCount(in.Op);
+				if (n > 0) ss << ", " << reg(in.A);
+				if (n > 1) ss << ", " << reg(in.B);
+				if (n > 2) ss << ", " << reg(in.C);
+			} else {
+				if (OperandCount(in.Op) > 0)
+					ss << " " << reg(in.A);
+				if (in.Op != Opcode::EndIf && in.Op != Opcode::ContinuePoint && in.Op != Opcode::EndCall)
+					ss << " -> " << in.Target;
+			}
+			ss << "\n";
+
+			if (in.Op == Opcode::If || in.Op == Opcode::Else || in.Op == Opcode::Loop || in.Op == Opcode::Call)
+				depth++;
+		}
+
+		ss << "; outputs:";
+		for (uint16_t r : program.Outputs)
+			ss << " " << reg(r);
+		ss << "\n";
+		return ss.str();
+	}
+
+	namespace
+	{
+		const char* GLSLFunctions[] = {
+			nullptr, nullptr, nullptr, "abs", "sign", "floor", "ceil", "fract", "trunc", "round", "roundEven",
+			"sqrt", "inversesqrt", "exp", "exp2", "log", "log2", "sin", "cos", "tan", "asin", "acos", "atan", "sinh", "cosh", "tanh",
+			nullptr, nullptr, nullptr, nullptr, "mod", "min", "max", "pow", "atan", "step",
+			nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr,
+			"clamp", "mix", "smoothstep", nullptr,
+		};
+
+		// Writes the bytecode as GLSL. Jumps become break statements: a
+		// loop with a continue target runs the code before it in a
+		// do { } while (false), a function that returns early is one as
+		// well, and a jump out of more than one of these sets a flag that
+		// is checked after each of them.
+		class GLSLWriter
+		{
+		public:
+			GLSLWriter(const Program& program)
+				: m_program(program)
+				, m_code(program.Code)
+				, m_jumped(program.Code.size() + 1, false)
+				, m_depth(1)
+			{
+				for (const Instruction& in : m_code)
+					if (in.Op == Opcode::Continue || in.Op == Opcode::Return)
+						m_jumped[in.Target] = true;
+			}
+
+			std::string Run()
+			{
+				Block(0, m_code.size());
+
+				std::ostringstream ss;
+				int slots = atoi(m_program.Entry.c_str() + strlen("mainModel"));
+				const char* type = slots == 16 ? "mat4" : (slots == 9 ? "mat3" : "vec4");
+				ss << "void " << m_program.Entry << "(out " << type << " materials, in vec3 xyz) {\n";
+
+				std::vector<bool> declared(m_program.NumRegisters, false);
+				for (const Instruction& in : m_code) {
+					uint16_t regs[4] = { in.Dst, in.A, in.B, in.C };
+					int n = OperandCount(in.Op);
+					for (int k = IsControlFlow(in.Op) ? 1 : 0; k <= n; k++)
+						declared[regs[k]] = !IsFixed(regs[k]);
+				}
+				for (uint16_t r : m_program.Outputs)
+					declared[r] = !IsFixed(r);
+				int count = 0;
+				for (size_t r = 0; r < declared.size(); r++) {
+					if (!declared[r])
+						continue;
+					ss << (count % 8 == 0 ? (count ? ";\n\tfloat " : "\tfloat ") : ", ") << "r" << r << " = 0.0";
+					count++;
+				}
+				if (count)
+					ss << ";\n";
+				for (const std::string& f : m_flags)
+					ss << "\tbool " << f << " = false;\n";
+
+				ss << m_body.str();
+				ss << "\tmaterials = " << type << "(";
+				for (int m = 0; m < slots; m++)
+					ss << (m ? ", " : "") << (m < (int)m_program.Outputs.size() ? Reg(m_program.Outputs[m]) : "0.0");
+				ss << ");\n}\n";
+				return ss.str();
+			}
+
+		private:
+			// a GLSL loop that break statements leave
+			struct Breakable
+			{
+				uint32_t Target;                // EndLoop, ContinuePoint or EndCall jumping to it
+				std::vector<std::string> Flags; // flags of jumps that passed through it
+			};
+
+			bool IsFixed(uint16_t r) const { return r < Program::NumInputs || m_program.IsConstant(r); }
+
+			std::string Reg(uint16_t r) const
+			{
+				if (r < Program::NumInputs)
+					return std::string("xyz.") + "xyz"[r];
+				if (!m_program.IsConstant(r))
+					return "r" + std::to_string(r);
+
+				float v = m_program.Constants[r - m_program.ConstantBase()];
+				char buf[48];
+				if (!std::isfinite(v)) {
+					uint32_t bits;
+					memcpy(&bits, &v, sizeof(bits));
+					snprintf(buf, sizeof(buf), "uintBitsToFloat(0x%08xu)", bits);
+					return buf;
+				}
+				snprintf(buf, sizeof(buf), "%.9g", v);
+				std::string s = buf;
+				if (s.find_first_of(".en") == std::string::npos)
+					s += ".0";
+				return v < 0.0f || (v == 0.0f && std::signbit(v)) ? "(" + s + ")" : s;
+			}
+
+			std::string Expression(const Instruction& in) const
+			{
+				std::string a = Reg(in.A), b = Reg(in.B), c = Reg(in.C);
+				switch (in.Op) {
+				case Opcode::Mov: return a;
+				case Opcode::Neg: return "-" + a;
+				case Opcode::Not: return "(" + a + " == 0.0 ? 1.0 : 0.0)";
+				case Opcode::Add: return a + " + " + b;
+				case Opcode::Sub: return a + " - " + b;
+				case Opcode::Mul: return a + " * " + b;
+				case Opcode::Div: return a + " / " + b;
+				case Opcode::Lt: return "float(" + a + " < " + b + ")";
+				case Opcode::Le: return "float(" + a + " <= " + b + ")";
+				case Opcode::Gt: return "float(" + a + " > " + b + ")";
+				case Opcode::Ge: return "float(" + a + " >= " + b + ")";
+				case Opcode::Eq: return "float(" + a + " == " + b + ")";
+				case Opcode::Ne: return "float(" + a + " != " + b + ")";
+				case Opcode::And: return "float(" + a + " != 0.0 && " + b + " != 0.0)";
+				case Opcode::Or: return "float(" + a + " != 0.0 || " + b + " != 0.0)";
+				case Opcode::Xor: return "float((" + a + " != 0.0) != (" + b + " != 0.0))";
+				case Opcode::Select: return "(" + a + " != 0.0 ? " + b + " : " + c + ")";
+				default:
+					break;
+				}
+				std::string call = std::string(GLSLFunctions[(int)in.Op]) + "(" + a;
+				int n = OperandCount(in.Op);
+				if (n > 1) call += ", " + b;
+				if (n > 2) call += ", " + c;
+				return call + ")";
+			}
+
+			void Line(const std::string& text)
+			{
+				m_body << std::string(m_depth, '\t') << text << "\n";
+			}
+
+			// the statement that jumps to resume after code[target]
+			std::string Jump(uint32_t target)
+			{
+				size_t i = m_stack.size();
+				while (m_stack[i - 1].Target != target)
+					i--;
+				if (i == m_stack.size())
+					return "break;";
+
+				std::string flag = "j" + std::to_string(target);
+				if (std::find(m_flags.begin(), m_flags.end(), flag) == m_flags.end())
+					m_flags.push_back(flag);
+				for (size_t k = i; k < m_stack.size(); k++) {
+					std::vector<std::string>& flags = m_stack[k].Flags;
+					if (std::find(flags.begin(), flags.end(), flag) == flags.end())
+						flags.push_back(flag);
+				}
+				return "{ " + flag + " = true; break; }";
+			}
+
+			void Open(const std::string& text, uint32_t target)
+			{
+				Line(text);
+				m_stack.push_back(Breakable{ target, std::vector<std::string>() });
+				m_depth++;
+			}
+			void Close(const std::string& text)
+			{
+				Breakable b = m_stack.back();
+				m_stack.pop_back();
+				m_depth--;
+				Line(text);
+				// the last construct a jump leaves resets its flag
+				for (const std::string& f : b.Flags) {
+					bool last = m_stack.back().Target == (uint32_t)atoi(f.c_str() + 1);
+					Line("if (" + f + ") " + (last ? "{ " + f + " = false; break; }" : "break;"));
+				}
+			}
+
+			void Block(size_t pc, size_t end)
+			{
+				for (; pc < end; pc++) {
+					const Instruction& in = m_code[pc];
+					switch (in.Op) {
+					case Opcode::If: {
+						size_t split = in.Target;
+						bool hasElse = m_code[split].Op == Opcode::Else;
+						size_t endIf = hasElse ? m_code[split].Target : split;
+						Line("if (" + Reg(in.A) + " != 0.0) {");
+						m_depth++;
+						Block(pc + 1, split);
+						if (hasElse) {
+							m_depth--;
+							Line("} else {");
+							m_depth++;
+							Block(split + 1, endIf);
+						}
+						m_depth--;
+						Line("}");
+						pc = endIf;
+						break;
+					}
+					case Opcode::Loop: {
+						size_t endLoop = in.Target;
+						size_t split = endLoop;
+						for (size_t i = pc + 1; i < endLoop; i++) {
+							if (m_code[i].Op == Opcode::Loop)
+								i = m_code[i].Target;
+							else if (m_code[i].Op == Opcode::ContinuePoint)
+								split = i;
+						}
+						Open("for (;;) {", (uint32_t)endLoop);
+						if (split != endLoop && m_jumped[split]) {
+							Open("do {", (uint32_t)split);
+							Block(pc + 1, split);
+							Close("} while (false);");
+							Block(split + 1, endLoop);
+						} else
+							Block(pc + 1, endLoop);
+						Close("}");
+						pc = endLoop;
+						break;
+					}
+					case Opcode::Call:
+						if (m_jumped[in.Target]) {
+							Open("do {", in.Target);
+							Block(pc + 1, in.Target);
+							Close("} while (false);");
+							pc = in.Target;
+						}
+						break;
+
+					case Opcode::BreakIfNot:
+						Line("if (" + Reg(in.A) + " == 0.0) " + Jump(in.Target));
+						break;
+					case Opcode::Break:
+					case Opcode::Continue:
+					case Opcode::Return:
+						Line(Jump(in.Target));
+						break;
+
+					case Opcode::Else:
+					case Opcode::EndIf:
+					case Opcode::ContinuePoint:
+					case Opcode::EndLoop:
+					case Opcode::EndCall:
+						break;
+
+					default:
+						Line("r" + std::to_string(in.Dst) + " = " + Expression(in) + ";");
+						break;
+					}
+				}
+			}
+
+			const Program& m_program;
+			const std::vector<Instruction>& m_code;
+			std::vector<bool> m_jumped; // targets of Continue and Return
+			std::vector<Breakable> m_stack;
+			std::vector<std::string> m_flags;
+			std::ostringstream m_body;
+			int m_depth;
+		};
+	}
+
+	std::string GenerateGLSL(const Program& program)
+	{
+		return GLSLWriter(program).Run();
+	}
+}
@@ -0,0 +1,149 @@
+#pragma once
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace irmf
+{
+	// Opcode of the scalar bytecode produced from an IRMF body. Vectors and
+	// matrices are split into their components at compile time and function
+	// calls are inlined, so every arithmetic instruction works on floats held
+	// in registers. Integers and booleans are stored as floats as well
+	// (booleans are 0 or 1).
+	enum class Opcode : uint8_t
+	{
+		// Dst = op(A)
+		Mov, Neg, Not, Abs, Sign, Floor, Ceil, Fract, Trunc, Round, RoundEven,
+		Sqrt, InvSqrt, Exp, Exp2, Log, Log2, Sin, Cos, Tan, Asin, Acos, Atan, Sinh, Cosh, Tanh,
+
+		// Dst = op(A, B)
+		Add, Sub, Mul, Div, Mod, Min, Max, Pow, Atan2, Step,
+		Lt, Le, Gt, Ge, Eq, Ne, And, Or, Xor,
+
+		// Dst = op(A, B, C)
+		Clamp, Mix, Smoothstep,
+		Select, // A != 0 ? B : C
+
+		// Structured control flow. Target refers to another instruction and a
+		// jump resumes execution right after it:
+		//   If A         -> matching Else or EndIf, taken when A == 0
+		//   Else         -> matching EndIf
+		//   Loop         -> matching EndLoop
+		//   BreakIfNot A -> EndLoop of the enclosing loop, taken when A == 0
+		//   Break        -> EndLoop of the enclosing loop
+		//   Continue     -> ContinuePoint of the enclosing loop
+		//   EndLoop      -> matching Loop, i.e. the next iteration
+		//   Call         -> matching EndCall (start of an inlined function)
+		//   Return       -> EndCall of the function being returned from
+		If, Else, EndIf, Loop, BreakIfNot, Break, Continue, ContinuePoint, EndLoop, Call, Return, EndCall,
+
+		Count
+	};
+
+	struct Instruction
+	{
+		Opcode Op;
+		uint16_t Dst, A, B, C;
+		uint32_t Target;
+	};
+
+	// Program is an immutable, compiled IRMF entry point. Its register file is
+	// laid out as [x, y, z][constants][variables and temporaries]; the
+	// materials computed by the entry point end up in the Outputs registers.
+	struct Program
+	{
+		enum { NumInputs = 3 };
+
+		std::string Entry;                // mainModel4, mainModel9 or mainModel16
+		std::vector<Instruction> Code;
+		std::vector<float> Constants;     // loaded into registers [NumInputs, NumInputs + Constants.size())
+		std::vector<uint16_t> Outputs;
+		uint16_t NumRegisters;
+		int MaxDepth;                     // deepest nesting of If/Loop/Call
+
+		Program() : NumRegisters(NumInputs), MaxDepth(0) { }
+
+		uint16_t ConstantBase() const { return NumInputs; }
+		bool IsConstant(uint16_t reg) const { return reg >= NumInputs && reg < NumInputs + Constants.size(); }
+	};
+
+	// Number of register operands (0-3) read by an arithmetic opcode; control
+	// flow opcodes report the registers they read as well (If, BreakIfNot).
+	int OperandCount(Opcode op);
+	bool IsControlFlow(Opcode op);
+	const char* OpcodeName(Opcode op);
+
+	// Human readable listing of a program, one instruction per line.
+	std::string Disassemble(const Program& program);
+
+	// GenerateGLSL prints a program back as an IRMF entry point (one float
+	// per register, structured if/for/do-while), e.g. to diff an optimized
+	// program against the original body or to load it in SHADERed.
+	std::string GenerateGLSL(const Program& program);
+
+	// ApplyOp evaluates an arithmetic opcode. It is shared by the compiler
+	// (constant folding) and the interpreter so that both agree bit for bit.
+	inline float ApplyOp(Opcode op, float a, float b, float c)
+	{
+		switch (op) {
+		case Opcode::Mov: return a;
+		case Opcode::Neg: return -a;
+		case Opcode::Not: return a == 0.0f ? 1.0f : 0.0f;
+		case Opcode::Abs: return std::fabs(a);
+		case Opcode::Sign: return (float)((a > 0.0f) - (a < 0.0f));
+		case Opcode::Floor: return std::floor(a);
+		case Opcode::Ceil: return std::ceil(a);
+		case Opcode::Fract: return a - std::floor(a);
+		case Opcode::Trunc: return std::trunc(a);
+		case Opcode::Round: return std::round(a);
+		case Opcode::RoundEven: return std::nearbyint(a);
+		case Opcode::Sqrt: return std::sqrt(a);
+		case Opcode::InvSqrt: return 1.0f / std::sqrt(a);
+		case Opcode::Exp: return std::exp(a);
+		case Opcode::Exp2: return std::exp2(a);
+		case Opcode::Log: return std::log(a);
+		case Opcode::Log2: return std::log2(a);
+		case Opcode::Sin: return std::sin(a);
+		case Opcode::Cos: return std::cos(a);
+		case Opcode::Tan: return std::tan(a);
+		case Opcode::Asin: return std::asin(a);
+		case Opcode::Acos: return std::acos(a);
+		case Opcode::Atan: return std::atan(a);
+		case Opcode::Sinh: return std::sinh(a);
+		case Opcode::Cosh: return std::cosh(a);
+		case Opcode::Tanh: return std::tanh(a);
+
+		case Opcode::Add: return a + b;
+		case Opcode::Sub: return a - b;
+		case Opcode::Mul: return a * b;
+		case Opcode::Div: return a / b;
+		case Opcode::Mod: return a - b * std::floor(a / b);
+		case Opcode::Min: return b < a ? b : a;
+		case Opcode::Max: return a < b ? b : a;
+		case Opcode::Pow: return std::pow(a, b);
+		case Opcode::Atan2: return std::atan2(a, b);
+		case Opcode::Step: return b < a ? 0.0f : 1.0f;
+		case Opcode::Lt: return a < b ? 1.0f : 0.0f;
+		case Opcode::Le: return a <= b ? 1.0f : 0.0f;
+		case Opcode::Gt: return a > b ? 1.0f : 0.0f;
+		case Opcode::Ge: return a >= b ? 1.0f : 0.0f;
+		case Opcode::Eq: return a == b ? 1.0f : 0.0f;
+		case Opcode::Ne: return a != b ? 1.0f : 0.0f;
+		case Opcode::And: return (a != 0.0f && b != 0.0f) ? 1.0f : 0.0f;
+		case Opcode::Or: return (a != 0.0f || b != 0.0f) ? 1.0f : 0.0f;
+		case Opcode::Xor: return ((a != 0.0f) != (b != 0.0f)) ? 1.0f : 0.0f;
+
+		case Opcode::Clamp: { float t = a < b ? b : a; return c < t ? c : t; }
+		case Opcode::Mix: return a * (1.0f - c) + b * c;
+		case Opcode::Smoothstep: {
+			float t = (c - a) / (b - a);
+			t = t < 0.0f ? 0.0f : (t > 1.0f ? 1.0f : t);
+			return t * t * (3.0f - 2.0f * t);
+		}
+		case Opcode::Select: return a != 0.0f ? b : c;
+
+		default: return 0.0f;
+		}
+	}
+}
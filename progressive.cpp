@@ -0,0 +1,154 @@
+#include "progressive.h"
+#include <algorithm>
+#include <cmath>
+
+namespace irmf
+{
+	// Initial guess used until the first step has been timed: 10 million
+	// samples per second, which is pessimistic for simple models.
+	static const float DefaultMsPerSample = 1e-4f;
+
+	// Number of multiples of 'step' in the half-open range [start, start+len).
+	static long long CountMultiples(int start, int len, int step)
+	{
+		if (len <= 0)
+			return 0;
+		int first = (start + step - 1) / step;
+		int last = (start + len - 1) / step;
+		return std::max(0, last - first + 1);
+	}
+
+	ProgressiveScheduler::ProgressiveScheduler()
+		: m_width(0), m_height(0), m_budgetMs(16.0f), m_msPerSample(DefaultMsPerSample),
+		  m_coarsest(CoarsestLevel), m_level(CoarsestLevel), m_tileX(0), m_tileY(0), m_generation(0),
+		  m_lastSamples(0), m_hasView(false), m_frameIndex(0), m_uniforms(0)
+	{
+		std::fill(m_view, m_view + 16, 0.0f);
+	}
+
+	void ProgressiveScheduler::SetBudget(float ms)
+	{
+		m_budgetMs = std::max(ms, 0.1f);
+	}
+
+	void ProgressiveScheduler::SetViewport(int width, int height)
+	{
+		if (width == m_width && height == m_height)
+			return;
+
+		m_width = std::max(width, 0);
+		m_height = std::max(height, 0);
+		Restart();
+	}
+
+	void ProgressiveScheduler::SetCoarsestLevel(int level)
+	{
+		// levels must be powers of two so that the anchor grids nest
+		int coarsest = 1;
+		while (coarsest * 2 <= std::min(level, (int)CoarsestLevel))
+			coarsest *= 2;
+
+		if (coarsest != m_coarsest) {
+			m_coarsest = coarsest;
+			Restart();
+		}
+	}
+
+	void ProgressiveScheduler::Restart()
+	{
+		m_level = m_coarsest;
+		m_tileX = 0;
+		m_tileY = 0;
+		m_lastSamples = 0;
+		m_generation++;
+	}
+
+	bool ProgressiveScheduler::Observe(const float view[16], int frameIndex, unsigned long long uniforms)
+	{
+		bool changed = !m_hasView || frameIndex < m_frameIndex || uniforms != m_uniforms;
+		for (int i = 0; i < 16 && !changed; i++)
+			changed = std::fabs(view[i] - m_view[i]) > 1e-6f;
+
+		std::copy(view, view + 16, m_view);
+		m_frameIndex = frameIndex;
+		m_uniforms = uniforms;
+		m_hasView = true;
+
+		if (changed)
+			Restart();
+		return changed;
+	}
+
+	long long ProgressiveScheduler::SampleCount(const ProgressiveStep& step) const
+	{
+		if (step.Level <= 0)
+			return 0;
+
+		long long count = CountMultiples(step.X, step.Width, step.Level) * CountMultiples(step.Y, step.Height, step.Level);
+
+		// anchors of the next coarser level were shaded already
+		if (step.Level < m_coarsest)
+			count -= CountMultiples(step.X, step.Width, step.Level * 2) * CountMultiples(step.Y, step.Height, step.Level * 2);
+
+		return count;
+	}
+
+	ProgressiveStep ProgressiveScheduler::Next(float lastStepMs)
+	{
+		if (lastStepMs > 0.0f && m_lastSamples > 0) {
+			float measured = lastStepMs / (float)m_lastSamples;
+			m_msPerSample = 0.75f * m_msPerSample + 0.25f * measured;
+		}
+
+		ProgressiveStep step = { 0, 0, 0, 0, 0, m_generation };
+		m_lastSamples = 0;
+
+		if (m_level == 0 || m_width == 0 || m_height == 0)
+			return step;
+
+		step.Level = m_level;
+
+		if (m_level == m_coarsest && m_coarsest > 1) {
+			// the coarse pass always covers the whole viewport so that the user
+			// sees the complete model as soon as possible
+			step.Width = m_width;
+			step.Height = m_height;
+			m_level /= 2;
+		} else {
+			int cols = (m_width + TileSize - 1) / TileSize;
+			int rows = (m_height + TileSize - 1) / TileSize;
+
+			long long perTile = std::max<long long>(1, (long long)TileSize * TileSize * 3 / (4 * m_level * m_level));
+			long long allowed = (long long)(m_budgetMs / std::max(m_msPerSample, 1e-9f));
+			long long tiles = std::max<long long>(1, allowed / perTile);
+
+			step.X = m_tileX * TileSize;
+			step.Y = m_tileY * TileSize;
+
+			if (m_tileX == 0 && tiles >= cols) {
+				// enough budget for one or more complete tile rows
+				int rowCount = (int)std::min<long long>(tiles / cols, rows - m_tileY);
+				step.Width = m_width;
+				step.Height = std::min(rowCount * TileSize, m_height - step.Y);
+				m_tileY += rowCount;
+			} else {
+				int count = (int)std::min<long long>(tiles, cols - m_tileX);
+				step.Width = std::min(count * TileSize, m_width - step.X);
+				step.Height = std::min((int)TileSize, m_height - step.Y);
+				m_tileX += count;
+				if (m_tileX >= cols) {
+					m_tileX = 0;
+					m_tileY++;
+				}
+			}
+
+			if (m_tileY >= rows) {
+				m_tileY = 0;
+				m_level /= 2;
+			}
+		}
+
+		m_lastSamples = SampleCount(step);
+		return step;
+	}
+}
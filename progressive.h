@@ -0,0 +1,71 @@
+#pragma once
+
+namespace irmf
+{
+	// ProgressiveStep describes the part of the preview that is shaded during a
+	// single frame. Only pixels that lie inside the rectangle and on the anchor
+	// grid of the current level are evaluated; all other pixels are discarded.
+	struct ProgressiveStep
+	{
+		int Level;      // block size in pixels (8, 4, 2, 1) or 0 once refinement is done
+		int X, Y;       // top-left corner of the rectangle in pixels
+		int Width, Height;
+		int Generation; // incremented every time the refinement restarts
+	};
+
+	// ProgressiveScheduler decides what the IRMF preview shades in each frame.
+	// The first step shades the whole viewport at the coarsest level, then
+	// every finer level is refined tile by tile, sizing each step so that the
+	// measured per-sample cost multiplied by the number of samples stays
+	// inside the frame budget. It does not touch the GPU, so it can be driven
+	// from plain CPU code.
+	class ProgressiveScheduler
+	{
+	public:
+		enum { CoarsestLevel = 8, TileSize = 64 };
+
+		ProgressiveScheduler();
+
+		void SetBudget(float ms);
+		float GetBudget() const { return m_budgetMs; }
+
+		void SetViewport(int width, int height);
+		void SetCoarsestLevel(int level);
+		int GetCoarsestLevel() const { return m_coarsest; }
+		void Restart();
+
+		// Observe compares the camera, the frame counter and a hash of the
+		// shader's uniform values with those seen in the previous frame and
+		// restarts the refinement if any of them has changed. It returns true
+		// when a restart happened.
+		bool Observe(const float view[16], int frameIndex, unsigned long long uniforms);
+
+		// Next returns the step that should be rendered in the coming frame.
+		// lastStepMs is the time spent rendering the previously returned step
+		// (pass 0 when unknown); it is used to refine the cost estimate.
+		ProgressiveStep Next(float lastStepMs);
+
+		bool IsDone() const { return m_level == 0; }
+		int GetGeneration() const { return m_generation; }
+		float GetCostPerSample() const { return m_msPerSample; }
+
+		// Number of shader invocations that a step will actually evaluate.
+		long long SampleCount(const ProgressiveStep& step) const;
+
+	private:
+		int m_width, m_height;
+		float m_budgetMs;
+		float m_msPerSample;
+
+		int m_coarsest;
+		int m_level;
+		int m_tileX, m_tileY;
+		int m_generation;
+
+		long long m_lastSamples;
+		bool m_hasView;
+		float m_view[16];
+		int m_frameIndex;
+		unsigned long long m_uniforms;
+	};
+}
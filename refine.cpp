@@ -0,0 +1,216 @@
+#include "refine.h"
+#include <algorithm>
+#include <climits>
+
+namespace irmf
+{
+	EdgeRefiner::EdgeRefiner(const Model& model, const Grid& grid, int block)
+		: m_grid(grid)
+		, m_block(std::max(block, 1))
+		, m_materials(0)
+		, m_width(grid.Size[0])
+		, m_bounded(true)
+		, m_batch(model.Code)
+		, m_interval(model.Code)
+		, m_k(INT_MIN)
+		, m_top(-1)
+		, m_bottom(-1)
+		, m_row(-1)
+		, m_evaluations(0)
+		, m_boxes(0)
+	{
+		m_materials = m_batch.GetOutputCount();
+		m_pixels.resize((size_t)m_materials * (m_block + 1) * m_width);
+		m_known.resize((size_t)(m_block + 1) * m_width);
+		m_bounds.resize(m_materials);
+	}
+
+	bool EdgeRefiner::Sample(int j, int k)
+	{
+		if (k != m_k || j > m_top || j < m_bottom) {
+			// the next band down shares its top row with this one's bottom
+			bool next = k == m_k && j == m_bottom - 1;
+			if (!Band(next ? m_bottom : j, k))
+				return false;
+		}
+		m_row = j;
+		return true;
+	}
+
+	// Band samples rows top down to top - block of layer k
+	bool EdgeRefiner::Band(int top, int k)
+	{
+		size_t rows = (size_t)m_block + 1;
+		bool shared = k == m_k && top == m_bottom;
+		if (shared)
+			for (int m = 0; m < m_materials; m++) {
+				uint8_t* pixels = &m_pixels[(size_t)m * rows * m_width];
+				std::copy_n(pixels + (size_t)(m_top - m_bottom) * m_width, m_width, pixels);
+			}
+		std::fill(m_known.begin() + (shared ? m_width : 0), m_known.end(), 0);
+		m_k = k;
+		m_top = top;
+		m_bottom = std::max(top - m_block, 0);
+		m_row = -1;
+
+		m_rects.clear();
+		for (int x0 = 0;; x0 += m_block) {
+			Rect rect = { x0, std::min(x0 + m_block, m_width - 1), m_bottom, m_top };
+			m_rects.push_back(rect);
+			Need(rect.X0, rect.Y0);
+			Need(rect.X1, rect.Y0);
+			Need(rect.X0, rect.Y1);
+			Need(rect.X1, rect.Y1);
+			if (rect.X1 == m_width - 1)
+				break;
+		}
+
+		if (!shared)
+			for (int l = 0; l < 32; l++)
+				m_tried[l] = m_filled[l] = 0;
+
+		// a level of blocks at a time, so their new corners are evaluated
+		// together
+		while (!m_rects.empty()) {
+			if (!Flush(k))
+				return false;
+			m_next.clear();
+			for (const Rect& rect : m_rects) {
+				int w = rect.X1 - rect.X0, h = rect.Y1 - rect.Y0;
+				if (w <= 1 && h <= 1)
+					continue; // all corners
+				bool agree = Agree(rect);
+				// bounding a block costs about BoxCost points, so it is only
+				// worth it where filling the block is likely enough to save
+				// more; smaller blocks are evaluated in full
+				if (!Worth(agree ? w : (w + 1) / 2, agree ? h : (h + 1) / 2)) {
+					for (int j = rect.Y0; j <= rect.Y1; j++)
+						for (int i = rect.X0; i <= rect.X1; i++)
+							Need(i, j);
+					continue;
+				}
+				if (agree && Uniform(rect, k)) {
+					for (int j = rect.Y0; j <= rect.Y1; j++) {
+						std::fill_n(&m_known[At(rect.X0, j)], rect.X1 - rect.X0 + 1, 1);
+						for (int m = 0; m < m_materials; m++) {
+							uint8_t* pixels = &m_pixels[(size_t)m * rows * m_width];
+							std::fill_n(pixels + At(rect.X0, j), rect.X1 - rect.X0 + 1, pixels[At(rect.X0, rect.Y0)]);
+						}
+					}
+					continue;
+				}
+				int xs[3] = { rect.X0, (rect.X0 + rect.X1) / 2, rect.X1 };
+				int ys[3] = { rect.Y0, (rect.Y0 + rect.Y1) / 2, rect.Y1 };
+				for (int a = 0; a < 2; a++)
+					for (int b = 0; b < 2; b++) {
+						Rect child = { xs[a], xs[a + 1], ys[b], ys[b + 1] };
+						// halves of blocks one pixel across
+						if ((a && xs[1] == xs[0]) || (b && ys[1] == ys[0]))
+							continue;
+						if (xs[1] == xs[0])
+							child.X1 = xs[2];
+						if (ys[1] == ys[0])
+							child.Y1 = ys[2];
+						m_next.push_back(child);
+						Need(child.X0, child.Y0);
+						Need(child.X1, child.Y0);
+						Need(child.X0, child.Y1);
+						Need(child.X1, child.Y1);
+					}
+			}
+			m_rects.swap(m_next);
+		}
+		return Flush(k);
+	}
+
+	// Agree tells whether the corners of the block, which are known, have
+	// the same bytes
+	bool EdgeRefiner::Agree(const Rect& rect) const
+	{
+		size_t rows = (size_t)m_block + 1;
+		for (int m = 0; m < m_materials; m++) {
+			const uint8_t* pixels = &m_pixels[(size_t)m * rows * m_width];
+			uint8_t v = pixels[At(rect.X0, rect.Y0)];
+			if (pixels[At(rect.X1, rect.Y0)] != v || pixels[At(rect.X0, rect.Y1)] != v || pixels[At(rect.X1, rect.Y1)] != v)
+				return false;
+		}
+		return true;
+	}
+
+	// Worth tells whether bounding a block w x h pixels across pays off,
+	// from how often blocks that large were filled in this layer so far
+	bool EdgeRefiner::Worth(int w, int h) const
+	{
+		if (!m_bounded)
+			return false;
+		int level = Level(w, h);
+		double filled = (m_filled[level] + 1.0) / (m_tried[level] + 2.0);
+		return filled * ((w + 1) * (h + 1) - 4) > BoxCost;
+	}
+
+	void EdgeRefiner::Need(int i, int j)
+	{
+		size_t at = At(i, j);
+		if (!m_known[at]) {
+			m_known[at] = 1;
+			m_points.push_back((int)at);
+		}
+	}
+
+	// Flush evaluates the pixels Need asked for
+	bool EdgeRefiner::Flush(int k)
+	{
+		size_t count = m_points.size();
+		if (count == 0)
+			return true;
+		m_x.resize(count);
+		m_y.resize(count);
+		m_z.assign(count, m_grid.Center(2, k));
+		for (size_t p = 0; p < count; p++) {
+			m_x[p] = m_grid.Center(0, m_points[p] % m_width);
+			m_y[p] = m_grid.Center(1, m_top - m_points[p] / m_width);
+		}
+		m_out.resize(m_materials * count);
+		if (!m_batch.Evaluate(m_x.data(), m_y.data(), m_z.data(), count, m_out.data()))
+			return false;
+		m_evaluations += count;
+
+		size_t rows = (size_t)m_block + 1;
+		for (int m = 0; m < m_materials; m++) {
+			uint8_t* pixels = &m_pixels[(size_t)m * rows * m_width];
+			const float* out = &m_out[m * count];
+			for (size_t p = 0; p < count; p++)
+				pixels[m_points[p]] = ToByte(out[p]);
+		}
+		m_points.clear();
+		return true;
+	}
+
+	// Uniform tells whether every pixel of the block has the bytes of its
+	// corners, which agree
+	bool EdgeRefiner::Uniform(const Rect& rect, int k)
+	{
+		size_t rows = (size_t)m_block + 1;
+		float min[3] = { m_grid.Center(0, rect.X0), m_grid.Center(1, rect.Y0), m_grid.Center(2, k) };
+		float max[3] = { m_grid.Center(0, rect.X1), m_grid.Center(1, rect.Y1), min[2] };
+		m_boxes++;
+		int level = Level(rect.X1 - rect.X0, rect.Y1 - rect.Y0);
+		m_tried[level]++;
+		if (!m_interval.Evaluate(min, max, m_bounds.data())) {
+			// most likely a loop that stays undecided over every box
+			m_bounded = false;
+			return false;
+		}
+		// the batch kernels' functions are within a few ulp of the ones the
+		// bounds are widened for, so leave a margin before a byte changes
+		const float margin = 1e-6f;
+		for (int m = 0; m < m_materials; m++) {
+			const Interval& b = m_bounds[m];
+			uint8_t v = m_pixels[(size_t)m * rows * m_width + At(rect.X0, rect.Y0)];
+			if (!(b.Lo <= b.Hi) || ToByte(b.Lo - margin) != v || ToByte(b.Hi + margin) != v)
+				return false;
+		}
+		m_filled[level]++;
+		return true;
+	}
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include "batch.h"
+#include "interval.h"
+#include "sampler.h"
+
+namespace irmf
+{
+	// EdgeRefiner samples the layers of a Grid as bytes (ToByte of each
+	// material), giving exactly what sampling every pixel gives while
+	// evaluating only near edges. A band of rows is covered with blocks of
+	// block x block pixels whose corner pixels are evaluated; a block is
+	// filled with its corners' bytes when they agree and IntervalEvaluator
+	// bounds every material over the block to that same byte, and split in
+	// four otherwise, down to single pixels. Models whose bounds cannot be
+	// established (undecided loops) are sampled pixel by pixel instead. Use
+	// one per thread.
+	class EdgeRefiner
+	{
+	public:
+		EdgeRefiner(const Model& model, const Grid& grid, int block);
+
+		// Sample computes row j of layer k: material m of pixel i is then
+		// GetPixels(m)[i]. The rows of a layer must be asked for from the
+		// top (Size[1] - 1) down. Returns false if a loop ran away.
+		bool Sample(int j, int k);
+
+		inline const uint8_t* GetPixels(int material) const
+		{
+			return m_pixels.data() + ((size_t)material * (m_block + 1) + (m_top - m_row)) * m_width;
+		}
+
+		// GetEvaluations returns the points evaluated so far, GetBoxes the
+		// blocks bounded
+		inline uint64_t GetEvaluations() const { return m_evaluations; }
+		inline uint64_t GetBoxes() const { return m_boxes; }
+
+	private:
+		// pixels [X0, X1] x [Y0, Y1], corners included
+		struct Rect
+		{
+			int X0, X1, Y0, Y1;
+		};
+
+		// bounding a block takes about as long as evaluating this many
+		// points
+		enum { BoxCost = 24 };
+
+		bool Band(int top, int k);
+		void Need(int i, int j);
+		bool Flush(int k);
+		bool Agree(const Rect& rect) const;
+		bool Worth(int w, int h) const;
+		bool Uniform(const Rect& rect, int k);
+
+		inline size_t At(int i, int j) const { return (size_t)(m_top - j) * m_width + i; }
+		// blocks are counted by the power of two of their larger side
+		static inline int Level(int w, int h)
+		{
+			int level = 0;
+			while ((1 << level) < std::max(w, h))
+				level++;
+			return level;
+		}
+
+		const Grid& m_grid;
+		int m_block, m_materials, m_width;
+		bool m_bounded;
+		BatchEvaluator m_batch;
+		IntervalEvaluator m_interval;
+		// the band: rows m_top down to m_bottom, m_block + 1 of them per
+		// material, and which of its pixels are known
+		int m_k, m_top, m_bottom, m_row;
+		std::vector<uint8_t> m_pixels, m_known;
+		std::vector<Rect> m_rects, m_next;
+		std::vector<int> m_points;
+		std::vector<float> m_x, m_y, m_z, m_out;
+		std::vector<Interval> m_bounds;
+		int m_tried[32], m_filled[32]; // blocks bounded in the layer, by Level
+		uint64_t m_evaluations, m_boxes;
+	};
+}
@@ -0,0 +1,536 @@
+#include "resin.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <vector>
+#include "bytes.h"
+#include "sampler.h"
+#include "threadpool.h"
+
+namespace irmf
+{
+	namespace
+	{
+		const uint32_t MagicCbddlp = 0x12fd0019;
+		const uint32_t MagicCtb = 0x12fd0086;
+		const uint32_t HeaderSize = 112;
+		const uint32_t PreviewHeaderSize = 32;
+		const uint32_t PrintParametersSize = 60;
+		const uint32_t SlicerInfoSize = 76;
+		const uint32_t LayerDefinitionSize = 36;
+		const int LargePreview[2] = { 400, 300 };
+		const int SmallPreview[2] = { 200, 125 };
+
+		// LayerEncoder run-length encodes the pixels of a layer, row after
+		// row, in the format's layer encoding.
+		class LayerEncoder
+		{
+		public:
+			LayerEncoder(ResinFormat format, std::vector<uint8_t>& out)
+				: m_format(format)
+				, m_out(out)
+				, m_value(false)
+				, m_count(0)
+			{
+			}
+
+			inline void Add(bool value, uint32_t count)
+			{
+				if (value != m_value) {
+					Flush();
+					m_value = value;
+				}
+				m_count += count;
+			}
+
+			void Flush()
+			{
+				if (m_format == ResinFormat::CBDDLP) {
+					// 1 bit of color and 7 of length per byte
+					uint8_t color = m_value ? 0x80 : 0;
+					for (; m_count > 0; m_count -= std::min<uint32_t>(m_count, 125))
+						m_out.push_back(color | (uint8_t)std::min<uint32_t>(m_count, 125));
+					return;
+				}
+				// 7 bits of gray, then the length of longer runs in 1-4 bytes
+				uint8_t gray = m_value ? 0x7f : 0;
+				for (; m_count > 0; m_count -= std::min<uint32_t>(m_count, 0xfffffff)) {
+					uint32_t n = std::min<uint32_t>(m_count, 0xfffffff);
+					if (n == 1) {
+						m_out.push_back(gray);
+						continue;
+					}
+					m_out.push_back(gray | 0x80);
+					if (n <= 0x7f)
+						m_out.push_back((uint8_t)n);
+					else if (n <= 0x3fff) {
+						m_out.push_back((uint8_t)(n >> 8) | 0x80);
+						m_out.push_back((uint8_t)n);
+					} else if (n <= 0x1fffff) {
+						m_out.push_back((uint8_t)(n >> 16) | 0xc0);
+						m_out.push_back((uint8_t)(n >> 8));
+						m_out.push_back((uint8_t)n);
+					} else {
+						m_out.push_back((uint8_t)(n >> 24) | 0xe0);
+						m_out.push_back((uint8_t)(n >> 16));
+						m_out.push_back((uint8_t)(n >> 8));
+						m_out.push_back((uint8_t)n);
+					}
+				}
+			}
+
+		private:
+			ResinFormat m_format;
+			std::vector<uint8_t>& m_out;
+			bool m_value;
+			uint32_t m_count;
+		};
+
+		// Preview renders the heights map (the last layer exposed under each
+		// spot, 0 for none) into a width x height image, keeping its aspect,
+		// as run-length encoded RGB15 behind the preview header at offset.
+		void Preview(const std::vector<int>& heights, int mapWidth, int mapHeight, int layers,
+			int width, int height, uint32_t offset, std::vector<uint8_t>& out)
+		{
+			std::vector<uint8_t> image;
+			double scale = std::min((double)width / mapWidth, (double)height / mapHeight);
+			double left = (width - mapWidth * scale) / 2.0, top = (height - mapHeight * scale) / 2.0;
+			uint32_t color = 0, count = 0;
+			auto flush = [&]() {
+				// bit 5 flags a 12-bit repeat count in the next word
+				for (; count > 0; count -= std::min<uint32_t>(count, 0xfff)) {
+					uint32_t n = std::min<uint32_t>(count, 0xfff);
+					if (n == 1)
+						Put16(image, color);
+					else {
+						Put16(image, color | 0x20);
+						Put16(image, (n - 1) | 0x3000);
+					}
+				}
+			};
+			for (int y = 0; y < height; y++)
+				for (int x = 0; x < width; x++) {
+					int u = (int)std::floor((x + 0.5 - left) / scale), v = (int)std::floor((y + 0.5 - top) / scale);
+					int h = u >= 0 && u < mapWidth && v >= 0 && v < mapHeight ? heights[(size_t)v * mapWidth + u] : 0;
+					uint32_t r = 24, g = 24, b = 32;
+					if (h > 0) {
+						g = 96 + 159 * h / layers;
+						r = g / 2;
+						b = g;
+					}
+					uint32_t c = (r >> 3) << 11 | (g >> 3) << 6 | (b >> 3);
+					if (c != color) {
+						flush();
+						color = c;
+					}
+					count++;
+				}
+			flush();
+
+			Put32(out, width);
+			Put32(out, height);
+			Put32(out, offset + PreviewHeaderSize);
+			Put32(out, (uint32_t)image.size());
+			for (int i = 0; i < 4; i++)
+				Put32(out, 0);
+			out.insert(out.end(), image.begin(), image.end());
+		}
+
+		// Layer is an encoded layer on its way to the file
+		struct Layer
+		{
+			std::vector<uint8_t> Data;
+			std::vector<uint8_t> Footprint; // exposed spots of the preview map
+			uint64_t Pixels;
+		};
+
+		struct LayerEntry
+		{
+			uint32_t Offset, Size;
+		};
+	}
+
+	bool LoadPrinterProfile(const std::string& filename, const std::string& name, PrinterProfile& profile, std::string& err)
+	{
+		std::ifstream file(filename);
+		if (!file) {
+			err = "failed to open " + filename;
+			return false;
+		}
+		std::stringstream ss;
+		ss << file.rdbuf();
+		std::string parseErr;
+		json11::Json printers = json11::Json::parse(ss.str(), parseErr);
+		if (!parseErr.empty()) {
+			err = filename + ": " + parseErr;
+			return false;
+		}
+		const json11::Json& printer = printers[name];
+		if (!printer.is_object()) {
+			err = filename + ": no printer " + name;
+			return false;
+		}
+
+		profile = PrinterProfile();
+		profile.Name = name;
+		struct
+		{
+			const char* Key;
+			float* Value;
+		} floats[] = {
+			{ "height", &profile.MaxHeight },
+			{ "layer", &profile.LayerHeight },
+			{ "exposure", &profile.Exposure },
+			{ "bottomExposure", &profile.BottomExposure },
+			{ "lightOff", &profile.LightOff },
+			{ "bottomLightOff", &profile.BottomLightOff },
+			{ "liftHeight", &profile.LiftHeight },
+			{ "liftSpeed", &profile.LiftSpeed },
+			{ "bottomLiftHeight", &profile.BottomLiftHeight },
+			{ "bottomLiftSpeed", &profile.BottomLiftSpeed },
+			{ "retractSpeed", &profile.RetractSpeed },
+		};
+		struct
+		{
+			const char* Key;
+			int* Value;
+		} ints[] = {
+			{ "bottomLayers", &profile.BottomLayers },
+			{ "power", &profile.Power },
+			{ "bottomPower", &profile.BottomPower },
+		};
+
+		for (const auto& item : printer.object_items()) {
+			const std::string& key = item.first;
+			const json11::Json& value = item.second;
+			bool known = false, valid = true;
+			for (auto& f : floats)
+				if (key == f.Key) {
+					known = true;
+					valid = value.is_number() && value.number_value() >= 0.0;
+					*f.Value = (float)value.number_value();
+				}
+			for (auto& i : ints)
+				if (key == i.Key) {
+					known = true;
+					valid = value.is_number() && value.number_value() >= 0.0;
+					*i.Value = value.int_value();
+				}
+			if (key == "resolution" || key == "pixel") {
+				known = true;
+				const json11::Json::array& items = value.array_items();
+				double xy[2];
+				if (value.is_number())
+					xy[0] = xy[1] = value.number_value();
+				else if (items.size() == 2 && items[0].is_number() && items[1].is_number()) {
+					xy[0] = items[0].number_value();
+					xy[1] = items[1].number_value();
+				} else
+					xy[0] = xy[1] = 0.0;
+				valid = xy[0] > 0.0 && xy[1] > 0.0;
+				for (int a = 0; a < 2; a++)
+					if (key == "resolution")
+						profile.Resolution[a] = (int)xy[a];
+					else
+						profile.PixelSize[a] = (float)xy[a];
+			} else if (key == "mirror") {
+				known = true;
+				valid = value.is_bool();
+				profile.Mirror = value.bool_value();
+			}
+			if (!known) {
+				err = filename + ": " + name + ": unknown setting " + key;
+				return false;
+			}
+			if (!valid) {
+				err = filename + ": " + name + ": invalid " + key;
+				return false;
+			}
+		}
+		if (!(profile.LayerHeight > 0.0f) || profile.Power > 255 || profile.BottomPower > 255) {
+			err = filename + ": " + name + ": invalid layer height or power";
+			return false;
+		}
+		return true;
+	}
+
+	bool WriteResinFile(const Model& model, const PrinterProfile& profile, const ResinSettings& settings, const std::string& filename, std::string& err)
+	{
+		float layerHeight = settings.LayerHeight > 0.0f ? settings.LayerHeight : profile.LayerHeight;
+		if (!(layerHeight > 0.0f)) {
+			err = "the layer height must be positive";
+			return false;
+		}
+		int width = profile.Resolution[0], height = profile.Resolution[1];
+		if (width <= 0 || height <= 0 || !(profile.PixelSize[0] > 0.0f) || !(profile.PixelSize[1] > 0.0f)) {
+			err = "the printer has no pixels";
+			return false;
+		}
+
+		// the bounding box is centered on the plate; only the pixels whose
+		// center falls in it are sampled
+		double scale = UnitLength(model) * 1000.0; // mm per model unit
+		double size[3];
+		for (int a = 0; a < 3; a++)
+			size[a] = ((double)model.Max[a] - model.Min[a]) * scale;
+		if (!(size[0] > 0.0 && size[1] > 0.0 && size[2] > 0.0)) {
+			err = "the bounding box of the model is empty";
+			return false;
+		}
+		if (size[0] > width * (double)profile.PixelSize[0] || size[1] > height * (double)profile.PixelSize[1]
+			|| (profile.MaxHeight > 0.0f && size[2] > profile.MaxHeight)) {
+			char text[128];
+			snprintf(text, sizeof(text), "the model (%.2f x %.2f x %.2f mm) does not fit the printer", size[0], size[1], size[2]);
+			err = text;
+			return false;
+		}
+		Grid grid;
+		int first[2];
+		for (int a = 0; a < 2; a++) {
+			int resolution = profile.Resolution[a];
+			double pixel = profile.PixelSize[a], center = ((double)model.Min[a] + model.Max[a]) / 2.0;
+			double from = (model.Min[a] - center) * scale / pixel + resolution / 2.0 - 0.5;
+			double to = (model.Max[a] - center) * scale / pixel + resolution / 2.0 - 0.5;
+			int lo = std::min(std::max((int)std::ceil(from), 0), resolution - 1);
+			int hi = std::min(std::max((int)std::floor(to), lo), resolution - 1);
+			first[a] = lo;
+			grid.Min[a] = (float)(center + (lo - resolution / 2.0) * pixel / scale);
+			grid.Pitch[a] = (float)(pixel / scale);
+			grid.Size[a] = hi - lo + 1;
+		}
+		double layers = std::ceil(size[2] / layerHeight - 1e-6);
+		if (layers > (1 << 24)) {
+			err = "the layer height is too small for the size of the model";
+			return false;
+		}
+		grid.Min[2] = model.Min[2];
+		grid.Pitch[2] = (float)(layerHeight / scale);
+		grid.Size[2] = std::max(1, (int)layers);
+		int layerCount = grid.Size[2];
+
+		// the previews are drawn from a map of the sampled area
+		double mapScale = std::min(LargePreview[0] / (grid.Size[0] * (double)profile.PixelSize[0]),
+			LargePreview[1] / (grid.Size[1] * (double)profile.PixelSize[1]));
+		int mapWidth = std::max(1, std::min(LargePreview[0], (int)std::lround(grid.Size[0] * profile.PixelSize[0] * mapScale)));
+		int mapHeight = std::max(1, std::min(LargePreview[1], (int)std::lround(grid.Size[1] * profile.PixelSize[1] * mapScale)));
+		std::vector<int> mapColumns(grid.Size[0]);
+		for (int i = 0; i < grid.Size[0]; i++)
+			mapColumns[i] = (int)((int64_t)i * mapWidth / grid.Size[0]);
+
+		FILE* file = fopen(filename.c_str(), "wb");
+		if (!file) {
+			err = "failed to create " + filename;
+			return false;
+		}
+		std::vector<uint8_t> header(HeaderSize, 0);
+		bool ok = fwrite(header.data(), 1, header.size(), file) == header.size();
+		uint64_t offset = HeaderSize;
+
+		struct Worker
+		{
+			std::unique_ptr<RowSampler> Sampler;
+			std::vector<uint8_t> Exposed;
+		};
+		ThreadPool pool(settings.Threads);
+		std::vector<Worker> workers(pool.GetThreadCount());
+		int window = 2 * pool.GetThreadCount();
+		std::vector<Layer> slots(window);
+		std::atomic<bool> runaway(false);
+		int materials = (int)model.Materials.size();
+
+		auto encode = [&](int k, int slot, int w) {
+			Worker& worker = workers[w];
+			if (!worker.Sampler) {
+				worker.Sampler.reset(new RowSampler(model, grid));
+				worker.Exposed.resize(grid.Size[0]);
+			}
+			Layer& layer = slots[slot];
+			layer.Data.clear();
+			layer.Footprint.assign((size_t)mapWidth * mapHeight, 0);
+			layer.Pixels = 0;
+			LayerEncoder encoder(settings.Format, layer.Data);
+			// the first image row is the back (+Y) of the plate
+			for (int row = 0; row < height; row++) {
+				int j = height - 1 - row - first[1];
+				if (j < 0 || j >= grid.Size[1]) {
+					encoder.Add(false, width);
+					continue;
+				}
+				if (!worker.Sampler->Sample(j, k)) {
+					runaway = true;
+					return false;
+				}
+				uint8_t* exposed = worker.Exposed.data();
+				std::fill(exposed, exposed + grid.Size[0], 0);
+				for (int m = 0; m < materials; m++) {
+					const float* values = worker.Sampler->GetValues(m);
+					for (int i = 0; i < grid.Size[0]; i++)
+						exposed[i] |= values[i] >= 0.5f;
+				}
+				uint8_t* footprint = &layer.Footprint[(size_t)((int64_t)(grid.Size[1] - 1 - j) * mapHeight / grid.Size[1]) * mapWidth];
+				encoder.Add(false, first[0]);
+				for (int i = 0; i < grid.Size[0]; i++) {
+					encoder.Add(exposed[i] != 0, 1);
+					if (exposed[i]) {
+						layer.Pixels++;
+						footprint[mapColumns[i]] = 1;
+					}
+				}
+				encoder.Add(false, width - first[0] - grid.Size[0]);
+			}
+			encoder.Flush();
+			return true;
+		};
+
+		std::vector<LayerEntry> entries(layerCount);
+		std::vector<int> heights((size_t)mapWidth * mapHeight, 0);
+		uint64_t pixels = 0;
+		auto write = [&](int k, int slot) {
+			const Layer& layer = slots[slot];
+			if (offset + layer.Data.size() > 0xffffffff) {
+				err = "the layer file would exceed 4 GB";
+				return false;
+			}
+			entries[k].Offset = (uint32_t)offset;
+			entries[k].Size = (uint32_t)layer.Data.size();
+			if (fwrite(layer.Data.data(), 1, layer.Data.size(), file) != layer.Data.size())
+				return false;
+			offset += layer.Data.size();
+			for (size_t p = 0; p < heights.size(); p++)
+				if (layer.Footprint[p])
+					heights[p] = k + 1;
+			pixels += layer.Pixels;
+			if (settings.Progress)
+				settings.Progress(k + 1, layerCount);
+			return true;
+		};
+
+		ok = ok && RunOrdered(pool, layerCount, window, encode, write);
+		if (runaway)
+			err = "a loop in the model did not terminate";
+
+		std::vector<uint8_t> tail;
+		uint32_t largePreview = 0, smallPreview = 0, printParameters = 0, slicerInfo = 0, layerTable = 0;
+		float printTime = 0.0f;
+		if (ok) {
+			largePreview = (uint32_t)offset;
+			Preview(heights, mapWidth, mapHeight, layerCount, LargePreview[0], LargePreview[1], largePreview, tail);
+			smallPreview = (uint32_t)(offset + tail.size());
+			Preview(heights, mapWidth, mapHeight, layerCount, SmallPreview[0], SmallPreview[1], smallPreview, tail);
+
+			int bottomLayers = std::min(profile.BottomLayers, layerCount);
+			for (int k = 0; k < layerCount; k++) {
+				bool bottom = k < bottomLayers;
+				float lift = bottom ? profile.BottomLiftHeight : profile.LiftHeight;
+				float liftSpeed = bottom ? profile.BottomLiftSpeed : profile.LiftSpeed;
+				printTime += bottom ? profile.BottomExposure + profile.BottomLightOff : profile.Exposure + profile.LightOff;
+				if (liftSpeed > 0.0f && profile.RetractSpeed > 0.0f)
+					printTime += lift / liftSpeed * 60.0f + lift / profile.RetractSpeed * 60.0f;
+			}
+			double volume = pixels * (double)profile.PixelSize[0] * profile.PixelSize[1] * layerHeight / 1000.0;
+
+			printParameters = (uint32_t)(offset + tail.size());
+			PutFloat(tail, profile.BottomLiftHeight);
+			PutFloat(tail, profile.BottomLiftSpeed);
+			PutFloat(tail, profile.LiftHeight);
+			PutFloat(tail, profile.LiftSpeed);
+			PutFloat(tail, profile.RetractSpeed);
+			PutFloat(tail, (float)volume); // ml
+			PutFloat(tail, 0.0f);          // weight
+			PutFloat(tail, 0.0f);          // cost
+			PutFloat(tail, profile.BottomLightOff);
+			PutFloat(tail, profile.LightOff);
+			Put32(tail, bottomLayers);
+			for (int i = 0; i < 4; i++)
+				Put32(tail, 0);
+
+			if (settings.Format == ResinFormat::CTB) {
+				slicerInfo = (uint32_t)(offset + tail.size());
+				PutFloat(tail, profile.BottomLiftHeight);
+				PutFloat(tail, profile.BottomLiftSpeed);
+				PutFloat(tail, profile.LiftHeight);
+				PutFloat(tail, profile.LiftSpeed);
+				PutFloat(tail, profile.LiftHeight); // retract height
+				PutFloat(tail, profile.RetractSpeed);
+				PutFloat(tail, 0.0f);               // rest after lift
+				Put32(tail, slicerInfo + SlicerInfoSize);
+				Put32(tail, (uint32_t)profile.Name.size());
+				tail.push_back(7); // not anti-aliased
+				Put16(tail, 0);
+				tail.push_back(0); // no per layer settings
+				Put32(tail, (uint32_t)(time(nullptr) / 60));
+				Put32(tail, 1);          // anti-aliasing level
+				Put32(tail, 0x01060300); // format of Chitubox 1.6.3
+				for (int i = 0; i < 6; i++)
+					Put32(tail, 0);
+				tail.insert(tail.end(), profile.Name.begin(), profile.Name.end());
+			}
+
+			layerTable = (uint32_t)(offset + tail.size());
+			for (int k = 0; k < layerCount; k++) {
+				bool bottom = k < bottomLayers;
+				PutFloat(tail, (k + 1) * layerHeight);
+				PutFloat(tail, bottom ? profile.BottomExposure : profile.Exposure);
+				PutFloat(tail, bottom ? profile.BottomLightOff : profile.LightOff);
+				Put32(tail, entries[k].Offset);
+				Put32(tail, entries[k].Size);
+				for (int i = 0; i < 4; i++)
+					Put32(tail, 0);
+			}
+			if (offset + tail.size() > 0xffffffff) {
+				err = "the layer file would exceed 4 GB";
+				ok = false;
+			}
+		}
+
+		if (ok) {
+			header.clear();
+			Put32(header, settings.Format == ResinFormat::CTB ? MagicCtb : MagicCbddlp);
+			Put32(header, 2);
+			PutFloat(header, width * profile.PixelSize[0]);
+			PutFloat(header, height * profile.PixelSize[1]);
+			PutFloat(header, profile.MaxHeight);
+			Put32(header, 0);
+			Put32(header, 0);
+			PutFloat(header, layerCount * layerHeight);
+			PutFloat(header, layerHeight);
+			PutFloat(header, profile.Exposure);
+			PutFloat(header, profile.BottomExposure);
+			PutFloat(header, profile.LightOff);
+			Put32(header, std::min(profile.BottomLayers, layerCount));
+			Put32(header, width);
+			Put32(header, height);
+			Put32(header, largePreview);
+			Put32(header, layerTable);
+			Put32(header, layerCount);
+			Put32(header, smallPreview);
+			Put32(header, (uint32_t)printTime);
+			Put32(header, profile.Mirror ? 1 : 0);
+			Put32(header, printParameters);
+			Put32(header, PrintParametersSize);
+			Put32(header, 1); // anti-aliasing level
+			Put16(header, profile.Power);
+			Put16(header, profile.BottomPower);
+			Put32(header, 0); // not encrypted
+			Put32(header, slicerInfo);
+			Put32(header, slicerInfo ? SlicerInfoSize : 0);
+			ok = fwrite(tail.data(), 1, tail.size(), file) == tail.size()
+				&& fseek(file, 0, SEEK_SET) == 0
+				&& fwrite(header.data(), 1, header.size(), file) == header.size();
+		}
+		if (fclose(file) != 0)
+			ok = false;
+		if (!ok) {
+			if (err.empty())
+				err = "failed to write " + filename + " (disk full?)";
+			remove(filename.c_str());
+		}
+		return ok;
+	}
+}
@@ -0,0 +1,88 @@
+#pragma once
+#include <functional>
+#include <string>
+#include "model.h"
+
+namespace irmf
+{
+	// PrinterProfile describes a masked-SLA resin printer: its LCD and the
+	// exposure and motion settings stored in its layer files. Lengths are in
+	// millimeters, speeds in mm/min, times in seconds.
+	struct PrinterProfile
+	{
+		std::string Name;
+		int Resolution[2];   // LCD pixels in X and Y
+		float PixelSize[2];  // size of an LCD pixel in X and Y
+		float MaxHeight;     // build height, 0 if unknown
+		bool Mirror;         // the LCD image is mirrored
+
+		float LayerHeight;
+		float Exposure, BottomExposure;
+		int BottomLayers;
+		float LightOff, BottomLightOff; // delays before each exposure
+		float LiftHeight, LiftSpeed, BottomLiftHeight, BottomLiftSpeed, RetractSpeed;
+		int Power, BottomPower; // UV LED PWM, 0-255
+
+		PrinterProfile()
+			: Resolution{ 1440, 2560 }
+			, PixelSize{ 0.04725f, 0.04725f }
+			, MaxHeight(0.0f)
+			, Mirror(true)
+			, LayerHeight(0.05f)
+			, Exposure(8.0f)
+			, BottomExposure(60.0f)
+			, BottomLayers(6)
+			, LightOff(1.0f)
+			, BottomLightOff(1.0f)
+			, LiftHeight(5.0f)
+			, LiftSpeed(60.0f)
+			, BottomLiftHeight(5.0f)
+			, BottomLiftSpeed(60.0f)
+			, RetractSpeed(150.0f)
+			, Power(255)
+			, BottomPower(255)
+		{
+		}
+	};
+
+	// LoadPrinterProfile reads the printer called name from a JSON file
+	// that maps printer names to objects with PrinterProfile's settings,
+	// e.g. { "mars": { "resolution": [1440, 2560], "pixel": 0.04725,
+	// "exposure": 8 } }. Settings it does not give keep their defaults.
+	bool LoadPrinterProfile(const std::string& filename, const std::string& name, PrinterProfile& profile, std::string& err);
+
+	enum class ResinFormat
+	{
+		CBDDLP, // also read as .photon: 1-bit layers
+		CTB     // 7-bit gray layers
+	};
+
+	// ResinSettings controls a resin printer export.
+	struct ResinSettings
+	{
+		ResinFormat Format;
+		float LayerHeight; // <= 0: the profile's
+		int Threads;       // <= 0: one per hardware thread
+
+		// Progress is called on the calling thread after each layer is
+		// written, with the number of layers done and the total
+		std::function<void(int, int)> Progress;
+
+		ResinSettings()
+			: Format(ResinFormat::CBDDLP)
+			, LayerHeight(0.0f)
+			, Threads(0)
+		{
+		}
+	};
+
+	// WriteResinFile writes the model, centered on the build plate, as a
+	// Chitubox layer file (.cbddlp/.photon or unencrypted .ctb version 2)
+	// for the printer: a pixel is exposed where any material is at least
+	// 0.5. Only the pixels over the model's bounding box are sampled; each
+	// layer is run-length encoded on the workers as it is sampled and
+	// appended to the file in order, then the previews (a top view shaded
+	// by height), print parameters and layer table are written after the
+	// layers and the header is filled in last.
+	bool WriteResinFile(const Model& model, const PrinterProfile& profile, const ResinSettings& settings, const std::string& filename, std::string& err);
+}
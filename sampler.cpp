@@ -0,0 +1,85 @@
+#include "sampler.h"
+#include <algorithm>
+#include <cmath>
+
+namespace irmf
+{
+	bool MakeGrid(const Model& model, float pitch, float layerHeight, Grid& grid, std::string& err)
+	{
+		if (layerHeight <= 0.0f)
+			layerHeight = pitch;
+		if (!(pitch > 0.0f) || !(layerHeight > 0.0f)) {
+			err = "the pitch must be positive";
+			return false;
+		}
+
+		float pitches[3] = { pitch, pitch, layerHeight };
+		for (int i = 0; i < 3; i++) {
+			double extent = (double)model.Max[i] - model.Min[i];
+			if (!(extent > 0.0)) {
+				err = "the bounding box of the model is empty";
+				return false;
+			}
+			// a cell that would only cover a rounding error is dropped; the
+			// error of a float pitch grows with the number of cells
+			double cells = std::ceil(extent / pitches[i] * (1.0 - 1e-6));
+			if (cells > (1 << 30)) {
+				err = "the pitch is too small for the size of the model";
+				return false;
+			}
+			grid.Min[i] = model.Min[i];
+			grid.Pitch[i] = pitches[i];
+			grid.Size[i] = std::max(1, (int)cells);
+		}
+		return true;
+	}
+
+	bool GetSourceGrid(const Model& model, const VoxelSource& source, Grid& grid, std::string& err)
+	{
+		if (source.GetChannelCount() != (int)model.Materials.size()) {
+			err = "the voxels have " + std::to_string(source.GetChannelCount()) + " materials, the model "
+				+ std::to_string(model.Materials.size());
+			return false;
+		}
+		grid = source.GetGrid();
+		return true;
+	}
+
+	RowSampler::RowSampler(const Model& model, const Grid& grid, int axis, VoxelSource* source)
+		: m_grid(grid)
+		, m_axis(axis)
+		, m_source(source)
+		, m_evaluator(model.Code)
+		, m_values((size_t)(source ? source->GetChannelCount() : m_evaluator.GetOutputCount()) * grid.Size[axis])
+	{
+		for (int a = 0; a < 3; a++)
+			m_coords[a].resize(grid.Size[axis]);
+		for (int i = 0; i < grid.Size[axis]; i++)
+			m_coords[axis][i] = grid.Center(axis, i);
+	}
+
+	void RowSampler::SetSpan(int first, int count)
+	{
+		for (int a = 0; a < 3; a++)
+			m_coords[a].resize(count);
+		for (int i = 0; i < count; i++)
+			m_coords[m_axis][i] = m_grid.Center(m_axis, first + i);
+		// the other axes are filled in by the next Sample
+		m_coords[(m_axis + 1) % 3][0] = m_coords[(m_axis + 2) % 3][0] = NAN;
+	}
+
+	bool RowSampler::Sample(int j, int k)
+	{
+		if (m_source)
+			return m_source->ReadRow(j, k, m_values.data());
+
+		std::vector<float>& u = m_coords[(m_axis + 1) % 3];
+		std::vector<float>& v = m_coords[(m_axis + 2) % 3];
+		float a = m_grid.Center((m_axis + 1) % 3, j), b = m_grid.Center((m_axis + 2) % 3, k);
+		if (u[0] != a || v[0] != b) {
+			std::fill(u.begin(), u.end(), a);
+			std::fill(v.begin(), v.end(), b);
+		}
+		return m_evaluator.Evaluate(m_coords[0].data(), m_coords[1].data(), m_coords[2].data(), u.size(), m_values.data());
+	}
+}
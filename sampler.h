@@ -0,0 +1,87 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "batch.h"
+#include "model.h"
+
+namespace irmf
+{
+	// Grid is the lattice a model is sampled on for export: Size[0] x
+	// Size[1] x Size[2] cells of Pitch[0..2] covering the bounding box, each
+	// sampled at its center. Layers are Z slices, rows run along X.
+	struct Grid
+	{
+		float Min[3];
+		float Pitch[3];
+		int Size[3];
+
+		inline float Center(int axis, int i) const { return Min[axis] + (i + 0.5f) * Pitch[axis]; }
+	};
+
+	// MakeGrid covers the model's bounding box with cells of pitch x pitch
+	// x layerHeight (layerHeight <= 0: pitch).
+	bool MakeGrid(const Model& model, float pitch, float layerHeight, Grid& grid, std::string& err);
+
+	// VoxelSource is voxels sampled before, one byte per material, that
+	// exports can read instead of evaluating the model (a VoxelStore or a
+	// VoxelFile).
+	class VoxelSource
+	{
+	public:
+		virtual ~VoxelSource() {}
+
+		virtual const Grid& GetGrid() const = 0;
+		virtual int GetChannelCount() const = 0;
+
+		// ReadRow writes row j of layer k, along X, as n / 255: channel c of
+		// cell i to values[c * GetGrid().Size[0] + i]. Returns false if the
+		// voxels cannot be read. May be called from several threads.
+		virtual bool ReadRow(int j, int k, float* values) = 0;
+	};
+
+	// GetSourceGrid returns the grid of a source for the passes that read it
+	// instead of the model; false, with err set, if it was not made for the
+	// model's materials.
+	bool GetSourceGrid(const Model& model, const VoxelSource& source, Grid& grid, std::string& err);
+
+	// RowSampler evaluates a model on rows of a Grid with a BatchEvaluator.
+	// Rows run along X unless another axis is given. Its buffers are
+	// allocated once, so sampling does not allocate. Use one per thread.
+	// Given a VoxelSource (and its grid), rows along X are read from it
+	// instead.
+	class RowSampler
+	{
+	public:
+		RowSampler(const Model& model, const Grid& grid, int axis = 0, VoxelSource* source = nullptr);
+
+		// Sample evaluates row j of layer k, j and k indexing the two axes
+		// after the row's (Y and Z for rows along X, Z and X along Y);
+		// material m of cell i is then GetValues(m)[i]. Returns false if a
+		// loop ran away (or the source could not be read).
+		bool Sample(int j, int k);
+
+		// SetSpan limits the rows Sample evaluates to cells [first, first +
+		// count); GetValues(m)[i] is then cell first + i. Not for sources.
+		void SetSpan(int first, int count);
+
+		inline const float* GetValues(int material) const { return m_values.data() + (size_t)material * m_coords[m_axis].size(); }
+		inline int GetMaterialCount() const { return (int)(m_values.size() / m_grid.Size[m_axis]); }
+
+	private:
+		const Grid& m_grid;
+		int m_axis;
+		VoxelSource* m_source;
+		BatchEvaluator m_evaluator;
+		std::vector<float> m_coords[3], m_values;
+	};
+
+	// ToByte maps a material value in [0, 1] to 0-255 (NaN is 0).
+	inline uint8_t ToByte(float v)
+	{
+		if (!(v > 0.0f))
+			return 0;
+		if (v >= 1.0f)
+			return 255;
+		return (uint8_t)(v * 255.0f + 0.5f);
+	}
+}
@@ -0,0 +1,670 @@
+#include "slicer.h"
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <set>
+#include "checkpoint.h"
+#include "png.h"
+#include "refine.h"
+#include "sampler.h"
+#include "threadpool.h"
+#include "zip.h"
+
+namespace irmf
+{
+	namespace
+	{
+		// per thread state, created by the thread on its first layer
+		struct Worker
+		{
+			std::unique_ptr<RowSampler> Sampler;
+			std::unique_ptr<CoverageSampler> Coverage; // when anti-aliasing
+			std::unique_ptr<EdgeRefiner> Refiner;      // when refining
+			std::vector<std::unique_ptr<PngEncoder>> Encoders;
+			std::vector<uint8_t> Pixels;
+		};
+
+		std::string LayerName(int layer, int layers)
+		{
+			int digits = 5;
+			for (int n = layers - 1; n >= 100000; n /= 10)
+				digits++;
+			char name[32];
+			snprintf(name, sizeof(name), "%0*d.png", digits, layer);
+			return name;
+		}
+
+		std::string Manifest(const Model& model, const Grid& grid, int bitDepth, const json11::Json::array& materials)
+		{
+			json11::Json manifest = json11::Json::object {
+				{ "format", "png" },
+				{ "bitDepth", bitDepth },
+				{ "min", json11::Json::array { grid.Min[0], grid.Min[1], grid.Min[2] } },
+				{ "max", json11::Json::array { model.Max[0], model.Max[1], model.Max[2] } },
+				{ "pitch", json11::Json::array { grid.Pitch[0], grid.Pitch[1], grid.Pitch[2] } },
+				{ "size", json11::Json::array { grid.Size[0], grid.Size[1], grid.Size[2] } },
+				{ "yAxis", "up" },
+				{ "materials", materials },
+			};
+			return manifest.dump();
+		}
+
+		// SliceKey describes everything besides the model that shapes the
+		// archive SliceToZip writes, for its checkpoints. Refine and Threads
+		// give the same images, so they are left out.
+		std::string SliceKey(const Grid& grid, const SliceSettings& settings)
+		{
+			char key[512];
+			snprintf(key, sizeof(key), "slices 1 min %a %a %a pitch %a %a %a size %d %d %d antialias %d %d %a store %d",
+				grid.Min[0], grid.Min[1], grid.Min[2], grid.Pitch[0], grid.Pitch[1], grid.Pitch[2], grid.Size[0], grid.Size[1], grid.Size[2],
+				(int)settings.AntiAliasing, settings.Samples, settings.IsoLevel, settings.Source ? 1 : 0);
+			return key;
+		}
+
+		// Turns lets layers take turns at one step, row by row and in layer
+		// order, while the rest of their work runs in parallel: a layer may
+		// work on a row once the layer before is done with it, so layers
+		// run a few rows apart. The pool starts layers in order, so the one
+		// a layer waits for is always running.
+		class Turns
+		{
+		public:
+			Turns(int layers)
+				: m_rows(layers, 0)
+				, m_stopped(false)
+			{
+			}
+
+			// Wait returns when the layer before is done with the first rows
+			// rows, or false once Stop was called
+			bool Wait(int layer, int rows)
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_changed.wait(lock, [&] { return layer == 0 || m_rows[layer - 1] >= rows || m_stopped; });
+				return !m_stopped;
+			}
+
+			// Done tells that the layer is done with its first rows rows
+			void Done(int layer, int rows)
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_rows[layer] = rows;
+				m_changed.notify_all();
+			}
+
+			// Stop releases the waiting layers, for when a layer fails
+			void Stop()
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_stopped = true;
+				m_changed.notify_all();
+			}
+
+		private:
+			std::mutex m_mutex;
+			std::condition_variable m_changed;
+			std::vector<int> m_rows;
+			bool m_stopped;
+		};
+
+		// per thread state of DitherToZip
+		struct DitherWorker
+		{
+			std::unique_ptr<RowSampler> Sampler;
+			PngEncoder Encoder;
+			std::vector<float> Wants;     // a row of each material per row, from the top
+			std::vector<float> Sums;      // one row, for Want
+			std::vector<float> Totals;    // of Wants, per material and column
+			std::vector<float> Errors;    // the row being dithered, padded by a pixel
+			std::vector<uint8_t> Chosen;  // the pixels: 0 empty, else 1 + the material
+			std::vector<uint8_t> Pixels;  // one image row
+			std::vector<uint64_t> Voxels;
+			std::vector<double> Expected;
+		};
+
+		// Want normalizes one row of material values to sum to at most 1; the
+		// rest is empty. wants holds a row of each material in turn, and is
+		// added to totals, which is laid out the same.
+		void Want(const RowSampler& sampler, int materials, int width, float* wants, float* sums, float* totals)
+		{
+			std::fill(sums, sums + width, 0.0f);
+			for (int m = 0; m < materials; m++) {
+				const float* values = sampler.GetValues(m);
+				float* w = wants + (size_t)m * width;
+				for (int i = 0; i < width; i++) {
+					float v = values[i] > 0.0f ? std::min(values[i], 1.0f) : 0.0f; // NaN is empty
+					w[i] = v;
+					sums[i] += v;
+				}
+			}
+			for (int i = 0; i < width; i++)
+				sums[i] = sums[i] > 1.0f ? 1.0f / sums[i] : 1.0f;
+			for (int m = 0; m < materials; m++) {
+				float* w = wants + (size_t)m * width;
+				float* t = totals + (size_t)m * width;
+				for (int i = 0; i < width; i++) {
+					w[i] *= sums[i];
+					t[i] += w[i];
+				}
+			}
+		}
+
+		// Dither picks a material or empty for every pixel of a layer. The
+		// error each pixel makes is spread with the Floyd-Steinberg weights,
+		// serpentine so it does not drift to one side; carry, if set, holds
+		// the error the previous layer left to each pixel and takes share of
+		// this one's. Empty makes up what the materials leave, error included,
+		// so it needs no channel of its own. Rows [begin, end) are done, in
+		// order from 0. Fixed is the number of materials if known, so the
+		// loops over them unroll, and Carry whether carry is set.
+		template <int Fixed, bool Carry>
+		void Dither(DitherWorker& worker, int materials, int width, int begin, int end, float share, float* carry)
+		{
+			const int n = Fixed ? Fixed : materials;
+			const float* wants = worker.Wants.data();
+			uint8_t* chosen = worker.Chosen.data();
+			float* errors = worker.Errors.data(); // this row's, then the next's
+			float keep = 1.0f - share;
+			float d[Fixed ? Fixed : 255], below0[Fixed ? Fixed : 255], below1[Fixed ? Fixed : 255];
+
+			if (begin == 0)
+				std::fill(worker.Errors.begin(), worker.Errors.end(), 0.0f);
+			for (int j = begin; j < end; j++) {
+				int dir = (j & 1) ? -1 : 1;
+				int i = dir > 0 ? 0 : width - 1;
+				// the error for the pixel ahead stays in d; below0 and below1
+				// are what the row below gets under this pixel and the next
+				for (int m = 0; m < n; m++)
+					d[m] = below0[m] = below1[m] = 0.0f;
+				for (int count = 0; count < width; count++, i += dir) {
+					size_t at = (size_t)j * width + i;
+					const float* w = wants + (size_t)j * width * n + i;
+					float* e = errors + (size_t)(i + 1) * n;
+					float* c = Carry ? carry + at * n : nullptr;
+					float empty = 1.0f;
+					for (int m = 0; m < n; m++) {
+						d[m] += w[m * width] + e[m];
+						if (Carry)
+							d[m] += c[m];
+						empty -= d[m];
+					}
+					// which one wins is close to random, so no branches
+					int best = 0;
+					float most = d[0];
+					for (int m = 1; m < n; m++) {
+						bool more = d[m] > most;
+						most = more ? d[m] : most;
+						best = more ? m : best;
+					}
+					best = empty > most ? n : best;
+					chosen[at] = (uint8_t)(best == n ? 0 : best + 1);
+
+					// e is no longer needed, so the row below goes in its
+					// place behind this pixel
+					float* behind = e - dir * n;
+					for (int m = 0; m < n; m++) {
+						// indexing d with best would keep it out of registers;
+						// spread errors get ever smaller away from the
+						// material, and denormals are slow
+						float r = std::fabs(d[m]) < 1e-12f ? 0.0f : d[m] - (m == best ? 1.0f : 0.0f);
+						if (Carry) {
+							c[m] = r * share;
+							r *= keep;
+						}
+						behind[m] = below0[m] + r * (3.0f / 16.0f);
+						below0[m] = below1[m] + r * (5.0f / 16.0f);
+						below1[m] = r * (1.0f / 16.0f);
+						d[m] = r * (7.0f / 16.0f);
+					}
+				}
+				// i is one past the row now, in the padding
+				float* last = errors + (size_t)(i + 1 - dir) * n;
+				for (int m = 0; m < n; m++)
+					last[m] = below0[m];
+			}
+		}
+
+		template <int Fixed>
+		void Dither(DitherWorker& worker, int materials, int width, int begin, int end, float share, float* carry)
+		{
+			if (carry)
+				Dither<Fixed, true>(worker, materials, width, begin, end, share, carry);
+			else
+				Dither<Fixed, false>(worker, materials, width, begin, end, share, carry);
+		}
+
+		void Dither(DitherWorker& worker, int materials, int width, int begin, int end, float share, float* carry)
+		{
+			switch (materials) {
+			case 1: Dither<1>(worker, materials, width, begin, end, share, carry); break;
+			case 2: Dither<2>(worker, materials, width, begin, end, share, carry); break;
+			case 3: Dither<3>(worker, materials, width, begin, end, share, carry); break;
+			case 4: Dither<4>(worker, materials, width, begin, end, share, carry); break;
+			default: Dither<0>(worker, materials, width, begin, end, share, carry); break;
+			}
+		}
+
+		// rows a layer dithers between two turns
+		const int TurnRows = 16;
+
+		// SliceSink writes the slabs of RunPipeline as SliceToZip writes
+		// the layers it samples
+		class SliceSink : public SlabSink
+		{
+		public:
+			SliceSink(const Model& model, const std::string& filename)
+				: m_model(model)
+				, m_filename(filename)
+			{
+			}
+
+			bool Begin(const Grid& grid, int materials, int slots, int workers, std::string& err) override
+			{
+				if (!m_zip.Open(m_filename, err))
+					return false;
+				m_grid = grid;
+				m_materials = materials;
+				m_dirs = MaterialDirectories(m_model.Materials);
+				m_slots.resize(slots);
+				m_workers.resize(workers);
+				return true;
+			}
+
+			void Encode(const Slab& slab, int slot, int w) override
+			{
+				Worker& worker = m_workers[w];
+				int width = m_grid.Size[0], height = m_grid.Size[1];
+				if (worker.Encoders.empty()) {
+					worker.Encoders.emplace_back(new PngEncoder());
+					worker.Pixels.resize(width);
+				}
+				std::vector<std::vector<uint8_t>>& files = m_slots[slot];
+				files.resize((size_t)slab.Count * m_materials);
+				for (int l = 0; l < slab.Count; l++)
+					for (int m = 0; m < m_materials; m++) {
+						PngEncoder& encoder = *worker.Encoders[0];
+						encoder.Begin(width, height);
+						// image rows run from the top (+Y) down
+						for (int j = height - 1; j >= 0; j--) {
+							const float* values = slab.Layer(l) + ((size_t)m * height + j) * width;
+							for (int i = 0; i < width; i++)
+								worker.Pixels[i] = ToByte(values[i]);
+							encoder.Row(worker.Pixels.data());
+						}
+						encoder.End(files[(size_t)l * m_materials + m]);
+					}
+			}
+
+			bool Write(const Slab& slab, int slot) override
+			{
+				const std::vector<std::vector<uint8_t>>& files = m_slots[slot];
+				for (int l = 0; l < slab.Count; l++) {
+					std::string name = LayerName(slab.First + l, m_grid.Size[2]);
+					for (int m = 0; m < m_materials; m++) {
+						const std::vector<uint8_t>& file = files[(size_t)l * m_materials + m];
+						if (!m_zip.Add(m_dirs[m] + "/" + name, file.data(), file.size()))
+							return false;
+					}
+				}
+				return true;
+			}
+
+			bool Finish(std::string& err) override
+			{
+				json11::Json::array entries;
+				for (int m = 0; m < m_materials; m++)
+					entries.push_back(json11::Json::object {
+						{ "name", m_model.Materials[m] },
+						{ "directory", m_dirs[m] },
+					});
+				std::string manifest = Manifest(m_model, m_grid, 8, entries);
+				bool ok = m_zip.Add("manifest.json", manifest.data(), manifest.size(), Z_DEFAULT_COMPRESSION);
+				// Close reports a failed Add
+				return m_zip.Close(err) && ok;
+			}
+
+			void Discard() override
+			{
+				remove(m_filename.c_str());
+			}
+
+		private:
+			const Model& m_model;
+			std::string m_filename;
+			ZipWriter m_zip;
+			Grid m_grid;
+			int m_materials;
+			std::vector<std::string> m_dirs;
+			std::vector<std::vector<std::vector<uint8_t>>> m_slots; // per layer and material
+			std::vector<Worker> m_workers;
+		};
+	}
+
+	std::vector<std::string> MaterialDirectories(const std::vector<std::string>& materials)
+	{
+		std::vector<std::string> dirs;
+		std::set<std::string> used;
+		for (size_t i = 0; i < materials.size(); i++) {
+			std::string dir;
+			for (char c : materials[i]) {
+				bool safe = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_' || c == '.';
+				dir += safe ? c : '_';
+			}
+			if (dir.empty() || dir == "." || dir == "..")
+				dir = "material" + std::to_string(i + 1);
+			if (used.count(dir))
+				dir += "_" + std::to_string(i + 1);
+			used.insert(dir);
+			dirs.push_back(dir);
+		}
+		return dirs;
+	}
+
+	bool SliceToZip(const Model& model, const SliceSettings& settings, const std::string& filename, SliceStats& stats, std::string& err)
+	{
+		stats = SliceStats();
+		if (settings.AntiAliasing != AntiAlias::None && settings.Source) {
+			err = "anti-aliasing samples the model, not stored voxels";
+			return false;
+		}
+
+		Grid grid;
+		if (settings.Source ? !GetSourceGrid(model, *settings.Source, grid, err)
+						   : !MakeGrid(model, settings.Pitch, settings.LayerHeight, grid, err))
+			return false;
+
+		int materials = (int)model.Materials.size();
+		int width = grid.Size[0], height = grid.Size[1], layers = grid.Size[2];
+		std::vector<std::string> dirs = MaterialDirectories(model.Materials);
+
+		// keep the layers an interrupted export of the same slices left,
+		// if they check out; a checkpoint of another export is dropped
+		ZipWriter zip;
+		Checkpoint checkpoint(filename, ExportHash(model, SliceKey(grid, settings)), settings.CheckpointInterval);
+		int first = 0;
+		uint64_t size = 0;
+		if (settings.CheckpointInterval > 0 && checkpoint.Load(first, size) && first <= layers) {
+			std::vector<std::string> names;
+			std::string resumeErr;
+			bool kept = zip.Resume(filename, size, names, resumeErr) && names.size() == (size_t)first * materials;
+			for (int k = 0; kept && k < first; k++)
+				for (int m = 0; m < materials; m++)
+					kept = kept && names[(size_t)k * materials + m] == dirs[m] + "/" + LayerName(k, layers);
+			if (!kept) {
+				zip.Close(resumeErr);
+				first = 0;
+			}
+		}
+		else
+			first = 0;
+		if (first == 0 && settings.CheckpointInterval > 0)
+			checkpoint.Remove();
+		if (first == 0 && !zip.Open(filename, err))
+			return false;
+		stats.Resumed = first;
+
+		ThreadPool pool(settings.Threads);
+		std::vector<Worker> workers(pool.GetThreadCount());
+
+		// layers finish out of order and wait in their slot until every
+		// layer before them has been written
+		int window = 2 * pool.GetThreadCount();
+		std::vector<std::vector<std::vector<uint8_t>>> slots(window, std::vector<std::vector<uint8_t>>(materials));
+		std::atomic<bool> runaway(false);
+
+		auto slice = [&](int item, int slot, int w) {
+			int k = first + item;
+			Worker& worker = workers[w];
+			if (!worker.Sampler && !worker.Coverage && !worker.Refiner) {
+				if (settings.AntiAliasing != AntiAlias::None)
+					worker.Coverage.reset(new CoverageSampler(model, grid, settings.AntiAliasing, settings.Samples, settings.IsoLevel));
+				else if (settings.Refine > 1 && !settings.Source)
+					worker.Refiner.reset(new EdgeRefiner(model, grid, settings.Refine));
+				else
+					worker.Sampler.reset(new RowSampler(model, grid, 0, settings.Source));
+				for (int m = 0; m < materials; m++)
+					worker.Encoders.emplace_back(new PngEncoder());
+				worker.Pixels.resize(width);
+			}
+
+			for (int m = 0; m < materials; m++)
+				worker.Encoders[m]->Begin(width, height);
+			// image rows run from the top (+Y) down
+			for (int j = height - 1; j >= 0; j--) {
+				if (worker.Refiner) {
+					if (!worker.Refiner->Sample(j, k)) {
+						runaway = true;
+						return false;
+					}
+					for (int m = 0; m < materials; m++)
+						worker.Encoders[m]->Row(worker.Refiner->GetPixels(m));
+					continue;
+				}
+				if (!(worker.Coverage ? worker.Coverage->Sample(j, k) : worker.Sampler->Sample(j, k))) {
+					runaway = true;
+					return false;
+				}
+				for (int m = 0; m < materials; m++) {
+					const float* values = worker.Coverage ? worker.Coverage->GetValues(m) : worker.Sampler->GetValues(m);
+					uint8_t* pixels = worker.Pixels.data();
+					for (int i = 0; i < width; i++)
+						pixels[i] = ToByte(values[i]);
+					worker.Encoders[m]->Row(pixels);
+				}
+			}
+			for (int m = 0; m < materials; m++)
+				worker.Encoders[m]->End(slots[slot][m]);
+			return true;
+		};
+
+		auto write = [&](int item, int slot) {
+			int k = first + item;
+			std::string name = LayerName(k, layers);
+			for (int m = 0; m < materials; m++)
+				if (!zip.Add(dirs[m] + "/" + name, slots[slot][m].data(), slots[slot][m].size()))
+					return false;
+			// the checkpoint must not get ahead of what is on the disk
+			if (checkpoint.Due() && k + 1 < layers && (!zip.Sync() || !checkpoint.Save(k + 1, zip.GetBytesWritten(), err)))
+				return false;
+			if (settings.Progress)
+				settings.Progress(k + 1, layers);
+			return true;
+		};
+
+		bool ok = RunOrdered(pool, layers - first, window, slice, write);
+		if (runaway)
+			err = "a loop in the model did not terminate";
+		stats.Pixels = (uint64_t)width * height * (layers - first);
+		for (const Worker& worker : workers) {
+			if (worker.Refiner) {
+				stats.Evaluations += worker.Refiner->GetEvaluations();
+				stats.Boxes += worker.Refiner->GetBoxes();
+			}
+			if (worker.Coverage)
+				stats.Evaluations += worker.Coverage->GetEvaluations();
+		}
+		if (settings.AntiAliasing == AntiAlias::None && settings.Refine <= 1 && !settings.Source)
+			stats.Evaluations = stats.Pixels;
+
+		if (ok) {
+			json11::Json::array entries;
+			for (int m = 0; m < materials; m++)
+				entries.push_back(json11::Json::object {
+					{ "name", model.Materials[m] },
+					{ "directory", dirs[m] },
+				});
+			std::string manifest = Manifest(model, grid, 8, entries);
+			ok = zip.Add("manifest.json", manifest.data(), manifest.size(), Z_DEFAULT_COMPRESSION);
+		}
+		std::string zipErr;
+		if (!zip.Close(zipErr) && !runaway) {
+			err = zipErr;
+			ok = false;
+		}
+		// a failed export keeps its layers for the next run if a checkpoint
+		// covers some of them
+		int done;
+		if (ok)
+			checkpoint.Remove();
+		else if (settings.CheckpointInterval <= 0 || !checkpoint.Load(done, size))
+			remove(filename.c_str());
+		return ok;
+	}
+
+	bool DitherToZip(const Model& model, const SliceSettings& settings, const std::string& filename, DitherStats& stats, std::string& err)
+	{
+		int materials = (int)model.Materials.size();
+		if (materials > 255) {
+			err = "dithering supports at most 255 materials";
+			return false;
+		}
+		if (!(settings.Carry >= 0.0f && settings.Carry < 1.0f)) {
+			err = "the carried error must be at least 0 and less than 1";
+			return false;
+		}
+
+		Grid grid;
+		if (settings.Source ? !GetSourceGrid(model, *settings.Source, grid, err)
+						   : !MakeGrid(model, settings.Pitch, settings.LayerHeight, grid, err))
+			return false;
+
+		ZipWriter zip;
+		if (!zip.Open(filename, err))
+			return false;
+
+		int width = grid.Size[0], height = grid.Size[1], layers = grid.Size[2];
+		size_t plane = (size_t)width * height;
+		// as few bits as hold the materials, which also spreads them over
+		// the gray levels
+		int bits = 1;
+		while ((1 << bits) <= materials)
+			bits *= 2;
+
+		ThreadPool pool(settings.Threads);
+		std::vector<DitherWorker> workers(pool.GetThreadCount());
+		int window = 2 * pool.GetThreadCount();
+		std::vector<std::vector<uint8_t>> slots(window);
+		std::vector<std::vector<uint64_t>> voxels(window);
+		std::vector<std::vector<double>> expected(window);
+		std::atomic<bool> runaway(false);
+
+		std::vector<float> carry;
+		if (settings.Carry > 0.0f)
+			carry.assign(plane * materials, 0.0f);
+		Turns turns(layers);
+
+		auto slice = [&](int k, int slot, int w) {
+			DitherWorker& worker = workers[w];
+			if (!worker.Sampler) {
+				worker.Sampler.reset(new RowSampler(model, grid, 0, settings.Source));
+				worker.Wants.resize(plane * materials);
+				worker.Errors.resize((size_t)(width + 2) * materials);
+				worker.Sums.resize(width);
+				worker.Totals.resize((size_t)width * materials);
+				worker.Chosen.resize(plane);
+				worker.Pixels.resize(((size_t)width * bits + 7) / 8);
+			}
+
+			// image rows run from the top (+Y) down
+			std::fill(worker.Totals.begin(), worker.Totals.end(), 0.0f);
+			for (int j = 0; j < height; j++) {
+				if (!worker.Sampler->Sample(height - 1 - j, k)) {
+					runaway = true;
+					turns.Stop();
+					return false;
+				}
+				Want(*worker.Sampler, materials, width, worker.Wants.data() + (size_t)j * width * materials, worker.Sums.data(), worker.Totals.data());
+			}
+
+			worker.Expected.assign(materials, 0.0);
+			for (int m = 0; m < materials; m++)
+				for (int i = 0; i < width; i++)
+					worker.Expected[m] += worker.Totals[(size_t)m * width + i];
+			if (carry.empty())
+				Dither(worker, materials, width, 0, height, 0.0f, nullptr);
+			else
+				for (int j = 0; j < height; j += TurnRows) {
+					int end = std::min(j + TurnRows, height);
+					if (!turns.Wait(k, end))
+						return false;
+					Dither(worker, materials, width, j, end, settings.Carry, carry.data());
+					turns.Done(k, end);
+				}
+
+			worker.Voxels.assign(materials, 0);
+			worker.Encoder.Begin(width, height, bits);
+			for (int j = 0; j < height; j++) {
+				const uint8_t* chosen = worker.Chosen.data() + (size_t)j * width;
+				if (bits == 8)
+					worker.Encoder.Row(chosen);
+				else {
+					uint8_t* pixels = worker.Pixels.data();
+					std::fill(worker.Pixels.begin(), worker.Pixels.end(), 0);
+					for (int i = 0; i < width; i++)
+						pixels[i * bits / 8] |= (uint8_t)(chosen[i] << (8 - bits - i * bits % 8));
+					worker.Encoder.Row(pixels);
+				}
+				// one pass per material, as counting in a table stalls on
+				// runs of the same one
+				for (int m = 0; m < materials; m++) {
+					int count = 0;
+					for (int i = 0; i < width; i++)
+						count += chosen[i] == m + 1;
+					worker.Voxels[m] += count;
+				}
+			}
+			worker.Encoder.End(slots[slot]);
+			voxels[slot] = worker.Voxels;
+			expected[slot] = worker.Expected;
+			return true;
+		};
+
+		stats.Voxels.assign(materials, 0);
+		stats.Expected.assign(materials, 0.0);
+		auto write = [&](int k, int slot) {
+			if (!zip.Add(LayerName(k, layers), slots[slot].data(), slots[slot].size())) {
+				turns.Stop();
+				return false;
+			}
+			for (int m = 0; m < materials; m++) {
+				stats.Voxels[m] += voxels[slot][m];
+				stats.Expected[m] += expected[slot][m];
+			}
+			if (settings.Progress)
+				settings.Progress(k + 1, layers);
+			return true;
+		};
+
+		bool ok = RunOrdered(pool, layers, window, slice, write);
+		if (runaway)
+			err = "a loop in the model did not terminate";
+
+		if (ok) {
+			json11::Json::array entries;
+			for (int m = 0; m < materials; m++)
+				entries.push_back(json11::Json::object {
+					{ "name", model.Materials[m] },
+					{ "value", m + 1 },
+				});
+			std::string manifest = Manifest(model, grid, bits, entries);
+			ok = zip.Add("manifest.json", manifest.data(), manifest.size(), Z_DEFAULT_COMPRESSION);
+		}
+		std::string zipErr;
+		if (!zip.Close(zipErr) && !runaway) {
+			err = zipErr;
+			ok = false;
+		}
+		if (!ok)
+			remove(filename.c_str());
+		return ok;
+	}
+
+	std::unique_ptr<SlabSink> NewSliceSink(const Model& model, const std::string& filename)
+	{
+		return std::unique_ptr<SlabSink>(new SliceSink(model, filename));
+	}
+}
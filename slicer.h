@@ -0,0 +1,107 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "coverage.h"
+#include "model.h"
+#include "pipeline.h"
+
+namespace irmf
+{
+	class VoxelSource;
+
+	// SliceSettings controls the resolution and parallelism of an export.
+	struct SliceSettings
+	{
+		float Pitch;       // pixel size in X and Y, in model units
+		float LayerHeight; // <= 0: same as Pitch
+		AntiAlias AntiAliasing; // slices: None writes the material values,
+		                        // the others how much of each pixel is at
+		                        // least IsoLevel
+		int Samples;       // anti-aliasing: N for N x N samples per pixel
+		float IsoLevel;    // anti-aliasing: material value of the edge
+		int Refine;        // slices: blocks of Refine pixels are only sampled
+		                   // in full near edges (see EdgeRefiner; <= 1:
+		                   // every pixel)
+		float Carry;       // dithering: share of each pixel's error passed on
+		                   // to the same pixel of the next layer, in [0, 1)
+		int Threads;       // <= 0: one per hardware thread
+		double CheckpointInterval; // slices: seconds between checkpoints an
+		                           // interrupted export resumes from (see
+		                           // Checkpoint), <= 0: none
+		VoxelSource* Source; // if set, layers are read from it (and its grid)
+		                     // instead of evaluating the model
+
+		// Progress is called on the calling thread after each layer is
+		// written, with the number of layers done and the total
+		std::function<void(int, int)> Progress;
+
+		SliceSettings()
+			: Pitch(0.1f)
+			, LayerHeight(0.0f)
+			, AntiAliasing(AntiAlias::None)
+			, Samples(4)
+			, IsoLevel(0.5f)
+			, Refine(32)
+			, Carry(0.0f)
+			, Threads(0)
+			, CheckpointInterval(0.0)
+			, Source(nullptr)
+		{
+		}
+	};
+
+	// MaterialDirectories turns material names into unique names usable as
+	// file and directory names.
+	std::vector<std::string> MaterialDirectories(const std::vector<std::string>& materials);
+
+	// SliceStats is how much work SliceToZip did.
+	struct SliceStats
+	{
+		uint64_t Pixels;      // per material
+		uint64_t Evaluations; // points the model was evaluated at
+		uint64_t Boxes;       // blocks bounded with interval arithmetic
+		int Resumed;          // layers kept from an interrupted export
+	};
+
+	// SliceToZip samples the model layer by layer along Z and writes one
+	// 8-bit grayscale PNG per material and layer to a ZIP archive, as
+	// <material>/<layer>.png with the top of each image at +Y, plus a
+	// manifest.json describing the grid. Layers are sampled and encoded in
+	// parallel, and written in order as soon as they are ready; only a few
+	// layers per thread are ever held in memory. With anti-aliasing, pixels
+	// hold how much of them each material covers (see CoverageSampler)
+	// rather than its value at their center. Otherwise the model is only
+	// sampled pixel by pixel near edges, which gives the same images. With
+	// settings.CheckpointInterval, the archive is synced and a checkpoint
+	// saved that often; if an export of the same model and settings left
+	// one, the layers it covers are checked and kept, and slicing resumes
+	// after them. Pixels and Evaluations count only the layers sampled.
+	bool SliceToZip(const Model& model, const SliceSettings& settings, const std::string& filename, SliceStats& stats, std::string& err);
+
+	// DitherStats is what DitherToZip assigned, per material.
+	struct DitherStats
+	{
+		std::vector<uint64_t> Voxels;
+		std::vector<double> Expected; // the sum of its values, normalized
+	};
+
+	// DitherToZip samples the model like SliceToZip, but assigns every pixel
+	// to exactly one material or to none, for printers that place one
+	// material per voxel: it writes one grayscale PNG per layer,
+	// <layer>.png, whose pixels hold 0 (empty) or the value the manifest
+	// gives the material (its index + 1), in as few bits as that takes.
+	// Values are normalized to sum to at most 1, the rest being empty, and
+	// dithered with Floyd-Steinberg error diffusion over all the materials
+	// at once (serpentine, each pixel taking the largest), so the materials
+	// keep their ratios locally. With settings.Carry, part of the error goes
+	// to the next layer instead; a layer then dithers each band of rows
+	// once the layer before is done with it.
+	bool DitherToZip(const Model& model, const SliceSettings& settings, const std::string& filename, DitherStats& stats, std::string& err);
+
+	// NewSliceSink makes a RunPipeline sink that writes the same archive as
+	// SliceToZip, without anti-aliasing.
+	std::unique_ptr<SlabSink> NewSliceSink(const Model& model, const std::string& filename);
+}
@@ -0,0 +1,410 @@
+#include "specialize.h"
+#include "interpreter.h"
+#include <algorithm>
+#include <cstring>
+
+namespace irmf
+{
+	namespace
+	{
+		// operands referring to the constants of the residual program
+		const uint16_t ConstantFlag = 0x8000;
+		const uint32_t NoTarget = 0xffffffff;
+
+		// what is known about a register at a point of the program
+		struct State
+		{
+			enum { Unknown, Known, Dirty }; // Dirty: known, but not stored in the register
+
+			int Kind;
+			float Value;
+		};
+
+		inline bool SameValue(float a, float b) { return memcmp(&a, &b, sizeof(float)) == 0; }
+
+		class Specializer
+		{
+		public:
+			Specializer(const Program& program, int axis, float value)
+				: m_program(program)
+				, m_state(program.NumRegisters, State{ State::Unknown, 0.0f })
+				, m_constants(program.Constants)
+				, m_emitted(program.Code.size(), NoTarget)
+			{
+				for (size_t i = 0; i < program.Constants.size(); i++)
+					m_state[program.ConstantBase() + i] = State{ State::Known, program.Constants[i] };
+				m_state[axis] = State{ State::Dirty, value };
+			}
+
+			void Run(Program& residual)
+			{
+				const Program& src = m_program;
+				Block(0, src.Code.size());
+
+				// known outputs are read from constant registers
+				std::vector<uint16_t> outputs;
+				for (uint16_t r : src.Outputs)
+					outputs.push_back(Operand(r));
+
+				RemoveDeadCode(outputs);
+
+				// registers after the constants move up by the number of
+				// constants that were added
+				uint16_t oldEnd = (uint16_t)(src.ConstantBase() + src.Constants.size());
+				uint16_t shift = (uint16_t)(m_constants.size() - src.Constants.size());
+				auto remap = [&](uint16_t r) -> uint16_t {
+					if (r & ConstantFlag)
+						return (uint16_t)(src.ConstantBase() + (r & ~ConstantFlag));
+					return r < oldEnd ? r : (uint16_t)(r + shift);
+				};
+
+				residual = Program();
+				residual.Entry = src.Entry;
+				residual.Constants = m_constants;
+				residual.NumRegisters = (uint16_t)(src.NumRegisters + shift);
+
+				std::vector<uint32_t> index(m_code.size(), NoTarget);
+				for (size_t i = 0; i < m_code.size(); i++) {
+					if (!m_keep[i])
+						continue;
+					index[i] = (uint32_t)residual.Code.size();
+					residual.Code.push_back(m_code[i]);
+				}
+
+				int depth = 0;
+				for (Instruction& in : residual.Code) {
+					if (!IsControlFlow(in.Op)) {
+						in.Dst = remap(in.Dst);
+						int n = OperandCount(in.Op);
+						in.A = n > 0 ? remap(in.A) : 0;
+						in.B = n > 1 ? remap(in.B) : 0;
+						in.C = n > 2 ? remap(in.C) : 0;
+						continue;
+					}
+					if (OperandCount(in.Op) > 0)
+						in.A = remap(in.A);
+					if (in.Target != NoTarget)
+						in.Target = index[m_emitted[in.Target]];
+					else
+						in.Target = 0;
+
+					if (in.Op == Opcode::If || in.Op == Opcode::Loop || in.Op == Opcode::Call)
+						residual.MaxDepth = std::max(residual.MaxDepth, ++depth);
+					else if (in.Op == Opcode::EndIf || in.Op == Opcode::EndLoop || in.Op == Opcode::EndCall)
+						depth--;
+				}
+
+				for (uint16_t r : outputs)
+					residual.Outputs.push_back(remap(r));
+			}
+
+		private:
+			// an enclosing loop or inlined function
+			struct Frame
+			{
+				bool Loop;
+				uint32_t End;                // Call: index of its EndCall
+				std::vector<uint16_t> Writes; // registers written inside
+				bool Jumped;                 // a Return or Continue was emitted
+			};
+
+			uint16_t Operand(uint16_t r)
+			{
+				const State& s = m_state[r];
+				if (s.Kind == State::Unknown)
+					return r;
+				for (size_t i = 0; i < m_constants.size(); i++)
+					if (SameValue(m_constants[i], s.Value))
+						return (uint16_t)(i | ConstantFlag);
+				m_constants.push_back(s.Value);
+				return (uint16_t)((m_constants.size() - 1) | ConstantFlag);
+			}
+
+			void Emit(Opcode op, uint16_t dst, uint16_t a, uint16_t b, uint16_t c, uint32_t target, size_t from)
+			{
+				if (from != NoTarget)
+					m_emitted[from] = (uint32_t)m_code.size();
+				m_code.push_back(Instruction{ op, dst, a, b, c, target });
+			}
+			void EmitControl(const Instruction& in, size_t pc, uint16_t a = 0)
+			{
+				bool hasTarget = in.Op != Opcode::EndIf && in.Op != Opcode::ContinuePoint && in.Op != Opcode::EndCall;
+				Emit(in.Op, 0, a, 0, 0, hasTarget ? in.Target : NoTarget, pc);
+			}
+
+			// stores the registers that are known but not held in the
+			// register file, before control flow merges paths
+			void Materialize(const std::vector<uint16_t>& regs)
+			{
+				for (uint16_t r : regs) {
+					if (m_state[r].Kind != State::Dirty)
+						continue;
+					Emit(Opcode::Mov, r, Operand(r), 0, 0, NoTarget, NoTarget);
+					m_state[r].Kind = State::Known;
+				}
+			}
+			void Forget(const std::vector<uint16_t>& regs)
+			{
+				for (uint16_t r : regs)
+					m_state[r].Kind = State::Unknown;
+			}
+
+			std::vector<uint16_t> Writes(size_t begin, size_t end)
+			{
+				std::vector<bool> seen(m_program.NumRegisters, false);
+				std::vector<uint16_t> ret;
+				for (size_t pc = begin; pc < end; pc++) {
+					const Instruction& in = m_program.Code[pc];
+					if (!IsControlFlow(in.Op) && !seen[in.Dst]) {
+						seen[in.Dst] = true;
+						ret.push_back(in.Dst);
+					}
+				}
+				return ret;
+			}
+
+			Frame& Innermost(bool loop)
+			{
+				size_t i = m_frames.size();
+				while (m_frames[i - 1].Loop != loop)
+					i--;
+				return m_frames[i - 1];
+			}
+
+			bool IsKnown(uint16_t r) const { return m_state[r].Kind != State::Unknown; }
+
+			void Block(size_t pc, size_t end)
+			{
+				const std::vector<Instruction>& code = m_program.Code;
+
+				for (; pc < end; pc++) {
+					const Instruction& in = code[pc];
+					switch (in.Op) {
+					case Opcode::If: {
+						size_t split = in.Target;
+						bool hasElse = code[split].Op == Opcode::Else;
+						size_t endIf = hasElse ? code[split].Target : split;
+
+						if (IsKnown(in.A)) {
+							// keep the contents of the branch that is taken
+							if (m_state[in.A].Value != 0.0f)
+								Block(pc + 1, split);
+							else if (hasElse)
+								Block(split + 1, endIf);
+							pc = endIf;
+							break;
+						}
+
+						std::vector<uint16_t> writes = Writes(pc + 1, endIf);
+						Materialize(writes);
+						std::vector<State> entry = m_state;
+
+						EmitControl(in, pc, in.A);
+						Block(pc + 1, split);
+						Materialize(writes);
+						std::vector<State> thenState;
+						thenState.swap(m_state);
+
+						m_state = entry;
+						if (hasElse) {
+							EmitControl(code[split], split);
+							Block(split + 1, endIf);
+							Materialize(writes);
+						}
+						EmitControl(code[endIf], endIf);
+
+						// a register keeps its value if both paths agree
+						for (uint16_t r : writes)
+							if (!(m_state[r].Kind == State::Known && thenState[r].Kind == State::Known && SameValue(m_state[r].Value, thenState[r].Value)))
+								m_state[r].Kind = State::Unknown;
+						pc = endIf;
+						break;
+					}
+
+					case Opcode::Loop: {
+						size_t endLoop = in.Target;
+						std::vector<uint16_t> writes = Writes(pc + 1, endLoop);
+						Materialize(writes);
+						Forget(writes);
+
+						EmitControl(in, pc);
+						m_frames.push_back(Frame{ true, 0, writes, false });
+						Block(pc + 1, endLoop);
+						Materialize(writes);
+						m_frames.pop_back();
+						EmitControl(code[endLoop], endLoop);
+
+						Forget(writes);
+						pc = endLoop;
+						break;
+					}
+					case Opcode::BreakIfNot:
+						if (IsKnown(in.A) && m_state[in.A].Value != 0.0f)
+							break;
+						Materialize(Innermost(true).Writes);
+						if (IsKnown(in.A))
+							Emit(Opcode::Break, 0, 0, 0, 0, in.Target, pc);
+						else
+							EmitControl(in, pc, in.A);
+						break;
+					case Opcode::Break:
+						Materialize(Innermost(true).Writes);
+						EmitControl(in, pc);
+						break;
+					case Opcode::Continue: {
+						Frame& f = Innermost(true);
+						Materialize(f.Writes);
+						f.Jumped = true;
+						EmitControl(in, pc);
+						break;
+					}
+					case Opcode::ContinuePoint: {
+						Frame& f = Innermost(true);
+						Materialize(f.Writes);
+						if (f.Jumped)
+							Forget(f.Writes);
+						EmitControl(in, pc);
+						break;
+					}
+
+					case Opcode::Call: {
+						size_t endCall = in.Target;
+						EmitControl(in, pc);
+						m_frames.push_back(Frame{ false, (uint32_t)endCall, Writes(pc + 1, endCall), false });
+						Block(pc + 1, endCall);
+						Frame f = m_frames.back();
+						m_frames.pop_back();
+						if (f.Jumped) {
+							Materialize(f.Writes);
+							Forget(f.Writes);
+						}
+						EmitControl(code[endCall], endCall);
+						pc = endCall;
+						break;
+					}
+					case Opcode::Return: {
+						size_t i = m_frames.size();
+						while (m_frames[i - 1].Loop || m_frames[i - 1].End != in.Target)
+							i--;
+						Frame& f = m_frames[i - 1];
+						Materialize(f.Writes);
+						f.Jumped = true;
+						EmitControl(in, pc);
+						break;
+					}
+
+					case Opcode::Else:
+					case Opcode::EndIf:
+					case Opcode::EndLoop:
+					case Opcode::EndCall:
+						break;
+
+					default:
+						Compute(in);
+						break;
+					}
+				}
+			}
+
+			void Compute(const Instruction& in)
+			{
+				int n = OperandCount(in.Op);
+				uint16_t ops[3] = { in.A, in.B, in.C };
+
+				// a known condition picks one operand
+				if (in.Op == Opcode::Select && IsKnown(in.A)) {
+					uint16_t pick = m_state[in.A].Value != 0.0f ? in.B : in.C;
+					Compute(Instruction{ Opcode::Mov, in.Dst, pick, 0, 0, 0 });
+					return;
+				}
+
+				bool known = true;
+				for (int i = 0; i < n; i++)
+					known = known && IsKnown(ops[i]);
+
+				if (known) {
+					float v = ApplyOp(in.Op, m_state[in.A].Value, n > 1 ? m_state[in.B].Value : 0.0f, n > 2 ? m_state[in.C].Value : 0.0f);
+					State& s = m_state[in.Dst];
+					if (!(s.Kind == State::Known && SameValue(s.Value, v)))
+						s = State{ State::Dirty, v };
+					return;
+				}
+
+				uint16_t a = n > 0 ? Operand(in.A) : 0;
+				uint16_t b = n > 1 ? Operand(in.B) : 0;
+				uint16_t c = n > 2 ? Operand(in.C) : 0;
+				Emit(in.Op, in.Dst, a, b, c, NoTarget, NoTarget);
+				m_state[in.Dst].Kind = State::Unknown;
+			}
+
+			// drops instructions writing registers that are never read
+			void RemoveDeadCode(const std::vector<uint16_t>& outputs)
+			{
+				m_keep.assign(m_code.size(), true);
+				for (bool changed = true; changed; ) {
+					std::vector<bool> read(m_program.NumRegisters, false);
+					for (uint16_t r : outputs)
+						if (!(r & ConstantFlag))
+							read[r] = true;
+					for (size_t i = 0; i < m_code.size(); i++) {
+						if (!m_keep[i])
+							continue;
+						const Instruction& in = m_code[i];
+						uint16_t ops[3] = { in.A, in.B, in.C };
+						for (int k = 0; k < OperandCount(in.Op); k++)
+							if (!(ops[k] & ConstantFlag))
+								read[ops[k]] = true;
+					}
+
+					changed = false;
+					for (size_t i = 0; i < m_code.size(); i++) {
+						if (m_keep[i] && !IsControlFlow(m_code[i].Op) && !read[m_code[i].Dst]) {
+							m_keep[i] = false;
+							changed = true;
+						}
+					}
+				}
+			}
+
+			const Program& m_program;
+			std::vector<State> m_state;
+			std::vector<float> m_constants;
+			std::vector<Frame> m_frames;
+
+			std::vector<Instruction> m_code; // operands use the original numbering, targets the original indices
+			std::vector<uint32_t> m_emitted; // index in m_code of each original control flow instruction
+			std::vector<bool> m_keep;
+		};
+	}
+
+	void SpecializeProgram(const Program& program, int axis, float value, Program& residual)
+	{
+		Specializer(program, axis, value).Run(residual);
+	}
+
+	SliceEvaluator::SliceEvaluator(const Program& program)
+		: m_program(program)
+	{
+	}
+
+	bool SliceEvaluator::EvaluateSlice(float z, float x0, float dx, int nx, float y0, float dy, int ny, float* out)
+	{
+		SpecializeProgram(m_program, 2, z, m_slice);
+
+		int outputs = GetOutputCount();
+		float values[16];
+		for (int j = 0; j < ny; j++) {
+			float y = y0 + j * dy;
+			SpecializeProgram(m_slice, 1, y, m_row);
+
+			Evaluator row(m_row);
+			for (int i = 0; i < nx; i++) {
+				if (!row.Evaluate(x0 + i * dx, y, z, values))
+					return false;
+				for (int m = 0; m < outputs; m++)
+					out[((size_t)m * ny + j) * nx + i] = values[m];
+			}
+		}
+		return true;
+	}
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include "program.h"
+
+namespace irmf
+{
+	// SpecializeProgram partially evaluates a Program for a fixed value of
+	// one input (0 = x, 1 = y, 2 = z). Everything that only depends on that
+	// input and on constants is folded, branches it decides are removed and
+	// so is the code that becomes dead. The residual program gives the same
+	// results as the original one for points with that coordinate.
+	void SpecializeProgram(const Program& program, int axis, float value, Program& residual);
+
+	// SliceEvaluator samples a model on Z slices. The program is specialized
+	// once per slice for its z and once per row for its y, so each sample
+	// only runs the code that depends on x. Use one per thread. Only the
+	// benchmark uses it: its samples run one at a time on the interpreter,
+	// which is slower than the BatchEvaluator rows the slicer samples.
+	class SliceEvaluator
+	{
+	public:
+		SliceEvaluator(const Program& program);
+
+		// EvaluateSlice samples the nx * ny grid (x0 + i * dx, y0 + j * dy, z).
+		// Material m of sample (i, j) is written to out[(m * ny + j) * nx + i].
+		// Returns false if a loop ran away.
+		bool EvaluateSlice(float z, float x0, float dx, int nx, float y0, float dy, int ny, float* out);
+
+		inline const Program& GetProgram() const { return m_program; }
+		inline int GetOutputCount() const { return (int)m_program.Outputs.size(); }
+
+	private:
+		const Program& m_program;
+		Program m_slice;
+		Program m_row;
+	};
+}
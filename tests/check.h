@@ -0,0 +1,47 @@
+#pragma once
+#include <cstdio>
+#include <string>
+#include "model.h"
+
+// The tests are plain executables run by ctest: CHECK reports a condition
+// that does not hold and counts it, and main returns Failures() != 0.
+
+namespace irmf
+{
+	namespace test
+	{
+		inline int& Failures()
+		{
+			static int failures = 0;
+			return failures;
+		}
+
+		// Example returns the path of a model of the examples directory
+		inline std::string Example(const std::string& name)
+		{
+			return std::string(IRMF_EXAMPLES) + "/" + name;
+		}
+
+		// LoadExample loads a model of the examples directory, counting a
+		// failure if it does not load
+		inline bool LoadExample(const std::string& name, Model& model)
+		{
+			std::string err;
+			if (LoadModelFile(Example(name), model, err))
+				return true;
+			fprintf(stderr, "%s: %s\n", name.c_str(), err.c_str());
+			Failures()++;
+			return false;
+		}
+	}
+}
+
+#define CHECK(cond, ...) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: %s: ", __FILE__, __LINE__, #cond); \
+			fprintf(stderr, __VA_ARGS__); \
+			fprintf(stderr, "\n"); \
+			irmf::test::Failures()++; \
+		} \
+	} while (0)
@@ -0,0 +1,97 @@
+// Slices an example with a checkpoint after every layer, keeps what a kill
+// after a few layers would have left on the disk, and checks that running
+// the export again resumes from there with the same entries as an export
+// that ran through, and that a checkpoint of other settings is not used.
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include "bytes.h"
+#include "check.h"
+#include "slicer.h"
+
+using namespace irmf;
+
+namespace
+{
+	bool Copy(const std::string& from, const std::string& to)
+	{
+		std::ifstream in(from, std::ios::binary);
+		std::ofstream out(to, std::ios::binary);
+		return in && out << in.rdbuf();
+	}
+
+	// Entries reads the name and the (stored or deflated) data of each
+	// entry from the local headers of an archive ZipWriter wrote
+	std::map<std::string, std::string> Entries(const std::string& filename)
+	{
+		std::ifstream file(filename, std::ios::binary);
+		std::string zip((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+		const uint8_t* p = (const uint8_t*)zip.data();
+		std::map<std::string, std::string> entries;
+		size_t at = 0;
+		while (at + 30 <= zip.size() && Get32(p + at) == 0x04034b50) {
+			size_t name = Get16(p + at + 26), extra = Get16(p + at + 28), size = Get32(p + at + 18);
+			size_t data = at + 30 + name + extra;
+			if (data + size > zip.size())
+				break;
+			entries[zip.substr(at + 30, name)] = zip.substr(data, size);
+			at = data + size;
+		}
+		return entries;
+	}
+}
+
+int main()
+{
+	const int stop = 5;
+	const std::string output = "checkpoint_test.zip", kept = "checkpoint_test_kept.zip", resumed = "checkpoint_test_resumed.zip";
+
+	Model model;
+	if (!test::LoadExample("sphere.irmf", model))
+		return 1;
+	SliceSettings settings;
+	settings.Pitch = 0.1f;
+	settings.CheckpointInterval = 1e-9;
+
+	// the uninterrupted export; at each Progress call the archive is synced
+	// and the checkpoint saved, as a kill would find them
+	int layers = 0;
+	bool copied = false;
+	settings.Progress = [&](int done, int total) {
+		layers = total;
+		if (done == stop)
+			copied = Copy(output, kept) && Copy(output + ".checkpoint", kept + ".checkpoint");
+	};
+	SliceStats stats;
+	std::string err;
+	CHECK(SliceToZip(model, settings, output, stats, err), "%s", err.c_str());
+	CHECK(copied, "no checkpoint after %d of %d layers", stop, layers);
+	CHECK(!std::ifstream(output + ".checkpoint"), "the checkpoint outlived the export");
+	std::map<std::string, std::string> full = Entries(output);
+	CHECK((int)full.size() == layers + 1, "%d entries for %d layers", (int)full.size(), layers);
+	settings.Progress = nullptr;
+
+	// resume from what the kill left
+	if (Copy(kept, resumed) && Copy(kept + ".checkpoint", resumed + ".checkpoint")) {
+		SliceStats again;
+		CHECK(SliceToZip(model, settings, resumed, again, err), "%s", err.c_str());
+		CHECK(again.Resumed == stop, "resumed after %d layers, not %d", again.Resumed, stop);
+		CHECK(Entries(resumed) == full, "the resumed archive differs from the uninterrupted one");
+		CHECK(!std::ifstream(resumed + ".checkpoint"), "the checkpoint outlived the resumed export");
+	}
+
+	// the iso level is part of the checkpoint's hash, though without
+	// anti-aliasing the images are the same
+	if (Copy(kept, resumed) && Copy(kept + ".checkpoint", resumed + ".checkpoint")) {
+		SliceStats again;
+		settings.IsoLevel = 0.25f;
+		CHECK(SliceToZip(model, settings, resumed, again, err), "%s", err.c_str());
+		CHECK(again.Resumed == 0, "resumed after %d layers from a checkpoint of other settings", again.Resumed);
+		CHECK(Entries(resumed) == full, "the archive started over differs from the first");
+	}
+
+	for (const std::string& name : { output, kept, resumed, kept + ".checkpoint" })
+		remove(name.c_str());
+	return test::Failures() != 0;
+}
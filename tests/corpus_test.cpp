@@ -0,0 +1,231 @@
+// Evaluates the models of the examples directory with the interpreter and
+// every batch kernel at random points and compares them with C++
+// transliterations of the same models.
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include "batch.h"
+#include "check.h"
+#include "interpreter.h"
+
+using namespace irmf;
+
+namespace
+{
+	const float Pi = 3.1415926535897932f;
+
+	float Clamp(float x, float lo, float hi) { return std::min(std::max(x, lo), hi); }
+	float Smoothstep(float a, float b, float x)
+	{
+		float t = Clamp((x - a) / (b - a), 0.0f, 1.0f);
+		return t * t * (3.0f - 2.0f * t);
+	}
+	float Gyroid(float x, float y, float z)
+	{
+		return std::sin(x) * std::cos(y) + std::sin(y) * std::cos(z) + std::sin(z) * std::cos(x);
+	}
+	float Length(float x, float y) { return std::sqrt(x * x + y * y); }
+	float Length(float x, float y, float z) { return std::sqrt(x * x + y * y + z * z); }
+	float SdBox(float x, float y, float z, float bx, float by, float bz)
+	{
+		float qx = std::fabs(x) - bx, qy = std::fabs(y) - by, qz = std::fabs(z) - bz;
+		return Length(std::max(qx, 0.0f), std::max(qy, 0.0f), std::max(qz, 0.0f)) + std::min(std::max(qx, std::max(qy, qz)), 0.0f);
+	}
+
+	void Sphere(float x, float y, float z, float* m)
+	{
+		m[0] = Length(x, y, z) <= 5.0f ? 1.0f : 0.0f;
+	}
+
+	void GyroidBall(float x, float y, float z, float* m)
+	{
+		m[0] = 0.0f;
+		if (Length(x, y, z) > 25.0f)
+			return;
+		m[0] = std::fabs(Gyroid(x * 0.6283f, y * 0.6283f, z * 0.6283f)) < 0.4f ? 1.0f : 0.0f;
+	}
+
+	void Lattice(float x, float y, float z, float* m)
+	{
+		m[0] = m[1] = 0.0f;
+		if (std::fabs(x) > 9.5f || std::fabs(y) > 9.5f || std::fabs(z) > 9.5f)
+			return;
+		float k = 2.0f * Pi / 4.0f;
+		float g = std::fabs(Gyroid(x * k, y * k, z * k));
+		m[0] = Clamp(Smoothstep(0.3f, 0.2f, g), 0.0f, 1.0f);
+		float v = 0.0f;
+		for (int i = 0; i < 6; i++) {
+			float a = i * Pi / 6.0f, c = std::cos(a), s = std::sin(a);
+			float qx = c * x - s * y, qy = s * x + c * y;
+			if (Length(Length(qx, qy) - 8.0f, z) < 0.5f) {
+				v = 1.0f;
+				break;
+			}
+		}
+		m[1] = v * (1.0f - m[0]);
+	}
+
+	int Fib(int n)
+	{
+		int a = 0, b = 1;
+		for (int i = 0; i < n; i++) {
+			int t = a + b;
+			a = b;
+			b = t;
+		}
+		return a;
+	}
+
+	void Features(float x, float y, float z, float* m)
+	{
+		std::fill(m, m + 9, 0.0f);
+		if (x > 2.5f && y > 2.5f)
+			return; // discard
+		m[0] = std::max(z, std::max(y, x));
+		m[1] = std::min(z, std::min(y, x));
+		int idx = (int)std::floor(std::fabs(x)) % 4;
+		const float w[4] = { 0.5f, 1.5f, 2.5f, 3.5f };
+		m[2] = w[idx] + 10.0f + w[idx];
+		m[3] = x + 3.0f * y;
+		m[4] = 2.0f * x + 4.0f * y;
+		m[5] = 1.0f / 25.0f;
+		m[6] = Fib(idx + 3) + 3.0f + SdBox(x, y, z, 1.0f, 1.5f, 2.0f);
+		m[7] = y < 0.0f ? -1.0f : y > 1.0f ? 2.0f : y * y;
+		float acc = 0.0f;
+		int k = 0;
+		do {
+			acc += k * 2.0f;
+			k++;
+			if (k == 2)
+				continue;
+			acc -= 0.5f;
+		} while (k < 5);
+		bool b = (z > 0.0f && y < 1.0f) || !(x < 0.0f);
+		m[8] = b ? acc : -acc;
+	}
+
+	void Twist(float x, float y, float z, float* m)
+	{
+		float angle = z * 0.05f + 0.3f * std::sin(z * 0.2f);
+		float c = std::cos(angle), s = std::sin(angle);
+		float px = c * x - s * y, py = s * x + c * y;
+		float r = 15.0f * (1.0f - 0.3f * Smoothstep(0.0f, 40.0f, z)) + 0.5f * std::sin(z);
+		float d = Length(px, py) - r * (0.75f + 0.25f * std::cos(5.0f * std::atan2(py, px)));
+		m[0] = d <= 0.0f ? 1.0f : 0.0f;
+		m[1] = d > 0.0f && d < 1.0f + 0.2f * std::cos(z) ? 1.0f : 0.0f;
+	}
+
+	void Functions(float x, float y, float z, float* m)
+	{
+		m[0] = Gyroid(x * 0.7f, y * 0.7f, z * 0.7f);
+		m[1] = Smoothstep(-2.0f, 3.0f, Length(x, y, z) - 2.0f) * std::exp(-0.1f * (x * x + y * y + z * z)) + std::pow(std::fabs(x) + 1.0f, 1.5f);
+		float t = Clamp(y * 0.1f + 0.5f, 0.0f, 1.0f);
+		m[2] = std::atan2(y, x + 7.0f) + (x + (z - x) * t) / (2.0f + z * z) + std::tanh(x) * std::log(y + 6.0f) + std::sqrt(z + 6.0f)
+			+ 1.0f / std::sqrt(z + 6.0f) + std::asin(x / 6.0f);
+		float c = std::cos(z), s = std::sin(z);
+		float qx = c * x - s * y, qy = s * x + c * y;
+		m[3] = qx * qy + std::exp2(z * 0.2f) + (x - 3.0f * std::floor(x / 3.0f)) + std::cosh(y * 0.2f) + std::sinh(x * 0.1f);
+	}
+
+	void Loop(float x, float y, float z, float* m)
+	{
+		float acc = 0.0f;
+		for (int i = 0; i < 5; i++) {
+			float a = i * 1.2566f;
+			if (Length(x - 3.0f * std::cos(a), y - 3.0f * std::sin(a), z) < 1.0f)
+				acc += 1.0f;
+		}
+		float c = std::cos(z), s = std::sin(z);
+		m[0] = Clamp(acc, 0.0f, 1.0f);
+		m[1] = SdBox(c * x + s * y, -s * x + c * y, z, 1.0f, 0.5f, 4.0f) < 0.0f ? 1.0f : 0.0f;
+		m[2] = x - std::floor(x) > 0.5f && m[1] < 0.5f && std::fabs(z) < 1.0f ? 0.7f : 0.0f;
+	}
+
+	void Torus(float x, float y, float z, float* m)
+	{
+		m[0] = Clamp(0.5f - (Length(Length(x, y) - 6.0f, z) - 3.0f) * 2.0f, 0.0f, 1.0f);
+		m[1] = Clamp(0.5f - (Length(x, y) - 1.5f) * 2.0f, 0.0f, 1.0f);
+	}
+
+	struct Case
+	{
+		const char* File;
+		int Outputs;
+		void (*Reference)(float x, float y, float z, float* m);
+	};
+
+	// Close tells whether a value is within float rounding of the reference,
+	// given the size of the terms it is made of
+	bool Close(float value, float reference)
+	{
+		return std::fabs(value - reference) <= 1e-3f * std::max(1.0f, std::fabs(reference));
+	}
+}
+
+int main()
+{
+	const Case cases[] = {
+		{ "sphere.irmf", 1, Sphere },
+		{ "gyroid.irmf", 1, GyroidBall },
+		{ "lattice.irmf", 2, Lattice },
+		{ "features.irmf", 9, Features },
+		{ "twist.irmf", 2, Twist },
+		{ "functions.irmf", 4, Functions },
+		{ "loop.irmf", 3, Loop },
+		{ "torus.irmf", 2, Torus },
+	};
+	const BatchTarget targets[] = { BatchTarget::Generic, BatchTarget::AVX2, BatchTarget::AVX512 };
+	const size_t count = 20000;
+
+	for (const Case& c : cases) {
+		Model model;
+		if (!test::LoadExample(c.File, model))
+			continue;
+		CHECK((int)model.Materials.size() == c.Outputs, "%s: %d materials", c.File, (int)model.Materials.size());
+		if ((int)model.Materials.size() != c.Outputs)
+			continue;
+
+		// the same points every run
+		std::vector<float> x(count), y(count), z(count), expected(count * c.Outputs);
+		uint32_t seed = 1;
+		auto next = [&]() {
+			seed = seed * 1664525u + 1013904223u;
+			return (seed >> 8) / 16777216.0f;
+		};
+		for (size_t i = 0; i < count; i++) {
+			x[i] = model.Min[0] + (model.Max[0] - model.Min[0]) * next();
+			y[i] = model.Min[1] + (model.Max[1] - model.Min[1]) * next();
+			z[i] = model.Min[2] + (model.Max[2] - model.Min[2]) * next();
+			float m[16];
+			c.Reference(x[i], y[i], z[i], m);
+			for (int o = 0; o < c.Outputs; o++)
+				expected[o * count + i] = m[o];
+		}
+
+		Evaluator evaluator(model.Code);
+		int wrong = 0;
+		for (size_t i = 0; i < count; i++) {
+			float m[16];
+			bool ok = evaluator.Evaluate(x[i], y[i], z[i], m);
+			for (int o = 0; o < c.Outputs && ok; o++)
+				if (!Close(m[o], expected[o * count + i]) && wrong++ < 3)
+					fprintf(stderr, "%s: interpreter: material %d at (%g, %g, %g) is %g, not %g\n", c.File, o, x[i], y[i], z[i], m[o], expected[o * count + i]);
+			CHECK(ok, "%s: interpreter failed at (%g, %g, %g)", c.File, x[i], y[i], z[i]);
+		}
+		CHECK(wrong == 0, "%s: the interpreter differs from the reference at %d values", c.File, wrong);
+
+		for (BatchTarget target : targets) {
+			BatchEvaluator batch(model.Code, target);
+			std::vector<float> out(count * c.Outputs);
+			CHECK(batch.Evaluate(x.data(), y.data(), z.data(), count, out.data()), "%s: %s failed", c.File, batch.GetTargetName());
+			wrong = 0;
+			for (size_t i = 0; i < out.size(); i++)
+				if (!Close(out[i], expected[i]) && wrong++ < 3)
+					fprintf(stderr, "%s: %s: material %d at (%g, %g, %g) is %g, not %g\n", c.File, batch.GetTargetName(), (int)(i / count),
+						x[i % count], y[i % count], z[i % count], out[i], expected[i]);
+			CHECK(wrong == 0, "%s: %s differs from the reference at %d values", c.File, batch.GetTargetName(), wrong);
+		}
+	}
+	return test::Failures() != 0;
+}
@@ -0,0 +1,39 @@
+// Checks the number of cells MakeGrid gives to a bounding box, which must
+// not gain a cell from the rounding of a float pitch.
+#include "check.h"
+#include "sampler.h"
+
+using namespace irmf;
+
+int main()
+{
+	struct Case
+	{
+		float Extent, Pitch;
+		int Cells;
+	};
+	const Case cases[] = {
+		{ 10.0f, 0.01f, 1000 },
+		{ 300.0f, 0.02f, 15000 },
+		{ 40.0f, 0.1f, 400 },
+		{ 10.0f, 0.3f, 34 },
+		{ 1.0f, 2.0f, 1 },
+	};
+
+	for (const Case& c : cases) {
+		Model model;
+		for (int i = 0; i < 3; i++) {
+			model.Min[i] = -c.Extent / 2;
+			model.Max[i] = c.Extent / 2;
+		}
+		Grid grid;
+		std::string err;
+		bool ok = MakeGrid(model, c.Pitch, 0.0f, grid, err);
+		CHECK(ok, "%g at %g: %s", c.Extent, c.Pitch, err.c_str());
+		if (!ok)
+			continue;
+		for (int i = 0; i < 3; i++)
+			CHECK(grid.Size[i] == c.Cells, "%g at %g: %d cells on axis %d, not %d", c.Extent, c.Pitch, grid.Size[i], i, c.Cells);
+	}
+	return test::Failures() != 0;
+}
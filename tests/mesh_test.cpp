@@ -0,0 +1,67 @@
+// Meshes examples with dual contouring and checks that every mesh is
+// closed and consistently oriented: each edge is used once in each
+// direction, by exactly two triangles, and the enclosed volume is positive.
+#include <map>
+#include <utility>
+#include "check.h"
+#include "dualcontour.h"
+
+using namespace irmf;
+
+int main()
+{
+	struct Case
+	{
+		const char* File;
+		float Pitch;
+		float Tolerance; // <= 0: the default
+	};
+	// the twisted box of loop.irmf has faces where two sheets meet in a
+	// cell, and the gyroid's thin walls tunnel through cell faces
+	const Case cases[] = {
+		{ "loop.irmf", 0.1f, 0.0f },
+		{ "loop.irmf", 0.1f, 0.0001f },
+		{ "loop.irmf", 0.1f, 0.05f },
+		{ "twist.irmf", 0.25f, 0.0f },
+		{ "torus.irmf", 0.1f, 0.0f },
+		{ "gyroid.irmf", 0.25f, 0.0f },
+	};
+
+	for (const Case& c : cases) {
+		Model model;
+		if (!test::LoadExample(c.File, model))
+			continue;
+		MeshSettings settings;
+		settings.Pitch = c.Pitch;
+		settings.Tolerance = c.Tolerance;
+		std::string err;
+		bool ok = DualContour(model, settings, [&](int material, const MeshPart& part) {
+			const char* name = model.Materials[material].c_str();
+			std::map<std::pair<uint32_t, uint32_t>, int> edges;
+			double volume = 0.0;
+			for (size_t t = 0; t < part.Triangles.size(); t += 3) {
+				const uint32_t* v = &part.Triangles[t];
+				for (int k = 0; k < 3; k++)
+					edges[std::make_pair(v[k], v[(k + 1) % 3])]++;
+				const float* a = &part.Positions[3 * v[0]];
+				const float* b = &part.Positions[3 * v[1]];
+				const float* p = &part.Positions[3 * v[2]];
+				volume += (a[0] * (b[1] * p[2] - b[2] * p[1]) - a[1] * (b[0] * p[2] - b[2] * p[0]) + a[2] * (b[0] * p[1] - b[1] * p[0])) / 6.0;
+			}
+			int open = 0, shared = 0;
+			for (const auto& edge : edges) {
+				auto back = edges.find(std::make_pair(edge.first.second, edge.first.first));
+				if (back == edges.end())
+					open++;
+				else if (edge.second != 1 || back->second != 1)
+					shared++;
+			}
+			CHECK(open == 0, "%s %g: %s: %d edges with one triangle", c.File, c.Tolerance, name, open);
+			CHECK(shared == 0, "%s %g: %s: %d edges with more than two triangles or flipped ones", c.File, c.Tolerance, name, shared);
+			CHECK(part.Triangles.empty() || volume > 0.0, "%s %g: %s: volume %g", c.File, c.Tolerance, name, volume);
+			return true;
+		}, err);
+		CHECK(ok, "%s: %s", c.File, err.c_str());
+	}
+	return test::Failures() != 0;
+}
@@ -0,0 +1,94 @@
+// Drives ProgressiveScheduler as the preview does, with a simulated cost
+// per sample, and checks when it restarts, how it sizes its steps against
+// the frame budget and that a refinement shades every pixel once.
+#include "check.h"
+#include "progressive.h"
+
+using namespace irmf;
+
+namespace
+{
+	// Refine runs the scheduler until it is done, timing each step as
+	// msPerSample per sample; returns the samples shaded, or -1 if it does
+	// not finish
+	long long Refine(ProgressiveScheduler& scheduler, float msPerSample, float budget, int& steps, int& overBudget)
+	{
+		long long samples = 0;
+		float last = 0.0f;
+		steps = overBudget = 0;
+		while (!scheduler.IsDone()) {
+			if (steps++ > 100000)
+				return -1;
+			ProgressiveStep step = scheduler.Next(last);
+			long long count = scheduler.SampleCount(step);
+			samples += count;
+			last = count * msPerSample;
+			// the coarse pass covers the whole viewport, and the estimate
+			// needs a few steps to settle
+			if (steps > 4 && last > 1.25f * budget)
+				overBudget++;
+		}
+		return samples;
+	}
+}
+
+int main()
+{
+	const float view[16] = { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, -5, 1 };
+	float moved[16];
+	for (int i = 0; i < 16; i++)
+		moved[i] = view[i];
+	moved[14] = -6.0f;
+
+	// restarts
+	{
+		ProgressiveScheduler scheduler;
+		scheduler.SetViewport(640, 480);
+		int generation = scheduler.GetGeneration();
+		CHECK(scheduler.Observe(view, 1, 7), "the first frame restarts");
+		CHECK(!scheduler.Observe(view, 2, 7), "nothing changed but the frame index");
+		CHECK(scheduler.Observe(moved, 3, 7), "the camera moved");
+		CHECK(!scheduler.Observe(moved, 4, 7), "the camera stayed");
+		CHECK(scheduler.Observe(moved, 5, 8), "a uniform changed");
+		CHECK(!scheduler.Observe(moved, 6, 8), "the uniforms stayed");
+		CHECK(scheduler.Observe(moved, 0, 8), "the frame counter was reset");
+		CHECK(scheduler.GetGeneration() == generation + 4, "generation %d after 4 restarts from %d", scheduler.GetGeneration(), generation);
+
+		scheduler.Next(0.0f);
+		CHECK(!scheduler.IsDone(), "done after one step");
+		CHECK(scheduler.Observe(moved, 1, 9), "a uniform changed");
+		ProgressiveStep step = scheduler.Next(0.0f);
+		CHECK(step.Level == ProgressiveScheduler::CoarsestLevel && step.Width == 640 && step.Height == 480,
+			"a restart begins with the coarse pass, not level %d over %d x %d", step.Level, step.Width, step.Height);
+	}
+
+	// budget and completion, on viewports that are not a multiple of the tiles
+	const int sizes[][2] = { { 1024, 768 }, { 1000, 700 }, { 37, 5 } };
+	const float costs[] = { 1e-5f, 1e-4f, 1e-3f };
+	for (const auto& size : sizes)
+		for (float cost : costs) {
+			ProgressiveScheduler scheduler;
+			scheduler.SetBudget(16.0f);
+			scheduler.SetViewport(size[0], size[1]);
+			int steps, overBudget;
+			long long samples = Refine(scheduler, cost, 16.0f, steps, overBudget);
+			CHECK(samples == (long long)size[0] * size[1], "%d x %d at %g ms: %lld samples, not one per pixel", size[0], size[1], cost, samples);
+			CHECK(overBudget == 0, "%d x %d at %g ms: %d of %d steps over the budget", size[0], size[1], cost, overBudget, steps);
+			// the estimate is a running average, which settles in 20 steps
+			float estimate = scheduler.GetCostPerSample();
+			CHECK(steps < 20 || (estimate > 0.8f * cost && estimate < 1.25f * cost), "%d x %d: cost estimate %g for %g after %d steps", size[0],
+				size[1], estimate, cost, steps);
+			CHECK(scheduler.Next(1.0f).Level == 0, "a finished refinement still has steps");
+
+			// a slower model takes more, smaller steps
+			if (size[0] == 1024 && cost == 1e-3f) {
+				ProgressiveScheduler fast;
+				fast.SetBudget(16.0f);
+				fast.SetViewport(size[0], size[1]);
+				int fastSteps;
+				Refine(fast, 1e-5f, 16.0f, fastSteps, overBudget);
+				CHECK(fastSteps < steps, "%d steps for a fast model, %d for a slow one", fastSteps, steps);
+			}
+		}
+	return test::Failures() != 0;
+}
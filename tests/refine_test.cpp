@@ -0,0 +1,56 @@
+// Slices examples with EdgeRefiner and checks that every pixel is the byte
+// that sampling each pixel (--refine 0) gives, at pitches that put the
+// pixel centers off the models' symmetries and leave partial blocks.
+#include "check.h"
+#include "refine.h"
+
+using namespace irmf;
+
+int main()
+{
+	struct Case
+	{
+		const char* File;
+		float Pitch;
+	};
+	const Case cases[] = {
+		{ "sphere.irmf", 0.37f },
+		{ "gyroid.irmf", 0.37f },
+		{ "lattice.irmf", 0.37f },
+		{ "struts.irmf", 0.37f },
+		{ "sphere.irmf", 0.13f },
+	};
+	const int blocks[] = { 8, 32 };
+
+	for (const Case& c : cases) {
+		Model model;
+		if (!test::LoadExample(c.File, model))
+			continue;
+		Grid grid;
+		std::string err;
+		bool ok = MakeGrid(model, c.Pitch, 0.0f, grid, err);
+		CHECK(ok, "%s: %s", c.File, err.c_str());
+		if (!ok)
+			continue;
+		int materials = (int)model.Materials.size();
+		RowSampler sampler(model, grid);
+		for (int block : blocks) {
+			EdgeRefiner refiner(model, grid, block);
+			long long differ = 0;
+			for (int k = 0; k < grid.Size[2]; k++)
+				for (int j = grid.Size[1] - 1; j >= 0; j--) {
+					ok = refiner.Sample(j, k) && sampler.Sample(j, k);
+					CHECK(ok, "%s: layer %d, row %d did not sample", c.File, k, j);
+					if (!ok)
+						break;
+					for (int m = 0; m < materials; m++)
+						for (int i = 0; i < grid.Size[0]; i++)
+							if (refiner.GetPixels(m)[i] != ToByte(sampler.GetValues(m)[i]) && differ++ == 0)
+								fprintf(stderr, "%s at %g, block %d: material %d, pixel %d, %d, %d is %d, not %d\n", c.File, c.Pitch, block, m, i, j, k,
+									refiner.GetPixels(m)[i], ToByte(sampler.GetValues(m)[i]));
+				}
+			CHECK(differ == 0, "%s at %g, block %d: %lld pixels differ", c.File, c.Pitch, block, differ);
+		}
+	}
+	return test::Failures() != 0;
+}
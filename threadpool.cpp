@@ -0,0 +1,131 @@
+#include "threadpool.h"
+#include <algorithm>
+
+namespace irmf
+{
+	ThreadPool::ThreadPool(int threads)
+		: m_next(0)
+		, m_queued(0)
+		, m_unfinished(0)
+		, m_stop(false)
+	{
+		if (threads <= 0)
+			threads = std::max(1, (int)std::thread::hardware_concurrency());
+		for (int i = 0; i < threads; i++)
+			m_queues.emplace_back(new Queue());
+		for (int i = 0; i < threads; i++)
+			m_threads.emplace_back(&ThreadPool::Work, this, i);
+	}
+
+	ThreadPool::~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_wake.notify_all();
+		for (std::thread& t : m_threads)
+			t.join();
+	}
+
+	void ThreadPool::Submit(Task task)
+	{
+		Queue& q = *m_queues[m_next++ % m_queues.size()];
+		{
+			std::lock_guard<std::mutex> lock(q.Mutex);
+			q.Tasks.push_back(std::move(task));
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_queued++;
+			m_unfinished++;
+		}
+		m_wake.notify_one();
+	}
+
+	void ThreadPool::Wait()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_idle.wait(lock, [this] { return m_unfinished == 0; });
+	}
+
+	bool ThreadPool::Take(int worker, Task& task)
+	{
+		// the oldest task of the own queue first, then the oldest one of
+		// the others: tasks are usually submitted in the order they are
+		// needed in
+		size_t count = m_queues.size();
+		for (size_t i = 0; i < count; i++) {
+			Queue& q = *m_queues[(worker + i) % count];
+			std::lock_guard<std::mutex> lock(q.Mutex);
+			if (!q.Tasks.empty()) {
+				task = std::move(q.Tasks.front());
+				q.Tasks.pop_front();
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void ThreadPool::Work(int worker)
+	{
+		for (;;) {
+			{
+				// claim one of the queued tasks, then find it
+				std::unique_lock<std::mutex> lock(m_mutex);
+				m_wake.wait(lock, [this] { return m_stop || m_queued > 0; });
+				if (m_stop)
+					return;
+				m_queued--;
+			}
+
+			Task task;
+			while (!Take(worker, task)) { }
+			task(worker);
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (--m_unfinished == 0)
+				m_idle.notify_all();
+		}
+	}
+
+	bool RunOrdered(ThreadPool& pool, int count, int window,
+		const std::function<bool(int, int, int)>& produce,
+		const std::function<bool(int, int)>& consume)
+	{
+		std::vector<char> done(window), failed(window);
+		std::mutex mutex;
+		std::condition_variable ready;
+		std::atomic<bool> cancel(false);
+
+		bool ok = true;
+		int next = 0;
+		for (int i = 0; i < count && ok; i++) {
+			while (next < count && next < i + window) {
+				int item = next++, slot = item % window;
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					done[slot] = false;
+				}
+				pool.Submit([&, item, slot](int worker) {
+					bool good = !cancel && produce(item, slot, worker);
+					std::lock_guard<std::mutex> lock(mutex);
+					done[slot] = true;
+					failed[slot] = !good;
+					ready.notify_all();
+				});
+			}
+
+			int slot = i % window;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				ready.wait(lock, [&] { return done[slot] != 0; });
+			}
+			ok = !failed[slot] && consume(i, slot);
+		}
+		// the remaining tasks refer to this frame
+		cancel = true;
+		pool.Wait();
+		return ok;
+	}
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace irmf
+{
+	// ThreadPool runs tasks on a fixed set of worker threads. Every worker
+	// has its own queue; tasks are handed out round robin and a worker whose
+	// queue runs dry steals from the others, so uneven tasks (layers that
+	// cut through more of the model) still keep every thread busy.
+	class ThreadPool
+	{
+	public:
+		// Task receives the index of the worker running it, in
+		// [0, GetThreadCount()), for per-thread state.
+		typedef std::function<void(int)> Task;
+
+		// threads <= 0 uses one thread per hardware thread
+		ThreadPool(int threads = 0);
+		~ThreadPool();
+
+		void Submit(Task task);
+
+		// Wait blocks until every submitted task has finished.
+		void Wait();
+
+		inline int GetThreadCount() const { return (int)m_threads.size(); }
+
+	private:
+		struct Queue
+		{
+			std::mutex Mutex;
+			std::deque<Task> Tasks;
+		};
+
+		bool Take(int worker, Task& task);
+		void Work(int worker);
+
+		std::vector<std::unique_ptr<Queue>> m_queues;
+		std::vector<std::thread> m_threads;
+		std::atomic<unsigned> m_next;
+
+		std::mutex m_mutex;
+		std::condition_variable m_wake, m_idle;
+		size_t m_queued;     // submitted, not claimed by a worker yet
+		size_t m_unfinished; // submitted, not finished yet
+		bool m_stop;
+	};
+
+	// RunOrdered calls produce(item, slot, worker) for every item in
+	// [0, count) on the pool and consume(item, slot) on the calling thread,
+	// in item order, as soon as each item and all the ones before it are
+	// done. At most window items are in flight at a time; slot, in
+	// [0, window), names the buffers an item may fill until it has been
+	// consumed. Stops at the first false from either and returns false.
+	bool RunOrdered(ThreadPool& pool, int count, int window,
+		const std::function<bool(int, int, int)>& produce,
+		const std::function<bool(int, int)>& consume);
+}
@@ -0,0 +1,420 @@
+#include "threemf.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <pugixml/src/pugixml.hpp>
+#include "decimate.h"
+
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#else
+#define fseek64 fseeko
+#endif
+
+namespace irmf
+{
+	namespace
+	{
+		const char* CoreNamespace = "http://schemas.microsoft.com/3dmanufacturing/core/2015/02";
+		const char* ModelPart = "3D/3dmodel.model";
+		const uint32_t PieceSize = 1 << 16; // vertices or triangles formatted and deflated at a time
+		const int Level = 1;
+
+		// distinct display colors for the base materials
+		const char* Colors[] = {
+			"#D0D0D0", "#E06030", "#3080E0", "#40B040", "#E0C030", "#A050C0", "#30C0C0", "#E05090",
+			"#806040", "#90A0B0", "#C0E060", "#6060A0", "#F0A070", "#40806A", "#B03040", "#303030",
+		};
+
+		struct StringWriter : pugi::xml_writer
+		{
+			std::string Text;
+			void write(const void* data, size_t size) override { Text.append((const char*)data, size); }
+		};
+
+		std::string Print(pugi::xml_document& doc)
+		{
+			pugi::xml_node declaration = doc.prepend_child(pugi::node_declaration);
+			declaration.append_attribute("version") = "1.0";
+			declaration.append_attribute("encoding") = "UTF-8";
+			StringWriter writer;
+			doc.save(writer, "", pugi::format_raw);
+			return writer.Text;
+		}
+
+		// Unit maps the IRMF "units" to a 3MF unit.
+		const char* Unit(const std::string& units)
+		{
+			if (units == "cm")
+				return "centimeter";
+			if (units == "m")
+				return "meter";
+			if (units == "in" || units == "inch")
+				return "inch";
+			if (units == "ft")
+				return "foot";
+			if (units == "um" || units == "micron")
+				return "micron";
+			return "millimeter";
+		}
+
+		void AppendInteger(std::string& out, uint64_t v)
+		{
+			char digits[20];
+			int n = 0;
+			do {
+				digits[n++] = (char)('0' + v % 10);
+				v /= 10;
+			} while (v > 0);
+			while (n > 0)
+				out += digits[--n];
+		}
+
+		// AppendFloat writes v with 7 significant digits (fewer below 1),
+		// without an exponent; printf is too slow for millions of vertices.
+		void AppendFloat(std::string& out, float v)
+		{
+			static const double Scale[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6 };
+			static const uint64_t Divisor[] = { 1, 10, 100, 1000, 10000, 100000, 1000000 };
+			double d = v;
+			if (!(std::fabs(d) < 1e6)) {
+				char text[32];
+				snprintf(text, sizeof(text), "%.9g", d);
+				out += text;
+				return;
+			}
+			if (d < 0.0) {
+				out += '-';
+				d = -d;
+			}
+			int digits = 1;
+			for (double power = 10.0; d >= power; power *= 10.0)
+				digits++;
+			int decimals = 7 - digits;
+			uint64_t scaled = (uint64_t)(d * Scale[decimals] + 0.5);
+			uint64_t fraction = scaled % Divisor[decimals];
+			AppendInteger(out, scaled / Divisor[decimals]);
+			if (fraction == 0)
+				return;
+			while (fraction % 10 == 0) {
+				fraction /= 10;
+				decimals--;
+			}
+			out += '.';
+			char text[8];
+			for (int i = decimals - 1; i >= 0; i--, fraction /= 10)
+				text[i] = (char)('0' + fraction % 10);
+			out.append(text, decimals);
+		}
+	}
+
+	ThreeMfWriter::ThreeMfWriter(int threads)
+		: m_pool(threads)
+		, m_spool(nullptr)
+		, m_spoolSize(0)
+		, m_text(m_pool.GetThreadCount())
+		, m_deflated(m_pool.GetThreadCount())
+		, m_inFlight(0)
+	{
+	}
+
+	ThreeMfWriter::~ThreeMfWriter()
+	{
+		m_pool.Wait();
+		if (m_spool)
+			fclose(m_spool);
+	}
+
+	bool ThreeMfWriter::Open(const std::string& filename, const Model& model, std::string& err)
+	{
+		m_spool = tmpfile();
+		if (!m_spool) {
+			err = "failed to create a temporary file";
+			return false;
+		}
+		if (!m_zip.Open(filename, err))
+			return false;
+		m_filename = filename;
+		m_info = model.Info;
+		m_materials.clear();
+		for (const std::string& name : model.Materials) {
+			Material material;
+			material.Name = name;
+			material.Vertices = material.Triangles = 0;
+			m_materials.push_back(material);
+		}
+		return true;
+	}
+
+	bool ThreeMfWriter::Fail(const std::string& err)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_error.empty())
+			m_error = err;
+		return false;
+	}
+
+	void ThreeMfWriter::Submit(const std::shared_ptr<Job>& job)
+	{
+		{
+			// keep the parts waiting for a worker to a few per thread
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_done.wait(lock, [this] { return m_inFlight < 2 * m_pool.GetThreadCount(); });
+			m_inFlight++;
+		}
+		m_pool.Submit([this, job](int worker) {
+			Run(*job, worker);
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_inFlight--;
+			m_done.notify_all();
+		});
+	}
+
+	void ThreeMfWriter::Run(Job& job, int worker)
+	{
+		std::string& text = m_text[worker];
+		text.clear();
+		for (size_t i = 0; i < job.Positions.size(); i += 3) {
+			text += "<vertex x=\"";
+			AppendFloat(text, job.Positions[i]);
+			text += "\" y=\"";
+			AppendFloat(text, job.Positions[i + 1]);
+			text += "\" z=\"";
+			AppendFloat(text, job.Positions[i + 2]);
+			text += "\"/>";
+		}
+		for (size_t i = 0; i < job.Triangles.size(); i += 3) {
+			text += "<triangle v1=\"";
+			AppendInteger(text, job.Triangles[i]);
+			text += "\" v2=\"";
+			AppendInteger(text, job.Triangles[i + 1]);
+			text += "\" v3=\"";
+			AppendInteger(text, job.Triangles[i + 2]);
+			text += "\"/>";
+		}
+
+		Deflated& deflated = m_deflated[worker];
+		if (!Deflate(text.data(), text.size(), Level, deflated, false)) {
+			Fail("failed to compress the model");
+			return;
+		}
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_error.empty())
+			return;
+		if (fwrite(deflated.Data.data(), 1, deflated.Data.size(), m_spool) != deflated.Data.size()) {
+			m_error = "failed to write the temporary file (disk full?)";
+			return;
+		}
+		Piece& piece = *job.Target;
+		piece.Offset = m_spoolSize;
+		piece.CompressedSize = deflated.Data.size();
+		piece.Size = deflated.Size;
+		piece.Crc = deflated.Crc;
+		m_spoolSize += deflated.Data.size();
+	}
+
+	bool ThreeMfWriter::Add(int material, const MeshPart& part)
+	{
+		Material& target = m_materials[material];
+		const float* p = part.Positions.data();
+		const uint32_t* t = part.Triangles.data();
+		uint32_t vertices = part.GetVertexCount(), triangles = part.GetTriangleCount();
+
+		// vertices shared with the previous part were written with it
+		const uint32_t none = 0xffffffffu;
+		m_remap.assign(vertices, none);
+		for (const auto& shared : part.Bottom) {
+			auto it = target.Boundary.find(shared.first);
+			if (it != target.Boundary.end())
+				m_remap[shared.second] = it->second;
+		}
+
+		std::shared_ptr<Job> job;
+		for (uint32_t i = 0; i <= vertices; i++) {
+			// hand over full pieces, and the last one
+			if (job && (i == vertices || job->Positions.size() == 3 * PieceSize)) {
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					target.VertexPieces.push_back(Piece());
+					job->Target = &target.VertexPieces.back();
+				}
+				Submit(job);
+				job.reset();
+			}
+			if (i == vertices || m_remap[i] != none)
+				continue;
+			if (target.Vertices >= 0x7fffffff)
+				return Fail("too many vertices for 3MF");
+			m_remap[i] = (uint32_t)target.Vertices++;
+			if (!job) {
+				job = std::make_shared<Job>();
+				job->Positions.reserve(3 * (size_t)std::min(vertices - i, PieceSize));
+			}
+			job->Positions.insert(job->Positions.end(), p + 3 * i, p + 3 * i + 3);
+		}
+
+		target.Boundary.clear();
+		for (const auto& shared : part.Top)
+			target.Boundary[shared.first] = m_remap[shared.second];
+
+		for (uint32_t first = 0; first < triangles; first += PieceSize) {
+			uint32_t count = std::min(triangles - first, PieceSize);
+			job = std::make_shared<Job>();
+			job->Triangles.resize(3 * (size_t)count);
+			for (size_t k = 0; k < 3 * (size_t)count; k++)
+				job->Triangles[k] = m_remap[t[3 * (size_t)first + k]];
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				target.TrianglePieces.push_back(Piece());
+				job->Target = &target.TrianglePieces.back();
+			}
+			Submit(job);
+		}
+		target.Triangles += triangles;
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_error.empty();
+	}
+
+	bool ThreeMfWriter::Close(std::string& err)
+	{
+		m_pool.Wait();
+
+		// the package's parts; the model's meshes are left as markers to
+		// splice the pieces in
+		pugi::xml_document types;
+		pugi::xml_node node = types.append_child("Types");
+		node.append_attribute("xmlns") = "http://schemas.openxmlformats.org/package/2006/content-types";
+		pugi::xml_node type = node.append_child("Default");
+		type.append_attribute("Extension") = "rels";
+		type.append_attribute("ContentType") = "application/vnd.openxmlformats-package.relationships+xml";
+		type = node.append_child("Default");
+		type.append_attribute("Extension") = "model";
+		type.append_attribute("ContentType") = "application/vnd.ms-package.3dmanufacturing-3dmodel+xml";
+
+		pugi::xml_document rels;
+		node = rels.append_child("Relationships");
+		node.append_attribute("xmlns") = "http://schemas.openxmlformats.org/package/2006/relationships";
+		pugi::xml_node rel = node.append_child("Relationship");
+		rel.append_attribute("Target") = (std::string("/") + ModelPart).c_str();
+		rel.append_attribute("Id") = "rel0";
+		rel.append_attribute("Type") = "http://schemas.microsoft.com/3dmanufacturing/2013/01/3dmodel";
+
+		pugi::xml_document doc;
+		pugi::xml_node model = doc.append_child("model");
+		model.append_attribute("unit") = Unit(m_info["units"].string_value());
+		model.append_attribute("xml:lang") = "en-US";
+		model.append_attribute("xmlns") = CoreNamespace;
+		static const char* metadata[][2] = {
+			{ "title", "Title" }, { "author", "Designer" }, { "notes", "Description" },
+			{ "copyright", "Copyright" }, { "date", "CreationDate" },
+		};
+		for (const auto& item : metadata) {
+			std::string value = m_info[item[0]].string_value();
+			if (value.empty())
+				continue;
+			pugi::xml_node entry = model.append_child("metadata");
+			entry.append_attribute("name") = item[1];
+			entry.text() = value.c_str();
+		}
+		pugi::xml_node entry = model.append_child("metadata");
+		entry.append_attribute("name") = "Application";
+		entry.text() = "irmf-export";
+
+		pugi::xml_node resources = model.append_child("resources");
+		pugi::xml_node build = model.append_child("build");
+		pugi::xml_node bases = resources.append_child("basematerials");
+		bases.append_attribute("id") = 1;
+		for (size_t m = 0; m < m_materials.size(); m++) {
+			pugi::xml_node base = bases.append_child("base");
+			base.append_attribute("name") = m_materials[m].Name.c_str();
+			base.append_attribute("displaycolor") = Colors[m % 16];
+		}
+		for (size_t m = 0; m < m_materials.size(); m++) {
+			// 3MF has no empty meshes
+			if (m_materials[m].Triangles == 0)
+				continue;
+			pugi::xml_node object = resources.append_child("object");
+			object.append_attribute("id") = (unsigned)m + 2;
+			object.append_attribute("type") = "model";
+			object.append_attribute("name") = m_materials[m].Name.c_str();
+			object.append_attribute("pid") = 1;
+			object.append_attribute("pindex") = (unsigned)m;
+			pugi::xml_node mesh = object.append_child("mesh");
+			mesh.append_child("vertices").append_child(pugi::node_comment).set_value(("v" + std::to_string(m)).c_str());
+			mesh.append_child("triangles").append_child(pugi::node_comment).set_value(("t" + std::to_string(m)).c_str());
+			build.append_child("item").append_attribute("objectid") = (unsigned)m + 2;
+		}
+
+		std::string text = Print(types);
+		m_zip.Add("[Content_Types].xml", text.data(), text.size(), Level);
+		text = Print(rels);
+		m_zip.Add("_rels/.rels", text.data(), text.size(), Level);
+
+		text = Print(doc);
+		m_zip.Begin(ModelPart, Level);
+		size_t at = 0;
+		Deflated piece;
+		for (size_t m = 0; m < m_materials.size() && m_error.empty(); m++) {
+			if (m_materials[m].Triangles == 0)
+				continue;
+			for (int kind = 0; kind < 2 && m_error.empty(); kind++) {
+				std::string marker = (kind == 0 ? "<!--v" : "<!--t") + std::to_string(m) + "-->";
+				size_t found = text.find(marker, at);
+				m_zip.Write(text.data() + at, found - at);
+				at = found + marker.size();
+				for (const Piece& p : kind == 0 ? m_materials[m].VertexPieces : m_materials[m].TrianglePieces) {
+					piece.Data.resize(p.CompressedSize);
+					piece.Size = p.Size;
+					piece.Crc = p.Crc;
+					if (fseek64(m_spool, (int64_t)p.Offset, SEEK_SET) != 0 || fread(piece.Data.data(), 1, piece.Data.size(), m_spool) != piece.Data.size()) {
+						Fail("failed to read the temporary file");
+						break;
+					}
+					m_zip.WriteDeflated(piece);
+				}
+			}
+		}
+		m_zip.Write(text.data() + at, text.size() - at);
+		m_zip.End();
+
+		fclose(m_spool);
+		m_spool = nullptr;
+		std::string zipErr;
+		if (!m_zip.Close(zipErr) && m_error.empty())
+			m_error = zipErr;
+		if (!m_error.empty()) {
+			err = m_error;
+			return false;
+		}
+		return true;
+	}
+
+	bool WriteThreeMf(Mesher mesher, const Model& model, const MeshSettings& settings, const std::string& filename, MeshStats& stats, std::string& err)
+	{
+		ThreeMfWriter writer(settings.Threads);
+		if (!writer.Open(filename, model, err))
+			return false;
+
+		auto consume = [&](int m, const MeshPart& part) {
+			return writer.Add(m, part);
+		};
+		bool ok = settings.MaxError > 0.0f ? Decimate(mesher, model, settings, consume, stats, err) : mesher(model, settings, consume, err);
+
+		std::string writeErr;
+		if (!writer.Close(writeErr) && err.empty()) {
+			err = writeErr;
+			ok = false;
+		}
+		int materials = (int)model.Materials.size();
+		stats.Triangles.assign(materials, 0);
+		stats.Vertices.assign(materials, 0);
+		for (int m = 0; m < materials; m++) {
+			stats.Triangles[m] = writer.GetTriangleCount(m);
+			stats.Vertices[m] = writer.GetVertexCount(m);
+		}
+		if (!ok)
+			remove(filename.c_str());
+		return ok;
+	}
+}
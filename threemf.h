@@ -0,0 +1,89 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "mesher.h"
+#include "model.h"
+#include "threadpool.h"
+#include "zip.h"
+
+namespace irmf
+{
+	// ThreeMfWriter writes the meshes of a model's materials to a 3MF
+	// package: one object per material, named after it and printed with a
+	// base material of the same name. Parts are welded as MeshWriter welds
+	// PLY parts, then formatted as XML and deflated on worker threads while
+	// the next ones are meshed; the compressed pieces are spooled to a
+	// temporary file and chained into the package's model part by Close.
+	class ThreeMfWriter
+	{
+	public:
+		// threads <= 0 uses one per hardware thread
+		ThreeMfWriter(int threads = 0);
+		~ThreeMfWriter();
+
+		bool Open(const std::string& filename, const Model& model, std::string& err);
+		bool Add(int material, const MeshPart& part);
+		// Close writes the package. Returns false, with err set, if this or
+		// any earlier write failed.
+		bool Close(std::string& err);
+
+		inline uint64_t GetVertexCount(int material) const { return m_materials[material].Vertices; }
+		inline uint64_t GetTriangleCount(int material) const { return m_materials[material].Triangles; }
+
+	private:
+		// Piece is a deflated piece of the model part in the spool file
+		struct Piece
+		{
+			uint64_t Offset, CompressedSize, Size;
+			uint32_t Crc;
+		};
+
+		struct Material
+		{
+			std::string Name;
+			uint64_t Vertices, Triangles;
+			std::unordered_map<uint32_t, uint32_t> Boundary; // key -> vertex, from the previous part
+			std::deque<Piece> VertexPieces, TrianglePieces;  // in order; filled in by the workers
+		};
+
+		struct Job
+		{
+			std::vector<float> Positions;
+			std::vector<uint32_t> Triangles;
+			Piece* Target;
+		};
+
+		void Submit(const std::shared_ptr<Job>& job);
+		void Run(Job& job, int worker);
+		bool Fail(const std::string& err);
+
+		ThreadPool m_pool;
+		ZipWriter m_zip;
+		std::string m_filename;
+		json11::Json m_info;
+		std::vector<Material> m_materials;
+		std::vector<uint32_t> m_remap;
+
+		FILE* m_spool;
+		uint64_t m_spoolSize;
+		std::vector<std::string> m_text;     // per worker
+		std::vector<Deflated> m_deflated;    // per worker
+
+		std::mutex m_mutex;
+		std::condition_variable m_done;
+		int m_inFlight;
+		std::string m_error;
+	};
+
+	// WriteThreeMf meshes every material of the model with mesher, in a
+	// single pass over the model, into the 3MF package filename. Nothing is
+	// left behind on failure.
+	bool WriteThreeMf(Mesher mesher, const Model& model, const MeshSettings& settings, const std::string& filename, MeshStats& stats, std::string& err);
+}
@@ -0,0 +1,614 @@
+#include "vdb.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <set>
+#include <zlib.h>
+#include "sampler.h"
+#include "threadpool.h"
+
+#ifdef _WIN32
+#define fseek64 _fseeki64
+#else
+#define fseek64 fseeko
+#endif
+
+namespace irmf
+{
+	namespace
+	{
+		// the tree is a root over internal nodes of 32^3 internal nodes of
+		// 16^3 leaves of 8^3 voxels; a node's children and values are in X,
+		// then Y, then Z order (Z fastest)
+		const int LeafEdge = 8;
+		const int LeafVoxels = LeafEdge * LeafEdge * LeafEdge;
+		const int NodeEdge = 16;   // leaves per lower internal node
+		const int NodeVoxels = LeafEdge * NodeEdge;
+		const int NodeSlots = NodeEdge * NodeEdge * NodeEdge;
+		const int UpperEdge = 32;  // lower nodes per upper internal node
+		const int UpperSlots = UpperEdge * UpperEdge * UpperEdge;
+
+		const int64_t Magic = 0x56444220;
+		const uint32_t FileVersion = 224;  // multipass I/O
+		const uint32_t LibraryVersion[2] = { 8, 0 };
+		const uint32_t CompressZip = 0x1;
+		const uint32_t CompressActiveMask = 0x2;
+		const char NoMaskOrInactiveValues = 0; // inactive values are the background
+
+		enum class State : uint8_t
+		{
+			Empty,
+			Tile,
+			Child
+		};
+
+		inline void Append(std::vector<uint8_t>& out, const void* data, size_t size)
+		{
+			out.insert(out.end(), (const uint8_t*)data, (const uint8_t*)data + size);
+		}
+
+		inline void SetBit(uint64_t* mask, int n)
+		{
+			mask[n >> 6] |= 1ull << (n & 63);
+		}
+
+		inline bool GetBit(const uint64_t* mask, int n)
+		{
+			return (mask[n >> 6] >> (n & 63)) & 1;
+		}
+
+		// AppendValues writes node values as OpenVDB's writeData does: raw,
+		// or zlib-compressed with the size in front (negated if compressing
+		// did not pay off and the values are raw after all)
+		void AppendValues(std::vector<uint8_t>& out, const float* values, size_t count, bool zip, std::vector<uint8_t>& scratch)
+		{
+			size_t bytes = count * sizeof(float);
+			if (!zip) {
+				Append(out, values, bytes);
+				return;
+			}
+			uLongf size = compressBound((uLong)bytes);
+			scratch.resize(size);
+			int64_t stored;
+			if (compress2(scratch.data(), &size, (const Bytef*)values, (uLong)bytes, Z_DEFAULT_COMPRESSION) == Z_OK && size < bytes) {
+				stored = (int64_t)size;
+				Append(out, &stored, 8);
+				Append(out, scratch.data(), size);
+			} else {
+				stored = -(int64_t)bytes;
+				Append(out, &stored, 8);
+				Append(out, values, bytes);
+			}
+		}
+
+		// Output writes the file, counting bytes for the grid offsets
+		struct Output
+		{
+			FILE* File;
+			uint64_t Offset;
+			bool Ok;
+
+			void Write(const void* data, size_t size)
+			{
+				if (Ok && size > 0 && fwrite(data, 1, size, File) != size)
+					Ok = false;
+				Offset += size;
+			}
+
+			template <typename T>
+			void Put(T value)
+			{
+				Write(&value, sizeof(value));
+			}
+
+			void String(const std::string& s)
+			{
+				Put((uint32_t)s.size());
+				Write(s.data(), s.size());
+			}
+
+			void Meta(const std::string& name, const std::string& type, const void* value, uint32_t size)
+			{
+				String(name);
+				String(type);
+				Put(size);
+				Write(value, size);
+			}
+		};
+
+		std::string MakeUuid()
+		{
+			std::random_device device;
+			std::mt19937_64 random(((uint64_t)device() << 32) ^ device());
+			uint8_t bytes[16];
+			for (int i = 0; i < 16; i++)
+				bytes[i] = (uint8_t)random();
+			bytes[6] = (bytes[6] & 0x0f) | 0x40; // version 4
+			bytes[8] = (bytes[8] & 0x3f) | 0x80;
+			char uuid[37];
+			char* out = uuid;
+			for (int i = 0; i < 16; i++) {
+				if (i == 4 || i == 6 || i == 8 || i == 10)
+					*out++ = '-';
+				out += snprintf(out, 3, "%02x", bytes[i]);
+			}
+			return std::string(uuid, 36);
+		}
+	}
+
+	bool WriteVdb(const Model& model, const VdbSettings& settings, const std::string& filename, VdbStats& stats, std::string& err)
+	{
+		Grid grid;
+		if (!MakeGrid(model, settings.Pitch, settings.LayerHeight, grid, err))
+			return false;
+		int channels = (int)model.Materials.size();
+		int nodes[3], uppers[3];
+		for (int a = 0; a < 3; a++) {
+			nodes[a] = (grid.Size[a] + NodeVoxels - 1) / NodeVoxels;
+			uppers[a] = (nodes[a] + UpperEdge - 1) / UpperEdge;
+		}
+		int nodeCount = nodes[0] * nodes[1] * nodes[2];
+		const bool zip = settings.Zip;
+
+		// Node is a lower internal node of one material, serialized on a
+		// worker: its topology (masks, tile values and leaf masks) and its
+		// leaves' buffers, which go to different parts of the file
+		struct Node
+		{
+			State Kind;
+			float Value; // of a Tile
+			std::vector<uint8_t> Topology, Buffers;
+			uint32_t Leaves, Tiles;
+			uint64_t Voxels;
+			int Min[3], Max[3];
+		};
+		// Placed is a Node once spooled
+		struct Placed
+		{
+			State Kind;
+			float Value;
+			uint32_t Tiles;
+			uint64_t TopologyAt, TopologySize, BuffersAt, BuffersSize;
+		};
+		struct Worker
+		{
+			std::unique_ptr<RowSampler> Sampler;
+			int Span;
+			std::vector<float> Layer;        // 8 planes of the node, channel by channel
+			std::vector<uint64_t> LeafMasks; // per channel and slot
+			std::vector<float> TileValues;   // per channel and slot
+			std::vector<uint64_t> ChildMask, ValueMask; // per channel
+			std::vector<std::vector<uint8_t>> LeafData; // per channel
+			std::vector<size_t> LeafAt, LeafSize; // per channel and slot, in LeafData
+			std::vector<uint8_t> Scratch;
+			std::vector<float> Active;
+		};
+
+		FILE* spool = tmpfile();
+		if (!spool) {
+			err = "failed to create a temporary file";
+			return false;
+		}
+		uint64_t spoolSize = 0;
+		std::vector<Placed> placed((size_t)channels * nodeCount);
+		stats.Voxels.assign(channels, 0);
+		stats.Leaves.assign(channels, 0);
+		stats.Tiles.assign(channels, 0);
+		std::vector<int> bounds(channels * 6);
+		for (int c = 0; c < channels; c++)
+			for (int a = 0; a < 3; a++) {
+				bounds[c * 6 + a] = grid.Size[a];
+				bounds[c * 6 + 3 + a] = -1;
+			}
+
+		ThreadPool pool(settings.Threads);
+		std::vector<Worker> workers(pool.GetThreadCount());
+		int window = 2 * pool.GetThreadCount();
+		std::vector<std::vector<Node>> slots(window, std::vector<Node>(channels));
+		std::atomic<bool> runaway(false);
+		const size_t planeSize = (size_t)NodeVoxels * NodeVoxels;
+		const size_t layerSize = LeafEdge * planeSize;
+
+		auto build = [&](int item, int slot, int w) {
+			Worker& worker = workers[w];
+			if (!worker.Sampler) {
+				worker.Sampler.reset(new RowSampler(model, grid));
+				worker.Span = -1;
+				worker.Layer.resize(channels * layerSize);
+				worker.LeafMasks.resize((size_t)channels * NodeSlots * 8);
+				worker.TileValues.resize((size_t)channels * NodeSlots);
+				worker.ChildMask.resize(channels * NodeSlots / 64);
+				worker.ValueMask.resize(channels * NodeSlots / 64);
+				worker.LeafData.resize(channels);
+				worker.LeafAt.resize((size_t)channels * NodeSlots);
+				worker.LeafSize.resize((size_t)channels * NodeSlots);
+			}
+			int nx = item % nodes[0], ny = item / nodes[0] % nodes[1], nz = item / nodes[0] / nodes[1];
+			int first[3] = { nx * NodeVoxels, ny * NodeVoxels, nz * NodeVoxels }, count[3];
+			for (int a = 0; a < 3; a++)
+				count[a] = std::min(NodeVoxels, grid.Size[a] - first[a]);
+			if (worker.Span != nx) {
+				worker.Sampler->SetSpan(first[0], count[0]);
+				worker.Span = nx;
+			}
+
+			std::vector<Node>& block = slots[slot];
+			std::fill(worker.ChildMask.begin(), worker.ChildMask.end(), 0);
+			std::fill(worker.ValueMask.begin(), worker.ValueMask.end(), 0);
+			for (int c = 0; c < channels; c++) {
+				worker.LeafData[c].clear();
+				Node& node = block[c];
+				node.Leaves = node.Tiles = 0;
+				node.Voxels = 0;
+				for (int a = 0; a < 3; a++) {
+					node.Min[a] = grid.Size[a];
+					node.Max[a] = -1;
+				}
+			}
+
+			// a layer of leaves at a time; cells past the grid stay 0
+			float leaf[LeafVoxels];
+			uint64_t mask[8];
+			for (int lz = 0; lz < NodeEdge && lz * LeafEdge < count[2]; lz++) {
+				std::fill(worker.Layer.begin(), worker.Layer.end(), 0.0f);
+				int planes = std::min(LeafEdge, count[2] - lz * LeafEdge);
+				for (int k = 0; k < planes; k++)
+					for (int j = 0; j < count[1]; j++) {
+						if (!worker.Sampler->Sample(first[1] + j, first[2] + lz * LeafEdge + k)) {
+							runaway = true;
+							return false;
+						}
+						for (int c = 0; c < channels; c++) {
+							const float* values = worker.Sampler->GetValues(c);
+							float* row = &worker.Layer[c * layerSize + k * planeSize + (size_t)j * NodeVoxels];
+							for (int i = 0; i < count[0]; i++) {
+								float v = values[i];
+								row[i] = v > 0.0f ? (v < 1.0f ? v : 1.0f) : 0.0f; // NaN is 0
+							}
+						}
+					}
+
+				for (int c = 0; c < channels; c++) {
+					Node& node = block[c];
+					const float* layer = &worker.Layer[c * layerSize];
+					for (int lx = 0; lx < NodeEdge && lx * LeafEdge < count[0]; lx++)
+						for (int ly = 0; ly < NodeEdge && ly * LeafEdge < count[1]; ly++) {
+							memset(mask, 0, sizeof(mask));
+							int active = 0;
+							for (int x = 0; x < LeafEdge; x++)
+								for (int y = 0; y < LeafEdge; y++)
+									for (int z = 0; z < LeafEdge; z++) {
+										int n = (x << 6) | (y << 3) | z;
+										float v = layer[z * planeSize + (size_t)(ly * LeafEdge + y) * NodeVoxels + lx * LeafEdge + x];
+										leaf[n] = v;
+										if (v > 0.0f) {
+											SetBit(mask, n);
+											active++;
+											int at[3] = { first[0] + lx * LeafEdge + x, first[1] + ly * LeafEdge + y, first[2] + lz * LeafEdge + z };
+											for (int a = 0; a < 3; a++) {
+												node.Min[a] = std::min(node.Min[a], at[a]);
+												node.Max[a] = std::max(node.Max[a], at[a]);
+											}
+										}
+									}
+							if (active == 0)
+								continue;
+							node.Voxels += active;
+							int n = (lx << 8) | (ly << 4) | lz;
+							if (active == LeafVoxels && std::all_of(leaf + 1, leaf + LeafVoxels, [&](float v) { return v == leaf[0]; })) {
+								SetBit(&worker.ValueMask[c * NodeSlots / 64], n);
+								worker.TileValues[(size_t)c * NodeSlots + n] = leaf[0];
+								continue;
+							}
+							SetBit(&worker.ChildMask[c * NodeSlots / 64], n);
+							memcpy(&worker.LeafMasks[((size_t)c * NodeSlots + n) * 8], mask, sizeof(mask));
+							std::vector<uint8_t>& data = worker.LeafData[c];
+							worker.LeafAt[(size_t)c * NodeSlots + n] = data.size();
+							Append(data, mask, sizeof(mask));
+							data.push_back(NoMaskOrInactiveValues);
+							worker.Active.clear();
+							for (int i = 0; i < LeafVoxels; i++)
+								if (leaf[i] > 0.0f)
+									worker.Active.push_back(leaf[i]);
+							AppendValues(data, worker.Active.data(), worker.Active.size(), zip, worker.Scratch);
+							worker.LeafSize[(size_t)c * NodeSlots + n] = data.size() - worker.LeafAt[(size_t)c * NodeSlots + n];
+						}
+				}
+			}
+
+			for (int c = 0; c < channels; c++) {
+				Node& node = block[c];
+				const uint64_t* childMask = &worker.ChildMask[c * NodeSlots / 64];
+				const uint64_t* valueMask = &worker.ValueMask[c * NodeSlots / 64];
+				const float* tiles = &worker.TileValues[(size_t)c * NodeSlots];
+				bool children = false, uniform = true, anyTile = false;
+				float value = 0.0f;
+				for (int n = 0; n < NodeSlots; n++) {
+					children = children || GetBit(childMask, n);
+					if (GetBit(valueMask, n)) {
+						if (!anyTile)
+							value = tiles[n];
+						anyTile = true;
+						uniform = uniform && tiles[n] == value;
+					} else
+						uniform = false;
+				}
+				node.Topology.clear();
+				node.Buffers.clear();
+				node.Value = value;
+				if (!children && !anyTile) {
+					node.Kind = State::Empty;
+					continue;
+				}
+				if (!children && uniform) {
+					node.Kind = State::Tile;
+					node.Tiles = 1;
+					continue;
+				}
+				node.Kind = State::Child;
+				Append(node.Topology, childMask, NodeSlots / 8);
+				Append(node.Topology, valueMask, NodeSlots / 8);
+				node.Topology.push_back(NoMaskOrInactiveValues);
+				worker.Active.clear();
+				for (int n = 0; n < NodeSlots; n++)
+					if (GetBit(valueMask, n))
+						worker.Active.push_back(tiles[n]);
+				node.Tiles = (uint32_t)worker.Active.size();
+				AppendValues(node.Topology, worker.Active.data(), worker.Active.size(), zip, worker.Scratch);
+				// leaves were serialized in sampling order; the file wants
+				// them in slot order
+				const std::vector<uint8_t>& data = worker.LeafData[c];
+				for (int n = 0; n < NodeSlots; n++)
+					if (GetBit(childMask, n)) {
+						size_t slot = (size_t)c * NodeSlots + n;
+						Append(node.Topology, &worker.LeafMasks[slot * 8], 64);
+						Append(node.Buffers, &data[worker.LeafAt[slot]], worker.LeafSize[slot]);
+						node.Leaves++;
+					}
+			}
+			return true;
+		};
+
+		auto spoolNodes = [&](int item, int slot) {
+			std::vector<Node>& block = slots[slot];
+			for (int c = 0; c < channels; c++) {
+				Node& node = block[c];
+				Placed& p = placed[(size_t)c * nodeCount + item];
+				p.Kind = node.Kind;
+				p.Value = node.Value;
+				p.Tiles = node.Tiles;
+				p.TopologyAt = spoolSize;
+				p.TopologySize = node.Topology.size();
+				p.BuffersAt = spoolSize + node.Topology.size();
+				p.BuffersSize = node.Buffers.size();
+				if ((!node.Topology.empty() && fwrite(node.Topology.data(), 1, node.Topology.size(), spool) != node.Topology.size())
+					|| (!node.Buffers.empty() && fwrite(node.Buffers.data(), 1, node.Buffers.size(), spool) != node.Buffers.size()))
+					return false;
+				spoolSize += node.Topology.size() + node.Buffers.size();
+				stats.Voxels[c] += node.Voxels;
+				stats.Leaves[c] += node.Leaves;
+				for (int a = 0; a < 3; a++) {
+					bounds[c * 6 + a] = std::min(bounds[c * 6 + a], node.Min[a]);
+					bounds[c * 6 + 3 + a] = std::max(bounds[c * 6 + 3 + a], node.Max[a]);
+				}
+			}
+			if (settings.Progress && (item + 1) % (nodes[0] * nodes[1]) == 0)
+				settings.Progress((item + 1) / (nodes[0] * nodes[1]), nodes[2]);
+			return true;
+		};
+
+		bool ok = RunOrdered(pool, nodeCount, window, build, spoolNodes);
+		slots.clear();
+		workers.clear();
+		if (runaway)
+			err = "a loop in the model did not terminate";
+		if (!ok) {
+			if (err.empty())
+				err = "failed to write a temporary file (disk full?)";
+			fclose(spool);
+			return false;
+		}
+
+		FILE* file = fopen(filename.c_str(), "wb");
+		if (!file) {
+			fclose(spool);
+			err = "failed to create " + filename;
+			return false;
+		}
+		Output out = { file, 0, true };
+		std::vector<uint8_t> copy, values, scratch;
+		auto copySpool = [&](uint64_t at, uint64_t size) {
+			if (size == 0 || !out.Ok)
+				return;
+			copy.resize((size_t)size);
+			if (fseek64(spool, (int64_t)at, SEEK_SET) != 0 || fread(copy.data(), 1, copy.size(), spool) != copy.size())
+				out.Ok = false;
+			out.Write(copy.data(), copy.size());
+		};
+
+		// header
+		out.Put(Magic);
+		out.Put(FileVersion);
+		out.Put(LibraryVersion[0]);
+		out.Put(LibraryVersion[1]);
+		out.Put((char)1); // has grid offsets
+		std::string uuid = MakeUuid();
+		out.Write(uuid.data(), uuid.size());
+		out.Put((uint32_t)1);
+		const std::string creator = "irmf";
+		out.Meta("creator", "string", creator.data(), (uint32_t)creator.size());
+		out.Put((int32_t)channels);
+
+		const uint32_t compression = CompressActiveMask | (zip ? CompressZip : 0);
+		const std::string compressionName = zip ? "zip + active values" : "active values";
+		std::set<std::string> names;
+		for (int c = 0; c < channels && out.Ok; c++) {
+			const std::string& material = model.Materials[c];
+			std::string name = material;
+			for (int n = 1; names.count(name); n++)
+				name = material + '\x1e' + std::to_string(n);
+			names.insert(name);
+			Placed* lower = &placed[(size_t)c * nodeCount];
+
+			// an upper node is a root tile if all its lower nodes are the
+			// same tile, a child if any is one
+			auto upperState = [&](int ux, int uy, int uz, float& value) {
+				bool any = false, uniform = true;
+				for (int x = 0; x < UpperEdge; x++)
+					for (int y = 0; y < UpperEdge; y++)
+						for (int z = 0; z < UpperEdge; z++) {
+							int gx = ux * UpperEdge + x, gy = uy * UpperEdge + y, gz = uz * UpperEdge + z;
+							if (gx >= nodes[0] || gy >= nodes[1] || gz >= nodes[2]) {
+								uniform = false;
+								continue;
+							}
+							const Placed& p = lower[((size_t)gz * nodes[1] + gy) * nodes[0] + gx];
+							if (p.Kind == State::Empty) {
+								uniform = false;
+								continue;
+							}
+							if (!any)
+								value = p.Value;
+							any = true;
+							uniform = uniform && p.Kind == State::Tile && p.Value == value;
+						}
+				return !any ? State::Empty : uniform ? State::Tile : State::Child;
+			};
+			std::vector<State> upper;
+			std::vector<float> upperValue;
+			uint32_t rootTiles = 0, rootChildren = 0;
+			for (int ux = 0; ux < uppers[0]; ux++)
+				for (int uy = 0; uy < uppers[1]; uy++)
+					for (int uz = 0; uz < uppers[2]; uz++) {
+						float value = 0.0f;
+						upper.push_back(upperState(ux, uy, uz, value));
+						upperValue.push_back(value);
+						rootTiles += upper.back() == State::Tile;
+						rootChildren += upper.back() == State::Child;
+					}
+			auto forUppers = [&](State kind, const std::function<void(int, int, int, float)>& f) {
+				size_t u = 0;
+				for (int ux = 0; ux < uppers[0]; ux++)
+					for (int uy = 0; uy < uppers[1]; uy++)
+						for (int uz = 0; uz < uppers[2]; uz++, u++)
+							if (upper[u] == kind)
+								f(ux, uy, uz, upperValue[u]);
+			};
+			auto forLowers = [&](int ux, int uy, int uz, const std::function<void(int, const Placed*)>& f) {
+				for (int x = 0; x < UpperEdge; x++)
+					for (int y = 0; y < UpperEdge; y++)
+						for (int z = 0; z < UpperEdge; z++) {
+							int gx = ux * UpperEdge + x, gy = uy * UpperEdge + y, gz = uz * UpperEdge + z;
+							bool inside = gx < nodes[0] && gy < nodes[1] && gz < nodes[2];
+							f((x << 10) | (y << 5) | z, inside ? &lower[((size_t)gz * nodes[1] + gy) * nodes[0] + gx] : nullptr);
+						}
+			};
+
+			// grid descriptor, with its offsets filled in at the end
+			out.String(name);
+			out.String("Tree_float_5_4_3");
+			out.String(""); // not an instance
+			uint64_t offsetsAt = out.Offset;
+			int64_t offsets[3] = { 0, 0, 0 };
+			out.Write(offsets, sizeof(offsets));
+			offsets[0] = (int64_t)out.Offset;
+			out.Put(compression);
+
+			// metadata, in name order as OpenVDB keeps it
+			const int* b = &bounds[c * 6];
+			bool empty = stats.Voxels[c] == 0;
+			out.Put((uint32_t)(empty ? 5 : 7));
+			const std::string gridClass = "fog volume";
+			out.Meta("class", "string", gridClass.data(), (uint32_t)gridClass.size());
+			if (!empty) {
+				out.Meta("file_bbox_max", "vec3i", b + 3, 12);
+				out.Meta("file_bbox_min", "vec3i", b, 12);
+			}
+			out.Meta("file_compression", "string", compressionName.data(), (uint32_t)compressionName.size());
+			int64_t voxels = (int64_t)stats.Voxels[c];
+			out.Meta("file_voxel_count", "int64", &voxels, 8);
+			char half = 0;
+			out.Meta("is_saved_as_half_float", "bool", &half, 1);
+			out.Meta("name", "string", material.data(), (uint32_t)material.size());
+
+			// index (i, j, k) is the center of cell (i, j, k)
+			out.String("ScaleTranslateMap");
+			double map[6][3];
+			for (int a = 0; a < 3; a++) {
+				double pitch = grid.Pitch[a];
+				map[0][a] = grid.Center(a, 0);  // translation
+				map[1][a] = pitch;              // scale
+				map[2][a] = pitch;              // voxel size
+				map[3][a] = 1.0 / pitch;        // inverse scale
+				map[4][a] = 1.0 / (pitch * pitch);
+				map[5][a] = 0.5 / pitch;
+			}
+			out.Write(map, sizeof(map));
+
+			// topology: the root's tiles and children, each upper node's
+			// masks and tiles followed by its lower nodes'
+			out.Put((int32_t)1); // buffer count
+			out.Put(0.0f);       // background
+			out.Put(rootTiles);
+			out.Put(rootChildren);
+			forUppers(State::Tile, [&](int ux, int uy, int uz, float value) {
+				int32_t origin[3] = { ux * UpperEdge * NodeVoxels, uy * UpperEdge * NodeVoxels, uz * UpperEdge * NodeVoxels };
+				out.Write(origin, sizeof(origin));
+				out.Put(value);
+				out.Put((char)1); // active
+				stats.Tiles[c]++;
+			});
+			forUppers(State::Child, [&](int ux, int uy, int uz, float) {
+				int32_t origin[3] = { ux * UpperEdge * NodeVoxels, uy * UpperEdge * NodeVoxels, uz * UpperEdge * NodeVoxels };
+				out.Write(origin, sizeof(origin));
+				std::vector<uint64_t> childMask(UpperSlots / 64), valueMask(UpperSlots / 64);
+				std::vector<float> tiles;
+				forLowers(ux, uy, uz, [&](int n, const Placed* p) {
+					if (p && p->Kind == State::Child) {
+						SetBit(childMask.data(), n);
+						stats.Tiles[c] += p->Tiles;
+					} else if (p && p->Kind == State::Tile) {
+						SetBit(valueMask.data(), n);
+						tiles.push_back(p->Value);
+						stats.Tiles[c]++;
+					}
+				});
+				out.Write(childMask.data(), UpperSlots / 8);
+				out.Write(valueMask.data(), UpperSlots / 8);
+				values.clear();
+				values.push_back(NoMaskOrInactiveValues);
+				AppendValues(values, tiles.data(), tiles.size(), zip, scratch);
+				out.Write(values.data(), values.size());
+				forLowers(ux, uy, uz, [&](int, const Placed* p) {
+					if (p && p->Kind == State::Child)
+						copySpool(p->TopologyAt, p->TopologySize);
+				});
+			});
+
+			// buffers: every leaf, in the same order
+			offsets[1] = (int64_t)out.Offset;
+			forUppers(State::Child, [&](int ux, int uy, int uz, float) {
+				forLowers(ux, uy, uz, [&](int, const Placed* p) {
+					if (p && p->Kind == State::Child)
+						copySpool(p->BuffersAt, p->BuffersSize);
+				});
+			});
+			offsets[2] = (int64_t)out.Offset;
+			if (out.Ok)
+				out.Ok = fseek64(file, (int64_t)offsetsAt, SEEK_SET) == 0 && fwrite(offsets, sizeof(offsets), 1, file) == 1
+					&& fseek64(file, (int64_t)out.Offset, SEEK_SET) == 0;
+		}
+		fclose(spool);
+		ok = out.Ok;
+		if (fclose(file) != 0)
+			ok = false;
+		if (!ok) {
+			err = "failed to write " + filename + " (disk full?)";
+			remove(filename.c_str());
+		}
+		return ok;
+	}
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include "model.h"
+
+namespace irmf
+{
+	// VdbSettings controls the resolution, compression and parallelism of
+	// WriteVdb.
+	struct VdbSettings
+	{
+		float Pitch;       // voxel size in X and Y, in model units
+		float LayerHeight; // <= 0: same as Pitch
+		bool Zip;          // zlib-compress the node values
+		int Threads;       // <= 0: one per hardware thread
+
+		// Progress is called on the calling thread after each slab of
+		// internal nodes is sampled, with the number done and the total
+		std::function<void(int, int)> Progress;
+
+		VdbSettings()
+			: Pitch(0.1f)
+			, LayerHeight(0.0f)
+			, Zip(false)
+			, Threads(0)
+		{
+		}
+	};
+
+	// VdbStats is what WriteVdb stored per material.
+	struct VdbStats
+	{
+		std::vector<uint64_t> Voxels; // active voxels, including those of tiles
+		std::vector<uint64_t> Leaves; // 8^3 leaf nodes
+		std::vector<uint64_t> Tiles;  // uniform nodes stored as a single value
+	};
+
+	// WriteVdb writes the model as an OpenVDB file with one FloatGrid
+	// (Tree_float_5_4_3) per material, named after it, holding the material
+	// values clamped to [0, 1] as a fog volume: voxels above 0 are active
+	// and the background is 0. The transform puts voxel centers where they
+	// were sampled, in model units.
+	//
+	// Each 128^3 internal node is sampled and built on a worker: leaves
+	// with no active voxels are dropped, uniform leaves and nodes become
+	// tiles, and the rest are serialized with only their active values
+	// (zipped if asked), then spooled to a temporary file in order. The
+	// top of the tree is put together from the spooled nodes once all are
+	// done, so memory holds a few nodes per thread however large the grid.
+	bool WriteVdb(const Model& model, const VdbSettings& settings, const std::string& filename, VdbStats& stats, std::string& err);
+}
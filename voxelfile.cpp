@@ -0,0 +1,393 @@
+#include "voxelfile.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include "threadpool.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#define fseek64 _fseeki64
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define fseek64 fseeko
+#endif
+
+namespace irmf
+{
+	namespace
+	{
+		const char Magic[8] = { 'I', 'R', 'M', 'F', 'V', 'O', 'X', '1' };
+		const uint64_t Page = 4096;
+		const int SuperVoxels = VoxelFile::BrickEdge * VoxelFile::SuperEdge;
+		const int BricksPerSuper = VoxelFile::SuperEdge * VoxelFile::SuperEdge * VoxelFile::SuperEdge;
+		const size_t BrickBytes = VoxelFile::BrickEdge * VoxelFile::BrickEdge * VoxelFile::BrickEdge;
+
+		struct Header
+		{
+			char Magic[8];
+			uint32_t Version;
+			uint32_t Channels;
+			int32_t Size[3];
+			float Min[3];
+			float Pitch[3];
+			uint32_t BrickEdge, SuperEdge;
+			uint32_t Reserved;
+			uint64_t TopOffset;
+			uint64_t NamesOffset, NamesSize; // NUL terminated material names
+			uint64_t FileSize;
+		};
+
+		inline uint64_t RoundUp(uint64_t v)
+		{
+			return (v + Page - 1) / Page * Page;
+		}
+	}
+
+	VoxelFile::VoxelFile()
+		: m_channels(0)
+		, m_supers{ 0, 0, 0 }
+		, m_superCount(0)
+		, m_data(nullptr)
+		, m_top(nullptr)
+		, m_size(0)
+#ifdef _WIN32
+		, m_file(INVALID_HANDLE_VALUE)
+		, m_mapping(nullptr)
+#endif
+	{
+	}
+
+	VoxelFile::~VoxelFile()
+	{
+		Close();
+	}
+
+	void VoxelFile::Close()
+	{
+#ifdef _WIN32
+		if (m_data)
+			UnmapViewOfFile(m_data);
+		if (m_mapping)
+			CloseHandle(m_mapping);
+		if (m_file != INVALID_HANDLE_VALUE)
+			CloseHandle(m_file);
+		m_mapping = nullptr;
+		m_file = INVALID_HANDLE_VALUE;
+#else
+		if (m_data)
+			munmap((void*)m_data, m_size);
+#endif
+		m_data = nullptr;
+		m_top = nullptr;
+		m_size = 0;
+		m_channels = 0;
+		m_materials.clear();
+	}
+
+	bool VoxelFile::Open(const std::string& filename, std::string& err)
+	{
+		Close();
+#ifdef _WIN32
+		m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		LARGE_INTEGER size;
+		if (m_file == INVALID_HANDLE_VALUE || !GetFileSizeEx((HANDLE)m_file, &size)) {
+			err = "failed to open " + filename;
+			Close();
+			return false;
+		}
+		m_size = (uint64_t)size.QuadPart;
+		if (m_size >= sizeof(Header)) {
+			m_mapping = CreateFileMappingA((HANDLE)m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (m_mapping)
+				m_data = (const uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+		}
+#else
+		int file = open(filename.c_str(), O_RDONLY);
+		struct stat info;
+		if (file < 0 || fstat(file, &info) != 0) {
+			if (file >= 0)
+				close(file);
+			err = "failed to open " + filename;
+			return false;
+		}
+		m_size = (uint64_t)info.st_size;
+		if (m_size >= sizeof(Header)) {
+			void* data = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, file, 0);
+			m_data = data == MAP_FAILED ? nullptr : (const uint8_t*)data;
+		}
+		close(file);
+#endif
+		if (!m_data) {
+			err = m_size < sizeof(Header) ? filename + " is not an irmfvox file" : "failed to map " + filename;
+			Close();
+			return false;
+		}
+
+		// everything the lookups will follow is checked up front
+		Header header;
+		memcpy(&header, m_data, sizeof(header));
+		bool ok = memcmp(header.Magic, Magic, sizeof(Magic)) == 0 && header.Version == 1 && header.Channels > 0
+			&& header.BrickEdge == BrickEdge && header.SuperEdge == SuperEdge && header.FileSize == m_size;
+		m_channels = (int)header.Channels;
+		m_superCount = 1;
+		for (int a = 0; a < 3 && ok; a++) {
+			ok = header.Size[a] > 0;
+			m_grid.Size[a] = header.Size[a];
+			m_grid.Min[a] = header.Min[a];
+			m_grid.Pitch[a] = header.Pitch[a];
+			m_supers[a] = (header.Size[a] + SuperVoxels - 1) / SuperVoxels;
+			m_superCount *= m_supers[a];
+		}
+		uint64_t topSize = (uint64_t)m_channels * m_superCount * 8;
+		ok = ok && header.TopOffset % 8 == 0 && header.TopOffset + topSize <= m_size
+			&& header.NamesOffset + header.NamesSize <= m_size;
+		auto valid = [this](uint64_t entry) {
+			return (entry & Uniform) ? entry <= (Uniform | 0xff) : entry % Page == 0 && entry >= Page && entry + Page <= m_size;
+		};
+		if (ok) {
+			m_top = (const uint64_t*)(m_data + header.TopOffset);
+			for (size_t s = 0; s < (size_t)m_channels * m_superCount && ok; s++) {
+				ok = valid(m_top[s]);
+				if (ok && !(m_top[s] & Uniform)) {
+					const uint64_t* table = (const uint64_t*)(m_data + m_top[s]);
+					for (int b = 0; b < BricksPerSuper && ok; b++)
+						ok = valid(table[b]);
+				}
+			}
+		}
+		if (ok) {
+			const char* names = (const char*)m_data + header.NamesOffset;
+			for (uint64_t at = 0; at < header.NamesSize;) {
+				const char* end = (const char*)memchr(names + at, 0, header.NamesSize - at);
+				if (!end)
+					break;
+				m_materials.emplace_back(names + at, end);
+				at = end - names + 1;
+			}
+			ok = (int)m_materials.size() == m_channels;
+		}
+		if (!ok) {
+			err = filename + " is not a valid irmfvox file";
+			Close();
+			return false;
+		}
+		return true;
+	}
+
+	const uint8_t* VoxelFile::Brick(int c, int x, int y, int z, uint8_t& value) const
+	{
+		uint64_t entry = m_top[(size_t)c * m_superCount + ((size_t)(z / SuperEdge) * m_supers[1] + y / SuperEdge) * m_supers[0] + x / SuperEdge];
+		if (!(entry & Uniform)) {
+			const uint64_t* table = (const uint64_t*)(m_data + entry);
+			entry = table[((z % SuperEdge) * SuperEdge + y % SuperEdge) * SuperEdge + x % SuperEdge];
+			if (!(entry & Uniform))
+				return m_data + entry;
+		}
+		value = (uint8_t)entry;
+		return nullptr;
+	}
+
+	bool VoxelFile::ReadRow(int j, int k, float* values)
+	{
+		int size = m_grid.Size[0];
+		int bricks = (size + BrickEdge - 1) / BrickEdge;
+		size_t at = ((size_t)(k % BrickEdge) * BrickEdge + j % BrickEdge) * BrickEdge;
+		for (int c = 0; c < m_channels; c++) {
+			float* out = values + (size_t)c * size;
+			for (int x = 0; x < bricks; x++) {
+				int i0 = x * BrickEdge, i1 = std::min(i0 + BrickEdge, size);
+				uint8_t value;
+				const uint8_t* data = Brick(c, x, j / BrickEdge, k / BrickEdge, value);
+				if (!data)
+					std::fill(out + i0, out + i1, value * (1.0f / 255.0f));
+				else
+					for (int i = i0; i < i1; i++)
+						out[i] = data[at + i - i0] * (1.0f / 255.0f);
+			}
+		}
+		return true;
+	}
+
+	bool WriteVoxelFile(const Model& model, const VoxelFileSettings& settings, const std::string& filename, std::string& err)
+	{
+		Grid grid;
+		if (!MakeGrid(model, settings.Pitch, settings.LayerHeight, grid, err))
+			return false;
+		int channels = (int)model.Materials.size();
+		int supers[3];
+		size_t superCount = 1;
+		for (int a = 0; a < 3; a++) {
+			supers[a] = (grid.Size[a] + SuperVoxels - 1) / SuperVoxels;
+			superCount *= supers[a];
+		}
+
+		FILE* file = fopen(filename.c_str(), "wb");
+		if (!file) {
+			err = "failed to create " + filename;
+			return false;
+		}
+		// the header and top index are written last, in front of the supers
+		std::vector<uint64_t> top((size_t)channels * superCount);
+		uint64_t offset = Page + RoundUp(top.size() * 8);
+		bool ok = fseek64(file, (int64_t)offset, SEEK_SET) == 0;
+
+		// Super is a super packed on a worker: per channel a uniform value,
+		// or a table followed by its bricks, with offsets from the start of
+		// Data until it is placed in the file
+		struct Super
+		{
+			std::vector<uint8_t> Data;
+			std::vector<uint64_t> Top;   // per channel
+			std::vector<size_t> Tables;  // offsets of the tables in Data
+		};
+		struct Worker
+		{
+			std::unique_ptr<RowSampler> Sampler;
+			int Span;
+			std::vector<uint8_t> Voxels; // the super, channel by channel
+		};
+		ThreadPool pool(settings.Threads);
+		std::vector<Worker> workers(pool.GetThreadCount());
+		int window = 2 * pool.GetThreadCount();
+		std::vector<Super> slots(window);
+		std::atomic<bool> runaway(false);
+		const size_t superBytes = (size_t)SuperVoxels * SuperVoxels * SuperVoxels;
+		const int edge = VoxelFile::BrickEdge;
+
+		auto pack = [&](int item, int slot, int w) {
+			Worker& worker = workers[w];
+			if (!worker.Sampler) {
+				worker.Sampler.reset(new RowSampler(model, grid));
+				worker.Span = -1;
+				worker.Voxels.resize(channels * superBytes);
+			}
+			int sx = item % supers[0], sy = item / supers[0] % supers[1], sz = item / supers[0] / supers[1];
+			int first[3] = { sx * SuperVoxels, sy * SuperVoxels, sz * SuperVoxels }, count[3];
+			for (int a = 0; a < 3; a++)
+				count[a] = std::min(SuperVoxels, grid.Size[a] - first[a]);
+			if (worker.Span != sx) {
+				worker.Sampler->SetSpan(first[0], count[0]);
+				worker.Span = sx;
+			}
+
+			// cells past the grid stay 0
+			std::fill(worker.Voxels.begin(), worker.Voxels.end(), 0);
+			for (int k = 0; k < count[2]; k++)
+				for (int j = 0; j < count[1]; j++) {
+					if (!worker.Sampler->Sample(first[1] + j, first[2] + k)) {
+						runaway = true;
+						return false;
+					}
+					for (int c = 0; c < channels; c++) {
+						const float* values = worker.Sampler->GetValues(c);
+						uint8_t* row = &worker.Voxels[c * superBytes + ((size_t)k * SuperVoxels + j) * SuperVoxels];
+						for (int i = 0; i < count[0]; i++)
+							row[i] = ToByte(values[i]);
+					}
+				}
+
+			Super& super = slots[slot];
+			super.Data.clear();
+			super.Top.assign(channels, 0);
+			super.Tables.clear();
+			uint64_t table[BricksPerSuper];
+			uint8_t brick[BrickBytes];
+			std::vector<uint8_t> bricks;
+			for (int c = 0; c < channels; c++) {
+				const uint8_t* voxels = &worker.Voxels[c * superBytes];
+				bricks.clear();
+				bool uniform = true;
+				for (int b = 0; b < BricksPerSuper; b++) {
+					int bx = b % VoxelFile::SuperEdge, by = b / VoxelFile::SuperEdge % VoxelFile::SuperEdge, bz = b / VoxelFile::SuperEdge / VoxelFile::SuperEdge;
+					uint8_t* out = brick;
+					for (int k = 0; k < edge; k++)
+						for (int j = 0; j < edge; j++, out += edge)
+							memcpy(out, voxels + ((size_t)(bz * edge + k) * SuperVoxels + by * edge + j) * SuperVoxels + bx * edge, edge);
+					if (std::all_of(brick + 1, brick + BrickBytes, [&](uint8_t v) { return v == brick[0]; }))
+						table[b] = VoxelFile::Uniform | brick[0];
+					else {
+						table[b] = Page + bricks.size(); // from the table
+						bricks.insert(bricks.end(), brick, brick + BrickBytes);
+					}
+					uniform = uniform && table[b] == table[0];
+				}
+				if (uniform && (table[0] & VoxelFile::Uniform)) {
+					super.Top[c] = table[0];
+					continue;
+				}
+				size_t at = super.Data.size();
+				super.Top[c] = at;
+				super.Tables.push_back(at);
+				for (int b = 0; b < BricksPerSuper; b++)
+					if (!(table[b] & VoxelFile::Uniform))
+						table[b] += at;
+				super.Data.insert(super.Data.end(), (const uint8_t*)table, (const uint8_t*)(table + BricksPerSuper));
+				super.Data.insert(super.Data.end(), bricks.begin(), bricks.end());
+			}
+			return true;
+		};
+
+		auto write = [&](int item, int slot) {
+			Super& super = slots[slot];
+			// offsets in Data become offsets in the file
+			for (size_t at : super.Tables) {
+				uint64_t* table = (uint64_t*)&super.Data[at];
+				for (int b = 0; b < BricksPerSuper; b++)
+					if (!(table[b] & VoxelFile::Uniform))
+						table[b] += offset;
+			}
+			for (int c = 0; c < channels; c++)
+				top[(size_t)c * superCount + item] = (super.Top[c] & VoxelFile::Uniform) ? super.Top[c] : super.Top[c] + offset;
+			if (!super.Data.empty() && fwrite(super.Data.data(), 1, super.Data.size(), file) != super.Data.size())
+				return false;
+			offset += super.Data.size();
+			if (settings.Progress && (item + 1) % (supers[0] * supers[1]) == 0)
+				settings.Progress((item + 1) / (supers[0] * supers[1]), supers[2]);
+			return true;
+		};
+
+		ok = ok && RunOrdered(pool, (int)superCount, window, pack, write);
+		if (runaway)
+			err = "a loop in the model did not terminate";
+
+		if (ok) {
+			std::string names;
+			for (const std::string& name : model.Materials)
+				names += name + '\0';
+			Header header;
+			memset(&header, 0, sizeof(header));
+			memcpy(header.Magic, Magic, sizeof(Magic));
+			header.Version = 1;
+			header.Channels = channels;
+			for (int a = 0; a < 3; a++) {
+				header.Size[a] = grid.Size[a];
+				header.Min[a] = grid.Min[a];
+				header.Pitch[a] = grid.Pitch[a];
+			}
+			header.BrickEdge = VoxelFile::BrickEdge;
+			header.SuperEdge = VoxelFile::SuperEdge;
+			header.TopOffset = Page;
+			header.NamesOffset = offset;
+			header.NamesSize = names.size();
+			header.FileSize = offset + names.size();
+			ok = fwrite(names.data(), 1, names.size(), file) == names.size()
+				&& fseek64(file, 0, SEEK_SET) == 0
+				&& fwrite(&header, sizeof(header), 1, file) == 1
+				&& fseek64(file, (int64_t)Page, SEEK_SET) == 0
+				&& fwrite(top.data(), 8, top.size(), file) == top.size();
+		}
+		if (fclose(file) != 0)
+			ok = false;
+		if (!ok) {
+			if (err.empty())
+				err = "failed to write " + filename + " (disk full?)";
+			remove(filename.c_str());
+		}
+		return ok;
+	}
+}
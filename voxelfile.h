@@ -0,0 +1,98 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+#include "model.h"
+#include "sampler.h"
+
+namespace irmf
+{
+	// VoxelFile reads an .irmfvox file: a Grid of byte voxels (ToByte of the
+	// material values, one channel per material) kept sparse.
+	//
+	// Each channel is cut into bricks of 16^3 voxels and the bricks into
+	// supers of 8^3 bricks. A channel's top index has an entry per super,
+	// which either is a uniform value or points to the super's table, an
+	// entry per brick that either is a uniform value or points to the
+	// brick's 4 KB of voxels (x fastest); only bricks that are not uniform
+	// are stored. Entries are 64-bit: bit 63 set and the value in the low
+	// byte, or the offset of the table or brick in the file. The file is
+	// little-endian, page aligned and mapped read-only as a whole, so a
+	// voxel is two lookups away.
+	class VoxelFile : public VoxelSource
+	{
+	public:
+		static const int BrickEdge = 16;
+		static const int SuperEdge = 8; // in bricks
+
+		VoxelFile();
+		~VoxelFile();
+
+		bool Open(const std::string& filename, std::string& err);
+		void Close();
+
+		const Grid& GetGrid() const override { return m_grid; }
+		int GetChannelCount() const override { return m_channels; }
+		inline const std::vector<std::string>& GetMaterials() const { return m_materials; }
+		bool ReadRow(int j, int k, float* values) override;
+
+		// Get returns voxel (i, j, k) of channel c, which must be in the grid.
+		inline uint8_t Get(int c, int i, int j, int k) const
+		{
+			const int brick = BrickEdge, super = BrickEdge * SuperEdge;
+			uint64_t entry = m_top[(size_t)c * m_superCount + ((size_t)(k / super) * m_supers[1] + j / super) * m_supers[0] + i / super];
+			if (entry & Uniform)
+				return (uint8_t)entry;
+			const uint64_t* table = (const uint64_t*)(m_data + entry);
+			entry = table[((k / brick % SuperEdge) * SuperEdge + j / brick % SuperEdge) * SuperEdge + i / brick % SuperEdge];
+			if (entry & Uniform)
+				return (uint8_t)entry;
+			return m_data[entry + ((k % brick) * brick + j % brick) * brick + i % brick];
+		}
+
+		static const uint64_t Uniform = 1ull << 63;
+
+	private:
+		const uint8_t* Brick(int c, int x, int y, int z, uint8_t& value) const;
+
+		Grid m_grid;
+		int m_channels;
+		int m_supers[3];
+		size_t m_superCount;
+		std::vector<std::string> m_materials;
+		const uint8_t* m_data;
+		const uint64_t* m_top;
+		uint64_t m_size;
+#ifdef _WIN32
+		void* m_file;
+		void* m_mapping;
+#endif
+	};
+
+	// VoxelFileSettings controls the resolution and parallelism of
+	// WriteVoxelFile.
+	struct VoxelFileSettings
+	{
+		float Pitch;       // voxel size in X and Y, in model units
+		float LayerHeight; // <= 0: same as Pitch
+		int Threads;       // <= 0: one per hardware thread
+
+		// Progress is called on the calling thread after each slab of
+		// supers is written, with the number done and the total
+		std::function<void(int, int)> Progress;
+
+		VoxelFileSettings()
+			: Pitch(0.1f)
+			, LayerHeight(0.0f)
+			, Threads(0)
+		{
+		}
+	};
+
+	// WriteVoxelFile samples the model into an .irmfvox file. Supers are
+	// sampled, checked for uniform bricks and packed on the workers, then
+	// appended to the file in order; the top index and header are written
+	// last. Only a few supers per thread are held in memory.
+	bool WriteVoxelFile(const Model& model, const VoxelFileSettings& settings, const std::string& filename, std::string& err);
+}
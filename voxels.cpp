@@ -0,0 +1,502 @@
+#include "voxels.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <pugixml/src/pugixml.hpp>
+#include "png.h"
+#include "sampler.h"
+#include "threadpool.h"
+#include "zip.h"
+
+namespace irmf
+{
+	namespace
+	{
+		// Run is a run of equal voxels, of any length
+		struct Run
+		{
+			uint8_t Value;
+			uint32_t Count;
+		};
+
+		inline void Append(std::vector<Run>& runs, uint8_t value, uint32_t count)
+		{
+			if (!runs.empty() && runs.back().Value == value)
+				runs.back().Count += count;
+			else
+				runs.push_back(Run{ value, count });
+		}
+
+		// BinvoxWriter streams the voxels of one material to a binvox file,
+		// as (value, count) byte pairs. Runs continue across planes.
+		class BinvoxWriter
+		{
+		public:
+			BinvoxWriter()
+				: m_file(nullptr)
+				, m_value(0)
+				, m_count(0)
+			{
+			}
+
+			~BinvoxWriter()
+			{
+				if (m_file)
+					fclose(m_file);
+			}
+
+			bool Open(const std::string& filename, int size, const float* translate, float scale, std::string& err)
+			{
+				m_file = fopen(filename.c_str(), "wb");
+				if (!m_file) {
+					err = "failed to create " + filename;
+					return false;
+				}
+				fprintf(m_file, "#binvox 1\ndim %d %d %d\ntranslate %.9g %.9g %.9g\nscale %.9g\ndata\n",
+					size, size, size, translate[0], translate[1], translate[2], scale);
+				return true;
+			}
+
+			bool Add(const std::vector<Run>& runs)
+			{
+				m_buffer.clear();
+				for (const Run& run : runs) {
+					if (run.Value != m_value) {
+						Flush();
+						m_value = run.Value;
+					}
+					m_count += run.Count;
+				}
+				// keep the last run open for the next plane
+				uint64_t open = m_count % 255;
+				m_count -= open;
+				Flush();
+				m_count = open;
+				return Write();
+			}
+
+			bool Close(std::string& err)
+			{
+				m_buffer.clear();
+				Flush();
+				bool ok = Write();
+				if (fclose(m_file) != 0)
+					ok = false;
+				m_file = nullptr;
+				if (!ok)
+					err = "failed to write the voxels (disk full?)";
+				return ok;
+			}
+
+		private:
+			void Flush()
+			{
+				for (; m_count > 0; m_count -= std::min<uint64_t>(m_count, 255)) {
+					m_buffer.push_back(m_value);
+					m_buffer.push_back((uint8_t)std::min<uint64_t>(m_count, 255));
+				}
+			}
+
+			bool Write()
+			{
+				return m_buffer.empty() || fwrite(m_buffer.data(), 1, m_buffer.size(), m_file) == m_buffer.size();
+			}
+
+			FILE* m_file;
+			uint8_t m_value;
+			uint64_t m_count;
+			std::vector<uint8_t> m_buffer;
+		};
+
+		// Meters formats a length in model units as meters, rounding away the
+		// float's binary noise so 0.1 mm is written as 0.0001
+		std::string Meters(float length, double meters)
+		{
+			char text[32];
+			snprintf(text, sizeof(text), "%.7g", length);
+			snprintf(text, sizeof(text), "%.9g", atof(text) * meters);
+			return text;
+		}
+
+		struct StringWriter : pugi::xml_writer
+		{
+			std::string Text;
+			void write(const void* data, size_t size) override { Text.append((const char*)data, size); }
+		};
+
+		std::string SvxManifest(const Model& model, const Grid& grid, const std::string& pattern)
+		{
+			double meters = UnitLength(model);
+			pugi::xml_document doc;
+			pugi::xml_node declaration = doc.append_child(pugi::node_declaration);
+			declaration.append_attribute("version") = "1.0";
+			declaration.append_attribute("encoding") = "UTF-8";
+
+			pugi::xml_node root = doc.append_child("grid");
+			root.append_attribute("version") = "1.0";
+			root.append_attribute("gridSizeX") = grid.Size[0];
+			root.append_attribute("gridSizeY") = grid.Size[1];
+			root.append_attribute("gridSizeZ") = grid.Size[2];
+			root.append_attribute("voxelSize") = Meters(grid.Pitch[0], meters).c_str();
+			root.append_attribute("subvoxelBits") = 8;
+			root.append_attribute("originX") = Meters(grid.Min[0], meters).c_str();
+			root.append_attribute("originY") = Meters(grid.Min[1], meters).c_str();
+			root.append_attribute("originZ") = Meters(grid.Min[2], meters).c_str();
+			root.append_attribute("slicesOrientation") = "Z";
+
+			pugi::xml_node channels = root.append_child("channels");
+			pugi::xml_node channel = channels.append_child("channel");
+			channel.append_attribute("type") = "DENSITY";
+			channel.append_attribute("bits") = 8;
+			channel.append_attribute("slices") = ("density/" + pattern).c_str();
+			if (model.Materials.size() > 1) {
+				channel = channels.append_child("channel");
+				channel.append_attribute("type") = "MATERIAL";
+				channel.append_attribute("bits") = 8;
+				channel.append_attribute("slices") = ("material/" + pattern).c_str();
+			}
+
+			pugi::xml_node materials = root.append_child("materials");
+			for (size_t m = 0; m < model.Materials.size(); m++) {
+				pugi::xml_node material = materials.append_child("material");
+				material.append_attribute("id") = (unsigned)m + 1;
+				material.append_attribute("urn") = ("urn:irmf:material:" + model.Materials[m]).c_str();
+			}
+
+			pugi::xml_node metadata = root.append_child("metadata");
+			for (const char* key : { "title", "author", "copyright", "date", "notes", "units" }) {
+				std::string value = model.Info[key].string_value();
+				if (value.empty())
+					continue;
+				pugi::xml_node entry = metadata.append_child("entry");
+				entry.append_attribute("key") = key;
+				entry.append_attribute("value") = value.c_str();
+			}
+
+			StringWriter writer;
+			doc.save(writer, "  ");
+			return writer.Text;
+		}
+
+		bool CheckThreshold(const VoxelSettings& settings, std::string& err)
+		{
+			if (!(settings.Threshold > 0.0f && settings.Threshold <= 1.0f)) {
+				err = "the threshold must be in (0, 1]";
+				return false;
+			}
+			return true;
+		}
+
+		// BinvoxSink writes the slabs of RunPipeline as binvox files. As
+		// binvox runs along Y, then Z, then X, the runs of every X plane are
+		// collected as the slabs come in (along Z) and written at the end;
+		// runs take a few bytes per change of value, so this stays small
+		// next to the voxels.
+		class BinvoxSink : public SlabSink
+		{
+		public:
+			BinvoxSink(const VoxelSettings& settings, const std::vector<std::string>& filenames)
+				: m_settings(settings)
+				, m_filenames(filenames)
+				, m_size(0)
+				, m_layers(0)
+			{
+			}
+
+			bool Begin(const Grid& grid, int materials, int slots, int, std::string& err) override
+			{
+				if (!CheckThreshold(m_settings, err))
+					return false;
+				if ((int)m_filenames.size() != materials) {
+					err = "one file name per material is needed";
+					return false;
+				}
+				if (grid.Pitch[2] != grid.Pitch[0]) {
+					err = "binvox voxels are cubes: the layer height must be the pitch";
+					return false;
+				}
+				m_grid = grid;
+				m_size = std::max(grid.Size[0], std::max(grid.Size[1], grid.Size[2]));
+				for (int m = 0; m < materials; m++) {
+					m_writers.emplace_back(new BinvoxWriter());
+					if (!m_writers[m]->Open(m_filenames[m], m_size, grid.Min, m_size * grid.Pitch[0], err)) {
+						m_writers.clear();
+						Discard();
+						return false;
+					}
+				}
+				m_slots.assign(slots, std::vector<std::vector<Run>>((size_t)materials * grid.Size[0]));
+				m_planes.assign((size_t)materials * grid.Size[0], std::vector<Run>());
+				return true;
+			}
+
+			void Encode(const Slab& slab, int slot, int) override
+			{
+				int width = m_grid.Size[0], height = m_grid.Size[1];
+				std::vector<std::vector<Run>>& planes = m_slots[slot];
+				for (size_t m = 0; m < m_writers.size(); m++)
+					for (int x = 0; x < width; x++) {
+						std::vector<Run>& runs = planes[m * width + x];
+						runs.clear();
+						for (int l = 0; l < slab.Count; l++) {
+							const float* values = slab.Layer(l) + m * height * width + x;
+							for (int y = 0; y < height; y++)
+								Append(runs, values[(size_t)y * width] >= m_settings.Threshold ? 1 : 0, 1);
+							Append(runs, 0, m_size - height);
+						}
+					}
+			}
+
+			bool Write(const Slab& slab, int slot) override
+			{
+				std::vector<std::vector<Run>>& planes = m_slots[slot];
+				for (size_t p = 0; p < planes.size(); p++)
+					for (const Run& run : planes[p])
+						Append(m_planes[p], run.Value, run.Count);
+				m_layers = slab.First + slab.Count;
+				return true;
+			}
+
+			bool Finish(std::string& err) override
+			{
+				int width = m_grid.Size[0];
+				bool ok = true;
+				if (m_layers == m_grid.Size[2]) {
+					std::vector<Run> runs;
+					for (size_t m = 0; m < m_writers.size() && ok; m++)
+						for (int x = 0; x < m_size && ok; x++) {
+							runs.clear();
+							if (x < width) {
+								runs.swap(m_planes[m * width + x]);
+								Append(runs, 0, (uint32_t)m_size * (m_size - m_grid.Size[2]));
+							} else
+								Append(runs, 0, (uint32_t)m_size * m_size);
+							ok = m_writers[m]->Add(runs);
+						}
+					if (!ok)
+						err = "failed to write the voxels (disk full?)";
+				}
+				for (size_t m = 0; m < m_writers.size(); m++) {
+					std::string writeErr;
+					if (!m_writers[m]->Close(writeErr) && ok) {
+						err = writeErr;
+						ok = false;
+					}
+				}
+				return ok;
+			}
+
+			void Discard() override
+			{
+				for (const std::string& filename : m_filenames)
+					remove(filename.c_str());
+			}
+
+		private:
+			VoxelSettings m_settings;
+			std::vector<std::string> m_filenames;
+			Grid m_grid;
+			int m_size;
+			std::vector<std::unique_ptr<BinvoxWriter>> m_writers;
+			std::vector<std::vector<std::vector<Run>>> m_slots; // runs per material and X plane
+			std::vector<std::vector<Run>> m_planes;
+			int m_layers; // written so far
+		};
+	}
+
+	bool WriteBinvox(const Model& model, const VoxelSettings& settings, const std::vector<std::string>& filenames, std::string& err)
+	{
+		int materials = (int)model.Materials.size();
+		if ((int)filenames.size() != materials) {
+			err = "one file name per material is needed";
+			return false;
+		}
+		if (!CheckThreshold(settings, err))
+			return false;
+
+		// binvox grids are cubes; the cells past the bounding box are empty
+		Grid grid;
+		if (!MakeGrid(model, settings.Pitch, 0.0f, grid, err))
+			return false;
+		int inside[3] = { grid.Size[0], grid.Size[1], grid.Size[2] };
+		int size = std::max(grid.Size[0], std::max(grid.Size[1], grid.Size[2]));
+		for (int a = 0; a < 3; a++)
+			grid.Size[a] = size;
+
+		std::vector<std::unique_ptr<BinvoxWriter>> writers;
+		for (int m = 0; m < materials; m++) {
+			writers.emplace_back(new BinvoxWriter());
+			if (!writers[m]->Open(filenames[m], size, grid.Min, size * grid.Pitch[0], err)) {
+				writers.clear();
+				for (int n = 0; n < m; n++)
+					remove(filenames[n].c_str());
+				return false;
+			}
+		}
+
+		ThreadPool pool(settings.Threads);
+		std::vector<std::unique_ptr<RowSampler>> samplers(pool.GetThreadCount());
+		int window = 2 * pool.GetThreadCount();
+		std::vector<std::vector<std::vector<Run>>> slots(window, std::vector<std::vector<Run>>(materials));
+		std::atomic<bool> runaway(false);
+
+		// plane x holds Z rows of Y voxels
+		auto plane = [&](int x, int slot, int w) {
+			if (!samplers[w])
+				samplers[w].reset(new RowSampler(model, grid, 1));
+			for (int m = 0; m < materials; m++)
+				slots[slot][m].clear();
+			for (int z = 0; z < size; z++) {
+				if (x >= inside[0] || z >= inside[2]) {
+					for (int m = 0; m < materials; m++)
+						Append(slots[slot][m], 0, size);
+					continue;
+				}
+				if (!samplers[w]->Sample(z, x)) {
+					runaway = true;
+					return false;
+				}
+				for (int m = 0; m < materials; m++) {
+					std::vector<Run>& runs = slots[slot][m];
+					const float* values = samplers[w]->GetValues(m);
+					for (int y = 0; y < inside[1]; y++)
+						Append(runs, values[y] >= settings.Threshold ? 1 : 0, 1);
+					Append(runs, 0, size - inside[1]);
+				}
+			}
+			return true;
+		};
+
+		auto write = [&](int x, int slot) {
+			for (int m = 0; m < materials; m++)
+				if (!writers[m]->Add(slots[slot][m]))
+					return false;
+			if (settings.Progress)
+				settings.Progress(x + 1, size);
+			return true;
+		};
+
+		bool ok = RunOrdered(pool, size, window, plane, write);
+		if (runaway)
+			err = "a loop in the model did not terminate";
+		else if (!ok)
+			err = "failed to write the voxels (disk full?)";
+		for (int m = 0; m < materials; m++) {
+			std::string writeErr;
+			if (!writers[m]->Close(writeErr) && ok) {
+				err = writeErr;
+				ok = false;
+			}
+		}
+		if (!ok)
+			for (const std::string& filename : filenames)
+				remove(filename.c_str());
+		return ok;
+	}
+
+	bool WriteSvx(const Model& model, const VoxelSettings& settings, const std::string& filename, std::string& err)
+	{
+		if (!CheckThreshold(settings, err))
+			return false;
+		Grid grid;
+		if (!MakeGrid(model, settings.Pitch, 0.0f, grid, err))
+			return false;
+		ZipWriter zip;
+		if (!zip.Open(filename, err))
+			return false;
+
+		int materials = (int)model.Materials.size();
+		int width = grid.Size[0], height = grid.Size[1], slices = grid.Size[2];
+		int channels = materials > 1 ? 2 : 1;
+		int digits = 4;
+		for (int n = slices - 1; n >= 10000; n /= 10)
+			digits++;
+		std::string pattern = "slice%0" + std::to_string(digits) + "d.png";
+
+		struct Worker
+		{
+			std::unique_ptr<RowSampler> Sampler;
+			PngEncoder Encoders[2];
+			std::vector<uint8_t> Rows[2];
+		};
+		ThreadPool pool(settings.Threads);
+		std::vector<Worker> workers(pool.GetThreadCount());
+		int window = 2 * pool.GetThreadCount();
+		std::vector<std::vector<std::vector<uint8_t>>> slots(window, std::vector<std::vector<uint8_t>>(channels));
+		std::atomic<bool> runaway(false);
+
+		auto slice = [&](int k, int slot, int w) {
+			Worker& worker = workers[w];
+			if (!worker.Sampler) {
+				worker.Sampler.reset(new RowSampler(model, grid));
+				for (int c = 0; c < channels; c++)
+					worker.Rows[c].resize(width);
+			}
+			for (int c = 0; c < channels; c++)
+				worker.Encoders[c].Begin(width, height);
+			uint8_t* density = worker.Rows[0].data();
+			uint8_t* material = worker.Rows[1].data();
+			for (int j = 0; j < height; j++) {
+				if (!worker.Sampler->Sample(j, k)) {
+					runaway = true;
+					return false;
+				}
+				std::fill(density, density + width, 0);
+				if (channels > 1)
+					std::fill(material, material + width, 0);
+				for (int m = 0; m < materials; m++) {
+					const float* values = worker.Sampler->GetValues(m);
+					for (int i = 0; i < width; i++) {
+						if (!(values[i] >= settings.Threshold))
+							continue;
+						// the first of equally strong materials wins
+						if (channels > 1 && (density[i] == 0 || values[i] > worker.Sampler->GetValues(material[i] - 1)[i]))
+							material[i] = (uint8_t)(m + 1);
+						density[i] = 255;
+					}
+				}
+				for (int c = 0; c < channels; c++)
+					worker.Encoders[c].Row(worker.Rows[c].data());
+			}
+			for (int c = 0; c < channels; c++)
+				worker.Encoders[c].End(slots[slot][c]);
+			return true;
+		};
+
+		auto write = [&](int k, int slot) {
+			char name[64];
+			snprintf(name, sizeof(name), pattern.c_str(), k);
+			static const char* dirs[2] = { "density/", "material/" };
+			for (int c = 0; c < channels; c++)
+				if (!zip.Add(dirs[c] + std::string(name), slots[slot][c].data(), slots[slot][c].size()))
+					return false;
+			if (settings.Progress)
+				settings.Progress(k + 1, slices);
+			return true;
+		};
+
+		bool ok = RunOrdered(pool, slices, window, slice, write);
+		if (runaway)
+			err = "a loop in the model did not terminate";
+
+		if (ok) {
+			std::string manifest = SvxManifest(model, grid, pattern);
+			ok = zip.Add("manifest.xml", manifest.data(), manifest.size(), Z_DEFAULT_COMPRESSION);
+		}
+		std::string zipErr;
+		if (!zip.Close(zipErr) && !runaway) {
+			err = zipErr;
+			ok = false;
+		}
+		if (!ok)
+			remove(filename.c_str());
+		return ok;
+	}
+
+	std::unique_ptr<SlabSink> NewBinvoxSink(const VoxelSettings& settings, const std::vector<std::string>& filenames)
+	{
+		return std::unique_ptr<SlabSink>(new BinvoxSink(settings, filenames));
+	}
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "model.h"
+#include "pipeline.h"
+
+namespace irmf
+{
+	// VoxelSettings controls the resolution and parallelism of a voxel
+	// export.
+	struct VoxelSettings
+	{
+		float Pitch;     // voxel size, in model units
+		float Threshold; // a voxel is filled where the material is at least this, in (0, 1]
+		int Threads;     // <= 0: one per hardware thread
+
+		// Progress is called on the calling thread after each plane of
+		// voxels is written, with the number of planes done and the total
+		std::function<void(int, int)> Progress;
+
+		VoxelSettings()
+			: Pitch(0.1f)
+			, Threshold(0.5f)
+			, Threads(0)
+		{
+		}
+	};
+
+	// WriteBinvox writes material m to filenames[m] as a binvox grid: a
+	// cube of Pitch sized voxels from the model's Min that covers its
+	// bounding box, with the model's axes. binvox orders the voxels by X,
+	// then Z, then Y, so X planes are sampled (along Y) and run-length
+	// encoded in parallel and streamed to the files in order; only a few
+	// planes per thread are held in memory.
+	bool WriteBinvox(const Model& model, const VoxelSettings& settings, const std::vector<std::string>& filenames, std::string& err);
+
+	// WriteSvx writes the model as SVX (Simple Voxels): a ZIP with a
+	// manifest.xml and one PNG per Z slice and channel, whose rows run from
+	// Y min. The DENSITY channel is 255 where any material reaches the
+	// threshold; with several materials, a MATERIAL channel holds the
+	// 1-based index of the strongest one. Slices are encoded in parallel
+	// and written in order, like SliceToZip.
+	bool WriteSvx(const Model& model, const VoxelSettings& settings, const std::string& filename, std::string& err);
+
+	// NewBinvoxSink makes a RunPipeline sink that writes the same files as
+	// WriteBinvox, with settings.Threshold. The pipeline's layer height
+	// must be its pitch. Runs are kept until the last slab, as binvox
+	// orders the voxels by X first.
+	std::unique_ptr<SlabSink> NewBinvoxSink(const VoxelSettings& settings, const std::vector<std::string>& filenames);
+}
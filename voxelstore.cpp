@@ -0,0 +1,533 @@
+#include "voxelstore.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include "threadpool.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <winioctl.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace irmf
+{
+	namespace
+	{
+		const char Magic[8] = { 'I', 'R', 'M', 'F', 'B', 'R', 'K', '1' };
+		// the header fills the first 64 KB so every brick is aligned for
+		// mapping, Windows' allocation granularity included
+		const size_t HeaderSize = 1 << 16;
+
+		struct Header
+		{
+			char Magic[8];
+			int32_t Channels;
+			int32_t Size[3];
+			float Min[3];
+			float Pitch[3];
+		};
+
+		VoxelStats EmptyStats(const Grid& grid)
+		{
+			VoxelStats empty;
+			memset(&empty, 0, sizeof(empty));
+			for (int a = 0; a < 3; a++) {
+				empty.Min[a] = grid.Size[a];
+				empty.Max[a] = -1;
+			}
+			return empty;
+		}
+
+		void MergeStats(VoxelStats& into, const VoxelStats& part)
+		{
+			into.Voxels += part.Voxels;
+			for (int a = 0; a < 3; a++) {
+				into.Min[a] = std::min(into.Min[a], part.Min[a]);
+				into.Max[a] = std::max(into.Max[a], part.Max[a]);
+			}
+		}
+
+		// StatsSink measures the slabs of RunPipeline as AnalyzeVoxels
+		// measures a store
+		class StatsSink : public SlabSink
+		{
+		public:
+			StatsSink(std::vector<VoxelStats>& stats)
+				: m_stats(stats)
+			{
+			}
+
+			bool Begin(const Grid& grid, int materials, int slots, int, std::string&) override
+			{
+				m_grid = grid;
+				m_stats.assign(materials, EmptyStats(grid));
+				m_slots.assign(slots, m_stats);
+				return true;
+			}
+
+			void Encode(const Slab& slab, int slot, int) override
+			{
+				int width = m_grid.Size[0], height = m_grid.Size[1];
+				for (int m = 0; m < slab.Materials; m++) {
+					VoxelStats& s = m_slots[slot][m];
+					s = EmptyStats(m_grid);
+					for (int l = 0; l < slab.Count; l++)
+						for (int j = 0; j < height; j++) {
+							const float* row = slab.Layer(l) + ((size_t)m * height + j) * width;
+							for (int i = 0; i < width; i++) {
+								if (ToByte(row[i]) < 128)
+									continue;
+								int at[3] = { i, j, slab.First + l };
+								s.Voxels++;
+								for (int a = 0; a < 3; a++) {
+									s.Min[a] = std::min(s.Min[a], at[a]);
+									s.Max[a] = std::max(s.Max[a], at[a]);
+								}
+							}
+						}
+				}
+			}
+
+			bool Write(const Slab&, int slot) override
+			{
+				for (size_t m = 0; m < m_stats.size(); m++)
+					MergeStats(m_stats[m], m_slots[slot][m]);
+				return true;
+			}
+
+			bool Finish(std::string&) override
+			{
+				for (VoxelStats& s : m_stats)
+					s.Volume = s.Voxels * (double)m_grid.Pitch[0] * m_grid.Pitch[1] * m_grid.Pitch[2];
+				return true;
+			}
+
+			void Discard() override {}
+
+		private:
+			std::vector<VoxelStats>& m_stats;
+			Grid m_grid;
+			std::vector<std::vector<VoxelStats>> m_slots;
+		};
+	}
+
+	const int VoxelStore::BrickSize[3] = { 64, 32, 32 };
+
+	VoxelStore::VoxelStore()
+		: m_channels(0)
+		, m_bricks{ 0, 0, 0 }
+		, m_brickBytes(0)
+		, m_budget(0)
+		, m_resident(0)
+		, m_peak(0)
+		, m_failed(false)
+#ifdef _WIN32
+		, m_file(INVALID_HANDLE_VALUE)
+		, m_mapping(nullptr)
+#else
+		, m_file(-1)
+#endif
+	{
+	}
+
+	VoxelStore::~VoxelStore()
+	{
+		std::string err;
+		Close(err);
+	}
+
+	bool VoxelStore::Create(const std::string& filename, const Grid& grid, int channels, size_t budget, std::string& err)
+	{
+		Close(err);
+		m_grid = grid;
+		m_channels = channels;
+		return Start(filename, budget, true, err);
+	}
+
+	bool VoxelStore::Open(const std::string& filename, size_t budget, std::string& err)
+	{
+		Close(err);
+		return Start(filename, budget, false, err);
+	}
+
+	bool VoxelStore::Start(const std::string& filename, size_t budget, bool create, std::string& err)
+	{
+		Header header;
+		if (create) {
+			memset(&header, 0, sizeof(header));
+			memcpy(header.Magic, Magic, sizeof(Magic));
+			header.Channels = m_channels;
+			for (int a = 0; a < 3; a++) {
+				header.Size[a] = m_grid.Size[a];
+				header.Min[a] = m_grid.Min[a];
+				header.Pitch[a] = m_grid.Pitch[a];
+			}
+		}
+
+#ifdef _WIN32
+		m_file = CreateFileA(filename.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+			create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (m_file == INVALID_HANDLE_VALUE) {
+			err = (create ? "failed to create " : "failed to open ") + filename;
+			return false;
+		}
+		DWORD done = 0;
+		bool ok = create ? WriteFile(m_file, &header, sizeof(header), &done, nullptr) != 0
+						 : ReadFile(m_file, &header, sizeof(header), &done, nullptr) != 0;
+		ok = ok && done == sizeof(header);
+#else
+		m_file = open(filename.c_str(), create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644);
+		if (m_file < 0) {
+			err = (create ? "failed to create " : "failed to open ") + filename;
+			return false;
+		}
+		bool ok = create ? pwrite(m_file, &header, sizeof(header), 0) == (ssize_t)sizeof(header)
+						 : pread(m_file, &header, sizeof(header), 0) == (ssize_t)sizeof(header);
+#endif
+		if (!create && ok) {
+			ok = memcmp(header.Magic, Magic, sizeof(Magic)) == 0 && header.Channels > 0;
+			m_channels = header.Channels;
+			for (int a = 0; a < 3; a++) {
+				ok = ok && header.Size[a] > 0;
+				m_grid.Size[a] = header.Size[a];
+				m_grid.Min[a] = header.Min[a];
+				m_grid.Pitch[a] = header.Pitch[a];
+			}
+			if (!ok) {
+				err = filename + " is not a voxel store";
+				std::string closeErr;
+				Close(closeErr);
+				return false;
+			}
+		}
+
+		uint64_t bricks = 1;
+		for (int a = 0; a < 3; a++) {
+			m_bricks[a] = (m_grid.Size[a] + BrickSize[a] - 1) / BrickSize[a];
+			bricks *= m_bricks[a];
+		}
+		m_brickBytes = (size_t)m_channels * BrickSize[0] * BrickSize[1] * BrickSize[2];
+		uint64_t size = HeaderSize + bricks * m_brickBytes;
+		m_budget = budget;
+
+		// a new store is sized without writing, so untouched bricks take
+		// no disk space
+#ifdef _WIN32
+		if (ok && create) {
+			DWORD returned;
+			DeviceIoControl((HANDLE)m_file, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &returned, nullptr);
+			LARGE_INTEGER end;
+			end.QuadPart = (LONGLONG)size;
+			ok = SetFilePointerEx((HANDLE)m_file, end, nullptr, FILE_BEGIN) && SetEndOfFile((HANDLE)m_file);
+		}
+		if (ok) {
+			m_mapping = CreateFileMappingA((HANDLE)m_file, nullptr, PAGE_READWRITE, 0, 0, nullptr);
+			ok = m_mapping != nullptr;
+		}
+#else
+		if (ok && create)
+			ok = ftruncate(m_file, (off_t)size) == 0;
+		else if (ok)
+			ok = lseek(m_file, 0, SEEK_END) >= (off_t)size;
+#endif
+		if (!ok) {
+			err = (create ? "failed to size " : "failed to read ") + filename;
+			std::string closeErr;
+			Close(closeErr);
+			return false;
+		}
+		return true;
+	}
+
+	bool VoxelStore::Close(std::string& err)
+	{
+		bool ok = !m_failed;
+		for (auto& item : m_mapped) {
+			Brick& brick = item.second;
+#ifdef _WIN32
+			if (brick.Dirty && !FlushViewOfFile(brick.Data, 0))
+				ok = false;
+#else
+			if (brick.Dirty && msync(brick.Data, m_brickBytes, MS_SYNC) != 0)
+				ok = false;
+#endif
+			brick.Dirty = false;
+			Unmap(brick);
+		}
+		m_mapped.clear();
+		m_idle.clear();
+		m_resident = 0;
+#ifdef _WIN32
+		if (m_mapping)
+			CloseHandle(m_mapping);
+		m_mapping = nullptr;
+		if (m_file != INVALID_HANDLE_VALUE)
+			CloseHandle(m_file);
+		m_file = INVALID_HANDLE_VALUE;
+#else
+		if (m_file >= 0 && close(m_file) != 0)
+			ok = false;
+		m_file = -1;
+#endif
+		m_failed = false;
+		if (!ok)
+			err = "failed to write the voxel store (disk full?)";
+		return ok;
+	}
+
+	uint8_t* VoxelStore::Map(size_t index)
+	{
+		uint64_t offset = HeaderSize + (uint64_t)index * m_brickBytes;
+#ifdef _WIN32
+		void* data = MapViewOfFile(m_mapping, FILE_MAP_WRITE, (DWORD)(offset >> 32), (DWORD)offset, m_brickBytes);
+		return (uint8_t*)data;
+#else
+		void* data = mmap(nullptr, m_brickBytes, PROT_READ | PROT_WRITE, MAP_SHARED, m_file, (off_t)offset);
+		return data == MAP_FAILED ? nullptr : (uint8_t*)data;
+#endif
+	}
+
+	void VoxelStore::Unmap(Brick& brick)
+	{
+		// dirty pages are handed to the system to write back; they leave
+		// the process with the mapping
+#ifdef _WIN32
+		if (brick.Dirty)
+			FlushViewOfFile(brick.Data, 0);
+		UnmapViewOfFile(brick.Data);
+#else
+		if (brick.Dirty)
+			msync(brick.Data, m_brickBytes, MS_ASYNC);
+		munmap(brick.Data, m_brickBytes);
+#endif
+	}
+
+	void VoxelStore::Trim()
+	{
+		while (m_resident > m_budget && !m_idle.empty()) {
+			auto it = m_mapped.find(m_idle.front());
+			m_idle.pop_front();
+			Unmap(it->second);
+			m_mapped.erase(it);
+			m_resident -= m_brickBytes;
+		}
+	}
+
+	uint8_t* VoxelStore::Lock(int x, int y, int z, bool write)
+	{
+		size_t index = ((size_t)z * m_bricks[1] + y) * m_bricks[0] + x;
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_mapped.find(index);
+		if (it != m_mapped.end()) {
+			Brick& brick = it->second;
+			if (brick.Users++ == 0)
+				m_idle.erase(brick.Idle);
+			brick.Dirty = brick.Dirty || write;
+			return brick.Data;
+		}
+
+		uint8_t* data = Map(index);
+		if (!data) {
+			m_failed = true;
+			return nullptr;
+		}
+		Brick& brick = m_mapped[index];
+		brick.Data = data;
+		brick.Users = 1;
+		brick.Dirty = write;
+		brick.Idle = m_idle.end();
+		m_resident += m_brickBytes;
+		m_peak = std::max(m_peak, m_resident);
+		Trim();
+		return data;
+	}
+
+	void VoxelStore::Unlock(int x, int y, int z)
+	{
+		size_t index = ((size_t)z * m_bricks[1] + y) * m_bricks[0] + x;
+		std::lock_guard<std::mutex> lock(m_mutex);
+		Brick& brick = m_mapped[index];
+		if (--brick.Users == 0) {
+			brick.Idle = m_idle.insert(m_idle.end(), index);
+			Trim();
+		}
+	}
+
+	bool VoxelStore::ReadRow(int j, int k, float* values)
+	{
+		int y = j / BrickSize[1], z = k / BrickSize[2], size = m_grid.Size[0];
+		for (int x = 0; x < m_bricks[0]; x++) {
+			const uint8_t* data = Lock(x, y, z, false);
+			if (!data)
+				return false;
+			int i0 = x * BrickSize[0], i1 = std::min(i0 + BrickSize[0], size);
+			for (int c = 0; c < m_channels; c++) {
+				const uint8_t* row = data + ((size_t)(c * BrickSize[2] + k % BrickSize[2]) * BrickSize[1] + j % BrickSize[1]) * BrickSize[0];
+				float* out = values + (size_t)c * size;
+				for (int i = i0; i < i1; i++)
+					out[i] = row[i - i0] * (1.0f / 255.0f);
+			}
+			Unlock(x, y, z);
+		}
+		return true;
+	}
+
+	bool Voxelize(const Model& model, const VoxelizeSettings& settings, const std::string& filename, VoxelStore& store, std::string& err)
+	{
+		Grid grid;
+		if (!MakeGrid(model, settings.Pitch, settings.LayerHeight, grid, err))
+			return false;
+		int materials = (int)model.Materials.size();
+		if (!store.Create(filename, grid, materials, settings.Budget, err))
+			return false;
+
+		const int* brick = VoxelStore::BrickSize;
+		int columns = store.GetBrickCount(0), rows = store.GetBrickCount(1), slabs = store.GetBrickCount(2);
+		struct Worker
+		{
+			std::unique_ptr<RowSampler> Sampler;
+			std::vector<uint8_t*> Bricks;
+			std::vector<uint8_t> Row;
+		};
+		ThreadPool pool(settings.Threads);
+		std::vector<Worker> workers(pool.GetThreadCount());
+		int window = 2 * pool.GetThreadCount();
+		std::atomic<bool> runaway(false), unmapped(false);
+
+		// item y + rows * z fills the bricks of row y of slab z; bricks stay
+		// unwritten (and sparse) until a voxel in them is not zero
+		auto fill = [&](int item, int, int w) {
+			Worker& worker = workers[w];
+			if (!worker.Sampler) {
+				worker.Sampler.reset(new RowSampler(model, grid));
+				worker.Bricks.resize(columns);
+				worker.Row.resize(grid.Size[0]);
+			}
+			int y = item % rows, z = item / rows;
+			int j0 = y * brick[1], j1 = std::min(j0 + brick[1], grid.Size[1]);
+			int k0 = z * brick[2], k1 = std::min(k0 + brick[2], grid.Size[2]);
+			std::fill(worker.Bricks.begin(), worker.Bricks.end(), nullptr);
+			bool ok = true;
+			for (int k = k0; k < k1 && ok; k++)
+				for (int j = j0; j < j1 && ok; j++) {
+					if (!worker.Sampler->Sample(j, k)) {
+						runaway = true;
+						ok = false;
+						break;
+					}
+					for (int m = 0; m < materials && ok; m++) {
+						const float* values = worker.Sampler->GetValues(m);
+						uint8_t* row = worker.Row.data();
+						for (int i = 0; i < grid.Size[0]; i++)
+							row[i] = ToByte(values[i]);
+						for (int x = 0; x < columns; x++) {
+							int i0 = x * brick[0], i1 = std::min(i0 + brick[0], grid.Size[0]);
+							if (!worker.Bricks[x]) {
+								if (std::all_of(row + i0, row + i1, [](uint8_t v) { return v == 0; }))
+									continue;
+								worker.Bricks[x] = store.Lock(x, y, z, true);
+								if (!worker.Bricks[x]) {
+									unmapped = true;
+									ok = false;
+									break;
+								}
+							}
+							memcpy(worker.Bricks[x] + ((size_t)(m * brick[2] + k - k0) * brick[1] + j - j0) * brick[0], row + i0, i1 - i0);
+						}
+					}
+				}
+			for (int x = 0; x < columns; x++)
+				if (worker.Bricks[x])
+					store.Unlock(x, y, z);
+			return ok;
+		};
+
+		auto progress = [&](int item, int) {
+			if (settings.Progress && (item + 1) % rows == 0)
+				settings.Progress((item + 1) / rows, slabs);
+			return true;
+		};
+
+		bool ok = RunOrdered(pool, rows * slabs, window, fill, progress);
+		if (runaway)
+			err = "a loop in the model did not terminate";
+		else if (unmapped)
+			err = "failed to map a brick of the voxel store";
+		if (!ok) {
+			std::string closeErr;
+			store.Close(closeErr);
+			remove(filename.c_str());
+		}
+		return ok;
+	}
+
+	bool AnalyzeVoxels(VoxelStore& store, int threads, std::vector<VoxelStats>& stats, std::string& err)
+	{
+		const Grid& grid = store.GetGrid();
+		const int* brick = VoxelStore::BrickSize;
+		int channels = store.GetChannelCount();
+		int columns = store.GetBrickCount(0), rows = store.GetBrickCount(1), slabs = store.GetBrickCount(2);
+
+		VoxelStats empty = EmptyStats(grid);
+		ThreadPool pool(threads);
+		int window = 2 * pool.GetThreadCount();
+		std::vector<std::vector<VoxelStats>> slots(window, std::vector<VoxelStats>(channels));
+		stats.assign(channels, empty);
+
+		// item y + rows * z measures the bricks of row y of slab z
+		auto measure = [&](int item, int slot, int) {
+			int y = item % rows, z = item / rows;
+			std::vector<VoxelStats>& part = slots[slot];
+			std::fill(part.begin(), part.end(), empty);
+			for (int x = 0; x < columns; x++) {
+				const uint8_t* data = store.Lock(x, y, z, false);
+				if (!data)
+					return false;
+				for (int c = 0; c < channels; c++) {
+					VoxelStats& s = part[c];
+					for (int k = 0; k < brick[2]; k++)
+						for (int j = 0; j < brick[1]; j++) {
+							const uint8_t* row = data + ((size_t)(c * brick[2] + k) * brick[1] + j) * brick[0];
+							for (int i = 0; i < brick[0]; i++) {
+								if (row[i] < 128)
+									continue;
+								int at[3] = { x * brick[0] + i, y * brick[1] + j, z * brick[2] + k };
+								s.Voxels++;
+								for (int a = 0; a < 3; a++) {
+									s.Min[a] = std::min(s.Min[a], at[a]);
+									s.Max[a] = std::max(s.Max[a], at[a]);
+								}
+							}
+						}
+				}
+				store.Unlock(x, y, z);
+			}
+			return true;
+		};
+
+		auto merge = [&](int, int slot) {
+			for (int c = 0; c < channels; c++)
+				MergeStats(stats[c], slots[slot][c]);
+			return true;
+		};
+
+		if (!RunOrdered(pool, rows * slabs, window, measure, merge)) {
+			err = "failed to map a brick of the voxel store";
+			return false;
+		}
+		for (VoxelStats& s : stats)
+			s.Volume = s.Voxels * (double)grid.Pitch[0] * grid.Pitch[1] * grid.Pitch[2];
+		return true;
+	}
+
+	std::unique_ptr<SlabSink> NewStatsSink(std::vector<VoxelStats>& stats)
+	{
+		return std::unique_ptr<SlabSink>(new StatsSink(stats));
+	}
+}
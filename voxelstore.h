@@ -0,0 +1,133 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "model.h"
+#include "pipeline.h"
+#include "sampler.h"
+
+namespace irmf
+{
+	// VoxelStore keeps a Grid of byte voxels (ToByte of the material
+	// values, one channel per material) in a file too large for memory.
+	// The file is a header followed by bricks of BrickSize voxels, each
+	// channel of a brick being 64 KB, and bricks are memory-mapped one at
+	// a time while they are in use. Mapped bricks that are no longer in use
+	// stay resident until the budget is exceeded, then the least recently
+	// used are written back (if dirty) and unmapped, so the store's share of
+	// the process' memory stays within the budget plus the bricks in use.
+	// Bricks never written read as zero. Lock and Unlock may be called from
+	// several threads.
+	class VoxelStore : public VoxelSource
+	{
+	public:
+		static const int BrickSize[3];
+
+		VoxelStore();
+		~VoxelStore();
+
+		// Create makes an empty store for grid, sized but sparse on disk.
+		bool Create(const std::string& filename, const Grid& grid, int channels, size_t budget, std::string& err);
+		// Open opens a store written before, for reading and writing.
+		bool Open(const std::string& filename, size_t budget, std::string& err);
+		// Close writes every dirty brick back and closes the file. Returns
+		// false, with err set, if that or an earlier mapping failed.
+		bool Close(std::string& err);
+
+		const Grid& GetGrid() const override { return m_grid; }
+		int GetChannelCount() const override { return m_channels; }
+		bool ReadRow(int j, int k, float* values) override;
+		inline int GetBrickCount(int axis) const { return m_bricks[axis]; }
+
+		// Lock maps brick (x, y, z) and keeps it mapped until the matching
+		// Unlock. Voxel (i, j, k) of channel c in the brick is at
+		// ((c * BrickSize[2] + k) * BrickSize[1] + j) * BrickSize[0] + i.
+		// Returns null if the brick cannot be mapped.
+		uint8_t* Lock(int x, int y, int z, bool write);
+		void Unlock(int x, int y, int z);
+
+		// GetPeakResident returns the most bytes of bricks ever mapped at once.
+		inline size_t GetPeakResident() const { return m_peak; }
+
+	private:
+		struct Brick
+		{
+			uint8_t* Data;
+			int Users;
+			bool Dirty;
+			std::list<size_t>::iterator Idle; // in m_idle while Users == 0
+		};
+
+		bool Start(const std::string& filename, size_t budget, bool create, std::string& err);
+		uint8_t* Map(size_t index);
+		void Unmap(Brick& brick);
+		void Trim();
+
+		Grid m_grid;
+		int m_channels;
+		int m_bricks[3];
+		size_t m_brickBytes, m_budget, m_resident, m_peak;
+		bool m_failed;
+
+#ifdef _WIN32
+		void* m_file;
+		void* m_mapping;
+#else
+		int m_file;
+#endif
+
+		std::mutex m_mutex;
+		std::unordered_map<size_t, Brick> m_mapped;
+		std::list<size_t> m_idle; // least recently used first
+	};
+
+	// VoxelizeSettings controls the resolution, memory and parallelism of
+	// Voxelize.
+	struct VoxelizeSettings
+	{
+		float Pitch;       // voxel size in X and Y, in model units
+		float LayerHeight; // <= 0: same as Pitch
+		size_t Budget;     // bytes of bricks kept mapped
+		int Threads;       // <= 0: one per hardware thread
+
+		// Progress is called on the calling thread after each slab of
+		// bricks is filled, with the number done and the total
+		std::function<void(int, int)> Progress;
+
+		VoxelizeSettings()
+			: Pitch(0.1f)
+			, LayerHeight(0.0f)
+			, Budget((size_t)256 << 20)
+			, Threads(0)
+		{
+		}
+	};
+
+	// Voxelize creates a store at filename for the model's grid and fills
+	// it Z slab by Z slab, one brick high, each slab cut into rows of bricks
+	// that are sampled and written on the workers, so only a few rows of
+	// bricks per thread are in use at a time. store is left open for the
+	// passes that read it.
+	bool Voxelize(const Model& model, const VoxelizeSettings& settings, const std::string& filename, VoxelStore& store, std::string& err);
+
+	// VoxelStats is what a material fills in a store.
+	struct VoxelStats
+	{
+		uint64_t Voxels; // voxels of at least 128 (a material value of 0.5)
+		int Min[3], Max[3]; // inclusive voxel bounds, if Voxels > 0
+		double Volume;   // in cubed model units
+	};
+
+	// AnalyzeVoxels reads the store brick by brick on threads workers and
+	// measures every channel.
+	bool AnalyzeVoxels(VoxelStore& store, int threads, std::vector<VoxelStats>& stats, std::string& err);
+
+	// NewStatsSink makes a RunPipeline sink that measures every material
+	// as AnalyzeVoxels does, into stats.
+	std::unique_ptr<SlabSink> NewStatsSink(std::vector<VoxelStats>& stats);
+}
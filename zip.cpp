@@ -0,0 +1,493 @@
+#include "zip.h"
+#include "bytes.h"
+#include <algorithm>
+#include <ctime>
+
+#ifdef _WIN32
+#include <io.h>
+#define fseek64 _fseeki64
+#else
+#include <unistd.h>
+#define fseek64 fseeko
+#endif
+
+namespace irmf
+{
+	namespace
+	{
+		const uint32_t Max32 = 0xffffffff;
+		const size_t Chunk = 1 << 20; // zlib counts in 32 bits
+
+		uint32_t Crc32(uint32_t crc, const void* data, size_t size)
+		{
+			const Bytef* p = (const Bytef*)data;
+			while (size > 0) {
+				uInt n = (uInt)std::min(size, Chunk);
+				crc = (uint32_t)crc32(crc, p, n);
+				p += n;
+				size -= n;
+			}
+			return crc;
+		}
+
+		// Now gives the local time in the format of ZIP headers
+		void Now(uint16_t& time, uint16_t& date)
+		{
+			time_t now = ::time(nullptr);
+			struct tm t = *localtime(&now);
+			time = (uint16_t)((t.tm_hour << 11) | (t.tm_min << 5) | (t.tm_sec / 2));
+			date = (uint16_t)((std::max(t.tm_year - 80, 0) << 9) | ((t.tm_mon + 1) << 5) | t.tm_mday);
+		}
+
+		// CheckData reads an entry's data from file, inflating it if it is
+		// deflated, and tells whether it has the entry's sizes and CRC
+		bool CheckData(FILE* file, uint16_t method, uint64_t compressedSize, uint64_t size, uint32_t crc)
+		{
+			if (method != 0 && method != 8)
+				return false;
+			z_stream zs = z_stream();
+			if (method == 8 && inflateInit2(&zs, -15) != Z_OK)
+				return false;
+			std::vector<uint8_t> in(Chunk), out(method == 8 ? Chunk : 0);
+			uint32_t sum = (uint32_t)crc32(0, Z_NULL, 0);
+			uint64_t left = compressedSize, total = 0;
+			int ret = Z_OK;
+			bool ok = true;
+			while (ok && left > 0) {
+				size_t n = (size_t)std::min<uint64_t>(left, Chunk);
+				if (fread(in.data(), 1, n, file) != n) {
+					ok = false;
+					break;
+				}
+				left -= n;
+				if (method == 0) {
+					sum = Crc32(sum, in.data(), n);
+					total += n;
+					continue;
+				}
+				zs.next_in = in.data();
+				zs.avail_in = (uInt)n;
+				do {
+					zs.next_out = out.data();
+					zs.avail_out = (uInt)out.size();
+					ret = inflate(&zs, Z_NO_FLUSH);
+					if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+						ok = false;
+						break;
+					}
+					size_t got = out.size() - zs.avail_out;
+					sum = Crc32(sum, out.data(), got);
+					total += got;
+				} while (zs.avail_out == 0 && ret != Z_STREAM_END);
+			}
+			if (method == 8) {
+				ok = ok && ret == Z_STREAM_END;
+				inflateEnd(&zs);
+			}
+			return ok && total == size && sum == crc;
+		}
+	}
+
+	bool Deflate(const void* data, size_t size, int level, Deflated& out, bool finish)
+	{
+		z_stream zs = z_stream();
+		if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			return false;
+
+		out.Crc = Crc32((uint32_t)crc32(0, Z_NULL, 0), data, size);
+		out.Size = size;
+		out.Data.resize(std::max<size_t>(size / 2, 1024));
+
+		const Bytef* in = (const Bytef*)data;
+		size_t written = 0;
+		int ret = Z_OK;
+		while (ret != Z_STREAM_END) {
+			if (zs.avail_in == 0 && size > 0) {
+				zs.next_in = (Bytef*)in;
+				zs.avail_in = (uInt)std::min(size, Chunk);
+				in += zs.avail_in;
+				size -= zs.avail_in;
+			}
+			if (written == out.Data.size())
+				out.Data.resize(out.Data.size() * 2);
+			zs.next_out = out.Data.data() + written;
+			zs.avail_out = (uInt)std::min(out.Data.size() - written, Chunk);
+			size_t avail = zs.avail_out;
+			int flush = size > 0 ? Z_NO_FLUSH : finish ? Z_FINISH : Z_SYNC_FLUSH;
+			ret = deflate(&zs, flush);
+			written += avail - zs.avail_out;
+			if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+				deflateEnd(&zs);
+				return false;
+			}
+			// a sync flush is complete once it leaves room in the output
+			if (flush == Z_SYNC_FLUSH && zs.avail_out > 0)
+				break;
+		}
+		out.Data.resize(written);
+		deflateEnd(&zs);
+		return true;
+	}
+
+	ZipWriter::ZipWriter()
+		: m_file(nullptr)
+		, m_offset(0)
+		, m_time(0)
+		, m_date(0)
+		, m_streaming(false)
+		, m_zs(z_stream())
+		, m_zsReady(false)
+		, m_zsPending(false)
+	{
+	}
+
+	ZipWriter::~ZipWriter()
+	{
+		if (m_zsReady)
+			deflateEnd(&m_zs);
+		if (m_file)
+			fclose(m_file);
+	}
+
+	bool ZipWriter::Open(const std::string& filename, std::string& err)
+	{
+		m_file = fopen(filename.c_str(), "wb");
+		if (!m_file) {
+			err = "failed to create " + filename;
+			return false;
+		}
+		m_offset = 0;
+		m_entries.clear();
+		m_error.clear();
+
+		Now(m_time, m_date);
+		return true;
+	}
+
+	bool ZipWriter::Resume(const std::string& filename, uint64_t size, std::vector<std::string>& names, std::string& err)
+	{
+		m_file = fopen(filename.c_str(), "r+b");
+		if (!m_file) {
+			err = "failed to open " + filename;
+			return false;
+		}
+		m_offset = 0;
+		m_entries.clear();
+		m_error.clear();
+		names.clear();
+		Now(m_time, m_date);
+
+		// walk the local headers that Add and AddDeflated wrote
+		bool ok = true;
+		std::vector<uint8_t> extra;
+		while (ok && m_offset < size) {
+			uint8_t h[30];
+			ok = fread(h, 1, sizeof(h), m_file) == sizeof(h) && Get32(h) == 0x04034b50;
+			if (!ok)
+				break;
+			Entry e{ std::string(Get16(h + 26), ' '), (uint16_t)Get16(h + 8), Get32(h + 14), Get32(h + 18), Get32(h + 22), m_offset };
+			extra.resize(Get16(h + 28));
+			ok = (e.Name.empty() || fread(&e.Name[0], 1, e.Name.size(), m_file) == e.Name.size())
+				&& (extra.empty() || fread(extra.data(), 1, extra.size(), m_file) == extra.size());
+			if (ok && extra.size() == 20 && Get16(extra.data()) == 1) {
+				e.Size = Get64(extra.data() + 4);
+				e.CompressedSize = Get64(extra.data() + 12);
+			}
+			ok = ok && CheckData(m_file, e.Method, e.CompressedSize, e.Size, e.Crc);
+			if (ok) {
+				if (m_entries.empty()) {
+					// the archive's time is that of its first entry
+					m_time = (uint16_t)Get16(h + 10);
+					m_date = (uint16_t)Get16(h + 12);
+				}
+				m_offset += sizeof(h) + e.Name.size() + extra.size() + e.CompressedSize;
+				names.push_back(e.Name);
+				m_entries.push_back(e);
+			}
+		}
+
+#ifdef _WIN32
+		ok = ok && m_offset == size && _chsize_s(_fileno(m_file), (int64_t)size) == 0;
+#else
+		ok = ok && m_offset == size && ftruncate(fileno(m_file), (off_t)size) == 0;
+#endif
+		if (!ok || fseek64(m_file, (int64_t)size, SEEK_SET) != 0) {
+			fclose(m_file);
+			m_file = nullptr;
+			err = filename + " does not hold what its checkpoint says";
+			return false;
+		}
+		return true;
+	}
+
+	bool ZipWriter::Sync()
+	{
+		if (!m_error.empty())
+			return false;
+#ifdef _WIN32
+		bool ok = fflush(m_file) == 0 && _commit(_fileno(m_file)) == 0;
+#else
+		bool ok = fflush(m_file) == 0 && fsync(fileno(m_file)) == 0;
+#endif
+		return ok || Fail("failed to write the archive (disk full?)");
+	}
+
+	bool ZipWriter::Fail(const std::string& err)
+	{
+		if (m_error.empty())
+			m_error = err;
+		return false;
+	}
+
+	bool ZipWriter::WriteRaw(const void* data, size_t size)
+	{
+		if (!m_error.empty())
+			return false;
+		if (size > 0 && fwrite(data, 1, size, m_file) != size)
+			return Fail("failed to write the archive (disk full?)");
+		m_offset += size;
+		return true;
+	}
+
+	bool ZipWriter::WriteLocalHeader(Entry& e, bool zip64)
+	{
+		std::vector<uint8_t> h;
+		Put32(h, 0x04034b50);
+		Put16(h, zip64 ? 45 : 20);
+		Put16(h, 1 << 11); // UTF-8 names
+		Put16(h, e.Method);
+		Put16(h, m_time);
+		Put16(h, m_date);
+		Put32(h, e.Crc);
+		Put32(h, zip64 ? Max32 : (uint32_t)e.CompressedSize);
+		Put32(h, zip64 ? Max32 : (uint32_t)e.Size);
+		Put16(h, (uint32_t)e.Name.size());
+		Put16(h, zip64 ? 20 : 0);
+		h.insert(h.end(), e.Name.begin(), e.Name.end());
+		if (zip64) {
+			Put16(h, 1);
+			Put16(h, 16);
+			Put64(h, e.Size);
+			Put64(h, e.CompressedSize);
+		}
+		return WriteRaw(h.data(), h.size());
+	}
+
+	bool ZipWriter::Add(const std::string& name, const void* data, size_t size, int level)
+	{
+		if (level != 0) {
+			Deflated file;
+			if (!Deflate(data, size, level, file))
+				return Fail("failed to compress " + name);
+			return AddDeflated(name, file);
+		}
+
+		Entry e{ name, 0, Crc32((uint32_t)crc32(0, Z_NULL, 0), data, size), size, size, m_offset };
+		if (!WriteLocalHeader(e, size >= Max32) || !WriteRaw(data, size))
+			return false;
+		m_entries.push_back(e);
+		return true;
+	}
+
+	bool ZipWriter::AddDeflated(const std::string& name, const Deflated& file)
+	{
+		Entry e{ name, 8, file.Crc, file.Data.size(), file.Size, m_offset };
+		if (!WriteLocalHeader(e, e.Size >= Max32 || e.CompressedSize >= Max32) || !WriteRaw(file.Data.data(), file.Data.size()))
+			return false;
+		m_entries.push_back(e);
+		return true;
+	}
+
+	bool ZipWriter::Begin(const std::string& name, int level)
+	{
+		Entry e{ name, (uint16_t)(level == 0 ? 0 : 8), (uint32_t)crc32(0, Z_NULL, 0), 0, 0, m_offset };
+		if (level != 0) {
+			if (m_zsReady)
+				deflateEnd(&m_zs);
+			m_zs = z_stream();
+			m_zsReady = deflateInit2(&m_zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+			if (!m_zsReady)
+				return Fail("failed to compress " + name);
+			m_buffer.resize(Chunk);
+			m_zsPending = false;
+		}
+		// the sizes are not known yet: reserve room for them
+		if (!WriteLocalHeader(e, true))
+			return false;
+		m_entries.push_back(e);
+		m_streaming = true;
+		return true;
+	}
+
+	bool ZipWriter::Write(const void* data, size_t size)
+	{
+		Entry& e = m_entries.back();
+		e.Crc = Crc32(e.Crc, data, size);
+		e.Size += size;
+		if (e.Method == 0) {
+			e.CompressedSize += size;
+			return WriteRaw(data, size);
+		}
+
+		const Bytef* in = (const Bytef*)data;
+		m_zsPending = m_zsPending || size > 0;
+		while (size > 0) {
+			m_zs.next_in = (Bytef*)in;
+			m_zs.avail_in = (uInt)std::min(size, Chunk);
+			in += m_zs.avail_in;
+			size -= m_zs.avail_in;
+			do {
+				m_zs.next_out = m_buffer.data();
+				m_zs.avail_out = (uInt)m_buffer.size();
+				deflate(&m_zs, Z_NO_FLUSH);
+				size_t n = m_buffer.size() - m_zs.avail_out;
+				e.CompressedSize += n;
+				if (!WriteRaw(m_buffer.data(), n))
+					return false;
+			} while (m_zs.avail_out == 0);
+		}
+		return true;
+	}
+
+	bool ZipWriter::WriteDeflated(const Deflated& piece)
+	{
+		Entry& e = m_entries.back();
+		if (e.Method != 8)
+			return Fail("compressed data in a stored entry");
+		// bring what Write compressed to a byte boundary, and keep what it
+		// compresses next from referring back across the piece
+		if (m_zsPending) {
+			do {
+				m_zs.next_out = m_buffer.data();
+				m_zs.avail_out = (uInt)m_buffer.size();
+				deflate(&m_zs, Z_FULL_FLUSH);
+				size_t n = m_buffer.size() - m_zs.avail_out;
+				e.CompressedSize += n;
+				if (!WriteRaw(m_buffer.data(), n))
+					return false;
+			} while (m_zs.avail_out == 0);
+			m_zsPending = false;
+		}
+		e.Crc = (uint32_t)crc32_combine(e.Crc, piece.Crc, (z_off_t)piece.Size);
+		e.Size += piece.Size;
+		e.CompressedSize += piece.Data.size();
+		return WriteRaw(piece.Data.data(), piece.Data.size());
+	}
+
+	bool ZipWriter::End()
+	{
+		Entry& e = m_entries.back();
+		m_streaming = false;
+		if (e.Method == 8) {
+			int ret;
+			do {
+				m_zs.next_out = m_buffer.data();
+				m_zs.avail_out = (uInt)m_buffer.size();
+				ret = deflate(&m_zs, Z_FINISH);
+				size_t n = m_buffer.size() - m_zs.avail_out;
+				e.CompressedSize += n;
+				if (!WriteRaw(m_buffer.data(), n))
+					return false;
+			} while (ret == Z_OK);
+		}
+		if (!m_error.empty())
+			return false;
+
+		// fill in the sizes
+		uint64_t end = m_offset;
+		m_offset = e.Offset;
+		if (fseek64(m_file, (int64_t)e.Offset, SEEK_SET) != 0 || !WriteLocalHeader(e, true) || fseek64(m_file, (int64_t)end, SEEK_SET) != 0)
+			return Fail("failed to write the archive");
+		m_offset = end;
+		return true;
+	}
+
+	bool ZipWriter::Close(std::string& err)
+	{
+		if (!m_file) {
+			err = "the archive is not open";
+			return false;
+		}
+		if (m_streaming)
+			End();
+
+		uint64_t start = m_offset;
+		std::vector<uint8_t> h;
+		for (const Entry& e : m_entries) {
+			h.clear();
+			std::vector<uint8_t> extra;
+			if (e.Size >= Max32)
+				Put64(extra, e.Size);
+			if (e.CompressedSize >= Max32)
+				Put64(extra, e.CompressedSize);
+			if (e.Offset >= Max32)
+				Put64(extra, e.Offset);
+			bool zip64 = !extra.empty();
+
+			Put32(h, 0x02014b50);
+			Put16(h, 45);
+			Put16(h, zip64 ? 45 : 20);
+			Put16(h, 1 << 11);
+			Put16(h, e.Method);
+			Put16(h, m_time);
+			Put16(h, m_date);
+			Put32(h, e.Crc);
+			Put32(h, (uint32_t)std::min<uint64_t>(e.CompressedSize, Max32));
+			Put32(h, (uint32_t)std::min<uint64_t>(e.Size, Max32));
+			Put16(h, (uint32_t)e.Name.size());
+			Put16(h, zip64 ? (uint32_t)extra.size() + 4 : 0);
+			Put16(h, 0); // comment
+			Put16(h, 0); // disk
+			Put16(h, 0); // internal attributes
+			Put32(h, 0); // external attributes
+			Put32(h, (uint32_t)std::min<uint64_t>(e.Offset, Max32));
+			h.insert(h.end(), e.Name.begin(), e.Name.end());
+			if (zip64) {
+				Put16(h, 1);
+				Put16(h, (uint32_t)extra.size());
+				h.insert(h.end(), extra.begin(), extra.end());
+			}
+			WriteRaw(h.data(), h.size());
+		}
+
+		uint64_t size = m_offset - start;
+		uint64_t count = m_entries.size();
+		h.clear();
+		if (count >= 0xffff || size >= Max32 || start >= Max32) {
+			uint64_t record = m_offset;
+			Put32(h, 0x06064b50);
+			Put64(h, 44);
+			Put16(h, 45);
+			Put16(h, 45);
+			Put32(h, 0);
+			Put32(h, 0);
+			Put64(h, count);
+			Put64(h, count);
+			Put64(h, size);
+			Put64(h, start);
+
+			Put32(h, 0x07064b50);
+			Put32(h, 0);
+			Put64(h, record);
+			Put32(h, 1);
+		}
+		Put32(h, 0x06054b50);
+		Put16(h, 0);
+		Put16(h, 0);
+		Put16(h, (uint32_t)std::min<uint64_t>(count, 0xffff));
+		Put16(h, (uint32_t)std::min<uint64_t>(count, 0xffff));
+		Put32(h, (uint32_t)std::min<uint64_t>(size, Max32));
+		Put32(h, (uint32_t)std::min<uint64_t>(start, Max32));
+		Put16(h, 0);
+		WriteRaw(h.data(), h.size());
+
+		if (fclose(m_file) != 0)
+			Fail("failed to write the archive");
+		m_file = nullptr;
+		if (!m_error.empty()) {
+			err = m_error;
+			return false;
+		}
+		return true;
+	}
+}
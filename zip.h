@@ -0,0 +1,95 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+namespace irmf
+{
+	// Deflated holds a file compressed ahead of time (e.g. on a worker
+	// thread) with Deflate, ready for ZipWriter::AddDeflated.
+	struct Deflated
+	{
+		std::vector<uint8_t> Data; // raw deflate stream
+		uint32_t Crc;              // CRC-32 of the uncompressed data
+		uint64_t Size;             // uncompressed size
+	};
+
+	// Deflate compresses data into out, reusing out's storage. Unless finish
+	// is set, the stream is left open on a byte boundary, as a piece of a
+	// larger entry for ZipWriter::WriteDeflated: pieces compressed
+	// separately (in parallel) chain into a single stream.
+	bool Deflate(const void* data, size_t size, int level, Deflated& out, bool finish = true);
+
+	// ZipWriter streams a ZIP archive to a file: entries are written as they
+	// are added and only their directory records are kept in memory. ZIP64
+	// records are used when the archive or an entry needs them.
+	class ZipWriter
+	{
+	public:
+		ZipWriter();
+		~ZipWriter();
+
+		bool Open(const std::string& filename, std::string& err);
+		// Resume reopens an archive that was being written when the process
+		// died, keeping its first size bytes (a size GetBytesWritten gave
+		// between entries): their entries are read back and checked against
+		// their CRCs, the rest is cut off and writing goes on from there.
+		// names receives the entries kept. Fails if they do not end at size
+		// or one does not check out.
+		bool Resume(const std::string& filename, uint64_t size, std::vector<std::string>& names, std::string& err);
+
+		// Add writes a complete entry, deflated at the given level (0 stores
+		// it).
+		bool Add(const std::string& name, const void* data, size_t size, int level = 0);
+		// AddDeflated writes an entry compressed with Deflate.
+		bool AddDeflated(const std::string& name, const Deflated& file);
+
+		// Begin, Write and End write an entry of unknown size in pieces,
+		// deflated at the given level (0 stores it).
+		bool Begin(const std::string& name, int level = Z_DEFAULT_COMPRESSION);
+		bool Write(const void* data, size_t size);
+		// WriteDeflated appends a piece compressed with Deflate (finish
+		// false) to a deflated entry.
+		bool WriteDeflated(const Deflated& piece);
+		bool End();
+
+		// Close writes the central directory. Returns false, with err set,
+		// if this or any earlier write failed.
+		bool Close(std::string& err);
+
+		// Sync waits until everything written so far is on the disk, for a
+		// checkpoint
+		bool Sync();
+
+		inline uint64_t GetBytesWritten() const { return m_offset; }
+
+	private:
+		struct Entry
+		{
+			std::string Name;
+			uint16_t Method;
+			uint32_t Crc;
+			uint64_t CompressedSize, Size, Offset;
+		};
+
+		bool WriteRaw(const void* data, size_t size);
+		bool WriteLocalHeader(Entry& e, bool zip64);
+		bool Fail(const std::string& err);
+
+		FILE* m_file;
+		uint64_t m_offset;
+		std::vector<Entry> m_entries;
+		uint16_t m_time, m_date;
+		std::string m_error;
+
+		// entry being written with Begin/Write/End
+		bool m_streaming;
+		z_stream m_zs;
+		bool m_zsReady;
+		bool m_zsPending; // m_zs has output to flush before a piece
+		std::vector<uint8_t> m_buffer;
+	};
+}